@@ -9,6 +9,7 @@
 #include "motion.h"
 #include "alg.h"
 #include "metrics.h"
+#include "framepool.h"
 
 #ifdef __MMX__
 #define HAVE_MMX
@@ -251,6 +252,9 @@ void alg_draw_location(struct coord *cent, struct images *imgs, struct image_dat
             out[width_maxx_y] =~out[width_maxx_y];
         }
     }
+    /* The picture may be shared, draw on a copy */
+    image_unshare(imgdata, imgs->secondary_type == SECONDARY_TYPE_RAW);
+
     if (style == LOCATE_BOX) { /* Draw a box on normal images. */
         alg_draw_box(cent, imgdata->image, imgs->width);
         if (imgdata->secondary_image && imgs->secondary_type == SECONDARY_TYPE_RAW) {
@@ -384,6 +388,9 @@ void alg_draw_red_location(struct coord *cent, struct images *imgs, struct image
         }
     }
 
+    /* The picture may be shared, draw on a copy */
+    image_unshare(imgdata, imgs->secondary_type == SECONDARY_TYPE_RAW);
+
     if (style == LOCATE_REDBOX) { /* Draw a red box on normal images. */
         alg_draw_red_box(cent, imgdata->image, imgs->width, imgs->height);
         if (imgdata->secondary_image && imgs->secondary_type == SECONDARY_TYPE_RAW) {
@@ -589,7 +596,7 @@ static int alg_labeling(struct context *cnt)
     imgs->labels_above = 0;
 
     /* Init: 0 means no label set / not checked. */
-    memset(labels, 0, width * height * sizeof(labels));
+    memset(labels, 0, width * height * sizeof(labels[0]));
     pixelpos = 0;
 
     for (iy = 0; iy < height - 1; iy++) {
@@ -1305,6 +1312,138 @@ int alg_diff(struct context *cnt, unsigned char *new)
     return diffs;
 }
 
+/**
+ * alg_diff_reduced
+ *      Like alg_diff_standard at half the resolution, for when the camera
+ *      can not keep up. Only the top left pixel of each 2x2 block is compared,
+ *      with the masks applied, and the whole block follows it in out and in
+ *      the count of diffs. The smart mask sensitivity of the block is raised
+ *      with it.
+ */
+int alg_diff_reduced(struct context *cnt, unsigned char *new)
+{
+    struct images *imgs = &cnt->imgs;
+    int x, y, k, diffs = 0;
+    int width = imgs->width;
+    int noise = cnt->noise;
+    int smartmask_speed = cnt->smartmask_speed;
+    unsigned char *out = imgs->out;
+
+    memset(out + imgs->motionsize, 128, imgs->motionsize / 2); /* Motion pictures are b/w */
+    memset(out, 0, imgs->motionsize);
+
+    for (y = 0; y < imgs->height - 1; y += 2) {
+        for (x = 0; x < width - 1; x += 2) {
+            int i = y * width + x;
+            int curdiff = abs(imgs->ref[i] - new[i]);
+
+            if (imgs->mask)
+                curdiff = curdiff * imgs->mask[i] / 255;
+
+            if (curdiff <= noise)
+                continue;
+
+            if (smartmask_speed) {
+                if (cnt->event_nr != cnt->prev_event) {
+                    imgs->smartmask_buffer[i] += SMARTMASK_SENSITIVITY_INCR;
+                    imgs->smartmask_buffer[i + 1] += SMARTMASK_SENSITIVITY_INCR;
+                    imgs->smartmask_buffer[i + width] += SMARTMASK_SENSITIVITY_INCR;
+                    imgs->smartmask_buffer[i + width + 1] += SMARTMASK_SENSITIVITY_INCR;
+                }
+
+                if (!imgs->smartmask_final[i])
+                    continue;
+            }
+
+            for (k = i; k < i + 2 * width; k += width) {
+                out[k] = new[k];
+                out[k + 1] = new[k + 1];
+            }
+            diffs += 4;
+        }
+    }
+
+    return diffs;
+}
+
+/**
+ * alg_diff_count
+ *      Marks the pixels of new which differ from the reference frame in out
+ *      like alg_diff_standard, without learning the smart mask.
+ */
+static int alg_diff_count(struct context *cnt, unsigned char *new, unsigned char *out)
+{
+    struct images *imgs = &cnt->imgs;
+    int i, curdiff, diffs = 0;
+    int noise = cnt->noise;
+
+    for (i = 0; i < imgs->motionsize; i++) {
+        curdiff = abs(imgs->ref[i] - new[i]);
+
+        if (imgs->mask)
+            curdiff = curdiff * imgs->mask[i] / 255;
+
+        if (curdiff > noise && (!cnt->smartmask_speed || imgs->smartmask_final[i])) {
+            out[i] = new[i];
+            diffs++;
+        } else {
+            out[i] = 0;
+        }
+    }
+
+    return diffs;
+}
+
+/**
+ * alg_diff_check
+ *      Checks picture new of img after the fact as the motion loop checks
+ *      the current picture: the differences to the reference frame, then
+ *      lightswitch and despeckle. The motion picture and the labels go to
+ *      out and labels, motionsize each, so the ones of the current picture
+ *      are left alone. img gets the labels found.
+ *
+ * Returns: the number of changed pixels.
+ */
+int alg_diff_check(struct context *cnt, struct image_data *img, unsigned char *new,
+                   unsigned char *out, int *labels)
+{
+    struct images *imgs = &cnt->imgs;
+    struct image_data *current_image = cnt->current_image;
+    unsigned char *current_out = imgs->out;
+    int *current_labels = imgs->labels;
+    int labelsize_max = imgs->labelsize_max;
+    int largest_label = imgs->largest_label;
+    int labelgroup_max = imgs->labelgroup_max;
+    int labels_above = imgs->labels_above;
+    int diffs;
+
+    diffs = alg_diff_count(cnt, new, out);
+    img->total_labels = 0;
+
+    if (cnt->conf.lightswitch > 1 && !cnt->lost_connection && alg_lightswitch(cnt, diffs))
+        return 0;
+
+    if (!cnt->conf.despeckle_filter || diffs == 0)
+        return diffs;
+
+    /* alg_despeckle works on the buffers of the current picture */
+    imgs->out = out;
+    imgs->labels = labels;
+    cnt->current_image = img;
+
+    diffs = alg_despeckle(cnt, diffs);
+
+    imgs->out = current_out;
+    imgs->labels = current_labels;
+    cnt->current_image = current_image;
+    imgs->labelsize_max = labelsize_max;
+    imgs->largest_label = largest_label;
+    imgs->labelgroup_max = labelgroup_max;
+    imgs->labels_above = labels_above;
+
+    return diffs;
+}
+
 /** 
  * alg_lightswitch 
  *      Detects a sudden massive change in the picture.
@@ -1331,7 +1470,7 @@ int alg_lightswitch(struct context *cnt, int diffs)
  * alg_switchfilter
  *
  */ 
-int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
+int alg_switchfilter(struct context *cnt, int diffs, struct image_data *img)
 {
     int linediff = diffs / cnt->imgs.height;
     unsigned char *out = cnt->imgs.out;
@@ -1357,7 +1496,8 @@ int alg_switchfilter(struct context *cnt, int diffs, unsigned char *newimg)
         if (cnt->conf.text_changes) {
             char tmp[80];
             sprintf(tmp, "%d %d", lines, vertlines);
-            draw_text(newimg, cnt->imgs.width - 10, 20, cnt->imgs.width, tmp, cnt->conf.text_double);
+            image_unshare(img, 0);
+            draw_text(img->image, cnt->imgs.width - 10, 20, cnt->imgs.width, tmp, cnt->conf.text_double);
         }
         return diffs;
     }
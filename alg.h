@@ -26,8 +26,10 @@ void alg_draw_location(struct coord *, struct images *, struct image_data *, int
 void alg_draw_red_location(struct coord *, struct images *, struct image_data *, int, int, int);
 int alg_diff(struct context *, unsigned char *);
 int alg_diff_standard(struct context *, unsigned char *);
+int alg_diff_reduced(struct context *, unsigned char *);
+int alg_diff_check(struct context *, struct image_data *, unsigned char *, unsigned char *, int *);
 int alg_lightswitch(struct context *, int diffs);
-int alg_switchfilter(struct context *, int, unsigned char *);
+int alg_switchfilter(struct context *, int, struct image_data *);
 void alg_noise_tune(struct context *, unsigned char *);
 void alg_threshold_tune(struct context *, int, int);
 int alg_despeckle(struct context *, int);
@@ -0,0 +1,268 @@
+/*
+ * arena.c
+ *
+ *  One block of memory per camera for its image buffers.
+ *
+ *  The pictures, reference frame, masks and labelling buffers of a camera
+ *  are carved out of one mapping, each aligned to ARENA_ALIGN, instead of
+ *  being allocated one by one. That keeps them aligned for the vector code
+ *  and together in as few pages as possible. The mapping may be backed by
+ *  huge pages and locked in memory.
+ *
+ *  Buffers are handed out in order and only given back all at once when
+ *  the arena is destroyed. The camera and its frame pools each hold a
+ *  reference, so picture buffers still in use once the camera is cleaned
+ *  up keep the mapping until they are given back. The arena is sized when the camera starts, any
+ *  buffer which does not fit comes from the heap instead. Both are counted
+ *  per class of buffer for the memory report.
+ */
+
+#include <sys/mman.h>
+
+#include "motion.h"
+#include "arena.h"
+
+/* Huge pages are assumed to be 2 MB, the size on x86 and ARM */
+#define ARENA_HUGEPAGE_SIZE     (2 * 1024 * 1024)
+
+struct arena {
+    pthread_mutex_t lock;
+    unsigned char *base;            /* The mapping, NULL if there is none */
+    size_t size;                    /* Size of the mapping */
+    size_t used;                    /* Bytes handed out from the mapping */
+    int hugepages;                  /* The mapping is made of huge pages */
+    int locked;                     /* The mapping is locked in memory */
+    int spilled;                    /* A buffer had to come from the heap */
+    int refs;                       /* Dropped by arena_destroy */
+    size_t arena_bytes[ARENA_CLASSES];
+    size_t heap_bytes[ARENA_CLASSES];
+};
+
+/* Kept in front of a buffer from the heap */
+struct arena_spill {
+    unsigned char *raw;             /* What to free */
+    size_t size;
+    int class;
+};
+
+static const char *arena_class_names[ARENA_CLASSES] = {
+    "pictures",
+    "secondary pictures",
+    "reference frame",
+    "masks",
+    "labels",
+    "scratch buffers"
+};
+
+/**
+ * arena_round
+ *      Rounds size up to the alignment of the buffers, to sum up the sizes
+ *      of the buffers an arena is to hold.
+ */
+size_t arena_round(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1);
+}
+
+/**
+ * arena_new
+ *      Creates an arena for size bytes of buffers. With hugepages set the
+ *      mapping is made of huge pages if the system has them reserved, or else
+ *      transparent huge pages are asked for. With lock set the mapping is
+ *      locked in memory. Both fall back to plain pages with a warning.
+ */
+struct arena *arena_new(size_t size, int hugepages, int lock)
+{
+    struct arena *arena;
+    void *base = MAP_FAILED;
+
+    arena = mymalloc(sizeof(struct arena));
+    arena->refs = 1;
+    pthread_mutex_init(&arena->lock, NULL);
+
+    if (size == 0)
+        return arena;
+
+#ifdef MAP_HUGETLB
+    if (hugepages) {
+        arena->size = (size + ARENA_HUGEPAGE_SIZE - 1) & ~((size_t)ARENA_HUGEPAGE_SIZE - 1);
+        base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (base != MAP_FAILED)
+            arena->hugepages = 1;
+        else
+            MOTION_LOG(WRN, TYPE_ALL, SHOW_ERRNO, "%s: No huge pages for %lu bytes of "
+                       "buffers, check vm.nr_hugepages", (unsigned long)arena->size);
+    }
+#endif
+
+    if (base == MAP_FAILED) {
+        arena->size = size;
+        base = mmap(NULL, arena->size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+        if (base == MAP_FAILED) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not map %lu bytes of buffers, "
+                       "using the heap", (unsigned long)arena->size);
+            arena->size = 0;
+            return arena;
+        }
+
+#ifdef MADV_HUGEPAGE
+        if (hugepages)
+            madvise(base, arena->size, MADV_HUGEPAGE);
+#endif
+    }
+
+    arena->base = base;
+
+    if (lock) {
+        if (mlock(arena->base, arena->size) == 0)
+            arena->locked = 1;
+        else
+            MOTION_LOG(WRN, TYPE_ALL, SHOW_ERRNO, "%s: Could not lock %lu bytes of buffers "
+                       "in memory, check ulimit -l", (unsigned long)arena->size);
+    }
+
+    return arena;
+}
+
+/**
+ * arena_ref
+ *      Adds a reference to arena, dropped again with arena_destroy.
+ *
+ * Returns arena.
+ */
+struct arena *arena_ref(struct arena *arena)
+{
+    __sync_add_and_fetch(&arena->refs, 1);
+
+    return arena;
+}
+
+/**
+ * arena_destroy
+ *      Drops a reference to arena. The last one frees the arena with all the
+ *      buffers in it. Buffers which came from the heap must be given back
+ *      with arena_free before.
+ */
+void arena_destroy(struct arena *arena)
+{
+    if (!arena || __sync_sub_and_fetch(&arena->refs, 1) != 0)
+        return;
+
+    if (arena->base) {
+        if (arena->locked)
+            munlock(arena->base, arena->size);
+        munmap(arena->base, arena->size);
+    }
+
+    pthread_mutex_destroy(&arena->lock);
+    free(arena);
+}
+
+/**
+ * arena_alloc
+ *      Hands out a zeroed buffer of size bytes aligned to ARENA_ALIGN, from
+ *      the heap if the arena is full. class is one of ARENA_* and tells
+ *      where the buffer is counted in the memory report.
+ *
+ * Returns the buffer, never NULL.
+ */
+void *arena_alloc(struct arena *arena, size_t size, int class)
+{
+    unsigned char *buffer = NULL;
+    unsigned char *raw;
+    struct arena_spill *spill;
+    size_t rounded = arena_round(size);
+    int spilled = 0;
+
+    pthread_mutex_lock(&arena->lock);
+
+    if (arena->base && arena->size - arena->used >= rounded) {
+        buffer = arena->base + arena->used;
+        arena->used += rounded;
+        arena->arena_bytes[class] += rounded;
+    } else {
+        arena->heap_bytes[class] += rounded;
+        spilled = !arena->spilled;
+        arena->spilled = 1;
+    }
+
+    pthread_mutex_unlock(&arena->lock);
+
+    if (buffer)
+        return buffer;
+
+    if (spilled && arena->base)
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Buffers are outgrowing their arena of %lu bytes, "
+                   "%s and later buffers come from the heap", (unsigned long)arena->size,
+                   arena_class_names[class]);
+
+    /* Align by hand, leaving room in front for the spill record */
+    raw = mymalloc(rounded + 2 * ARENA_ALIGN);
+    buffer = (unsigned char *)(((uintptr_t)raw + 2 * ARENA_ALIGN) & ~((uintptr_t)ARENA_ALIGN - 1));
+
+    spill = (struct arena_spill *)(buffer - ARENA_ALIGN);
+    spill->raw = raw;
+    spill->size = rounded;
+    spill->class = class;
+
+    return buffer;
+}
+
+/**
+ * arena_free
+ *      Gives back a buffer from arena_alloc, which may be NULL. Only buffers
+ *      which came from the heap are freed, the others stay in the arena until
+ *      it is destroyed.
+ */
+void arena_free(struct arena *arena, void *buffer)
+{
+    unsigned char *p = buffer;
+    struct arena_spill *spill;
+
+    if (!buffer)
+        return;
+
+    if (arena->base && p >= arena->base && p < arena->base + arena->size)
+        return;
+
+    spill = (struct arena_spill *)(p - ARENA_ALIGN);
+
+    pthread_mutex_lock(&arena->lock);
+    arena->heap_bytes[spill->class] -= spill->size;
+    pthread_mutex_unlock(&arena->lock);
+
+    free(spill->raw);
+}
+
+/**
+ * arena_report
+ *      Logs the bytes of buffers of each class in the arena and on the heap.
+ */
+void arena_report(struct arena *arena)
+{
+    size_t arena_bytes[ARENA_CLASSES];
+    size_t heap_bytes[ARENA_CLASSES];
+    size_t used;
+    int i;
+
+    pthread_mutex_lock(&arena->lock);
+    memcpy(arena_bytes, arena->arena_bytes, sizeof(arena_bytes));
+    memcpy(heap_bytes, arena->heap_bytes, sizeof(heap_bytes));
+    used = arena->used;
+    pthread_mutex_unlock(&arena->lock);
+
+    for (i = 0; i < ARENA_CLASSES; i++) {
+        if (arena_bytes[i] || heap_bytes[i])
+            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Memory for %s: %lu bytes in the arena, "
+                       "%lu bytes on the heap", arena_class_names[i],
+                       (unsigned long)arena_bytes[i], (unsigned long)heap_bytes[i]);
+    }
+
+    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Memory arena: %lu of %lu bytes used%s%s",
+               (unsigned long)used, (unsigned long)arena->size,
+               arena->hugepages ? ", huge pages" : "", arena->locked ? ", locked" : "");
+}
@@ -0,0 +1,34 @@
+/*
+ * arena.h
+ *
+ *  One block of memory per camera for its image buffers.
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/* Alignment of every buffer, one cache line and enough for NEON loads */
+#define ARENA_ALIGN             64
+
+/* Classes of buffers counted by the memory report */
+#define ARENA_PICTURE           0   /* Pictures of the frame pool */
+#define ARENA_SECONDARY         1   /* Secondary pictures */
+#define ARENA_REFERENCE         2   /* Reference frame and its motion counters */
+#define ARENA_MASK              3   /* Mask and smart mask buffers */
+#define ARENA_LABELS            4   /* Labelling buffers */
+#define ARENA_WORK              5   /* Scratch buffers */
+#define ARENA_CLASSES           6
+
+struct arena;
+
+extern size_t arena_round(size_t size);
+extern struct arena *arena_new(size_t size, int hugepages, int lock);
+extern struct arena *arena_ref(struct arena *arena);
+extern void arena_destroy(struct arena *arena);
+extern void *arena_alloc(struct arena *arena, size_t size, int class);
+extern void arena_free(struct arena *arena, void *buffer);
+extern void arena_report(struct arena *arena);
+
+#endif /* ARENA_H_ */
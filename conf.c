@@ -46,12 +46,20 @@ struct config conf_template = {
     width:                          DEF_WIDTH,
     height:                         DEF_HEIGHT,
     quality:                        DEF_QUALITY,
+    picture_encoder_threads:        0,
     rotate_deg:                     0,
     max_changes:                    DEF_CHANGES,
     threshold_tune:                 0,
     output_pictures:                "on",
     motion_img:                     0,
+    motion_img_format:              "picture",
     output_secondary_pictures:      0,
+    output_crop_pictures:           "off",
+    crop_picture_padding:           16,
+    output_thumbnails:              0,
+    thumbnail_width:                160,
+    thumbnail_height:               0,
+    thumbnail_filter:               "box",
     emulate_motion:                 0,
     event_gap:                      DEF_EVENT_GAP,
     max_movie_time:                 DEF_MAXMOVIETIME,
@@ -61,8 +69,15 @@ struct config conf_template = {
     input:                          IN_DEFAULT,
     norm:                           0,
     frame_limit:                    DEF_MAXFRAMERATE,
+    load_shedding:                  1,
+    governor:                       0,
+    priority:                       0,
+    minimum_fps:                    0,
+    idle_minutes:                   0,
+    idle_detect_interval:           4,
     quiet:                          1,
     picture_type:                   "jpeg",
+    picture_color_matrix:           "bt601",
     noise:                          DEF_NOISELEVEL,
     noise_tune:                     1,
     minimum_frame_time:             0,
@@ -75,8 +90,14 @@ struct config conf_template = {
     roundrobin_frames:              1,
     roundrobin_skip:                1,
     pre_capture:                    0,
+    pre_capture_compress:           0,
     post_capture:                   0,
     switchfilter:                   0,
+    memory_hugepages:               0,
+    memory_lock:                    0,
+    executor:                       0,
+    executor_threads:               0,
+    executor_affinity:              NULL,
     ffmpeg_output:                  0,
     extpipe:                        NULL,
     useextpipe:                     0,
@@ -97,6 +118,12 @@ struct config conf_template = {
     stream_maxrate:                 1,
     stream_localhost:               1,
     stream_limit:                   0,
+    stream_max_clients:             DEF_MAXSTREAMS,
+    stream_lag_quality:             0,
+    stream_tiers:                   NULL,
+    stream_zerocopy:                0,
+    stream_webp:                    0,
+    stream_shared_port:             0,
     stream_auth_method:             0,
     stream_authentication:          NULL,
     webcontrol_port:                0,
@@ -364,6 +391,64 @@ config_param config_params[] = {
     print_int
     },
     {
+    "load_shedding",
+    "# Shed work when processing a frame takes longer than framerate allows:\n"
+    "# first detect motion on every other frame, then also stream every other\n"
+    "# frame, then also detect motion at half resolution. Frames are always\n"
+    "# captured and recorded. Work is restored as the load drops. Left to the\n"
+    "# governor when it is on. (default: on)",
+    0,
+    CONF_OFFSET(load_shedding),
+    copy_bool,
+    print_bool
+    },
+    {
+    "governor",
+    "# Share the CPU between the cameras by priority when the host is overloaded,\n"
+    "# the cameras with the lowest priority give way first. The cameras then do\n"
+    "# not shed load on their own. (default: off)",
+    1,
+    CONF_OFFSET(governor),
+    copy_bool,
+    print_bool
+    },
+    {
+    "priority",
+    "# Priority of the camera for the governor, higher gives way later. (default: 0)",
+    0,
+    CONF_OFFSET(priority),
+    copy_int,
+    print_int
+    },
+    {
+    "minimum_fps",
+    "# Frame rate the governor keeps the camera at at least, set it to frame_limit\n"
+    "# to keep the full rate. (default: 0)",
+    0,
+    CONF_OFFSET(minimum_fps),
+    copy_int,
+    print_int
+    },
+    {
+    "idle_minutes",
+    "# Minutes without motion after which the scene is idle and motion is only\n"
+    "# detected on every idle_detect_interval frame, 0 to always detect on every\n"
+    "# frame. Frames are still captured into the pre_capture buffer, and the first\n"
+    "# motion checks the frames skipped for minimum_motion_frames. (default: 0)",
+    0,
+    CONF_OFFSET(idle_minutes),
+    copy_int,
+    print_int
+    },
+    {
+    "idle_detect_interval",
+    "# Detect motion on every this many frames while the scene is idle. (default: 4)",
+    0,
+    CONF_OFFSET(idle_detect_interval),
+    copy_int,
+    print_int
+    },
+    {
     "minimum_frame_time",
     "# Minimum time in seconds between capturing picture frames from the camera.\n"
     "# Default: 0 = disabled - the capture rate is given by the camera framerate.\n"
@@ -564,6 +649,53 @@ config_param config_params[] = {
     print_bool
     },
     {
+    "memory_hugepages",
+    "# Keep the image buffers of the camera in huge pages, which must be reserved\n"
+    "# with vm.nr_hugepages. Without them transparent huge pages are asked for.\n"
+    "# (default: off)",
+    0,
+    CONF_OFFSET(memory_hugepages),
+    copy_bool,
+    print_bool
+    },
+    {
+    "memory_lock",
+    "# Lock the image buffers of the camera in memory so they are never swapped\n"
+    "# out. Needs a high enough ulimit -l. (default: off)",
+    0,
+    CONF_OFFSET(memory_lock),
+    copy_bool,
+    print_bool
+    },
+    {
+    "executor",
+    "# Run the frames of all cameras on a shared pool of worker threads instead\n"
+    "# of one thread per camera. The workers also capture and feed the outputs,\n"
+    "# without the capture and output threads of each camera. Netcam handler\n"
+    "# threads and the web threads are kept. (default: off)",
+    1,
+    CONF_OFFSET(executor),
+    copy_bool,
+    print_bool
+    },
+    {
+    "executor_threads",
+    "# Number of worker threads of the executor, 0 for one per CPU core. (default: 0)",
+    1,
+    CONF_OFFSET(executor_threads),
+    copy_int,
+    print_int
+    },
+    {
+    "executor_affinity",
+    "# CPUs to pin the worker threads of the executor to in turn, like 0-3,6\n"
+    "# (default: not defined)",
+    1,
+    CONF_OFFSET(executor_affinity),
+    copy_string,
+    print_string
+    },
+    {
     "threshold",
     "\n############################################################\n"
     "# Motion Detection Settings:\n"
@@ -674,6 +806,17 @@ config_param config_params[] = {
     print_int
     },
     {
+    "pre_capture_compress",
+    "# Keep the pictures of the pre_capture buffer as jpeg until an event needs\n"
+    "# them, so it takes a fraction of the memory. They are compressed in a thread\n"
+    "# of their own, or by the executor workers, with the quality of the pictures,\n"
+    "# and saved as they are when possible. (default: off)",
+    0,
+    CONF_OFFSET(pre_capture_compress),
+    copy_bool,
+    print_bool
+    },
+    {
     "post_capture",
     "# Number of frames to capture after motion is no longer detected (default: 0)",
     0,
@@ -736,6 +879,18 @@ config_param config_params[] = {
     print_bool
     },
     {
+    "debug_picture_format",
+    "# Format of the debug pictures (default: picture)\n"
+    "# Valid values: picture, mask, labels\n"
+    "# 'mask' saves only which pixels moved as a run-length coded 1 bit\n"
+    "# mask file (.msk), 'labels' adds the label of each moving pixel when\n"
+    "# the despeckle_filter does labeling.",
+    0,
+    CONF_OFFSET(motion_img_format),
+    copy_string,
+    print_string
+    },
+    {
     "output_secondary_pictures",
     "# Output pictures from any enabled secondary image (default: off)",
     0,
@@ -744,6 +899,63 @@ config_param config_params[] = {
     print_bool
     },
     {
+    "output_crop_pictures",
+    "# Save only the area of the picture with motion (default: off)\n"
+    "# Valid values: on, off, only\n"
+    "# When set to 'on' the crop is saved next to the normal picture\n"
+    "# with a 'c' appended to its name, 'only' saves it instead of the\n"
+    "# normal picture. The crop offset is stored in the EXIF X/Y position,\n"
+    "# in inches at a resolution of 72 pixels per inch, and is available\n"
+    "# as %{cropx} and %{cropy} in imagepath.",
+    0,
+    CONF_OFFSET(output_crop_pictures),
+    copy_string,
+    print_string
+    },
+    {
+    "crop_picture_padding",
+    "# Number of pixels added around the motion area of crop pictures.\n"
+    "# The crop is then aligned to 16 pixels (default: 16)",
+    0,
+    CONF_OFFSET(crop_picture_padding),
+    copy_int,
+    print_int
+    },
+    {
+    "output_thumbnails",
+    "# Save a small copy of every picture and preview next to it\n"
+    "# with a 't' appended to its name (default: off)",
+    0,
+    CONF_OFFSET(output_thumbnails),
+    copy_bool,
+    print_bool
+    },
+    {
+    "thumbnail_width",
+    "# Width of the thumbnails (default: 160)",
+    0,
+    CONF_OFFSET(thumbnail_width),
+    copy_int,
+    print_int
+    },
+    {
+    "thumbnail_height",
+    "# Height of the thumbnails. 0 keeps the aspect ratio of the image (default: 0)",
+    0,
+    CONF_OFFSET(thumbnail_height),
+    copy_int,
+    print_int
+    },
+    {
+    "thumbnail_filter",
+    "# Filter used to scale the thumbnails\n"
+    "# Valid values: box, bilinear (default: box)",
+    0,
+    CONF_OFFSET(thumbnail_filter),
+    copy_string,
+    print_string
+    },
+    {
     "quality",
     "# The quality (in percent) to be used by the jpeg compression (default: 75)",
     0,
@@ -752,6 +964,16 @@ config_param config_params[] = {
     print_int
     },
     {
+    "picture_encoder_threads",
+    "# Number of extra threads encoding jpeg pictures in parallel when many\n"
+    "# are saved at once, like the pre_capture pictures at the start of an\n"
+    "# event. Files are still saved in order. (default: 0 = off)",
+    0,
+    CONF_OFFSET(picture_encoder_threads),
+    copy_int,
+    print_int
+    },
+    {
     "picture_type",
     "# Type of output images\n"
     "# Valid values: jpeg, ppm (default: jpeg)",
@@ -760,6 +982,15 @@ config_param config_params[] = {
     copy_string,
     print_string
     },
+    {
+    "picture_color_matrix",
+    "# Colour matrix used to convert images to RGB for ppm pictures\n"
+    "# Valid values: bt601, bt709 (default: bt601)",
+    0,
+    CONF_OFFSET(picture_color_matrix),
+    copy_string,
+    print_string
+    },
 #ifdef HAVE_FFMPEG
     {
     "ffmpeg_output_movies",
@@ -926,6 +1157,8 @@ config_param config_params[] = {
     "# %D = changed pixels, %N = noise level, \\n = new line,\n"
     "# %i and %J = width and height of motion area,\n"
     "# %K and %L = X and Y coordinates of motion center\n"
+    "# %{cropx} and %{cropy} = X and Y offset of crop pictures,\n"
+    "# %{cropw} and %{croph} = width and height of crop pictures\n"
     "# %C = value defined by text_event - do not use with text_event!\n"
     "# You can put quotation marks around the text to allow\n"
     "# leading spaces\n"
@@ -1105,7 +1338,9 @@ config_param config_params[] = {
     "\n############################################################\n"
     "# Live Stream Server\n"
     "############################################################\n\n"
-    "# The mini-http server listens to this port for requests (default: 0 = disabled)",
+    "# The mini-http server listens to this port for requests. It serves the\n"
+    "# stream at any url and the latest frame as a still image at /snapshot\n"
+    "# (default: 0 = disabled)",
     0,
     CONF_OFFSET(stream_port),
     copy_int,
@@ -1163,6 +1398,70 @@ config_param config_params[] = {
     print_int
     },
     {
+    "stream_max_clients",
+    "# Maximum number of clients connected to the stream at the same time.\n"
+    "# Further clients wait in the listen queue (default: 10)",
+    0,
+    CONF_OFFSET(stream_max_clients),
+    copy_int,
+    print_int
+    },
+    {
+    "stream_lag_quality",
+    "# Clients that can not keep up with the stream skip frames until they catch up.\n"
+    "# When set, clients falling behind repeatedly get a half size stream encoded\n"
+    "# at this quality instead, until they keep up again (default: 0 = off)",
+    0,
+    CONF_OFFSET(stream_lag_quality),
+    copy_int,
+    print_int
+    },
+    {
+    "stream_tiers",
+    "# Further sizes of the stream, for clients that ask for them by name in the\n"
+    "# url path (http://host:port/name) or query (?tier=name). Tiers are separated\n"
+    "# by commas and given as name=WIDTHxHEIGHT[:quality[:maxrate]], quality and\n"
+    "# maxrate default to those of the stream. The picture is scaled to fit in\n"
+    "# WIDTHxHEIGHT, keeping its aspect ratio. Each tier is only encoded while it\n"
+    "# has clients, e.g. mobile=640x360:50:5,wall=1920x1080:85 (default: none)",
+    0,
+    CONF_OFFSET(stream_tiers),
+    copy_string,
+    print_string
+    },
+    {
+    "stream_zerocopy",
+    "# Send large stream frames with MSG_ZEROCOPY instead of copying them into\n"
+    "# the socket buffers. Needs Linux 4.14 or newer (default: off)",
+    0,
+    CONF_OFFSET(stream_zerocopy),
+    copy_bool,
+    print_bool
+    },
+    {
+    "stream_webp",
+    "# Also offer the stream, its tiers and snapshots as WebP, which takes less\n"
+    "# bandwidth than jpeg. Clients get it by adding format=webp to the url query\n"
+    "# or, without a format parameter, by listing image/webp in their Accept\n"
+    "# header. Each frame is encoded once per format asked for (default: off)",
+    0,
+    CONF_OFFSET(stream_webp),
+    copy_bool,
+    print_bool
+    },
+    {
+    "stream_shared_port",
+    "# Serve the streams of all cameras on this one port from a single stream\n"
+    "# thread instead of one port per camera, each camera at the url\n"
+    "# http://host:port/<thread number>/stream and its still image at\n"
+    "# /<thread number>/snapshot. The stream_port of the cameras is then\n"
+    "# ignored (default: 0 = disabled)",
+    1,
+    CONF_OFFSET(stream_shared_port),
+    copy_int,
+    print_int
+    },
+    {
     "stream_auth_method",
     "# Set the authentication method (default: 0)\n"
     "# 0 = disabled \n"
@@ -26,12 +26,20 @@ struct config {
     int width;
     int height;
     int quality;
+    int picture_encoder_threads;
     int rotate_deg;
     int max_changes;
     int threshold_tune;
     const char *output_pictures;
     int motion_img;
+    const char *motion_img_format;
     int output_secondary_pictures;
+    const char *output_crop_pictures;
+    int crop_picture_padding;
+    int output_thumbnails;
+    int thumbnail_width;
+    int thumbnail_height;
+    const char *thumbnail_filter;
     int emulate_motion;
     int event_gap;
     int max_movie_time;
@@ -41,11 +49,18 @@ struct config {
     int input;
     int norm;
     int frame_limit;
+    int load_shedding;
+    int governor;
+    int priority;
+    int minimum_fps;
+    int idle_minutes;
+    int idle_detect_interval;
     int quiet;
     int useextpipe; /* ext_pipe on or off */
     const char *extpipe; /* full Command-line for pipe -- must accept YUV420P images  */
     int extpipe_secondary;
     const char *picture_type;
+    const char *picture_color_matrix;
     int noise;
     int noise_tune;
     int minimum_frame_time;
@@ -58,8 +73,14 @@ struct config {
     int roundrobin_frames;
     int roundrobin_skip;
     int pre_capture;
+    int pre_capture_compress;
     int post_capture;
     int switchfilter;
+    int memory_hugepages;
+    int memory_lock;
+    int executor;
+    int executor_threads;
+    const char *executor_affinity;
     int ffmpeg_output;
     int ffmpeg_output_debug;
     int ffmpeg_output_secondary;
@@ -78,6 +99,12 @@ struct config {
     int stream_maxrate;
     int stream_localhost;
     int stream_limit;
+    int stream_max_clients;
+    int stream_lag_quality;
+    const char *stream_tiers;
+    int stream_zerocopy;
+    int stream_webp;
+    int stream_shared_port;
     int stream_auth_method;
     const char *stream_authentication;
     int webcontrol_port;
@@ -11,6 +11,7 @@
 
 #include <ctype.h>
 #include "motion.h"
+#include "framepool.h"
 
 /* Highest ascii value is 126 (~) */
 #define ASCII_MAX 127
@@ -1169,6 +1170,9 @@ int draw_text(unsigned char *image, unsigned int startx, unsigned int starty, un
 
 int draw_final_image_text(struct context* cnt, struct image_data* imgdata, unsigned int startx, unsigned int starty, const char *text, unsigned int factor)
 {
+    /* The picture may be shared, draw on a copy */
+    image_unshare(imgdata, cnt->imgs.secondary_type == SECONDARY_TYPE_RAW);
+
     draw_text(imgdata->image, startx, starty, cnt->imgs.width, text, factor);
 
     if (imgdata->secondary_image  && cnt->imgs.secondary_type == SECONDARY_TYPE_RAW) {
@@ -0,0 +1,167 @@
+/*
+ * encoder.c
+ *
+ *  Pool of worker threads encoding pictures in parallel.
+ *
+ *  encoder_pool_run hands a batch of jobs to the workers, takes jobs itself
+ *  as well and returns when the whole batch is encoded. Jobs are taken in
+ *  order but may finish in any order; the caller commits the results.
+ */
+
+#include "motion.h"
+#include "picture.h"
+#include "encoder.h"
+
+struct encoder_pool {
+    struct context *cnt;
+    pthread_t *threads;
+    int thread_count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t work;        /* Signalled when a batch is queued or on stop */
+    pthread_cond_t done;        /* Signalled when the last job of a batch is done */
+
+    struct encoder_job *jobs;
+    int job_count;
+    int next_job;
+    int done_jobs;
+    int finish;
+};
+
+static void encode_job(struct encoder_job *job)
+{
+    job->size = put_jpeg_yuv420p_memory(job->dest, job->dest_size, job->image,
+                                        job->width, job->height, job->quality,
+                                        job->description, job->timestamp_tm, job->box);
+}
+
+/**
+ * take_jobs
+ *      Encodes jobs of the current batch until none are left to take.
+ *      Called with the pool locked, returns with it locked.
+ */
+static void take_jobs(struct encoder_pool *pool)
+{
+    struct encoder_job *job;
+
+    while (pool->next_job < pool->job_count) {
+        job = &pool->jobs[pool->next_job++];
+        pthread_mutex_unlock(&pool->lock);
+
+        encode_job(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->done_jobs == pool->job_count)
+            pthread_cond_signal(&pool->done);
+    }
+}
+
+static void *encoder_worker(void *arg)
+{
+    struct encoder_pool *pool = arg;
+
+    /* Log with the thread number of the camera we encode for */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)pool->cnt->threadnr));
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (!pool->finish) {
+        take_jobs(pool);
+        if (!pool->finish)
+            pthread_cond_wait(&pool->work, &pool->lock);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/**
+ * encoder_pool_start
+ *      Starts threads workers encoding pictures for camera cnt.
+ *
+ * Returns the pool, NULL if no worker could be started.
+ */
+struct encoder_pool *encoder_pool_start(struct context *cnt, int threads)
+{
+    struct encoder_pool *pool;
+    int i;
+
+    pool = mymalloc(sizeof(struct encoder_pool));
+    pool->cnt = cnt;
+    pool->threads = mymalloc(threads * sizeof(pthread_t));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, encoder_worker, pool)) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start picture encoder thread %d", i);
+            break;
+        }
+        pool->thread_count++;
+    }
+
+    if (pool->thread_count == 0) {
+        encoder_pool_stop(pool);
+        return NULL;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Started %d picture encoder threads", pool->thread_count);
+
+    return pool;
+}
+
+/**
+ * encoder_pool_run
+ *      Encodes count jobs using the workers and the calling thread.
+ *
+ * Returns when all jobs are done.
+ */
+void encoder_pool_run(struct encoder_pool *pool, struct encoder_job *jobs, int count)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    pool->jobs = jobs;
+    pool->job_count = count;
+    pool->next_job = 0;
+    pool->done_jobs = 0;
+    pthread_cond_broadcast(&pool->work);
+
+    take_jobs(pool);
+
+    while (pool->done_jobs < pool->job_count)
+        pthread_cond_wait(&pool->done, &pool->lock);
+
+    pool->jobs = NULL;
+    pool->job_count = 0;
+    pool->next_job = 0;
+
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * encoder_pool_stop
+ *      Stops the workers and frees the pool.
+ */
+void encoder_pool_stop(struct encoder_pool *pool)
+{
+    int i;
+
+    if (!pool)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->finish = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->thread_count; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
@@ -0,0 +1,34 @@
+/*
+ * encoder.h
+ *
+ *  Pool of worker threads encoding pictures in parallel.
+ */
+
+#ifndef ENCODER_H_
+#define ENCODER_H_
+
+#include <time.h>
+#include "coord.h"
+
+struct context;
+struct encoder_pool;
+
+/* One picture to encode as jpeg into dest, size is set when done */
+struct encoder_job {
+    unsigned char *image;       /* YUV420P input */
+    int width;
+    int height;
+    int quality;
+    char *description;          /* EXIF description, may be NULL */
+    struct tm *timestamp_tm;
+    struct coord *box;          /* EXIF subject area, may be NULL */
+    unsigned char *dest;
+    int dest_size;
+    int size;
+};
+
+extern struct encoder_pool *encoder_pool_start(struct context *cnt, int threads);
+extern void encoder_pool_run(struct encoder_pool *pool, struct encoder_job *jobs, int count);
+extern void encoder_pool_stop(struct encoder_pool *pool);
+
+#endif /* ENCODER_H_ */
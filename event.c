@@ -246,21 +246,31 @@ static void event_stop_stream(struct context *cnt, int type ATTRIBUTE_UNUSED,
             char *dummy2 ATTRIBUTE_UNUSED, void *dummy3 ATTRIBUTE_UNUSED,
             struct tm *tm ATTRIBUTE_UNUSED)
 {
-    if ((cnt->conf.stream_port) && (cnt->stream.socket != -1))
+    if (cnt->stream_publisher)
         stream_stop(cnt);
 }
 
+/*
+ * The output stage feeds the stream from its own thread, so everything about
+ * the picture comes with the event: its image data in eventdata and its EXIF
+ * description in description. cnt->current_image belongs to the motion thread.
+ */
 static void event_stream_put(struct context *cnt, int type ATTRIBUTE_UNUSED,
-            unsigned char *img, char *dummy1 ATTRIBUTE_UNUSED,
-            void *eventdata, struct tm *tm ATTRIBUTE_UNUSED)
+            unsigned char *img, char *description,
+            void *eventdata, struct tm *tm)
 {
-    if (cnt->conf.stream_port) {
+    struct coord *box = NULL;
+
+    if (cnt->stream_publisher) {
         if (eventdata && !img) {
             struct image_data* imgdata = (struct image_data*)eventdata;
 
+            box = &imgdata->location;
+
             if (imgdata->secondary_image && cnt->conf.stream_secondary) {
                 if (cnt->imgs.secondary_type == SECONDARY_TYPE_RAW) {
-                    stream_put(cnt, imgdata->secondary_image, cnt->imgs.secondary_width, cnt->imgs.secondary_height, cnt->imgs.secondary_size);
+                    stream_put(cnt, imgdata->secondary_image, cnt->imgs.secondary_width, cnt->imgs.secondary_height, cnt->imgs.secondary_size,
+                               description, tm, box);
                 }
                 else if (cnt->imgs.secondary_type == SECONDARY_TYPE_JPEG) {
                     stream_put_encoded(cnt, imgdata->secondary_image, cnt->imgs.secondary_width, cnt->imgs.secondary_height, imgdata->secondary_size);
@@ -272,7 +282,7 @@ static void event_stream_put(struct context *cnt, int type ATTRIBUTE_UNUSED,
         }
 
         if (img) {
-            stream_put(cnt, img, cnt->imgs.width, cnt->imgs.height, cnt->imgs.size);
+            stream_put(cnt, img, cnt->imgs.width, cnt->imgs.height, cnt->imgs.size, description, tm, box);
         }
     }
 }
@@ -330,10 +340,14 @@ static void event_image_detect(struct context *cnt, int type ATTRIBUTE_UNUSED,
         else
             imagepath = DEF_IMAGEPATH;
 
+        /* The crop is needed before the filename for the %{crop*} specifiers */
+        if (cnt->crop_img != CROPIMG_OFF)
+            locate_crop_box(cnt, imgdat);
+
         mystrftime(cnt, filename, sizeof(filename), imagepath, currenttime_tm, NULL, 0);
         snprintf(fullfilename, PATH_MAX, "%s/%s.%s", cnt->conf.filepath, filename, imageext(cnt));
 
-        put_image(cnt, fullfilename, imgdat, FTYPE_IMAGE);
+        put_event_image(cnt, fullfilename, imgdat, FTYPE_IMAGE);
     }
 }
 
@@ -361,9 +375,20 @@ static void event_imagem_detect(struct context *cnt, int type ATTRIBUTE_UNUSED,
         mystrftime(cnt, filename, sizeof(filename), imagepath, currenttime_tm, NULL, 0);
         /* motion images gets same name as normal images plus an appended 'm' */
         snprintf(filenamem, PATH_MAX, "%sm", filename);
-        snprintf(fullfilenamem, PATH_MAX, "%s/%s.%s", cnt->conf.filepath, filenamem, imageext(cnt));
 
-        put_picture(cnt, fullfilenamem, cnt->imgs.out, FTYPE_IMAGE_MOTION);
+        if (cnt->motion_img_format == MOTIONIMG_PICTURE) {
+            snprintf(fullfilenamem, PATH_MAX, "%s/%s.%s", cnt->conf.filepath, filenamem, imageext(cnt));
+            put_picture(cnt, fullfilenamem, cnt->imgs.out, FTYPE_IMAGE_MOTION);
+        } else {
+            if (snprintf(fullfilenamem, PATH_MAX, "%s/%s.msk", cnt->conf.filepath,
+                         filenamem) >= PATH_MAX) {
+                MOTION_LOG(ERR, TYPE_EVENTS, NO_ERRNO, "%s: Motion mask path too long: %s/%s.msk",
+                           cnt->conf.filepath, filenamem);
+                return;
+            }
+            put_motion_mask(cnt, fullfilenamem, cnt->motion_img_format == MOTIONIMG_LABELS,
+                            FTYPE_IMAGE_MOTION);
+        }
     }
 }
 
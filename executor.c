@@ -0,0 +1,414 @@
+/*
+ * executor.c
+ *
+ *  Pool of worker threads running the frames of all cameras.
+ *
+ *  Instead of one thread per camera looping over its frames, each camera
+ *  is a task which runs one frame and submits itself again for when the
+ *  next frame is due. A fixed number of workers, one per core by default,
+ *  runs the tasks of all cameras.
+ *
+ *  Tasks which are not due yet wait in a heap ordered by due time. The
+ *  worker which finds tasks due moves them to the queue of the worker which
+ *  ran them last, so a camera keeps to the same core while it can. Each
+ *  worker runs the tasks of its own queue oldest first, and once its queue
+ *  is empty it steals the newest task from the queue of another worker.
+ *
+ *  A task is only in the executor between the end of one frame and the
+ *  start of the next, so the frames of a camera never overlap and stay in
+ *  order whichever worker runs them.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE 1
+#endif
+
+#include "motion.h"
+#include "scheduler.h"
+#include "executor.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#define NSEC_PER_SEC    1000000000LL
+
+/* CPUs executor_affinity may list */
+#define EXECUTOR_MAX_CPUS   1024
+
+struct executor_worker {
+    struct executor *ex;
+    pthread_t thread;
+    int index;
+    int cpu;                            /* CPU to pin the worker to, -1 for any */
+
+    pthread_mutex_t lock;               /* Protects the queue */
+    struct executor_task *head;         /* Taken by the worker */
+    struct executor_task *tail;         /* Stolen by the others */
+};
+
+struct executor {
+    struct executor_worker *workers;
+    int worker_count;
+    int started;                        /* Workers with a thread */
+
+    pthread_mutex_t lock;               /* Protects the timers and finish */
+    pthread_cond_t wake;                /* Signalled when tasks are due earlier or ready */
+    struct executor_task **timers;      /* Heap of the tasks not due yet */
+    int timer_count;
+    int timer_size;
+    int ready;                          /* Tasks in the queues of the workers */
+    int finish;
+};
+
+static void queue_push(struct executor_worker *w, struct executor_task *task)
+{
+    pthread_mutex_lock(&w->lock);
+
+    task->next = NULL;
+    task->prev = w->tail;
+    if (w->tail)
+        w->tail->next = task;
+    else
+        w->head = task;
+    w->tail = task;
+
+    pthread_mutex_unlock(&w->lock);
+}
+
+/**
+ * queue_take
+ *      Takes the oldest task of the queue of the worker itself or, with steal
+ *      set, the newest one of the queue of another worker.
+ *
+ * Returns the task, NULL if the queue is empty.
+ */
+static struct executor_task *queue_take(struct executor_worker *w, int steal)
+{
+    struct executor_task *task;
+
+    pthread_mutex_lock(&w->lock);
+
+    if (steal) {
+        task = w->tail;
+        if (task) {
+            w->tail = task->prev;
+            if (w->tail)
+                w->tail->next = NULL;
+            else
+                w->head = NULL;
+        }
+    } else {
+        task = w->head;
+        if (task) {
+            w->head = task->next;
+            if (w->head)
+                w->head->prev = NULL;
+            else
+                w->tail = NULL;
+        }
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    if (task)
+        __sync_fetch_and_sub(&w->ex->ready, 1);
+
+    return task;
+}
+
+static void timer_push(struct executor *ex, struct executor_task *task)
+{
+    int i, parent;
+
+    if (ex->timer_count == ex->timer_size) {
+        ex->timer_size = ex->timer_size ? ex->timer_size * 2 : 16;
+        ex->timers = myrealloc(ex->timers, ex->timer_size * sizeof(struct executor_task *),
+                               "timer_push");
+    }
+
+    for (i = ex->timer_count++; i > 0; i = parent) {
+        parent = (i - 1) / 2;
+        if (ex->timers[parent]->due <= task->due)
+            break;
+        ex->timers[i] = ex->timers[parent];
+    }
+
+    ex->timers[i] = task;
+}
+
+static struct executor_task *timer_pop(struct executor *ex)
+{
+    struct executor_task *task = ex->timers[0];
+    struct executor_task *last = ex->timers[--ex->timer_count];
+    int i, child;
+
+    for (i = 0; (child = 2 * i + 1) < ex->timer_count; i = child) {
+        if (child + 1 < ex->timer_count && ex->timers[child + 1]->due < ex->timers[child]->due)
+            child++;
+        if (last->due <= ex->timers[child]->due)
+            break;
+        ex->timers[i] = ex->timers[child];
+    }
+
+    ex->timers[i] = last;
+
+    return task;
+}
+
+/**
+ * executor_release
+ *      Moves the tasks which are due to the queues of the workers which ran
+ *      them last, or to the one of worker w for new tasks. Called with the
+ *      executor locked.
+ *
+ * Returns the number of tasks moved.
+ */
+static int executor_release(struct executor *ex, struct executor_worker *w, long long now)
+{
+    struct executor_task *task;
+    int released = 0;
+
+    while (ex->timer_count && ex->timers[0]->due <= now) {
+        task = timer_pop(ex);
+        __sync_fetch_and_add(&ex->ready, 1);
+        queue_push(task->worker >= 0 ? &ex->workers[task->worker] : w, task);
+        released++;
+    }
+
+    if (released > 1)
+        pthread_cond_broadcast(&ex->wake);
+
+    return released;
+}
+
+static struct executor_task *executor_take(struct executor_worker *w)
+{
+    struct executor *ex = w->ex;
+    struct executor_task *task;
+    int i;
+
+    task = queue_take(w, 0);
+
+    for (i = 1; !task && i < ex->worker_count; i++)
+        task = queue_take(&ex->workers[(w->index + i) % ex->worker_count], 1);
+
+    return task;
+}
+
+static void executor_pin(struct executor_worker *w)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+
+    if (w->cpu < 0)
+        return;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpus))
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Could not pin worker %d to CPU %d",
+                   w->index, w->cpu);
+#endif
+}
+
+static void *executor_worker(void *arg)
+{
+    struct executor_worker *w = arg;
+    struct executor *ex = w->ex;
+    struct executor_task *task;
+    struct timespec ts;
+    long long now;
+
+    executor_pin(w);
+
+    while (1) {
+        task = executor_take(w);
+
+        if (task) {
+            task->worker = w->index;
+            task->run(task);
+            continue;
+        }
+
+        pthread_mutex_lock(&ex->lock);
+
+        if (ex->finish) {
+            pthread_mutex_unlock(&ex->lock);
+            break;
+        }
+
+        now = monotonic_ns();
+
+        if (executor_release(ex, w, now) == 0 && __sync_fetch_and_add(&ex->ready, 0) == 0) {
+            if (ex->timer_count == 0) {
+                pthread_cond_wait(&ex->wake, &ex->lock);
+            } else {
+                ts.tv_sec = ex->timers[0]->due / NSEC_PER_SEC;
+                ts.tv_nsec = ex->timers[0]->due % NSEC_PER_SEC;
+                pthread_cond_timedwait(&ex->wake, &ex->lock, &ts);
+            }
+        }
+
+        pthread_mutex_unlock(&ex->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * executor_cpus
+ *      Parses a list of CPUs like "0-3,6" into cpus, which has room for size.
+ *
+ * Returns the number of CPUs in the list, 0 if it is not valid.
+ */
+static int executor_cpus(const char *list, int *cpus, int size)
+{
+    const char *p = list;
+    char *end;
+    long first, last;
+    int count = 0;
+
+    while (*p) {
+        first = last = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return 0;
+        p = end;
+
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p || last < first)
+                return 0;
+            p = end;
+        }
+
+        for (; first <= last && count < size; first++)
+            cpus[count++] = first;
+
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return 0;
+    }
+
+    return count;
+}
+
+/**
+ * executor_start
+ *      Starts threads workers, one per online CPU if threads is 0. affinity
+ *      is a list of CPUs like "0-3,6" to pin the workers to in turn, or NULL
+ *      to leave them to the scheduler of the system.
+ *
+ * Returns the executor, NULL if no worker could be started.
+ */
+struct executor *executor_start(int threads, const char *affinity)
+{
+    struct executor *ex;
+    pthread_condattr_t condattr;
+    int cpus[EXECUTOR_MAX_CPUS];
+    int cpu_count = 0;
+    int i;
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    if (affinity) {
+        cpu_count = executor_cpus(affinity, cpus, EXECUTOR_MAX_CPUS);
+        if (cpu_count == 0)
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Invalid executor_affinity %s, "
+                       "the workers are not pinned", affinity);
+#ifndef __linux__
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: executor_affinity is only supported on Linux");
+        cpu_count = 0;
+#endif
+    }
+
+    ex = mymalloc(sizeof(struct executor));
+    ex->workers = mymalloc(threads * sizeof(struct executor_worker));
+    pthread_mutex_init(&ex->lock, NULL);
+
+    /* Due times are on the monotonic clock */
+    pthread_condattr_init(&condattr);
+    pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ex->wake, &condattr);
+    pthread_condattr_destroy(&condattr);
+
+    /* All queues exist before the first worker may steal from them */
+    ex->worker_count = threads;
+
+    for (i = 0; i < threads; i++) {
+        ex->workers[i].ex = ex;
+        ex->workers[i].index = i;
+        ex->workers[i].cpu = cpu_count ? cpus[i % cpu_count] : -1;
+        pthread_mutex_init(&ex->workers[i].lock, NULL);
+    }
+
+    for (i = 0; i < threads; i++) {
+        if (pthread_create(&ex->workers[i].thread, NULL, executor_worker, &ex->workers[i])) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start executor worker %d", i);
+            break;
+        }
+        ex->started++;
+    }
+
+    if (ex->started == 0) {
+        executor_stop(ex);
+        return NULL;
+    }
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Started %d executor workers%s", ex->started,
+               cpu_count ? ", pinned to CPUs" : "");
+
+    return ex;
+}
+
+/**
+ * executor_submit
+ *      Queues task to be run once due, on the monotonic clock. A task must
+ *      not be submitted again before it has started running.
+ */
+void executor_submit(struct executor *ex, struct executor_task *task, long long due)
+{
+    pthread_mutex_lock(&ex->lock);
+
+    task->due = due;
+    timer_push(ex, task);
+
+    /* Wake a worker if the task is the next one due */
+    if (ex->timers[0] == task)
+        pthread_cond_signal(&ex->wake);
+
+    pthread_mutex_unlock(&ex->lock);
+}
+
+/**
+ * executor_stop
+ *      Stops the workers once they are done with the tasks they are running
+ *      and frees the executor. Tasks still queued are not run, the caller
+ *      stops whatever submits them first.
+ */
+void executor_stop(struct executor *ex)
+{
+    int i;
+
+    pthread_mutex_lock(&ex->lock);
+    ex->finish = 1;
+    pthread_cond_broadcast(&ex->wake);
+    pthread_mutex_unlock(&ex->lock);
+
+    for (i = 0; i < ex->started; i++)
+        pthread_join(ex->workers[i].thread, NULL);
+
+    for (i = 0; i < ex->worker_count; i++)
+        pthread_mutex_destroy(&ex->workers[i].lock);
+
+    pthread_cond_destroy(&ex->wake);
+    pthread_mutex_destroy(&ex->lock);
+    free(ex->timers);
+    free(ex->workers);
+    free(ex);
+}
@@ -0,0 +1,25 @@
+/*
+ * executor.h
+ *
+ *  Pool of worker threads running the frames of all cameras.
+ */
+
+#ifndef EXECUTOR_H_
+#define EXECUTOR_H_
+
+struct executor;
+
+/* A task run by the workers once it is due, embedded in what it runs for */
+struct executor_task {
+    void (*run)(struct executor_task *task);
+    long long due;                      /* When to run it on the monotonic clock */
+    int worker;                         /* Worker which ran it last, -1 for none */
+    struct executor_task *next;         /* Links while queued */
+    struct executor_task *prev;
+};
+
+extern struct executor *executor_start(int threads, const char *affinity);
+extern void executor_submit(struct executor *ex, struct executor_task *task, long long due);
+extern void executor_stop(struct executor *ex);
+
+#endif /* EXECUTOR_H_ */
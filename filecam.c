@@ -23,6 +23,8 @@ int filecam_start (struct context *cnt)
         return -1;
     }
 
+    filecam->start_ns = monotonic_ns();
+
     cnt->imgs.width = cnt->conf.width;
     cnt->imgs.height = cnt->conf.height;
     cnt->imgs.size = (cnt->conf.width * cnt->conf.height * 3) / 2;
@@ -44,6 +46,12 @@ int filecam_next (struct context *cnt, struct image_data* imgdat)
         if (fread(imgdat->image, 1, cnt->imgs.size, filecam->capture_file)) {
             if (cnt->rotate_data.degrees > 0)
                 rotate_map(cnt, imgdat->image);
+
+            /* The file has no times, its frames were taken frame_limit apart */
+            if (cnt->conf.frame_limit > 0)
+                imgdat->capture_mono_ns = filecam->start_ns +
+                                          filecam->frame * 1000000000LL / cnt->conf.frame_limit;
+            filecam->frame++;
         }
         else {
             raise(SIGQUIT);
@@ -14,6 +14,8 @@ typedef struct filecam_context {
     struct context *cnt;        /* pointer to parent motion
                                    context structure */
     FILE *capture_file;
+    long long start_ns;         /* When the first frame was read, on the monotonic clock */
+    int frame;                  /* Index of the next frame in the file */
 } filecam_context;
 
 extern void filecam_select_as_plugin(struct context *);
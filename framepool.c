@@ -0,0 +1,236 @@
+/*
+ * framepool.c
+ *
+ *  Pools of reference counted picture buffers.
+ *
+ *  A camera picture is captured once into a buffer from the pool and then
+ *  shared instead of copied: the ring buffer, image_virgin, the preview
+ *  picture and the output stage each hold a reference. Whoever draws on a
+ *  picture first takes a private copy with frame_unshare if the buffer is
+ *  shared, so the others keep seeing the picture as it was.
+ *
+ *  Buffers are plain picture pointers with a small header in front of them,
+ *  so the code using them does not change. When the last reference goes the
+ *  buffer returns to its pool to be handed out again. A pool takes its
+ *  buffers from the arena of the camera, see arena.c.
+ */
+
+#include "motion.h"
+#include "framepool.h"
+#include "arena.h"
+
+/* Room for the header, keeps the picture as aligned as the arena does */
+#define FRAME_HEADER_SIZE ARENA_ALIGN
+
+struct frame_header {
+    struct frame_pool *pool;
+    struct frame_header *next;      /* Next idle buffer of the pool */
+    int refs;
+};
+
+struct frame_pool {
+    pthread_mutex_t lock;
+    struct arena *arena;            /* Where the buffers come from */
+    int class;                      /* ARENA_* class of the buffers */
+    int size;                       /* Picture size of the buffers */
+    int count;                      /* Buffers allocated and not freed */
+    int closing;                    /* Free buffers as they come back */
+    struct frame_header *idle;
+};
+
+static struct frame_header *frame_header(unsigned char *buffer)
+{
+    return (struct frame_header *)(buffer - FRAME_HEADER_SIZE);
+}
+
+static void frame_pool_destroy(struct frame_pool *pool)
+{
+    arena_destroy(pool->arena);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
+
+/**
+ * frame_pool_new
+ *      Creates a pool of buffers holding size bytes, taken from arena and
+ *      counted there as class. The pool keeps a reference to arena.
+ */
+struct frame_pool *frame_pool_new(struct arena *arena, int class, int size)
+{
+    struct frame_pool *pool;
+
+    pool = mymalloc(sizeof(struct frame_pool));
+    pool->arena = arena_ref(arena);
+    pool->class = class;
+    pool->size = size;
+    pthread_mutex_init(&pool->lock, NULL);
+
+    return pool;
+}
+
+/**
+ * frame_pool_free
+ *      Frees the pool. Buffers still referenced are freed when their last
+ *      reference goes, the pool and its reference to the arena with the
+ *      last of them.
+ *
+ * Returns the number of buffers still referenced.
+ */
+int frame_pool_free(struct frame_pool *pool)
+{
+    struct frame_header *header;
+    int count;
+
+    if (!pool)
+        return 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool->closing = 1;
+
+    while ((header = pool->idle)) {
+        pool->idle = header->next;
+        arena_free(pool->arena, header);
+        pool->count--;
+    }
+
+    count = pool->count;
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (count) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: %d picture buffers still in use, freed once "
+                   "given back", count);
+        return count;
+    }
+
+    frame_pool_destroy(pool);
+
+    return 0;
+}
+
+/**
+ * frame_pool_get
+ *      Takes an idle buffer from the pool, allocating one if there is none.
+ *
+ * Returns the buffer holding one reference. Its content is undefined.
+ */
+unsigned char *frame_pool_get(struct frame_pool *pool)
+{
+    struct frame_header *header;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if ((header = pool->idle)) {
+        pool->idle = header->next;
+    } else {
+        header = arena_alloc(pool->arena, FRAME_HEADER_SIZE + pool->size, pool->class);
+        header->pool = pool;
+        pool->count++;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    header->next = NULL;
+    header->refs = 1;
+
+    return (unsigned char *)header + FRAME_HEADER_SIZE;
+}
+
+/**
+ * frame_ref
+ *      Adds a reference to buffer, which may be NULL.
+ *
+ * Returns buffer.
+ */
+unsigned char *frame_ref(unsigned char *buffer)
+{
+    if (buffer)
+        __sync_add_and_fetch(&frame_header(buffer)->refs, 1);
+
+    return buffer;
+}
+
+/**
+ * frame_unref
+ *      Drops a reference to buffer, which may be NULL. The last one returns
+ *      the buffer to its pool.
+ */
+void frame_unref(unsigned char *buffer)
+{
+    struct frame_header *header;
+    struct frame_pool *pool;
+    int last = 0;
+
+    if (!buffer)
+        return;
+
+    header = frame_header(buffer);
+
+    if (__sync_sub_and_fetch(&header->refs, 1) != 0)
+        return;
+
+    pool = header->pool;
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (pool->closing) {
+        arena_free(pool->arena, header);
+        last = (--pool->count == 0);
+    } else {
+        header->next = pool->idle;
+        pool->idle = header;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (last)
+        frame_pool_destroy(pool);
+}
+
+/**
+ * frame_shared
+ *      Tells if buffer has other references than the caller's.
+ */
+int frame_shared(unsigned char *buffer)
+{
+    return __sync_add_and_fetch(&frame_header(buffer)->refs, 0) > 1;
+}
+
+/**
+ * frame_unshare
+ *      Makes buffer private to the caller before it writes to it. A shared
+ *      buffer is replaced by one from the same pool, holding a copy of the
+ *      picture if copy is set, and the caller's reference to it is dropped.
+ *
+ * Returns the buffer to write to.
+ */
+unsigned char *frame_unshare(unsigned char *buffer, int copy)
+{
+    unsigned char *private;
+
+    if (!buffer || !frame_shared(buffer))
+        return buffer;
+
+    private = frame_pool_get(frame_header(buffer)->pool);
+
+    if (copy)
+        memcpy(private, buffer, frame_header(buffer)->pool->size);
+
+    frame_unref(buffer);
+
+    return private;
+}
+
+/**
+ * image_unshare
+ *      Makes the picture of img, and its secondary picture if secondary is
+ *      set, private before drawing on them.
+ */
+void image_unshare(struct image_data *img, int secondary)
+{
+    img->image = frame_unshare(img->image, 1);
+
+    if (secondary)
+        img->secondary_image = frame_unshare(img->secondary_image, 1);
+}
@@ -0,0 +1,24 @@
+/*
+ * framepool.h
+ *
+ *  Pools of reference counted picture buffers.
+ */
+
+#ifndef FRAMEPOOL_H_
+#define FRAMEPOOL_H_
+
+struct frame_pool;
+struct image_data;
+struct arena;
+
+extern struct frame_pool *frame_pool_new(struct arena *arena, int class, int size);
+extern int frame_pool_free(struct frame_pool *pool);
+extern unsigned char *frame_pool_get(struct frame_pool *pool);
+
+extern unsigned char *frame_ref(unsigned char *buffer);
+extern void frame_unref(unsigned char *buffer);
+extern int frame_shared(unsigned char *buffer);
+extern unsigned char *frame_unshare(unsigned char *buffer, int copy);
+extern void image_unshare(struct image_data *img, int secondary);
+
+#endif /* FRAMEPOOL_H_ */
@@ -0,0 +1,172 @@
+/*
+ * governor.c
+ *
+ *  Shares out the CPU between the cameras by priority under overload.
+ *
+ *  Left to themselves the cameras of an overloaded host all run late and
+ *  degrade alike. The governor runs in main, looks at the timing reports of
+ *  all cameras every GOVERNOR_SECONDS and decides which one gives way.
+ *
+ *  While any camera overruns its frames, or runs below its minimum_fps,
+ *  the camera with the lowest priority which still can is moved one step
+ *  down: first the SHED_* levels of the scheduler, which cut motion
+ *  detection and stream rate, then its frame rate is halved step by step
+ *  down to its minimum_fps. Once every camera is calm for
+ *  GOVERNOR_CALM_CHECKS decisions in a row the camera with the highest
+ *  priority which gave way gets one step back.
+ *
+ *  A camera with minimum_fps at its frame_limit keeps its full rate and is
+ *  never moved down, neither its frame rate nor its SHED_* level.
+ *  Under the governor the cameras do not shed load on their own, or a
+ *  camera of high priority would shed before one of low priority.
+ */
+
+#include "motion.h"
+#include "governor.h"
+
+/* Calm decisions in a row */
+static int calm_checks;
+/* Seconds since the last decision */
+static int ticks;
+/* Set while overloaded with no camera left to give way */
+static int exhausted;
+
+/**
+ * governor_steps
+ *      Returns the last step camera cnt may be moved down to, 0 for a
+ *      camera which keeps its full rate and never gives way.
+ */
+static int governor_steps(struct context *cnt)
+{
+    int minimum_fps = cnt->conf.minimum_fps > 1 ? cnt->conf.minimum_fps : 1;
+    int halvings = 0;
+
+    /* Shedding would cost it frames of detection and stream as well */
+    if (cnt->conf.frame_limit > 0 && cnt->conf.minimum_fps >= cnt->conf.frame_limit)
+        return 0;
+
+    while ((cnt->conf.frame_limit >> halvings) > minimum_fps)
+        halvings++;
+
+    return GOVERNOR_RATE_STEP + halvings;
+}
+
+/**
+ * governor_rate
+ *      Returns the frame rate cap of camera cnt at its step, 0 for no cap.
+ */
+static int governor_rate(struct context *cnt)
+{
+    int rate;
+
+    if (cnt->governor_step <= GOVERNOR_RATE_STEP)
+        return 0;
+
+    rate = cnt->conf.frame_limit >> (cnt->governor_step - GOVERNOR_RATE_STEP);
+
+    if (rate < cnt->conf.minimum_fps)
+        rate = cnt->conf.minimum_fps;
+
+    return rate > 1 ? rate : 1;
+}
+
+/**
+ * governor_apply
+ *      Hands the step of camera cnt to its scheduler, which applies it.
+ */
+static void governor_apply(struct context *cnt)
+{
+    int shed_floor = cnt->governor_step < GOVERNOR_RATE_STEP ? cnt->governor_step : GOVERNOR_RATE_STEP;
+
+    /* The camera reads them on its own thread */
+    __atomic_store_n(&cnt->scheduler.shed_floor, shed_floor, __ATOMIC_RELAXED);
+    __atomic_store_n(&cnt->scheduler.rate_cap, governor_rate(cnt), __ATOMIC_RELAXED);
+}
+
+static void governor_step(struct context *cnt, int step)
+{
+    int rate_cap;
+
+    cnt->governor_step = step;
+    governor_apply(cnt);
+
+    if ((rate_cap = governor_rate(cnt)))
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Thread %d with priority %d governed to step %d, "
+                   "%d fps", cnt->threadnr, cnt->conf.priority, step, rate_cap);
+    else
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Thread %d with priority %d governed to step %d",
+                   cnt->threadnr, cnt->conf.priority, step);
+}
+
+/**
+ * governor_run
+ *      Called by main once a second, decides every GOVERNOR_SECONDS.
+ */
+void governor_run(struct context **cnt_list)
+{
+    struct context *cnt, *give = NULL, *take = NULL;
+    struct frame_scheduler *sched;
+    float fps, percent_over, percent_idle;
+    int overloaded = 0, calm = 1;
+    int i;
+
+    if (!cnt_list[0]->conf.governor || ++ticks < GOVERNOR_SECONDS)
+        return;
+
+    ticks = 0;
+
+    for (i = cnt_list[1] != NULL ? 1 : 0; (cnt = cnt_list[i]); i++) {
+        if (!cnt->running)
+            continue;
+
+        /* frame_limit may have changed from http-control */
+        governor_apply(cnt);
+
+        sched = &cnt->scheduler;
+
+        /* The camera writes its report on its own thread */
+        __atomic_load(&sched->fps, &fps, __ATOMIC_RELAXED);
+        __atomic_load(&sched->percent_over, &percent_over, __ATOMIC_RELAXED);
+        __atomic_load(&sched->percent_idle, &percent_idle, __ATOMIC_RELAXED);
+
+        /* No report yet */
+        if (fps == 0)
+            continue;
+
+        if ((percent_over >= SHED_OVER_PERCENT && percent_idle < SHED_IDLE_PERCENT) ||
+            fps < cnt->conf.minimum_fps * GOVERNOR_FPS_MARGIN)
+            overloaded = 1;
+
+        if (percent_over >= SHED_CALM_PERCENT)
+            calm = 0;
+
+        /* The lowest priority gives way first, the lowest step of those first */
+        if (cnt->governor_step < governor_steps(cnt) &&
+            (!give || cnt->conf.priority < give->conf.priority ||
+             (cnt->conf.priority == give->conf.priority && cnt->governor_step < give->governor_step)))
+            give = cnt;
+
+        /* The highest priority gets its steps back first */
+        if (cnt->governor_step > 0 &&
+            (!take || cnt->conf.priority > take->conf.priority ||
+             (cnt->conf.priority == take->conf.priority && cnt->governor_step > take->governor_step)))
+            take = cnt;
+    }
+
+    if (overloaded) {
+        calm_checks = 0;
+
+        if (give) {
+            exhausted = 0;
+            governor_step(give, give->governor_step + 1);
+        } else if (!exhausted) {
+            exhausted = 1;
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Overloaded with every camera at its minimum_fps");
+        }
+    } else if (calm && take && ++calm_checks >= GOVERNOR_CALM_CHECKS) {
+        calm_checks = 0;
+        governor_step(take, take->governor_step - 1);
+    } else if (!calm) {
+        calm_checks = 0;
+    }
+}
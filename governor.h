@@ -0,0 +1,28 @@
+/*
+ * governor.h
+ *
+ *  Shares out the CPU between the cameras by priority under overload.
+ */
+
+#ifndef GOVERNOR_H_
+#define GOVERNOR_H_
+
+/* Seconds between two decisions, one per timing report of the cameras */
+#define GOVERNOR_SECONDS            SCHEDULER_REPORT_SECONDS
+/* Calm decisions in a row before one camera gets a step back */
+#define GOVERNOR_CALM_CHECKS        3
+/* Share of minimum_fps a camera must reach, the rest is jitter of the reports */
+#define GOVERNOR_FPS_MARGIN         0.9f
+
+/*
+ * Steps of a camera, each also sheds what the ones below it do. The
+ * SHED_* levels come first, every step above GOVERNOR_RATE_STEP halves
+ * the frame rate down to minimum_fps.
+ */
+#define GOVERNOR_RATE_STEP          SHED_DETECT_REDUCED
+
+struct context;
+
+extern void governor_run(struct context **cnt_list);
+
+#endif /* GOVERNOR_H_ */
@@ -749,6 +749,9 @@ int mmalcam_next(struct context *cnt, struct image_data* imgdat)
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: mmalcam_next - start");
     mmal_output_process_buffer(&mmalcam->camera_output, imgdat->image, cnt->imgs.size);
 
+    /* Captured when the end of the frame came in, before the still capture delay */
+    imgdat->capture_mono_ns = monotonic_ns();
+
     if (cnt->imgs.secondary_size && imgdat != NULL) {
         imgdat->secondary_size = mmal_output_process_buffer(&mmalcam->secondary_output, imgdat->secondary_image, cnt->imgs.secondary_size);
     }
@@ -21,6 +21,14 @@
 #include "picture.h"
 #include "rotate.h"
 #include "metrics.h"
+#include "yuv2rgb.h"
+#include "yuvscale.h"
+#include "encoder.h"
+#include "pipeline.h"
+#include "framepool.h"
+#include "arena.h"
+#include "executor.h"
+#include "governor.h"
 
 #ifdef _PROFILING
 #include "gperftools/profiler.h"
@@ -62,6 +70,14 @@ struct context **cnt_list = NULL;
  */
 volatile int threads_running = 0;
 
+/**
+ * executor
+ *
+ *   Worker threads running the cameras when the executor option is on,
+ *   NULL when each camera has a thread of its own.
+ */
+static struct executor *executor = NULL;
+
 /* Set this when we want main to end or restart */
 volatile unsigned int finish = 0;
 
@@ -123,21 +139,32 @@ static void image_ring_resize(struct context *cnt, int new_size)
                 memcpy(tmp, cnt->imgs.image_ring, sizeof(struct image_data) * smallest);
             
 
-            /* In the new buffers, allocate image memory */
+            /* 
+             * In the new buffers, take image memory from the pool. A compressed
+             * ring takes it when a picture is captured, see image_ring_restore.
+             */
             {
                 int i;
-                for(i = smallest; i < new_size; i++) {
-                    tmp[i].image = mymalloc(cnt->imgs.size);
+                for(i = smallest; i < new_size && !cnt->compress_stage; i++) {
+                    tmp[i].image = frame_pool_get(cnt->imgs.frame_pool);
                     memset(tmp[i].image, 0x80, cnt->imgs.size);  /* initialize to grey */
                 }
 
                 if (cnt->imgs.secondary_size) {
                     for(i = smallest; i < new_size; i++) {
-                        tmp[i].secondary_image = mymalloc(cnt->imgs.secondary_size);
+                        tmp[i].secondary_image = frame_pool_get(cnt->imgs.secondary_pool);
                         if (cnt->imgs.secondary_type == SECONDARY_TYPE_RAW)
                             memset(tmp[i].secondary_image, 0x80, cnt->imgs.secondary_size);  /* initialize to grey */
                     }
                 }
+
+                /* Give the pictures of dropped buffers back to the pool */
+                for(i = new_size; i < cnt->imgs.image_ring_size; i++) {
+                    frame_unref(cnt->imgs.image_ring[i].image);
+                    frame_unref(cnt->imgs.image_ring[i].secondary_image);
+                    frame_unref(cnt->imgs.image_ring[i].virgin);
+                    free(cnt->imgs.image_ring[i].encoded);
+                }
             }
             
             /* Free the old ring */
@@ -170,9 +197,13 @@ static void image_ring_destroy(struct context *cnt)
     if (cnt->imgs.image_ring == NULL)
         return;
 
-    /* Free all image buffers */
-    for (i = 0; i < cnt->imgs.image_ring_size; i++) 
-        free(cnt->imgs.image_ring[i].image);
+    /* Drop all image buffers */
+    for (i = 0; i < cnt->imgs.image_ring_size; i++) {
+        frame_unref(cnt->imgs.image_ring[i].image);
+        frame_unref(cnt->imgs.image_ring[i].secondary_image);
+        frame_unref(cnt->imgs.image_ring[i].virgin);
+        free(cnt->imgs.image_ring[i].encoded);
+    }
     
     
     /* Free the ring */
@@ -196,22 +227,21 @@ static void image_ring_destroy(struct context *cnt)
  */
 static void image_save_as_preview(struct context *cnt, struct image_data *img)
 {
-    void * image;
-    void * secondary_image;
+    unsigned char *image;
+    unsigned char *secondary_image;
     /* Save preview image pointer */
     image = cnt->imgs.preview_image.image;
     secondary_image = cnt->imgs.preview_image.secondary_image;
 
     /* Copy all info */
     memcpy(&cnt->imgs.preview_image.image, img, sizeof(struct image_data));
-    /* restore image pointer */
-    cnt->imgs.preview_image.image = image;
-    cnt->imgs.preview_image.secondary_image = secondary_image;
 
-    /* Copy image */
-    memcpy(cnt->imgs.preview_image.image, img->image, cnt->imgs.size);
-    if (secondary_image)
-        memcpy(cnt->imgs.preview_image.secondary_image, img->secondary_image, cnt->imgs.secondary_size);
+    /* Share the pictures instead of copying them, drawing on them copies */
+    cnt->imgs.preview_image.image = frame_ref(img->image);
+    cnt->imgs.preview_image.secondary_image = frame_ref(img->secondary_image);
+    cnt->imgs.preview_image.virgin = NULL;
+    frame_unref(image);
+    frame_unref(secondary_image);
 
     /* 
      * If we set output_all to yes and during the event
@@ -504,7 +534,7 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
          * We also disable this in setup_mode.
          */
         if (conf->stream_motion && !conf->setup_mode && img->shot != 1) 
-            event(cnt, EVENT_STREAM, NULL, NULL, img, &img->timestamp_tm);
+            output_stage_put(cnt, OUTPUT_STREAM, img->image, img, NULL);
 
         /* 
          * Save motion jpeg, if configured 
@@ -520,6 +550,95 @@ static void motion_detected(struct context *cnt, int dev, struct image_data *img
     
 }
 
+/**
+ * image_encodable_ahead
+ *
+ *   Tells if the pictures saved for images are full size jpegs which can be
+ *   encoded before they are saved, see encode_image_burst.
+ */
+static int image_encodable_ahead(struct context *cnt)
+{
+    return (cnt->new_img & NEWIMG_ON) && cnt->crop_img != CROPIMG_ONLY &&
+           cnt->imgs.picture_type == IMAGE_TYPE_JPEG && cnt->imgs.type == VIDEO_PALETTE_YUV420P &&
+           cnt->log_level < DBG; /* Debug text is drawn just before saving */
+}
+
+/**
+ * image_ring_restore
+ *
+ *   Gives an image of the ring whose picture is kept compressed a raw picture
+ *   again. With decode set the jpeg is decoded into it, and kept to be saved
+ *   as it is when it is what put_image would save. Otherwise the picture is
+ *   not needed any more and the image gets a new one to capture into.
+ */
+static void image_ring_restore(struct context *cnt, struct image_data *img, int decode)
+{
+    if (img->image)
+        return;
+
+    img->image = frame_pool_get(cnt->imgs.frame_pool);
+
+    if (!decode || !img->encoded) {
+        memset(img->image, 0x80, cnt->imgs.size);  /* grey */
+    } else if (mjpegtoyuv420p(img->image, img->encoded, cnt->imgs.width, cnt->imgs.height,
+                              img->encoded_size) < 0) {
+        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Could not decode a pre_capture picture");
+        memset(img->image, 0x80, cnt->imgs.size);
+    }
+
+    /* The jpeg has no exif_text and comes from the full size picture */
+    if (!decode || !image_encodable_ahead(cnt) || cnt->conf.exif_text ||
+        (img->secondary_image && cnt->conf.output_secondary_pictures)) {
+        free(img->encoded);
+        img->encoded = NULL;
+    }
+}
+
+/**
+ * encode_ring_burst
+ *
+ *   Encodes the pictures of all images waiting to be saved in parallel when
+ *   there are more than process_image_ring saves per loop, like the
+ *   pre_capture images when an event starts.
+ *
+ * Returns 1 if a burst was encoded and must be flushed now, 0 otherwise.
+ */
+static int encode_ring_burst(struct context *cnt)
+{
+    struct image_data **burst;
+    struct image_data *img;
+    int i = cnt->imgs.image_ring_out;
+    int count = 0;
+
+    /* Only full size jpeg pictures are encoded ahead, see encode_image_burst */
+    if (!image_encodable_ahead(cnt))
+        return 0;
+
+    burst = mymalloc(cnt->imgs.image_ring_size * sizeof(struct image_data *));
+
+    /* Same images as process_image_ring saves on a flush */
+    do {
+        img = &cnt->imgs.image_ring[i];
+
+        if ((img->flags & (IMAGE_SAVE | IMAGE_SAVED)) != IMAGE_SAVE)
+            break;
+
+        /* Pictures kept compressed are saved as they are */
+        if (img->shot < cnt->conf.frame_limit && img->image)
+            burst[count++] = img;
+
+        if (++i >= cnt->imgs.image_ring_size)
+            i = 0;
+    } while (i != cnt->imgs.image_ring_in);
+
+    if (count > 2)
+        encode_image_burst(cnt, burst, count);
+
+    free(burst);
+
+    return count > 2;
+}
+
 /**
  * process_image_ring
  *
@@ -541,6 +660,10 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
      */
     struct image_data *saved_current_image = cnt->current_image;
 
+    /* Encode all pictures to save in parallel, then save them all now in order */
+    if (cnt->encoders && encode_ring_burst(cnt))
+        max_images = IMAGE_BUFFER_FLUSH;
+
     /* If image is flaged to be saved and not saved yet, process it */
     do {
         /* Check if we should save/send this image, breakout if not */
@@ -549,6 +672,7 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 
         /* Set inte global cotext that we are working with this image */
         cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_out];
+        image_ring_restore(cnt, cnt->current_image, 1);
 
         if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].shot < cnt->conf.frame_limit) {
             if (cnt->log_level >= DBG) {
@@ -579,6 +703,12 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
                   NULL, NULL, &cnt->imgs.image_ring[cnt->imgs.image_ring_out],
                   &cnt->imgs.image_ring[cnt->imgs.image_ring_out].timestamp_tm);
 
+            /* Drop a picture encoded ahead that was not saved after all */
+            if (cnt->imgs.image_ring[cnt->imgs.image_ring_out].encoded) {
+                free(cnt->imgs.image_ring[cnt->imgs.image_ring_out].encoded);
+                cnt->imgs.image_ring[cnt->imgs.image_ring_out].encoded = NULL;
+            }
+
             /* 
              * Check if we must add any "filler" frames into movie to keep up fps 
              * Only if we are recording videos ( ffmpeg or extenal pipe )         
@@ -644,6 +774,14 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
             }
         }
 
+        /* A compressed ring keeps no pictures which have been saved */
+        if (cnt->compress_stage && cnt->current_image != saved_current_image) {
+            frame_unref(cnt->current_image->image);
+            cnt->current_image->image = NULL;
+            free(cnt->current_image->encoded);
+            cnt->current_image->encoded = NULL;
+        }
+
         /* Increment to image after last sended */
         if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size)
             cnt->imgs.image_ring_out = 0;
@@ -662,6 +800,52 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
     cnt->current_image = saved_current_image;
 }
 
+/**
+ * image_arena_size
+ *
+ *   Sums up the buffers motion_init takes from the arena of the camera: the
+ *   pictures of the ring, the capture and output stages, image_virgin, out and
+ *   the preview, the reference frame, the masks, the labels and common_buffer.
+ *
+ * Returns:     the size in bytes
+ */
+static size_t image_arena_size(struct context *cnt)
+{
+    size_t size = 0;
+    int frames;
+
+    /* A compressed ring only has raw pictures for the frames being compressed */
+    if (cnt->conf.pre_capture_compress && cnt->imgs.type == VIDEO_PALETTE_YUV420P)
+        frames = PIPELINE_COMPRESS_FRAMES;
+    else
+        frames = MAX(cnt->conf.pre_capture, 0);
+
+    frames += MAX(cnt->conf.minimum_motion_frames, 1) + PIPELINE_CAPTURE_FRAMES +
+              PIPELINE_OUTPUT_FRAMES + 3;
+
+    /* Pictures of an idle scene kept for motion_idle_backfill */
+    if (cnt->conf.idle_minutes > 0)
+        frames += MAX(cnt->conf.minimum_motion_frames, 1);
+
+    /* Pool buffers have a header of ARENA_ALIGN bytes */
+    size += frames * arena_round(ARENA_ALIGN + cnt->imgs.size);
+    if (cnt->imgs.secondary_size)
+        size += frames * arena_round(ARENA_ALIGN + cnt->imgs.secondary_size);
+
+    size += arena_round(cnt->imgs.size);
+    size += arena_round(cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn[0]));
+    size += 2 * arena_round(cnt->imgs.motionsize);
+    size += arena_round(cnt->imgs.motionsize * sizeof(cnt->imgs.smartmask_buffer[0]));
+    size += arena_round(cnt->imgs.motionsize * sizeof(cnt->imgs.labels[0]));
+    size += arena_round((cnt->imgs.motionsize / 2 + 1) * sizeof(cnt->imgs.labelsize[0]));
+    size += arena_round(3 * cnt->imgs.width * cnt->imgs.height);
+
+    if (cnt->conf.mask_file)
+        size += arena_round(cnt->imgs.motionsize);
+
+    return size;
+}
+
 /**
  * motion_init
  *
@@ -680,6 +864,7 @@ static void process_image_ring(struct context *cnt, unsigned int max_images)
 static int motion_init(struct context *cnt)
 {
     FILE *picture;
+    unsigned char *mask;
 
     /* Store thread number in TLS. */
     pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
@@ -731,20 +916,36 @@ static int motion_init(struct context *cnt)
         return -3;
     }
 
+    /* The image buffers of the camera are aligned and kept together in its arena */
+    cnt->imgs.arena = arena_new(image_arena_size(cnt), cnt->conf.memory_hugepages,
+                                cnt->conf.memory_lock);
+
+    /* Pictures are shared between the ring, image_virgin, the preview and the outputs */
+    cnt->imgs.frame_pool = frame_pool_new(cnt->imgs.arena, ARENA_PICTURE, cnt->imgs.size);
+    if (cnt->imgs.secondary_size)
+        cnt->imgs.secondary_pool = frame_pool_new(cnt->imgs.arena, ARENA_SECONDARY,
+                                                  cnt->imgs.secondary_size);
+
     image_ring_resize(cnt, 1); /* Create a initial precapture ring buffer with 1 frame */
 
-    cnt->imgs.ref = mymalloc(cnt->imgs.size);
-    cnt->imgs.out = mymalloc(cnt->imgs.size);
+    cnt->imgs.ref = arena_alloc(cnt->imgs.arena, cnt->imgs.size, ARENA_REFERENCE);
+    cnt->imgs.out = frame_pool_get(cnt->imgs.frame_pool);
     memset(cnt->imgs.out, 0, cnt->imgs.size);
 
     /* contains the moving objects of ref. frame */
-    cnt->imgs.ref_dyn = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn[0]));
-    cnt->imgs.image_virgin = mymalloc(cnt->imgs.size);
-    cnt->imgs.smartmask = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_final = mymalloc(cnt->imgs.motionsize);
-    cnt->imgs.smartmask_buffer = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.smartmask_buffer));
-    cnt->imgs.labels = mymalloc(cnt->imgs.motionsize * sizeof(cnt->imgs.labels));
-    cnt->imgs.labelsize = mymalloc((cnt->imgs.motionsize/2+1) * sizeof(cnt->imgs.labelsize));
+    cnt->imgs.ref_dyn = arena_alloc(cnt->imgs.arena, cnt->imgs.motionsize * sizeof(cnt->imgs.ref_dyn[0]),
+                                    ARENA_REFERENCE);
+    cnt->imgs.image_virgin = frame_pool_get(cnt->imgs.frame_pool);
+    cnt->imgs.smartmask = arena_alloc(cnt->imgs.arena, cnt->imgs.motionsize, ARENA_MASK);
+    cnt->imgs.smartmask_final = arena_alloc(cnt->imgs.arena, cnt->imgs.motionsize, ARENA_MASK);
+    cnt->imgs.smartmask_buffer = arena_alloc(cnt->imgs.arena,
+                                             cnt->imgs.motionsize * sizeof(cnt->imgs.smartmask_buffer[0]),
+                                             ARENA_MASK);
+    cnt->imgs.labels = arena_alloc(cnt->imgs.arena, cnt->imgs.motionsize * sizeof(cnt->imgs.labels[0]),
+                                   ARENA_LABELS);
+    cnt->imgs.labelsize = arena_alloc(cnt->imgs.arena,
+                                      (cnt->imgs.motionsize / 2 + 1) * sizeof(cnt->imgs.labelsize[0]),
+                                      ARENA_LABELS);
 
     /* Set output picture type */
     if (!strcmp(cnt->conf.picture_type, "ppm"))
@@ -754,19 +955,21 @@ static int motion_init(struct context *cnt)
     else
         cnt->imgs.picture_type = IMAGE_TYPE_JPEG;
 
-    /* allocate buffer here for preview buffer */
-    cnt->imgs.preview_image.image = mymalloc(cnt->imgs.size);
-
-    if (cnt->imgs.secondary_size)
-        cnt->imgs.preview_image.secondary_image = mymalloc(cnt->imgs.secondary_size);
+    if (cnt->conf.picture_color_matrix && !strcasecmp(cnt->conf.picture_color_matrix, "bt709"))
+        cnt->imgs.rgb_matrix = YUV_MATRIX_BT709;
     else
-        cnt->imgs.preview_image.secondary_image = NULL;
+        cnt->imgs.rgb_matrix = YUV_MATRIX_BT601;
+
+    /* The preview shares the pictures of the ring, see image_save_as_preview */
+    cnt->imgs.preview_image.image = NULL;
+    cnt->imgs.preview_image.secondary_image = NULL;
 
     /* 
      * Allocate a buffer for temp. usage in some places 
      * Only despeckle & bayer2rgb24() for now for now... 
      */
-    cnt->imgs.common_buffer = mymalloc(3 * cnt->imgs.width * cnt->imgs.height);
+    cnt->imgs.common_buffer = arena_alloc(cnt->imgs.arena, 3 * cnt->imgs.width * cnt->imgs.height,
+                                          ARENA_WORK);
 
     if (cnt->imgs.secondary_width) {
         cnt->imgs.secondary_width_scale = (float)cnt->imgs.secondary_width / (float)cnt->imgs.width;
@@ -782,6 +985,38 @@ static int motion_init(struct context *cnt)
         cnt->imgs.secondary_height_scale = 1.0f;
     }
 
+    /* 
+     * Thumbnails are scaled from the primary image, or from a raw secondary
+     * image when pictures are saved from that. Keep the aspect ratio of the
+     * image unless both sizes are set, sizes must be even for YUV420P.
+     */
+    cnt->imgs.thumbnail_width = cnt->conf.thumbnail_width;
+    if (cnt->imgs.thumbnail_width < 2 || cnt->imgs.thumbnail_width > cnt->imgs.width)
+        cnt->imgs.thumbnail_width = cnt->imgs.width;
+
+    if (cnt->conf.thumbnail_height > 0)
+        cnt->imgs.thumbnail_height = cnt->conf.thumbnail_height;
+    else
+        cnt->imgs.thumbnail_height = cnt->imgs.thumbnail_width * cnt->imgs.height / cnt->imgs.width;
+
+    if (cnt->imgs.thumbnail_height < 2 || cnt->imgs.thumbnail_height > cnt->imgs.height)
+        cnt->imgs.thumbnail_height = cnt->imgs.height;
+
+    cnt->imgs.thumbnail_width &= ~1;
+    cnt->imgs.thumbnail_height &= ~1;
+
+    if (cnt->conf.thumbnail_filter && !strcasecmp(cnt->conf.thumbnail_filter, "bilinear"))
+        cnt->imgs.thumbnail_filter = SCALE_FILTER_BILINEAR;
+    else
+        cnt->imgs.thumbnail_filter = SCALE_FILTER_BOX;
+
+    /* The jpeg encoder reads whole 16 line blocks, allow for that past the end */
+    cnt->imgs.thumbnail = mymalloc((cnt->imgs.thumbnail_width * cnt->imgs.thumbnail_height * 3) / 2 +
+                                   cnt->imgs.thumbnail_width * 16);
+
+    if (cnt->conf.picture_encoder_threads > 0)
+        cnt->encoders = encoder_pool_start(cnt, cnt->conf.picture_encoder_threads);
+
     /* 
      * Now is a good time to init rotation data. Since vid_start has been
      * called, we know that we have imgs.width and imgs.height. When capturing
@@ -928,8 +1163,15 @@ static int motion_init(struct context *cnt)
              * applies to the already rotated image, not the capture image. Thus, use
              * width and height from imgs.
              */
-            cnt->imgs.mask = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
+            mask = get_pgm(picture, cnt->imgs.width, cnt->imgs.height);
             myfclose(picture);
+
+            /* Keep the mask with the other buffers it is used with */
+            if (mask) {
+                cnt->imgs.mask = arena_alloc(cnt->imgs.arena, cnt->imgs.motionsize, ARENA_MASK);
+                memcpy(cnt->imgs.mask, mask, cnt->imgs.motionsize);
+                free(mask);
+            }
         } else {
             MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Error opening mask file %s", 
                        cnt->conf.mask_file);
@@ -950,6 +1192,8 @@ static int motion_init(struct context *cnt)
         cnt->imgs.mask = NULL;
     }
 
+    arena_report(cnt->imgs.arena);
+
     /* Always initialize smart_mask - someone could turn it on later... */
     memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
     memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
@@ -962,7 +1206,14 @@ static int motion_init(struct context *cnt)
     cnt->threshold = cnt->conf.max_changes;
 
     /* Initialize stream server if stream port is specified to not 0 */
-    if (cnt->conf.stream_port) {
+    if (cnt->conf.stream_shared_port) {
+        if (stream_init(cnt) == -1)
+            cnt->finish = 1;
+        else
+            MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Serving motion-stream at /%d/stream"
+                       " of port %d auth %s", cnt->threadnr, cnt->conf.stream_shared_port,
+                       cnt->conf.stream_auth_method ? "Enabled":"Disabled");
+    } else if (cnt->conf.stream_port) {
         if (stream_init(cnt) == -1) {
             MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Problem enabling motion-stream server in port %d", 
                        cnt->conf.stream_port);
@@ -973,6 +1224,17 @@ static int motion_init(struct context *cnt)
         }    
     }
 
+    /* 
+     * Capture the next frame and feed the outputs while the motion thread works.
+     * On the executor the worker running the frame does both, so the threads
+     * stay the fixed pool of workers.
+     */
+    if (!executor) {
+        cnt->output_stage = output_stage_start(cnt);
+        cnt->capture_stage = capture_stage_start(cnt);
+    }
+    cnt->compress_stage = compress_stage_start(cnt, executor);
+
     /* Prevent first few frames from triggering motion... */
     cnt->moved = 8;
     /* 2 sec startup delay so FPS is calculated correct */
@@ -995,6 +1257,15 @@ static int motion_init(struct context *cnt)
  */
 static void motion_cleanup(struct context *cnt)
 {
+    capture_stage_stop(cnt->capture_stage);
+    cnt->capture_stage = NULL;
+
+    /* Flush the outputs before the stream and the pipes are closed */
+    output_stage_stop(cnt->output_stage);
+    cnt->output_stage = NULL;
+
+    compress_stage_stop(cnt);
+
     /* Stop stream */
     event(cnt, EVENT_STOP, NULL, NULL, NULL, NULL);
 
@@ -1004,62 +1275,71 @@ static void motion_cleanup(struct context *cnt)
     }
 
     if (cnt->imgs.out) {
-        free(cnt->imgs.out);
+        frame_unref(cnt->imgs.out);
         cnt->imgs.out = NULL;
     }
 
-    if (cnt->imgs.ref) {
-        free(cnt->imgs.ref);
-        cnt->imgs.ref = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.ref);
+    cnt->imgs.ref = NULL;
 
-    if (cnt->imgs.ref_dyn) {
-        free(cnt->imgs.ref_dyn);
-        cnt->imgs.ref_dyn = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.ref_dyn);
+    cnt->imgs.ref_dyn = NULL;
 
     if (cnt->imgs.image_virgin) {
-        free(cnt->imgs.image_virgin);
+        frame_unref(cnt->imgs.image_virgin);
         cnt->imgs.image_virgin = NULL;
     }
 
-    if (cnt->imgs.labels) {
-        free(cnt->imgs.labels);
-        cnt->imgs.labels = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.labels);
+    cnt->imgs.labels = NULL;
 
-    if (cnt->imgs.labelsize) {
-        free(cnt->imgs.labelsize);
-        cnt->imgs.labelsize = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.labelsize);
+    cnt->imgs.labelsize = NULL;
 
-    if (cnt->imgs.smartmask) {
-        free(cnt->imgs.smartmask);
-        cnt->imgs.smartmask = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.mask);
+    cnt->imgs.mask = NULL;
 
-    if (cnt->imgs.smartmask_final) {
-        free(cnt->imgs.smartmask_final);
-        cnt->imgs.smartmask_final = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.smartmask);
+    cnt->imgs.smartmask = NULL;
 
-    if (cnt->imgs.smartmask_buffer) {
-        free(cnt->imgs.smartmask_buffer);
-        cnt->imgs.smartmask_buffer = NULL;
-    }
+    arena_free(cnt->imgs.arena, cnt->imgs.smartmask_final);
+    cnt->imgs.smartmask_final = NULL;
 
-    if (cnt->imgs.common_buffer) {
-        free(cnt->imgs.common_buffer);
-        cnt->imgs.common_buffer = NULL;
+    arena_free(cnt->imgs.arena, cnt->imgs.smartmask_buffer);
+    cnt->imgs.smartmask_buffer = NULL;
+
+    arena_free(cnt->imgs.arena, cnt->imgs.common_buffer);
+    cnt->imgs.common_buffer = NULL;
+
+    frame_unref(cnt->imgs.preview_image.image);
+    frame_unref(cnt->imgs.preview_image.secondary_image);
+    cnt->imgs.preview_image.image = NULL;
+    cnt->imgs.preview_image.secondary_image = NULL;
+
+    if (cnt->imgs.thumbnail) {
+        free(cnt->imgs.thumbnail);
+        cnt->imgs.thumbnail = NULL;
     }
 
-    if (cnt->imgs.preview_image.image) {
-        free(cnt->imgs.preview_image.image);
-        cnt->imgs.preview_image.image = NULL;
+    if (cnt->encoders) {
+        encoder_pool_stop(cnt->encoders);
+        cnt->encoders = NULL;
     }
 
     image_ring_destroy(cnt); /* Cleanup the precapture ring buffer */
 
+    /* 
+     * Pictures still in use, such as by a compress task which has yet to
+     * run, keep their pool and the arena until they are given back.
+     */
+    frame_pool_free(cnt->imgs.frame_pool);
+    frame_pool_free(cnt->imgs.secondary_pool);
+    cnt->imgs.frame_pool = NULL;
+    cnt->imgs.secondary_pool = NULL;
+
+    arena_destroy(cnt->imgs.arena);
+    cnt->imgs.arena = NULL;
+
     rotate_deinit(cnt); /* cleanup image rotation data */
 
     if (cnt->pipe != -1) {
@@ -1106,1101 +1386,1241 @@ static void motion_cleanup(struct context *cnt)
 }
 
 /**
- * motion_loop
+ * motion_idle_release
  *
- *   Thread function for the motion handling threads.
+ *   Drops the picture kept for motion_idle_backfill by the image a new image
+ *   takes the place of in the ring, and by the one which is now too far back
+ *   for backfill to look at.
+ */
+static void motion_idle_release(struct context *cnt)
+{
+    int pos = cnt->imgs.image_ring_in - MAX(cnt->conf.minimum_motion_frames, 1);
+
+    while (pos < 0)
+        pos += cnt->imgs.image_ring_size;
+
+    frame_unref(cnt->imgs.image_ring[pos].virgin);
+    cnt->imgs.image_ring[pos].virgin = NULL;
+
+    frame_unref(cnt->current_image->virgin);
+    cnt->current_image->virgin = NULL;
+}
+
+/**
+ * motion_idle_backfill
+ *
+ *   Checks the images of the ring which were skipped while the scene was
+ *   idle for motion, as far back as minimum_motion_frames looks, so an
+ *   event starts as it would have with every frame checked. The pictures
+ *   are checked as they were captured, before any text was drawn on them,
+ *   with the same lightswitch and despeckle steps as the current one.
  *
+ * Returns the number of images checked.
  */
-static void *motion_loop(void *arg)
+static int motion_idle_backfill(struct context *cnt)
 {
-    struct context *cnt = arg;
-    int i, j, z = 0;
-    time_t lastframetime = 0;
-    int frame_buffer_size;
-    unsigned int rate_limit = 0;
-    int area_once = 0;
+    struct image_data *img;
+    unsigned char *out;
+    int *labels;
+    int pos = cnt->imgs.image_ring_in;
+    int i, checked = 0;
+
+    if (!cnt->threshold || cnt->pause)
+        return 0;
+
+    /* Once per idle period, the motion picture and labels of the current one stay */
+    out = mymalloc(cnt->imgs.motionsize);
+    labels = mymalloc(cnt->imgs.motionsize * sizeof(labels[0]));
+
+    for (i = 1; i < cnt->conf.minimum_motion_frames && i < cnt->imgs.image_ring_size; i++) {
+        pos = pos ? pos - 1 : cnt->imgs.image_ring_size - 1;
+        img = &cnt->imgs.image_ring[pos];
+
+        if (!(img->flags & IMAGE_UNDETECTED) || !img->virgin)
+            continue;
+
+        img->diffs = alg_diff_check(cnt, img, img->virgin, out, labels);
+        img->flags &= ~IMAGE_UNDETECTED;
+
+        if (img->diffs > cnt->threshold)
+            img->flags |= IMAGE_MOTION;
+
+        frame_unref(img->virgin);
+        img->virgin = NULL;
+        checked++;
+    }
+
+    free(labels);
+    free(out);
+
+    return checked;
+}
+
+/*
+ * State of the motion loop of a camera kept from one frame to the next.
+ */
+struct motion_loop_state {
+    time_t lastframetime;
+    int area_once;
     int area_minx[9], area_miny[9], area_maxx[9], area_maxy[9];
-    int smartmask_ratio = 0;
-    int smartmask_count = 20;
-    unsigned int smartmask_lastrate = 0;
-    int olddiffs = 0;
-    int previous_diffs = 0, previous_location_x = 0, previous_location_y = 0;
+    int smartmask_ratio;
+    int smartmask_count;
+    unsigned int smartmask_lastrate;
+    int olddiffs;
+    int previous_diffs, previous_location_x, previous_location_y;
     unsigned int text_size_factor;
-    unsigned int passflag = 0;
-    long int *rolling_average_data = NULL;
-    long int *rolling_elapsed_data = NULL;
-    long int rolling_average_limit, required_frame_time, frame_delay, delay_time_nsec;
-    int rolling_frame = 0;
-    struct timeval tv1, tv2;
-    unsigned long int rolling_average, elapsedtime;
-    unsigned long long int timenow = 0, timebefore = 0;
-    int vid_return_code = 0;        /* Return code used when calling vid_next */
-    int minimum_frame_time_downcounter = cnt->conf.minimum_frame_time; /* time in seconds to skip between capturing images */
-    unsigned int get_image = 1;    /* Flag used to signal that we capture new image when we run the loop */
-    struct image_data *old_image;
+    int minimum_frame_time_downcounter; /* time in seconds to skip between capturing images */
+    unsigned int get_image;             /* Flag used to signal that we capture new image when we run the loop */
+    time_t last_motion;                 /* When the last image with motion was seen */
+    int idle;                           /* The scene is idle, see motion_idle_backfill */
+    unsigned int idle_frames;
 
     /* 
-     * Next two variables are used for snapshot and timelapse feature
-     * time_last_frame is set to 1 so that first coming timelapse or second = 0
-     * is acted upon.
+     * Used for snapshot and timelapse feature. time_last_frame is set to 1
+     * so that first coming timelapse or second = 0 is acted upon.
      */
-    unsigned long int time_last_frame = 1, time_current_frame;
+    unsigned long int time_last_frame;
+};
+
+/**
+ * motion_loop_start
+ *
+ *   Initialises a camera and the state of its motion loop.
+ *
+ * Returns:     0 OK
+ *             <0 motion_init failed
+ */
+static int motion_loop_start(struct context *cnt, struct motion_loop_state *ls)
+{
+    memset(ls, 0, sizeof(struct motion_loop_state));
+    ls->smartmask_count = 20;
+    ls->minimum_frame_time_downcounter = cnt->conf.minimum_frame_time;
+    ls->get_image = 1;
+    ls->time_last_frame = 1;
+    ls->last_motion = time(NULL);
 
     cnt->running = 1;
     
     if (motion_init(cnt) < 0) 
-        goto err;
-    
+        return -1;
 
     /* Initialize the double sized characters if needed. */
     if (cnt->conf.text_double)
-        text_size_factor = 2;
+        ls->text_size_factor = 2;
     else
-        text_size_factor = 1;
+        ls->text_size_factor = 1;
 
     /* Initialize area detection */
-    area_minx[0] = area_minx[3] = area_minx[6] = 0;
-    area_miny[0] = area_miny[1] = area_miny[2] = 0;
+    ls->area_minx[0] = ls->area_minx[3] = ls->area_minx[6] = 0;
+    ls->area_miny[0] = ls->area_miny[1] = ls->area_miny[2] = 0;
 
-    area_minx[1] = area_minx[4] = area_minx[7] = cnt->imgs.width / 3;
-    area_maxx[0] = area_maxx[3] = area_maxx[6] = cnt->imgs.width / 3;
+    ls->area_minx[1] = ls->area_minx[4] = ls->area_minx[7] = cnt->imgs.width / 3;
+    ls->area_maxx[0] = ls->area_maxx[3] = ls->area_maxx[6] = cnt->imgs.width / 3;
 
-    area_minx[2] = area_minx[5] = area_minx[8] = cnt->imgs.width / 3 * 2;
-    area_maxx[1] = area_maxx[4] = area_maxx[7] = cnt->imgs.width / 3 * 2;
+    ls->area_minx[2] = ls->area_minx[5] = ls->area_minx[8] = cnt->imgs.width / 3 * 2;
+    ls->area_maxx[1] = ls->area_maxx[4] = ls->area_maxx[7] = cnt->imgs.width / 3 * 2;
 
-    area_miny[3] = area_miny[4] = area_miny[5] = cnt->imgs.height / 3;
-    area_maxy[0] = area_maxy[1] = area_maxy[2] = cnt->imgs.height / 3;
+    ls->area_miny[3] = ls->area_miny[4] = ls->area_miny[5] = cnt->imgs.height / 3;
+    ls->area_maxy[0] = ls->area_maxy[1] = ls->area_maxy[2] = cnt->imgs.height / 3;
 
-    area_miny[6] = area_miny[7] = area_miny[8] = cnt->imgs.height / 3 * 2;
-    area_maxy[3] = area_maxy[4] = area_maxy[5] = cnt->imgs.height / 3 * 2;
+    ls->area_miny[6] = ls->area_miny[7] = ls->area_miny[8] = cnt->imgs.height / 3 * 2;
+    ls->area_maxy[3] = ls->area_maxy[4] = ls->area_maxy[5] = cnt->imgs.height / 3 * 2;
 
-    area_maxx[2] = area_maxx[5] = area_maxx[8] = cnt->imgs.width;
-    area_maxy[6] = area_maxy[7] = area_maxy[8] = cnt->imgs.height;
+    ls->area_maxx[2] = ls->area_maxx[5] = ls->area_maxx[8] = cnt->imgs.width;
+    ls->area_maxy[6] = ls->area_maxy[7] = ls->area_maxy[8] = cnt->imgs.height;
     
     /* Work out expected frame rate based on config setting */
     if (cnt->conf.frame_limit < 2) 
         cnt->conf.frame_limit = 2;
 
-    required_frame_time = 1000000L / cnt->conf.frame_limit;
-
-    frame_delay = required_frame_time;
-
-    /*
-     * Reserve enough space for a 10 second timing history buffer. Note that,
-     * if there is any problem on the allocation, mymalloc does not return.
-     */
-    rolling_average_limit = 10 * cnt->conf.frame_limit;
-    rolling_average_data = mymalloc(sizeof(rolling_average_data) * rolling_average_limit);
-    rolling_elapsed_data = mymalloc(sizeof(rolling_elapsed_data) * rolling_average_limit);
-
-    /* Preset history buffer with expected frame rate */
-    for (j = 0; j < rolling_average_limit; j++) {
-        rolling_average_data[j] = required_frame_time;
-        rolling_elapsed_data[j] = required_frame_time;
-    }
+    scheduler_init(&cnt->scheduler, cnt->conf.frame_limit);
 
     if (cnt->track.type)
         cnt->moved = track_center(cnt, cnt->video_dev, 0, 0, 0);
 
-#ifdef __OpenBSD__
+    return 0;
+}
+
+/**
+ * motion_loop_frame
+ *
+ *   Runs the motion loop of a camera for one frame: captures it, detects
+ *   motion, handles events and feeds the outputs. Frames of a camera must
+ *   be run one after the other, the caller waits for the next one to be
+ *   due in between.
+ *
+ * Returns:     0 go on with the next frame
+ *             -1 leave the loop, the watchdog restarts the camera
+ */
+static int motion_loop_frame(struct context *cnt, struct motion_loop_state *ls)
+{
+    int i, j, z = 0;
+    int frame_buffer_size;
+    int overlay_motion_img;
+    int vid_return_code = 0;        /* Return code used when calling vid_next */
+    struct image_data *old_image;
+    unsigned int output_sinks;     /* OUTPUT_* fed with the pictures of this frame */
+    unsigned long int time_current_frame;
+
+
+    /***** MOTION LOOP - PREPARE FOR NEW FRAME SECTION *****/
+    cnt->watchdog = WATCHDOG_TMO;
+
+    /* Time the frame against its deadline */
+    scheduler_frame_start(&cnt->scheduler);
+
     /* 
-     * FIXMARK 
-     * Fixes zombie issue on OpenBSD 4.6
+     * When the camera can not keep up the scheduler sheds load, starting
+     * with motion detection on every other frame.
      */
-    struct sigaction sig_handler_action;
-    struct sigaction sigchild_action;
-    setup_signals(&sig_handler_action, &sigchild_action);
-#endif
+    cnt->process_thisframe = scheduler_shed_level(&cnt->scheduler) < SHED_DETECT_ALTERNATE ||
+                             !cnt->process_thisframe;
 
-    /*
-     * MAIN MOTION LOOP BEGINS HERE 
-     * Should go on forever... unless you bought vaporware :) 
+    /* 
+     * Since we don't have sanity checks done when options are set,
+     * this sanity check must go in the main loop :(, before pre_captures
+     * are attempted. 
      */
+    if (cnt->conf.minimum_motion_frames < 1)
+        cnt->conf.minimum_motion_frames = 1;
 
-#ifdef _PROFILING
-    ProfilerStart("motion.prof");
-#endif
+    if (cnt->conf.pre_capture < 0)
+        cnt->conf.pre_capture = 0;
 
-    while (!cnt->finish || cnt->makemovie) {
+    /* 
+     * Check if our buffer is still the right size
+     * If pre_capture or minimum_motion_frames has been changed
+     * via the http remote control we need to re-size the ring buffer
+     */
+    frame_buffer_size = cnt->conf.pre_capture + cnt->conf.minimum_motion_frames;
 
-    /***** MOTION LOOP - PREPARE FOR NEW FRAME SECTION *****/
-        cnt->watchdog = WATCHDOG_TMO;
+    if (cnt->imgs.image_ring_size != frame_buffer_size) 
+        image_ring_resize(cnt, frame_buffer_size);
+    
+    /* Get time for current frame */
+    cnt->currenttime = time(NULL);
 
-        /* Get current time and preserver last time for frame interval calc. */
-        timebefore = timenow;
-        gettimeofday(&tv1, NULL);
-        timenow = tv1.tv_usec + 1000000L * tv1.tv_sec;
+    /* 
+     * localtime returns static data and is not threadsafe
+     * so we use localtime_r which is reentrant and threadsafe.
+     * The broken down time only changes once per second.
+     */
+    if (ls->lastframetime != cnt->currenttime)
+        localtime_r(&cnt->currenttime, cnt->currenttime_tm);
 
-        /* 
-         * Calculate detection rate limit. Above 5fps we limit the detection
-         * rate to 3fps to reduce load at higher framerates. 
-         */
-        cnt->process_thisframe = 1;
-// Rate limit disabled as it doesn't help on Pi
-//        rate_limit++;
-//        if (rate_limit >= (cnt->lastrate / 3)) {
-//            rate_limit = 0;
-//            cnt->process_thisframe = 1;
-//        }
+    /* 
+     * If we have started on a new second we reset the shots variable
+     * lastrate is updated to be the number of the last frame. last rate
+     * is used as the ffmpeg framerate when motion is detected.
+     */
+    if (ls->lastframetime != cnt->currenttime) {
+        cnt->lastrate = cnt->shots + 1;
+        cnt->shots = -1;
+        ls->lastframetime = cnt->currenttime;
+        
+        if (cnt->conf.minimum_frame_time) {
+            ls->minimum_frame_time_downcounter--;
+            if (ls->minimum_frame_time_downcounter == 0)
+                ls->get_image = 1;
+        } else {
+            ls->get_image = 1;
+        }    
+    }
 
-        /* 
-         * Since we don't have sanity checks done when options are set,
-         * this sanity check must go in the main loop :(, before pre_captures
-         * are attempted. 
-         */
-        if (cnt->conf.minimum_motion_frames < 1)
-            cnt->conf.minimum_motion_frames = 1;
+    /* 
+     * Once nothing has moved for idle_minutes, motion is only detected
+     * on every idle_detect_interval frame until it moves again.
+     */
+    if (cnt->conf.idle_minutes > 0 && !cnt->conf.setup_mode) {
+        if (!ls->idle && !cnt->detecting_motion && !cnt->postcap &&
+            cnt->currenttime - ls->last_motion >= cnt->conf.idle_minutes * 60) {
+            ls->idle = 1;
+            ls->idle_frames = 0;
+            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Scene idle for %d minutes, detecting motion "
+                       "on every %d frames", cnt->conf.idle_minutes, cnt->conf.idle_detect_interval);
+        }
 
-        if (cnt->conf.pre_capture < 0)
-            cnt->conf.pre_capture = 0;
+        if (ls->idle && cnt->conf.idle_detect_interval > 1 &&
+            ++ls->idle_frames % cnt->conf.idle_detect_interval)
+            cnt->process_thisframe = 0;
+    } else {
+        ls->idle = 0;
+    }
 
-        /* 
-         * Check if our buffer is still the right size
-         * If pre_capture or minimum_motion_frames has been changed
-         * via the http remote control we need to re-size the ring buffer
-         */
-        frame_buffer_size = cnt->conf.pre_capture + cnt->conf.minimum_motion_frames;
 
-        if (cnt->imgs.image_ring_size != frame_buffer_size) 
-            image_ring_resize(cnt, frame_buffer_size);
-        
-        /* Get time for current frame */
-        cnt->currenttime = time(NULL);
+    /* Increase the shots variable for each frame captured within this second */
+    cnt->shots++;
+    cnt->total_shots++;
 
-        /* 
-         * localtime returns static data and is not threadsafe
-         * so we use localtime_r which is reentrant and threadsafe
-         */
-        localtime_r(&cnt->currenttime, cnt->currenttime_tm);
+    if (cnt->startup_frames > 0)
+        cnt->startup_frames--;
 
-        /* 
-         * If we have started on a new second we reset the shots variable
-         * lastrate is updated to be the number of the last frame. last rate
-         * is used as the ffmpeg framerate when motion is detected.
-         */
-        if (lastframetime != cnt->currenttime) {
-            cnt->lastrate = cnt->shots + 1;
-            cnt->shots = -1;
-            lastframetime = cnt->currenttime;
-            
-            if (cnt->conf.minimum_frame_time) {
-                minimum_frame_time_downcounter--;
-                if (minimum_frame_time_downcounter == 0)
-                    get_image = 1;
-            } else {
-                get_image = 1;
-            }    
+    if (ls->get_image) {
+        if (cnt->conf.minimum_frame_time) {
+            ls->minimum_frame_time_downcounter = cnt->conf.minimum_frame_time;
+            ls->get_image = 0;
         }
 
+        /* ring_buffer_in is pointing to current pos, update before put in a new image */
+        if (++cnt->imgs.image_ring_in >= cnt->imgs.image_ring_size)
+            cnt->imgs.image_ring_in = 0;
 
-        /* Increase the shots variable for each frame captured within this second */
-        cnt->shots++;
-        cnt->total_shots++;
+        /* Check if we have filled the ring buffer, throw away last image */
+        if (cnt->imgs.image_ring_in == cnt->imgs.image_ring_out) {
+            if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size)
+                cnt->imgs.image_ring_out = 0;
+        }
 
-        if (cnt->startup_frames > 0)
-            cnt->startup_frames--;
+        /* cnt->current_image points to position in ring where to store image, diffs etc. */
+        old_image = cnt->current_image;
+        cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
+
+        /* What was kept compressed in there is gone, capture into a raw picture */
+        image_ring_restore(cnt, cnt->current_image, 0);
+        motion_idle_release(cnt);
+
+        /* Init/clear current_image */
+        if (cnt->process_thisframe) {
+            /* set diffs to 0 now, will be written after we calculated diffs in new image */
+            cnt->current_image->diffs = 0;
+
+            /* Set flags to 0 */
+            cnt->current_image->flags = 0;
+            cnt->current_image->cent_dist = 0;
+
+            /* Clear location data */
+            memset(&cnt->current_image->location, 0, sizeof(cnt->current_image->location));
+            cnt->current_image->total_labels = 0;
+        } else if (cnt->current_image && old_image) {
+            /* not processing this frame: save some important values for next image */
+            cnt->current_image->diffs = old_image->diffs;
+            cnt->current_image->timestamp = old_image->timestamp;
+            cnt->current_image->timestamp_tm = old_image->timestamp_tm;
+            cnt->current_image->shot = old_image->shot;
+            cnt->current_image->cent_dist = old_image->cent_dist;
+            /* 
+             * Only whether it moved carries over, the event logic below sets the
+             * save flags afresh. Inherited IMAGE_SAVE|IMAGE_SAVED would stop
+             * process_image_ring at this frame.
+             */
+            cnt->current_image->flags = (old_image->flags & IMAGE_MOTION) | IMAGE_UNDETECTED;
+            cnt->current_image->location = old_image->location;
+            cnt->current_image->total_labels = old_image->total_labels;
+        }
 
-        if (get_image) {
-            if (cnt->conf.minimum_frame_time) {
-                minimum_frame_time_downcounter = cnt->conf.minimum_frame_time;
-                get_image = 0;
-            }
+        /* Store time with pre_captured image */
+        cnt->current_image->timestamp = cnt->currenttime;
+        cnt->current_image->timestamp_tm = *cnt->currenttime_tm;
 
-            /* ring_buffer_in is pointing to current pos, update before put in a new image */
-            if (++cnt->imgs.image_ring_in >= cnt->imgs.image_ring_size)
-                cnt->imgs.image_ring_in = 0;
+        /* Store shot number with pre_captured image */
+        cnt->current_image->shot = cnt->shots;
+        cnt->current_image->total_shots = cnt->total_shots;
 
-            /* Check if we have filled the ring buffer, throw away last image */
-            if (cnt->imgs.image_ring_in == cnt->imgs.image_ring_out) {
-                if (++cnt->imgs.image_ring_out >= cnt->imgs.image_ring_size)
-                    cnt->imgs.image_ring_out = 0;
+    /***** MOTION LOOP - RETRY INITIALIZING SECTION *****/
+        /* 
+         * If a camera is not available we keep on retrying every 10 seconds
+         * until it shows up.
+         */
+        if (cnt->video_dev < 0 &&
+            cnt->currenttime % 10 == 0 && cnt->shots == 0) {
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO,
+                       "%s: Retrying until successful connection with camera");
+            cnt->video_dev = vid_start(cnt);
+
+            /* 
+             * If the netcam has different dimensions than in the config file
+             * we need to restart Motion to re-allocate all the buffers
+             */
+            if (cnt->imgs.width != cnt->conf.width || cnt->imgs.height != cnt->conf.height) {
+                MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Camera has finally become available\n"
+                           "Camera image has different width and height"
+                           "from what is in the config file. You should fix that\n"
+                           "Restarting Motion thread to reinitialize all "
+                           "image buffers to new picture dimensions");
+                cnt->conf.width = cnt->imgs.width;
+                cnt->conf.height = cnt->imgs.height;
+                /* 
+                 * Leave the main loop terminating the camera,
+                 * watchdog will start us again 
+                 */
+                return -1;
             }
 
-            /* cnt->current_image points to position in ring where to store image, diffs etc. */
-            old_image = cnt->current_image;
-            cnt->current_image = &cnt->imgs.image_ring[cnt->imgs.image_ring_in];
+            if (!executor)
+                cnt->capture_stage = capture_stage_start(cnt);
+        }
 
-            /* Init/clear current_image */
-            if (cnt->process_thisframe) {
-                /* set diffs to 0 now, will be written after we calculated diffs in new image */
-                cnt->current_image->diffs = 0;
 
-                /* Set flags to 0 */
-                cnt->current_image->flags = 0;
-                cnt->current_image->cent_dist = 0;
+    /***** MOTION LOOP - IMAGE CAPTURE SECTION *****/
 
-                /* Clear location data */
-                memset(&cnt->current_image->location, 0, sizeof(cnt->current_image->location));
-                cnt->current_image->total_labels = 0;
-            } else if (cnt->current_image && old_image) {
-                /* not processing this frame: save some important values for next image */
-                cnt->current_image->diffs = old_image->diffs;
-                cnt->current_image->timestamp = old_image->timestamp;
-                cnt->current_image->timestamp_tm = old_image->timestamp_tm;
-                cnt->current_image->shot = old_image->shot;
-                cnt->current_image->cent_dist = old_image->cent_dist;
-                cnt->current_image->flags = old_image->flags;
-                cnt->current_image->location = old_image->location;
-                cnt->current_image->total_labels = old_image->total_labels;
+        /* 
+         * Fetch next frame from camera
+         * If vid_next returns 0 all is well and we got a new picture
+         * Any non zero value is an error.
+         * 0 = OK, valid picture
+         * <0 = fatal error - leave the thread by breaking out of the main loop
+         * >0 = non fatal error - copy last image or show grey image with message
+         */
+        if (cnt->video_dev >= 0)
+            vid_return_code = capture_stage_next(cnt, cnt->current_image);
+        else
+            vid_return_code = 1; /* Non fatal error */
+
+        // VALID PICTURE
+        if (vid_return_code == 0) {
+            cnt->lost_connection = 0;
+            cnt->connectionlosttime = 0;
+
+            /* If all is well reset missing_frame_counter */
+            if (cnt->missing_frame_counter >= MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit) {
+                /* If we previously logged starting a grey image, now log video re-start */
+                MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Video signal re-acquired");
+                // event for re-acquired video signal can be called here
             }
+            cnt->missing_frame_counter = 0;
+
 
-            /* Store time with pre_captured image */
-            cnt->current_image->timestamp = cnt->currenttime;
-            localtime_r(&cnt->current_image->timestamp, &cnt->current_image->timestamp_tm);
+            /* 
+             * Keep the newly captured still virgin image, which we will
+             * not alter with text and location graphics. It shares the
+             * picture, the overlays are drawn on a copy.
+             */
+            frame_unref(cnt->imgs.image_virgin);
+            cnt->imgs.image_virgin = frame_ref(cnt->current_image->image);
 
-            /* Store shot number with pre_captured image */
-            cnt->current_image->shot = cnt->shots;
-            cnt->current_image->total_shots = cnt->total_shots;
+            /* Skipped in an idle scene, kept as captured for motion_idle_backfill */
+            if (ls->idle && (cnt->current_image->flags & IMAGE_UNDETECTED))
+                cnt->current_image->virgin = frame_ref(cnt->imgs.image_virgin);
 
-        /***** MOTION LOOP - RETRY INITIALIZING SECTION *****/
             /* 
-             * If a camera is not available we keep on retrying every 10 seconds
-             * until it shows up.
+             * If the camera is a netcam we let the camera decide the pace.
+             * Otherwise we will keep on adding duplicate frames.
+             * By resetting the timer the framerate becomes maximum the rate
+             * of the Netcam.
              */
-            if (cnt->video_dev < 0 &&
-                cnt->currenttime % 10 == 0 && cnt->shots == 0) {
-                MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO,
-                           "%s: Retrying until successful connection with camera");
-                cnt->video_dev = vid_start(cnt);
+            if (cnt->conf.netcam_url)
+                scheduler_rebase(&cnt->scheduler);
+        // FATAL ERROR - leave the thread by breaking out of the main loop    
+        } else if (vid_return_code < 0) {
+            /* Fatal error - Close video device */
+            MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Video device fatal error - Closing video device"); 
+            capture_stage_stop(cnt->capture_stage);
+            cnt->capture_stage = NULL;
+            vid_close(cnt);
+            /* 
+             * Use virgin image, if we are not able to open it again next loop
+             * a gray image with message is applied
+             * flag lost_connection
+             */
+            frame_unref(cnt->current_image->image);
+            cnt->current_image->image = frame_ref(cnt->imgs.image_virgin);
+            cnt->lost_connection = 1;
+        /* NO FATAL ERROR -  
+        *        copy last image or show grey image with message 
+        *        flag on lost_connection if :
+        *               vid_return_code == NETCAM_RESTART_ERROR  
+        *        cnt->video_dev < 0
+        *        cnt->missing_frame_counter > (MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit)
+        */            
+        } else { 
+
+            MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: vid_return_code %d", 
+                       vid_return_code);
 
+            /* 
+             * Netcams that change dimensions while Motion is running will
+             * require that Motion restarts to reinitialize all the many
+             * buffers inside Motion. It will be a mess to try and recover any
+             * other way
+             */
+            if (vid_return_code == NETCAM_RESTART_ERROR) {
+                MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Restarting Motion thread to reinitialize all "
+                           "image buffers");
                 /* 
-                 * If the netcam has different dimensions than in the config file
-                 * we need to restart Motion to re-allocate all the buffers
+                 * Leave the main loop terminating the camera,
+                 * watchdog will start us again 
+                 * Set lost_connection flag on 
                  */
-                if (cnt->imgs.width != cnt->conf.width || cnt->imgs.height != cnt->conf.height) {
-                    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Camera has finally become available\n"
-                               "Camera image has different width and height"
-                               "from what is in the config file. You should fix that\n"
-                               "Restarting Motion thread to reinitialize all "
-                               "image buffers to new picture dimensions");
-                    cnt->conf.width = cnt->imgs.width;
-                    cnt->conf.height = cnt->imgs.height;
-                    /* 
-                     * Break out of main loop terminating thread 
-                     * watchdog will start us again 
-                     */
-                    break;
-                }
-            }
-
 
-        /***** MOTION LOOP - IMAGE CAPTURE SECTION *****/
+                cnt->lost_connection = 1;
+                return -1;
+            }
 
             /* 
-             * Fetch next frame from camera
-             * If vid_next returns 0 all is well and we got a new picture
-             * Any non zero value is an error.
-             * 0 = OK, valid picture
-             * <0 = fatal error - leave the thread by breaking out of the main loop
-             * >0 = non fatal error - copy last image or show grey image with message
+             * First missed frame - store timestamp 
+             * Don't reset time when thread restarts
              */
-            if (cnt->video_dev >= 0)
-                vid_return_code = vid_next(cnt, cnt->current_image->image, cnt->current_image);
-            else
-                vid_return_code = 1; /* Non fatal error */
-
-            // VALID PICTURE
-            if (vid_return_code == 0) {
-                cnt->lost_connection = 0;
-                cnt->connectionlosttime = 0;
-
-                /* If all is well reset missing_frame_counter */
-                if (cnt->missing_frame_counter >= MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit) {
-                    /* If we previously logged starting a grey image, now log video re-start */
-                    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Video signal re-acquired");
-                    // event for re-acquired video signal can be called here
-                }
-                cnt->missing_frame_counter = 0;
+            if (cnt->connectionlosttime == 0)
+                cnt->connectionlosttime = cnt->currenttime;
 
+            /* 
+             * Increase missing_frame_counter
+             * The first MISSING_FRAMES_TIMEOUT seconds we copy previous virgin image
+             * After MISSING_FRAMES_TIMEOUT seconds we put a grey error image in the buffer
+             * If we still have not yet received the initial image from a camera
+             * we go straight for the grey error image.
+             */
+            ++cnt->missing_frame_counter;
 
-                /* 
-                 * Save the newly captured still virgin image to a buffer
-                 * which we will not alter with text and location graphics
-                 */
-                memcpy(cnt->imgs.image_virgin, cnt->current_image->image, cnt->imgs.size);
+            if (cnt->video_dev >= 0 &&
+                cnt->missing_frame_counter < (MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit)) {
+                frame_unref(cnt->current_image->image);
+                cnt->current_image->image = frame_ref(cnt->imgs.image_virgin);
+            } else {
+                const char *tmpin;
+                char tmpout[80];
+                struct tm tmptime;
+                cnt->lost_connection = 1;
+    
+                if (cnt->video_dev >= 0)
+                    tmpin = "CONNECTION TO CAMERA LOST\\nSINCE %Y-%m-%d %T";
+                else
+                    tmpin = "UNABLE TO OPEN VIDEO DEVICE\\nSINCE %Y-%m-%d %T";
+
+                localtime_r(&cnt->connectionlosttime, &tmptime);
+                cnt->current_image->image = frame_unshare(cnt->current_image->image, 0);
+                memset(cnt->current_image->image, 0x80, cnt->imgs.size);
+                mystrftime(cnt, tmpout, sizeof(tmpout), tmpin, &tmptime, NULL, 0);
+                draw_final_image_text(cnt, cnt->current_image, 10, 20 * ls->text_size_factor,
+                                      tmpout, cnt->conf.text_double);
+
+                /* Write error message only once */
+                if (cnt->missing_frame_counter == MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit) {
+                    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Video signal lost - Adding grey image"); 
+                    // Event for lost video signal can be called from here
+                    event(cnt, EVENT_CAMERA_LOST, NULL, NULL,
+                          NULL, cnt->currenttime_tm);
+                }
 
                 /* 
-                 * If the camera is a netcam we let the camera decide the pace.
-                 * Otherwise we will keep on adding duplicate frames.
-                 * By resetting the timer the framerate becomes maximum the rate
-                 * of the Netcam.
+                 * If we don't get a valid frame for a long time, try to close/reopen device 
+                 * Only try this when a device is open 
                  */
-                if (cnt->conf.netcam_url) {
-                    gettimeofday(&tv1, NULL);
-                    timenow = tv1.tv_usec + 1000000L * tv1.tv_sec;
+                if ((cnt->video_dev > 0) && 
+                    (cnt->missing_frame_counter == (MISSING_FRAMES_TIMEOUT * 4) * cnt->conf.frame_limit)) {
+                    MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Video signal still lost - "
+                               "Trying to close video device");
+                    capture_stage_stop(cnt->capture_stage);
+                    cnt->capture_stage = NULL;
+                    vid_close(cnt);
                 }
-            // FATAL ERROR - leave the thread by breaking out of the main loop    
-            } else if (vid_return_code < 0) {
-                /* Fatal error - Close video device */
-                MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Video device fatal error - Closing video device"); 
-                vid_close(cnt);
+            }
+        }
+
+    /***** MOTION LOOP - MOTION DETECTION SECTION *****/
+
+        /* The output stage may still hold the last motion picture, keep it as it is */
+        cnt->imgs.out = frame_unshare(cnt->imgs.out, 1);
+
+        /* 
+         * The actual motion detection takes place in the following
+         * diffs is the number of pixels detected as changed
+         * Make a differences picture in image_out
+         *
+         * alg_diff_standard is the slower full feature motion detection algorithm
+         * alg_diff first calls a fast detection algorithm which only looks at a
+         * fraction of the pixels. If this detects possible motion alg_diff_standard
+         * is called.
+         */
+        if (cnt->process_thisframe) {
+            if (cnt->threshold && !cnt->pause) {
                 /* 
-                 * Use virgin image, if we are not able to open it again next loop
-                 * a gray image with message is applied
-                 * flag lost_connection
+                 * If we've already detected motion and we want to see if there's
+                 * still motion, don't bother trying the fast one first. IF there's
+                 * motion, the alg_diff will trigger alg_diff_standard
+                 * anyway
                  */
-                memcpy(cnt->current_image->image, cnt->imgs.image_virgin, cnt->imgs.size);
-                cnt->lost_connection = 1;
-            /* NO FATAL ERROR -  
-            *        copy last image or show grey image with message 
-            *        flag on lost_connection if :
-            *               vid_return_code == NETCAM_RESTART_ERROR  
-            *        cnt->video_dev < 0
-            *        cnt->missing_frame_counter > (MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit)
-            */            
-            } else { 
-
-                MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: vid_return_code %d", 
-                           vid_return_code);
+                if (scheduler_shed_level(&cnt->scheduler) >= SHED_DETECT_REDUCED && !cnt->conf.setup_mode)
+                    cnt->current_image->diffs = alg_diff_reduced(cnt, cnt->imgs.image_virgin);
+                else if (cnt->detecting_motion || cnt->conf.setup_mode)
+                    cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_virgin);
+                else
+                    cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_virgin);
 
-                /* 
-                 * Netcams that change dimensions while Motion is running will
-                 * require that Motion restarts to reinitialize all the many
-                 * buffers inside Motion. It will be a mess to try and recover any
-                 * other way
+                /* Lightswitch feature - has light intensity changed?
+                 * This can happen due to change of light conditions or due to a sudden change of the camera
+                 * sensitivity. If alg_lightswitch detects lightswitch we suspend motion detection the next
+                 * 5 frames to allow the camera to settle.
+                 * Don't check if we have lost connection, we detect "Lost signal" frame as lightswitch
                  */
-                if (vid_return_code == NETCAM_RESTART_ERROR) {
-                    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Restarting Motion thread to reinitialize all "
-                               "image buffers");
-                    /* 
-                     * Break out of main loop terminating thread 
-                     * watchdog will start us again 
-                     * Set lost_connection flag on 
-                     */
-
-                    cnt->lost_connection = 1;
-                    break;
+                if (cnt->conf.lightswitch > 1 && !cnt->lost_connection) {
+                    if (alg_lightswitch(cnt, cnt->current_image->diffs)) {
+                        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Lightswitch detected"); 
+
+                        if (cnt->moved < 5)
+                            cnt->moved = 5;
+
+                        cnt->current_image->diffs = 0;
+                        alg_update_reference_frame(cnt, RESET_REF_FRAME);
+                    }
                 }
 
                 /* 
-                 * First missed frame - store timestamp 
-                 * Don't reset time when thread restarts
+                 * Switchfilter feature tries to detect a change in the video signal
+                 * from one camera to the next. This is normally used in the Round
+                 * Robin feature. The algorithm is not very safe.
+                 * The algorithm takes a little time so we only call it when needed
+                 * ie. when feature is enabled and diffs>threshold.
+                 * We do not suspend motion detection like we did for lightswitch
+                 * because with Round Robin this is controlled by roundrobin_skip.
                  */
-                if (cnt->connectionlosttime == 0)
-                    cnt->connectionlosttime = cnt->currenttime;
+                if (cnt->conf.switchfilter && cnt->current_image->diffs > cnt->threshold) {
+                    cnt->current_image->diffs = alg_switchfilter(cnt, cnt->current_image->diffs, 
+                                                                 cnt->current_image);
+                
+                    if (cnt->current_image->diffs <= cnt->threshold) {
+                        cnt->current_image->diffs = 0;
+                    
+                        MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Switchfilter detected");
+                    }
+                }
 
                 /* 
-                 * Increase missing_frame_counter
-                 * The first MISSING_FRAMES_TIMEOUT seconds we copy previous virgin image
-                 * After MISSING_FRAMES_TIMEOUT seconds we put a grey error image in the buffer
-                 * If we still have not yet received the initial image from a camera
-                 * we go straight for the grey error image.
+                 * Despeckle feature
+                 * First we run (as given by the despeckle_filter option iterations
+                 * of erode and dilate algorithms.
+                 * Finally we run the labelling feature.
+                 * All this is done in the alg_despeckle code.
                  */
-                ++cnt->missing_frame_counter;
-
-                if (cnt->video_dev >= 0 &&
-                    cnt->missing_frame_counter < (MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit)) {
-                    memcpy(cnt->current_image->image, cnt->imgs.image_virgin, cnt->imgs.size);
-                } else {
-                    const char *tmpin;
-                    char tmpout[80];
-                    struct tm tmptime;
-                    cnt->lost_connection = 1;
-        
-                    if (cnt->video_dev >= 0)
-                        tmpin = "CONNECTION TO CAMERA LOST\\nSINCE %Y-%m-%d %T";
-                    else
-                        tmpin = "UNABLE TO OPEN VIDEO DEVICE\\nSINCE %Y-%m-%d %T";
-
-                    localtime_r(&cnt->connectionlosttime, &tmptime);
-                    memset(cnt->current_image->image, 0x80, cnt->imgs.size);
-                    mystrftime(cnt, tmpout, sizeof(tmpout), tmpin, &tmptime, NULL, 0);
-                    draw_final_image_text(cnt, cnt->current_image, 10, 20 * text_size_factor,
-                                          tmpout, cnt->conf.text_double);
-
-                    /* Write error message only once */
-                    if (cnt->missing_frame_counter == MISSING_FRAMES_TIMEOUT * cnt->conf.frame_limit) {
-                        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Video signal lost - Adding grey image"); 
-                        // Event for lost video signal can be called from here
-                        event(cnt, EVENT_CAMERA_LOST, NULL, NULL,
-                              NULL, cnt->currenttime_tm);
-                    }
-
-                    /* 
-                     * If we don't get a valid frame for a long time, try to close/reopen device 
-                     * Only try this when a device is open 
-                     */
-                    if ((cnt->video_dev > 0) && 
-                        (cnt->missing_frame_counter == (MISSING_FRAMES_TIMEOUT * 4) * cnt->conf.frame_limit)) {
-                        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Video signal still lost - "
-                                   "Trying to close video device");
-                        vid_close(cnt);
-                    }
+                cnt->current_image->total_labels = 0;
+                cnt->imgs.largest_label = 0;
+                ls->olddiffs = 0;
+            
+                if (cnt->conf.despeckle_filter && cnt->current_image->diffs > 0) {
+                    ls->olddiffs = cnt->current_image->diffs;
+                    cnt->current_image->diffs = alg_despeckle(cnt, ls->olddiffs);
+                } else if (cnt->imgs.labelsize_max) {
+                    cnt->imgs.labelsize_max = 0; /* Disable labeling if enabled */
                 }
-            }
 
-        /***** MOTION LOOP - MOTION DETECTION SECTION *****/
+            } else if (!cnt->conf.setup_mode) {
+                cnt->current_image->diffs = 0;
+            }
+        }
 
-            /* 
-             * The actual motion detection takes place in the following
-             * diffs is the number of pixels detected as changed
-             * Make a differences picture in image_out
-             *
-             * alg_diff_standard is the slower full feature motion detection algorithm
-             * alg_diff first calls a fast detection algorithm which only looks at a
-             * fraction of the pixels. If this detects possible motion alg_diff_standard
-             * is called.
-             */
-            if (cnt->process_thisframe) {
-                if (cnt->threshold && !cnt->pause) {
-                    /* 
-                     * If we've already detected motion and we want to see if there's
-                     * still motion, don't bother trying the fast one first. IF there's
-                     * motion, the alg_diff will trigger alg_diff_standard
-                     * anyway
-                     */
-                    if (cnt->detecting_motion || cnt->conf.setup_mode)
-                        cnt->current_image->diffs = alg_diff_standard(cnt, cnt->imgs.image_virgin);
-                    else
-                        cnt->current_image->diffs = alg_diff(cnt, cnt->imgs.image_virgin);
-
-                    /* Lightswitch feature - has light intensity changed?
-                     * This can happen due to change of light conditions or due to a sudden change of the camera
-                     * sensitivity. If alg_lightswitch detects lightswitch we suspend motion detection the next
-                     * 5 frames to allow the camera to settle.
-                     * Don't check if we have lost connection, we detect "Lost signal" frame as lightswitch
-                     */
-                    if (cnt->conf.lightswitch > 1 && !cnt->lost_connection) {
-                        if (alg_lightswitch(cnt, cnt->current_image->diffs)) {
-                            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Lightswitch detected"); 
-
-                            if (cnt->moved < 5)
-                                cnt->moved = 5;
-
-                            cnt->current_image->diffs = 0;
-                            alg_update_reference_frame(cnt, RESET_REF_FRAME);
-                        }
-                    }
+        /* Manipulate smart_mask sensitivity (only every smartmask_ratio seconds) */
+        if ((cnt->smartmask_speed && (cnt->event_nr != cnt->prev_event)) && 
+            (!--ls->smartmask_count)) {
+            alg_tune_smartmask(cnt);
+            ls->smartmask_count = ls->smartmask_ratio;
+        }
 
-                    /* 
-                     * Switchfilter feature tries to detect a change in the video signal
-                     * from one camera to the next. This is normally used in the Round
-                     * Robin feature. The algorithm is not very safe.
-                     * The algorithm takes a little time so we only call it when needed
-                     * ie. when feature is enabled and diffs>threshold.
-                     * We do not suspend motion detection like we did for lightswitch
-                     * because with Round Robin this is controlled by roundrobin_skip.
-                     */
-                    if (cnt->conf.switchfilter && cnt->current_image->diffs > cnt->threshold) {
-                        cnt->current_image->diffs = alg_switchfilter(cnt, cnt->current_image->diffs, 
-                                                                     cnt->current_image->image);
-                    
-                        if (cnt->current_image->diffs <= cnt->threshold) {
-                            cnt->current_image->diffs = 0;
-                        
-                            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Switchfilter detected");
-                        }
-                    }
+        /* 
+         * cnt->moved is set by the tracking code when camera has been asked to move.
+         * When camera is moving we do not want motion to detect motion or we will
+         * get our camera chasing itself like crazy and we will get motion detected
+         * which is not really motion. So we pretend there is no motion by setting
+         * cnt->diffs = 0.
+         * We also pretend to have a moving camera when we start Motion and when light
+         * switch has been detected to allow camera to settle.
+         */
+        if (cnt->moved) {
+            cnt->moved--;
+            cnt->current_image->diffs = 0;
+        }
 
-                    /* 
-                     * Despeckle feature
-                     * First we run (as given by the despeckle_filter option iterations
-                     * of erode and dilate algorithms.
-                     * Finally we run the labelling feature.
-                     * All this is done in the alg_despeckle code.
-                     */
-                    cnt->current_image->total_labels = 0;
-                    cnt->imgs.largest_label = 0;
-                    olddiffs = 0;
-                
-                    if (cnt->conf.despeckle_filter && cnt->current_image->diffs > 0) {
-                        olddiffs = cnt->current_image->diffs;
-                        cnt->current_image->diffs = alg_despeckle(cnt, olddiffs);
-                    } else if (cnt->imgs.labelsize_max) {
-                        cnt->imgs.labelsize_max = 0; /* Disable labeling if enabled */
-                    }
+    /***** MOTION LOOP - TUNING SECTION *****/
 
-                } else if (!cnt->conf.setup_mode) {
-                    cnt->current_image->diffs = 0;
-                }
-            }
+        /* 
+         * If noise tuning was selected, do it now. but only when
+         * no frames have been recorded and only once per second
+         */
+        if ((cnt->conf.noise_tune && cnt->shots == 0) &&
+             (!cnt->detecting_motion && (cnt->current_image->diffs <= cnt->threshold)))
+            alg_noise_tune(cnt, cnt->imgs.image_virgin);
+        
 
-            /* Manipulate smart_mask sensitivity (only every smartmask_ratio seconds) */
-            if ((cnt->smartmask_speed && (cnt->event_nr != cnt->prev_event)) && 
-                (!--smartmask_count)) {
-                alg_tune_smartmask(cnt);
-                smartmask_count = smartmask_ratio;
-            }
+        /* 
+         * If we are not noise tuning lets make sure that remote controlled
+         * changes of noise_level are used.
+         */
+        if (cnt->process_thisframe) {
+            if (!cnt->conf.noise_tune)
+                cnt->noise = cnt->conf.noise;
 
             /* 
-             * cnt->moved is set by the tracking code when camera has been asked to move.
-             * When camera is moving we do not want motion to detect motion or we will
-             * get our camera chasing itself like crazy and we will get motion detected
-             * which is not really motion. So we pretend there is no motion by setting
-             * cnt->diffs = 0.
-             * We also pretend to have a moving camera when we start Motion and when light
-             * switch has been detected to allow camera to settle.
+             * threshold tuning if enabled
+             * if we are not threshold tuning lets make sure that remote controlled
+             * changes of threshold are used.
              */
-            if (cnt->moved) {
-                cnt->moved--;
-                cnt->current_image->diffs = 0;
-            }
+            if (cnt->conf.threshold_tune)
+                alg_threshold_tune(cnt, cnt->current_image->diffs, cnt->detecting_motion);
+            else
+                cnt->threshold = cnt->conf.max_changes;
 
-        /***** MOTION LOOP - TUNING SECTION *****/
+            /* 
+             * If motion is detected (cnt->current_image->diffs > cnt->threshold) and before we add text to the pictures
+             * we find the center and size coordinates of the motion to be used for text overlays and later
+             * for adding the locate rectangle 
+             */
+            if (cnt->current_image->diffs > cnt->threshold)
+                alg_locate_center_size(&cnt->imgs, cnt->imgs.width, cnt->imgs.height, &cnt->current_image->location);
 
             /* 
-             * If noise tuning was selected, do it now. but only when
-             * no frames have been recorded and only once per second
+             * Update reference frame. 
+             * micro-lighswitch: trying to auto-detect lightswitch events. 
+             * frontdoor illumination. Updates are rate-limited to 3 per second at   
+             * framerates above 5fps to save CPU resources and to keep sensitivity   
+             * at a constant level.                                                  
              */
-            if ((cnt->conf.noise_tune && cnt->shots == 0) &&
-                 (!cnt->detecting_motion && (cnt->current_image->diffs <= cnt->threshold)))
-                alg_noise_tune(cnt, cnt->imgs.image_virgin);
-            
 
-            /* 
-             * If we are not noise tuning lets make sure that remote controlled
-             * changes of noise_level are used.
-             */
-            if (cnt->process_thisframe) {
-                if (!cnt->conf.noise_tune)
-                    cnt->noise = cnt->conf.noise;
+            if ((cnt->current_image->diffs > cnt->threshold) && (cnt->conf.lightswitch == 1) &&
+                (cnt->lightswitch_framecounter < (cnt->lastrate * 2)) && /* two seconds window only */
+                /* number of changed pixels almost the same in two consecutive frames and */
+                ((abs(ls->previous_diffs - cnt->current_image->diffs)) < (ls->previous_diffs / 15)) &&
+                /* center of motion in about the same place ? */
+                ((abs(cnt->current_image->location.x - ls->previous_location_x)) <= (cnt->imgs.width / 150)) &&
+                ((abs(cnt->current_image->location.y - ls->previous_location_y)) <= (cnt->imgs.height / 150))) {
+                alg_update_reference_frame(cnt, RESET_REF_FRAME);
+                cnt->current_image->diffs = 0;
+                cnt->lightswitch_framecounter = 0;
+
+                MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: micro-lightswitch!"); 
+            } else {
+                alg_update_reference_frame(cnt, UPDATE_REF_FRAME);
+            }
+
+            ls->previous_diffs = cnt->current_image->diffs;
+            ls->previous_location_x = cnt->current_image->location.x;
+            ls->previous_location_y = cnt->current_image->location.y;
+        }
 
-                /* 
-                 * threshold tuning if enabled
-                 * if we are not threshold tuning lets make sure that remote controlled
-                 * changes of threshold are used.
-                 */
-                if (cnt->conf.threshold_tune)
-                    alg_threshold_tune(cnt, cnt->current_image->diffs, cnt->detecting_motion);
-                else
-                    cnt->threshold = cnt->conf.max_changes;
+    /***** MOTION LOOP - TEXT AND GRAPHICS OVERLAY SECTION *****/
 
-                /* 
-                 * If motion is detected (cnt->current_image->diffs > cnt->threshold) and before we add text to the pictures
-                 * we find the center and size coordinates of the motion to be used for text overlays and later
-                 * for adding the locate rectangle 
-                 */
-                if (cnt->current_image->diffs > cnt->threshold)
-                    alg_locate_center_size(&cnt->imgs, cnt->imgs.width, cnt->imgs.height, &cnt->current_image->location);
+        /* 
+         * Some overlays on top of the motion image
+         * Note that these now modifies the cnt->imgs.out so this buffer
+         * can no longer be used for motion detection features until next
+         * picture frame is captured.
+         * Mask files store the plain motion pixels, so they need no overlays.
+         */
+        overlay_motion_img = (cnt->conf.motion_img && cnt->motion_img_format == MOTIONIMG_PICTURE) ||
+                             cnt->conf.ffmpeg_output_debug || cnt->conf.setup_mode;
+
+        /* Smartmask overlay */
+        if (cnt->smartmask_speed && overlay_motion_img)
+            overlay_smartmask(cnt, cnt->imgs.out);
+
+        /* Largest labels overlay */
+        if (cnt->imgs.largest_label && overlay_motion_img)
+            overlay_largest_label(cnt, cnt->imgs.out);
+
+        /* Fixed mask overlay */
+        if (cnt->imgs.mask && overlay_motion_img)
+            overlay_fixed_mask(cnt, cnt->imgs.out);
+
+        /* Initialize the double sized characters if needed. */
+        if (cnt->conf.text_double && ls->text_size_factor == 1) {
+            ls->text_size_factor = 2;
+        /* If text_double is set to off, then reset the scaling text_size_factor. */
+        } else if (!cnt->conf.text_double && ls->text_size_factor == 2) {
+            ls->text_size_factor = 1;
+        }
 
-                /* 
-                 * Update reference frame. 
-                 * micro-lighswitch: trying to auto-detect lightswitch events. 
-                 * frontdoor illumination. Updates are rate-limited to 3 per second at   
-                 * framerates above 5fps to save CPU resources and to keep sensitivity   
-                 * at a constant level.                                                  
-                 */
+        /* Add changed pixels in upper right corner of the pictures */
+        if (cnt->conf.text_changes) {
+            char tmp[15];
 
-                if ((cnt->current_image->diffs > cnt->threshold) && (cnt->conf.lightswitch == 1) &&
-                    (cnt->lightswitch_framecounter < (cnt->lastrate * 2)) && /* two seconds window only */
-                    /* number of changed pixels almost the same in two consecutive frames and */
-                    ((abs(previous_diffs - cnt->current_image->diffs)) < (previous_diffs / 15)) &&
-                    /* center of motion in about the same place ? */
-                    ((abs(cnt->current_image->location.x - previous_location_x)) <= (cnt->imgs.width / 150)) &&
-                    ((abs(cnt->current_image->location.y - previous_location_y)) <= (cnt->imgs.height / 150))) {
-                    alg_update_reference_frame(cnt, RESET_REF_FRAME);
-                    cnt->current_image->diffs = 0;
-                    cnt->lightswitch_framecounter = 0;
-
-                    MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: micro-lightswitch!"); 
-                } else {
-                    alg_update_reference_frame(cnt, UPDATE_REF_FRAME);
-                }
+            if (!cnt->pause)
+                sprintf(tmp, "%d", cnt->current_image->diffs);
+            else
+                sprintf(tmp, "-");
 
-                previous_diffs = cnt->current_image->diffs;
-                previous_location_x = cnt->current_image->location.x;
-                previous_location_y = cnt->current_image->location.y;
-            }
+            draw_final_image_text(cnt, cnt->current_image, cnt->imgs.width - 10, 10,
+                                  tmp, cnt->conf.text_double);
+        }
 
-        /***** MOTION LOOP - TEXT AND GRAPHICS OVERLAY SECTION *****/
+        /* 
+         * Add changed pixels to motion-images (for stream) in setup_mode
+         * and always overlay smartmask (not only when motion is detected) 
+         */
+        if (cnt->conf.setup_mode) {
+            char tmp[PATH_MAX];
+            sprintf(tmp, "D:%5d L:%3d N:%3d", cnt->current_image->diffs, 
+                    cnt->current_image->total_labels, cnt->noise);
+            draw_text(cnt->imgs.out, cnt->imgs.width - 10, cnt->imgs.height - 30 * ls->text_size_factor,
+                      cnt->imgs.width, tmp, cnt->conf.text_double);
+            sprintf(tmp, "THREAD %d SETUP", cnt->threadnr);
+            draw_text(cnt->imgs.out, cnt->imgs.width - 10, cnt->imgs.height - 10 * ls->text_size_factor,
+                      cnt->imgs.width, tmp, cnt->conf.text_double);
+        }
 
-            /* 
-             * Some overlays on top of the motion image
-             * Note that these now modifies the cnt->imgs.out so this buffer
-             * can no longer be used for motion detection features until next
-             * picture frame is captured.
-             */
+        /* Add text in lower left corner of the pictures */
+        if (cnt->conf.text_left) {
+            char tmp[PATH_MAX];
+            mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left, 
+                       &cnt->current_image->timestamp_tm, NULL, 0);
+            draw_final_image_text(cnt, cnt->current_image, 10, cnt->imgs.height - 10 * ls->text_size_factor,
+                                  tmp, cnt->conf.text_double);
+        }
 
-            /* Smartmask overlay */
-            if (cnt->smartmask_speed && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || 
-                cnt->conf.setup_mode))
-                overlay_smartmask(cnt, cnt->imgs.out);
-
-            /* Largest labels overlay */
-            if (cnt->imgs.largest_label && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || 
-                cnt->conf.setup_mode))
-                overlay_largest_label(cnt, cnt->imgs.out);
-
-            /* Fixed mask overlay */
-            if (cnt->imgs.mask && (cnt->conf.motion_img || cnt->conf.ffmpeg_output_debug || 
-                cnt->conf.setup_mode))
-                overlay_fixed_mask(cnt, cnt->imgs.out);
-
-            /* Initialize the double sized characters if needed. */
-            if (cnt->conf.text_double && text_size_factor == 1) {
-                text_size_factor = 2;
-            /* If text_double is set to off, then reset the scaling text_size_factor. */
-            } else if (!cnt->conf.text_double && text_size_factor == 2) {
-                text_size_factor = 1;
-            }
+        /* Add text in lower right corner of the pictures */
+        if (cnt->conf.text_right) {
+            char tmp[PATH_MAX];
+            mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right, 
+                       &cnt->current_image->timestamp_tm, NULL, 0);
+            draw_final_image_text(cnt, cnt->current_image, cnt->imgs.width - 10, cnt->imgs.height - 10 * ls->text_size_factor,
+                                  tmp, cnt->conf.text_double);
+        }
 
-            /* Add changed pixels in upper right corner of the pictures */
-            if (cnt->conf.text_changes) {
-                char tmp[15];
 
-                if (!cnt->pause)
-                    sprintf(tmp, "%d", cnt->current_image->diffs);
-                else
-                    sprintf(tmp, "-");
+    /***** MOTION LOOP - ACTIONS AND EVENT CONTROL SECTION *****/
 
-                draw_final_image_text(cnt, cnt->current_image, cnt->imgs.width - 10, 10,
-                                      tmp, cnt->conf.text_double);
-            }
+        if (cnt->current_image->diffs > cnt->threshold) {
+            /* flag this image, it have motion */
+            cnt->current_image->flags |= IMAGE_MOTION;
+            cnt->lightswitch_framecounter++; /* micro lightswitch */
+        } else { 
+            cnt->lightswitch_framecounter = 0;
+        }    
 
-            /* 
-             * Add changed pixels to motion-images (for stream) in setup_mode
-             * and always overlay smartmask (not only when motion is detected) 
-             */
-            if (cnt->conf.setup_mode) {
-                char tmp[PATH_MAX];
-                sprintf(tmp, "D:%5d L:%3d N:%3d", cnt->current_image->diffs, 
-                        cnt->current_image->total_labels, cnt->noise);
-                draw_text(cnt->imgs.out, cnt->imgs.width - 10, cnt->imgs.height - 30 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
-                sprintf(tmp, "THREAD %d SETUP", cnt->threadnr);
-                draw_text(cnt->imgs.out, cnt->imgs.width - 10, cnt->imgs.height - 10 * text_size_factor,
-                          cnt->imgs.width, tmp, cnt->conf.text_double);
-            }
+        if (cnt->current_image->flags & IMAGE_MOTION) {
+            ls->last_motion = cnt->currenttime;
 
-            /* Add text in lower left corner of the pictures */
-            if (cnt->conf.text_left) {
-                char tmp[PATH_MAX];
-                mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_left, 
-                           &cnt->current_image->timestamp_tm, NULL, 0);
-                draw_final_image_text(cnt, cnt->current_image, 10, cnt->imgs.height - 10 * text_size_factor,
-                                      tmp, cnt->conf.text_double);
+            /* First sign of change in an idle scene, back to every frame */
+            if (ls->idle) {
+                ls->idle = 0;
+                MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Scene no longer idle, %d earlier frames "
+                           "checked for motion", motion_idle_backfill(cnt));
             }
+        }
 
-            /* Add text in lower right corner of the pictures */
-            if (cnt->conf.text_right) {
-                char tmp[PATH_MAX];
-                mystrftime(cnt, tmp, sizeof(tmp), cnt->conf.text_right, 
-                           &cnt->current_image->timestamp_tm, NULL, 0);
-                draw_final_image_text(cnt, cnt->current_image, cnt->imgs.width - 10, cnt->imgs.height - 10 * text_size_factor,
-                                      tmp, cnt->conf.text_double);
+        /* 
+         * If motion has been detected we take action and start saving
+         * pictures and movies etc by calling motion_detected().
+         * Is emulate_motion enabled we always call motion_detected()
+         * If post_capture is enabled we also take care of this in the this
+         * code section.
+         */
+        if (cnt->conf.emulate_motion && (cnt->startup_frames == 0)) {
+            cnt->detecting_motion = 1;
+            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Emulating motion");
+            if (cnt->conf.useextpipe && cnt->extpipe) {
+                /* Setup the postcap counter */
+                cnt->postcap = cnt->conf.post_capture;
+                MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: (Em) Init post capture %d", 
+                           cnt->postcap);
             }
 
-
-        /***** MOTION LOOP - ACTIONS AND EVENT CONTROL SECTION *****/
-
-            if (cnt->current_image->diffs > cnt->threshold) {
-                /* flag this image, it have motion */
-                cnt->current_image->flags |= IMAGE_MOTION;
-                cnt->lightswitch_framecounter++; /* micro lightswitch */
-            } else { 
-                cnt->lightswitch_framecounter = 0;
-            }    
-
+            cnt->current_image->flags |= (IMAGE_TRIGGER | IMAGE_SAVE);
+            motion_detected(cnt, cnt->video_dev, cnt->current_image);
+        } else if ((cnt->current_image->flags & IMAGE_MOTION) && (cnt->startup_frames == 0)) {
             /* 
-             * If motion has been detected we take action and start saving
-             * pictures and movies etc by calling motion_detected().
-             * Is emulate_motion enabled we always call motion_detected()
-             * If post_capture is enabled we also take care of this in the this
-             * code section.
+             * Did we detect motion (like the cat just walked in :) )?
+             * If so, ensure the motion is sustained if minimum_motion_frames
              */
-            if (cnt->conf.emulate_motion && (cnt->startup_frames == 0)) {
-                cnt->detecting_motion = 1;
-                MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: Emulating motion");
-                if (cnt->conf.useextpipe && cnt->extpipe) {
-                    /* Setup the postcap counter */
-                    cnt->postcap = cnt->conf.post_capture;
-                    MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: (Em) Init post capture %d", 
-                               cnt->postcap);
-                }
-
-                cnt->current_image->flags |= (IMAGE_TRIGGER | IMAGE_SAVE);
-                motion_detected(cnt, cnt->video_dev, cnt->current_image);
-            } else if ((cnt->current_image->flags & IMAGE_MOTION) && (cnt->startup_frames == 0)) {
-                /* 
-                 * Did we detect motion (like the cat just walked in :) )?
-                 * If so, ensure the motion is sustained if minimum_motion_frames
-                 */
 
-                /* Count how many frames with motion there is in the last minimum_motion_frames in precap buffer */
-                int frame_count = 0;
-                int pos = cnt->imgs.image_ring_in;
-
-                for (i = 0; i < cnt->conf.minimum_motion_frames; i++) {
-                
-                    if (cnt->imgs.image_ring[pos].flags & IMAGE_MOTION)
-                        frame_count++;
+            /* Count how many frames with motion there is in the last minimum_motion_frames in precap buffer */
+            int frame_count = 0;
+            int pos = cnt->imgs.image_ring_in;
 
-                    if (pos == 0) 
-                        pos = cnt->imgs.image_ring_size-1;
-                    else 
-                        pos--;
-                }
+            for (i = 0; i < cnt->conf.minimum_motion_frames; i++) {
+            
+                if (cnt->imgs.image_ring[pos].flags & IMAGE_MOTION)
+                    frame_count++;
 
-                if (frame_count >= cnt->conf.minimum_motion_frames) {
+                if (pos == 0) 
+                    pos = cnt->imgs.image_ring_size-1;
+                else 
+                    pos--;
+            }
 
-                    cnt->current_image->flags |= (IMAGE_TRIGGER | IMAGE_SAVE);
-                    cnt->detecting_motion = 1;
+            if (frame_count >= cnt->conf.minimum_motion_frames) {
 
-                    /* Setup the postcap counter */
-                    cnt->postcap = cnt->conf.post_capture;
-                    MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Setup post capture %d", 
-                               cnt->postcap);
+                cnt->current_image->flags |= (IMAGE_TRIGGER | IMAGE_SAVE);
+                cnt->detecting_motion = 1;
 
-                    /* Mark all images in image_ring to be saved */
-                    for (i = 0; i < cnt->imgs.image_ring_size; i++) 
-                        cnt->imgs.image_ring[i].flags |= IMAGE_SAVE;
-                    
-                } else if ((cnt->postcap) && 
-                           (cnt->conf.useextpipe && cnt->extpipe)) {			
-                   /* we have motion in this frame, but not enought frames for trigger. Check postcap */
-                    cnt->current_image->flags |= (IMAGE_POSTCAP | IMAGE_SAVE);
-                    cnt->postcap--;
-                    MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: post capture %d", 
-                               cnt->postcap);
-                } else {
-                    cnt->current_image->flags |= IMAGE_PRECAP;
-                }
+                /* Setup the postcap counter */
+                cnt->postcap = cnt->conf.post_capture;
+                MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Setup post capture %d", 
+                           cnt->postcap);
 
-                /* Always call motion_detected when we have a motion image */
-                motion_detected(cnt, cnt->video_dev, cnt->current_image);
+                /* Mark all images in image_ring to be saved */
+                for (i = 0; i < cnt->imgs.image_ring_size; i++) 
+                    cnt->imgs.image_ring[i].flags |= IMAGE_SAVE;
+                
             } else if ((cnt->postcap) && 
-                      (cnt->conf.useextpipe && cnt->extpipe)) {	
-                /* No motion, doing postcap */
+                       (cnt->conf.useextpipe && cnt->extpipe)) {			
+               /* we have motion in this frame, but not enought frames for trigger. Check postcap */
                 cnt->current_image->flags |= (IMAGE_POSTCAP | IMAGE_SAVE);
                 cnt->postcap--;
                 MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: post capture %d", 
                            cnt->postcap);
             } else {
-                /* Done with postcap, so just have the image in the precap buffer */
                 cnt->current_image->flags |= IMAGE_PRECAP;
-                /* gapless movie feature */
-                if ((cnt->conf.event_gap == 0) && (cnt->detecting_motion == 1))
-                    cnt->makemovie = 1;
-                cnt->detecting_motion = 0;
             }
 
-            /* Update last frame saved time, so we can end event after gap time */
-            if (cnt->current_image->flags & IMAGE_SAVE) 
-                cnt->lasttime = cnt->current_image->timestamp;
+            /* Always call motion_detected when we have a motion image */
+            motion_detected(cnt, cnt->video_dev, cnt->current_image);
+        } else if ((cnt->postcap) && 
+                  (cnt->conf.useextpipe && cnt->extpipe)) {	
+            /* No motion, doing postcap */
+            cnt->current_image->flags |= (IMAGE_POSTCAP | IMAGE_SAVE);
+            cnt->postcap--;
+            MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: post capture %d", 
+                       cnt->postcap);
+        } else {
+            /* Done with postcap, so just have the image in the precap buffer */
+            cnt->current_image->flags |= IMAGE_PRECAP;
+            /* gapless movie feature */
+            if ((cnt->conf.event_gap == 0) && (cnt->detecting_motion == 1))
+                cnt->makemovie = 1;
+            cnt->detecting_motion = 0;
+        }
+
+        /* Update last frame saved time, so we can end event after gap time */
+        if (cnt->current_image->flags & IMAGE_SAVE) 
+            cnt->lasttime = cnt->current_image->timestamp;
+        
+
+        /* 
+         * Simple hack to recognize motion in a specific area 
+         * Do we need a new coversion specifier as well?? 
+         */
+        if ((cnt->conf.area_detect) && (cnt->event_nr != ls->area_once) && 
+            (cnt->current_image->flags & IMAGE_TRIGGER)) {
+            j = strlen(cnt->conf.area_detect);
             
+            for (i = 0; i < j; i++) {
+                z = cnt->conf.area_detect[i] - 49; /* 1 becomes 0 */
+                if ((z >= 0) && (z < 9)) {
+                    if (cnt->current_image->location.x > ls->area_minx[z] &&
+                        cnt->current_image->location.x < ls->area_maxx[z] &&
+                        cnt->current_image->location.y > ls->area_miny[z] &&
+                        cnt->current_image->location.y < ls->area_maxy[z]) {
+                        event(cnt, EVENT_AREA_DETECTED, NULL, NULL,
+                              NULL, cnt->currenttime_tm);
+                        ls->area_once = cnt->event_nr; /* Fire script only once per event */
 
-            /* 
-             * Simple hack to recognize motion in a specific area 
-             * Do we need a new coversion specifier as well?? 
-             */
-            if ((cnt->conf.area_detect) && (cnt->event_nr != area_once) && 
-                (cnt->current_image->flags & IMAGE_TRIGGER)) {
-                j = strlen(cnt->conf.area_detect);
-                
-                for (i = 0; i < j; i++) {
-                    z = cnt->conf.area_detect[i] - 49; /* 1 becomes 0 */
-                    if ((z >= 0) && (z < 9)) {
-                        if (cnt->current_image->location.x > area_minx[z] &&
-                            cnt->current_image->location.x < area_maxx[z] &&
-                            cnt->current_image->location.y > area_miny[z] &&
-                            cnt->current_image->location.y < area_maxy[z]) {
-                            event(cnt, EVENT_AREA_DETECTED, NULL, NULL,
-                                  NULL, cnt->currenttime_tm);
-                            area_once = cnt->event_nr; /* Fire script only once per event */
-
-                            MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Motion in area %d detected.",
-                                       z + 1);
-                            break;
-                        }
+                        MOTION_LOG(DBG, TYPE_ALL, NO_ERRNO, "%s: Motion in area %d detected.",
+                                   z + 1);
+                        break;
                     }
                 }
             }
-            
-            /* 
-             * Is the movie too long? Then make movies
-             * First test for max_movie_time
-             */
-            if ((cnt->conf.max_movie_time && cnt->event_nr == cnt->prev_event) &&
-                (cnt->currenttime - cnt->eventtime >= cnt->conf.max_movie_time))
-                cnt->makemovie = 1;
+        }
+        
+        /* 
+         * Is the movie too long? Then make movies
+         * First test for max_movie_time
+         */
+        if ((cnt->conf.max_movie_time && cnt->event_nr == cnt->prev_event) &&
+            (cnt->currenttime - cnt->eventtime >= cnt->conf.max_movie_time))
+            cnt->makemovie = 1;
 
-            /* 
-             * Now test for quiet longer than 'gap' OR make movie as decided in
-             * previous statement.
-             */
-            if (((cnt->currenttime - cnt->lasttime >= cnt->conf.event_gap) && cnt->conf.event_gap > 0) || 
-                  cnt->makemovie) {
-                if (cnt->event_nr == cnt->prev_event || cnt->makemovie) {
+        /* 
+         * Now test for quiet longer than 'gap' OR make movie as decided in
+         * previous statement.
+         */
+        if (((cnt->currenttime - cnt->lasttime >= cnt->conf.event_gap) && cnt->conf.event_gap > 0) || 
+              cnt->makemovie) {
+            if (cnt->event_nr == cnt->prev_event || cnt->makemovie) {
 
-                    /* Flush image buffer */
-                    process_image_ring(cnt, IMAGE_BUFFER_FLUSH);
+                /* Flush image buffer */
+                process_image_ring(cnt, IMAGE_BUFFER_FLUSH);
 
-                    /* Save preview_shot here at the end of event */
-                    if (cnt->imgs.preview_image.diffs) {
-                        preview_save(cnt);
-                        cnt->imgs.preview_image.diffs = 0;
-                    }
+                /* Save preview_shot here at the end of event */
+                if (cnt->imgs.preview_image.diffs) {
+                    preview_save(cnt);
+                    cnt->imgs.preview_image.diffs = 0;
+                }
 
-                    event(cnt, EVENT_ENDMOTION, NULL, NULL, NULL, cnt->currenttime_tm);
+                event(cnt, EVENT_ENDMOTION, NULL, NULL, NULL, cnt->currenttime_tm);
 
-                    /* 
-                     * If tracking is enabled we center our camera so it does not
-                     * point to a place where it will miss the next action
-                     */
-                    if (cnt->track.type)
-                        cnt->moved = track_center(cnt, cnt->video_dev, 0, 0, 0);
+                /* 
+                 * If tracking is enabled we center our camera so it does not
+                 * point to a place where it will miss the next action
+                 */
+                if (cnt->track.type)
+                    cnt->moved = track_center(cnt, cnt->video_dev, 0, 0, 0);
 
-                    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: End of event %d", 
-                               cnt->event_nr);
+                MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: End of event %d", 
+                           cnt->event_nr);
 
-                    cnt->makemovie = 0;
-                    /* Reset post capture */
-                    cnt->postcap = 0;
+                cnt->makemovie = 0;
+                /* Reset post capture */
+                cnt->postcap = 0;
 
-                    /* Finally we increase the event number */
-                    cnt->event_nr++;
-                    cnt->lightswitch_framecounter = 0;
+                /* Finally we increase the event number */
+                cnt->event_nr++;
+                cnt->lightswitch_framecounter = 0;
 
-                    /* 
-                     * And we unset the text_event_string to avoid that buffered
-                     * images get a timestamp from previous event.
-                     */
-                    cnt->text_event_string[0] = '\0';
-                }
+                /* 
+                 * And we unset the text_event_string to avoid that buffered
+                 * images get a timestamp from previous event.
+                 */
+                cnt->text_event_string[0] = '\0';
             }
+        }
 
-            /* Save/send to movie some images */
-            process_image_ring(cnt, 2);
-
-        /***** MOTION LOOP - SETUP MODE CONSOLE OUTPUT SECTION *****/
+        /* Save/send to movie some images */
+        process_image_ring(cnt, 2);
 
-            /* If CAMERA_VERBOSE enabled output some numbers to console */
-            if (cnt->conf.setup_mode) {
-                char msg[1024] = "\0";
-                char part[100];
+        /* Keep the picture compressed until an event needs it */
+        compress_stage_put(cnt, cnt->current_image);
 
-                if (cnt->conf.despeckle_filter) {
-                    snprintf(part, 99, "Raw changes: %5d - changes after '%s': %5d",
-                             olddiffs, cnt->conf.despeckle_filter, cnt->current_image->diffs);
-                    strcat(msg, part);
-                    if (strchr(cnt->conf.despeckle_filter, 'l')) {
-                        sprintf(part, " - labels: %3d", cnt->current_image->total_labels);
-                        strcat(msg, part);
-                    }
-                } else {
-                    sprintf(part, "Changes: %5d", cnt->current_image->diffs);
-                    strcat(msg, part);
-                }
+    /***** MOTION LOOP - SETUP MODE CONSOLE OUTPUT SECTION *****/
 
-                if (cnt->conf.noise_tune) {
-                    sprintf(part, " - noise level: %2d", cnt->noise);
+        /* If CAMERA_VERBOSE enabled output some numbers to console */
+        if (cnt->conf.setup_mode) {
+            char msg[1024] = "\0";
+            char part[100];
+
+            if (cnt->conf.despeckle_filter) {
+                snprintf(part, 99, "Raw changes: %5d - changes after '%s': %5d",
+                         ls->olddiffs, cnt->conf.despeckle_filter, cnt->current_image->diffs);
+                strcat(msg, part);
+                if (strchr(cnt->conf.despeckle_filter, 'l')) {
+                    sprintf(part, " - labels: %3d", cnt->current_image->total_labels);
                     strcat(msg, part);
                 }
+            } else {
+                sprintf(part, "Changes: %5d", cnt->current_image->diffs);
+                strcat(msg, part);
+            }
 
-                if (cnt->conf.threshold_tune) {
-                    sprintf(part, " - threshold: %d", cnt->threshold);
-                    strcat(msg, part);
-                }
+            if (cnt->conf.noise_tune) {
+                sprintf(part, " - noise level: %2d", cnt->noise);
+                strcat(msg, part);
+            }
 
-                MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: %s", msg);
+            if (cnt->conf.threshold_tune) {
+                sprintf(part, " - threshold: %d", cnt->threshold);
+                strcat(msg, part);
             }
 
-        } /* get_image end */
+            MOTION_LOG(INF, TYPE_ALL, NO_ERRNO, "%s: %s", msg);
+        }
+
+    } /* get_image end */
 
     /***** MOTION LOOP - SNAPSHOT FEATURE SECTION *****/
 
-        /* 
-         * Did we get triggered to make a snapshot from control http? Then shoot a snap
-         * If snapshot_interval is not zero and time since epoch MOD snapshot_interval = 0 then snap
-         * We actually allow the time to run over the interval in case we have a delay
-         * from slow camera.
-         * Note: Negative value means SIGALRM snaps are enabled
-         * httpd-control snaps are always enabled.
-         */
+    /* 
+     * Did we get triggered to make a snapshot from control http? Then shoot a snap
+     * If snapshot_interval is not zero and time since epoch MOD snapshot_interval = 0 then snap
+     * We actually allow the time to run over the interval in case we have a delay
+     * from slow camera.
+     * Note: Negative value means SIGALRM snaps are enabled
+     * httpd-control snaps are always enabled.
+     */
 
-        /* time_current_frame is used both for snapshot and timelapse features */
-        time_current_frame = cnt->currenttime;
+    /* time_current_frame is used both for snapshot and timelapse features */
+    time_current_frame = cnt->currenttime;
 
-        if ((cnt->conf.snapshot_interval > 0 && cnt->shots == 0 &&
-             time_current_frame % cnt->conf.snapshot_interval <= time_last_frame % cnt->conf.snapshot_interval) ||
-             cnt->snapshot) {
-            event(cnt, EVENT_IMAGE_SNAPSHOT, NULL, NULL, cnt->current_image, &cnt->current_image->timestamp_tm);
-            cnt->snapshot = 0;
-        }
+    if ((cnt->conf.snapshot_interval > 0 && cnt->shots == 0 &&
+         time_current_frame % cnt->conf.snapshot_interval <= ls->time_last_frame % cnt->conf.snapshot_interval) ||
+         cnt->snapshot) {
+        event(cnt, EVENT_IMAGE_SNAPSHOT, NULL, NULL, cnt->current_image, &cnt->current_image->timestamp_tm);
+        cnt->snapshot = 0;
+    }
 
 
     /***** MOTION LOOP - TIMELAPSE FEATURE SECTION *****/
 
 
-        time_last_frame = time_current_frame;
+    ls->time_last_frame = time_current_frame;
 
 
     /***** MOTION LOOP - VIDEO LOOPBACK SECTION *****/
 
-        /* 
-         * Feed last image and motion image to video device pipes and the stream clients
-         * In setup mode we send the special setup mode image to both stream and vloopback pipe
-         * In normal mode we feed the latest image to vloopback device and we send
-         * the image to the stream. We always send the first image in a second to the stream.
-         * Other image are sent only when the config option stream_motion is off
-         * The result is that with stream_motion on the stream stream is normally at the minimal
-         * 1 frame per second but the minute motion is detected the motion_detected() function
-         * sends all detected pictures to the stream except the 1st per second which is already sent.
-         */
-        if (cnt->conf.setup_mode) {
-            event(cnt, EVENT_IMAGE, cnt->imgs.out, NULL, &cnt->pipe, cnt->currenttime_tm);
-            event(cnt, EVENT_STREAM, cnt->imgs.out, NULL, NULL, cnt->currenttime_tm);
+    /* 
+     * Feed last image and motion image to video device pipes and the stream clients
+     * In setup mode we send the special setup mode image to both stream and vloopback pipe
+     * In normal mode we feed the latest image to vloopback device and we send
+     * the image to the stream. We always send the first image in a second to the stream.
+     * Other image are sent only when the config option stream_motion is off
+     * The result is that with stream_motion on the stream stream is normally at the minimal
+     * 1 frame per second but the minute motion is detected the motion_detected() function
+     * sends all detected pictures to the stream except the 1st per second which is already sent.
+     * The output stage references the pictures and feeds them in order from its own thread.
+     */
+    if (cnt->conf.setup_mode) {
+        output_sinks = OUTPUT_PIPE | OUTPUT_STREAM;
 #ifdef HAVE_SDL
-            if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
-                event(cnt, EVENT_SDL_PUT, cnt->imgs.out, NULL, NULL, cnt->currenttime_tm);
+        if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
+            output_sinks |= OUTPUT_SDL;
 #endif
-        } else {
-            event(cnt, EVENT_IMAGE, cnt->current_image->image, NULL, 
-                  &cnt->pipe, &cnt->current_image->timestamp_tm);
+        output_stage_put(cnt, output_sinks | OUTPUT_MOTION_PIPE, cnt->imgs.out, NULL, cnt->imgs.out);
+    } else {
+        output_sinks = OUTPUT_PIPE;
 
-            if (!cnt->conf.stream_motion || cnt->shots == 1)
-                event(cnt, EVENT_STREAM, NULL, NULL, cnt->current_image,
-                      &cnt->current_image->timestamp_tm);
+        /* Shedding load, the stream gets every other frame */
+        if ((!cnt->conf.stream_motion || cnt->shots == 1) &&
+            (scheduler_shed_level(&cnt->scheduler) < SHED_STREAM_RATE || (cnt->shots & 1)))
+            output_sinks |= OUTPUT_STREAM;
 #ifdef HAVE_SDL
-            if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
-                event(cnt, EVENT_SDL_PUT, cnt->current_image->image, NULL, NULL,
-                      &cnt->current_image->timestamp_tm);
+        if (cnt_list[0]->conf.sdl_threadnr == cnt->threadnr)
+            output_sinks |= OUTPUT_SDL;
 #endif
-        }
-
-        event(cnt, EVENT_IMAGEM, cnt->imgs.out, NULL, &cnt->mpipe, cnt->currenttime_tm);
+        output_stage_put(cnt, output_sinks | OUTPUT_MOTION_PIPE, cnt->current_image->image,
+                         cnt->current_image, cnt->imgs.out);
+        scheduler_latency(&cnt->scheduler, cnt->current_image->capture_mono_ns);
+    }
 
 
     /***** MOTION LOOP - ONCE PER SECOND PARAMETER UPDATE SECTION *****/
 
-        /* Check for some config parameter changes but only every second */
-        if (cnt->shots == 0) {
-            if (strcasecmp(cnt->conf.output_pictures, "on") == 0)
-                cnt->new_img = NEWIMG_ON;
-            else if (strcasecmp(cnt->conf.output_pictures, "first") == 0)
-                cnt->new_img = NEWIMG_FIRST;
-            else if (strcasecmp(cnt->conf.output_pictures, "best") == 0)
-                cnt->new_img = NEWIMG_BEST;
-            else if (strcasecmp(cnt->conf.output_pictures, "center") == 0)
-                cnt->new_img = NEWIMG_CENTER;
-            else
-                cnt->new_img = NEWIMG_OFF;
+    /* Check for some config parameter changes but only every second */
+    if (cnt->shots == 0) {
+        if (strcasecmp(cnt->conf.output_pictures, "on") == 0)
+            cnt->new_img = NEWIMG_ON;
+        else if (strcasecmp(cnt->conf.output_pictures, "first") == 0)
+            cnt->new_img = NEWIMG_FIRST;
+        else if (strcasecmp(cnt->conf.output_pictures, "best") == 0)
+            cnt->new_img = NEWIMG_BEST;
+        else if (strcasecmp(cnt->conf.output_pictures, "center") == 0)
+            cnt->new_img = NEWIMG_CENTER;
+        else
+            cnt->new_img = NEWIMG_OFF;
 
-            if (strcasecmp(cnt->conf.locate_motion_mode, "on") == 0)
-                cnt->locate_motion_mode = LOCATE_ON;
-            else if (strcasecmp(cnt->conf.locate_motion_mode, "preview") == 0)
-                cnt->locate_motion_mode = LOCATE_PREVIEW;
-            else
-                cnt->locate_motion_mode = LOCATE_OFF;
-
-            if (strcasecmp(cnt->conf.locate_motion_style, "box") == 0)
-                cnt->locate_motion_style = LOCATE_BOX;
-            else if (strcasecmp(cnt->conf.locate_motion_style, "redbox") == 0)
-                cnt->locate_motion_style = LOCATE_REDBOX;
-            else if (strcasecmp(cnt->conf.locate_motion_style, "cross") == 0)
-                cnt->locate_motion_style = LOCATE_CROSS;
-            else if (strcasecmp(cnt->conf.locate_motion_style, "redcross") == 0)
-                cnt->locate_motion_style = LOCATE_REDCROSS;
-            else
-                cnt->locate_motion_style = LOCATE_BOX;
-
-            /* Sanity check for smart_mask_speed, silly value disables smart mask */
-            if (cnt->conf.smart_mask_speed < 0 || cnt->conf.smart_mask_speed > 10)
-                cnt->conf.smart_mask_speed = 0;
-
-            /* Has someone changed smart_mask_speed or framerate? */
-            if (cnt->conf.smart_mask_speed != cnt->smartmask_speed || 
-                smartmask_lastrate != cnt->lastrate) {
-                if (cnt->conf.smart_mask_speed == 0) {
-                    memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
-                    memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
-                }
+        if (strcasecmp(cnt->conf.output_crop_pictures, "on") == 0)
+            cnt->crop_img = CROPIMG_ON;
+        else if (strcasecmp(cnt->conf.output_crop_pictures, "only") == 0)
+            cnt->crop_img = CROPIMG_ONLY;
+        else
+            cnt->crop_img = CROPIMG_OFF;
 
-                smartmask_lastrate = cnt->lastrate;
-                cnt->smartmask_speed = cnt->conf.smart_mask_speed;
-                /* 
-                 * Decay delay - based on smart_mask_speed (framerate independent)
-                 * This is always 5*smartmask_speed seconds 
-                 */
-                smartmask_ratio = 5 * cnt->lastrate * (11 - cnt->smartmask_speed);
-            }
+        if (strcasecmp(cnt->conf.motion_img_format, "mask") == 0)
+            cnt->motion_img_format = MOTIONIMG_MASK;
+        else if (strcasecmp(cnt->conf.motion_img_format, "labels") == 0)
+            cnt->motion_img_format = MOTIONIMG_LABELS;
+        else
+            cnt->motion_img_format = MOTIONIMG_PICTURE;
 
-#if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
+        if (strcasecmp(cnt->conf.locate_motion_mode, "on") == 0)
+            cnt->locate_motion_mode = LOCATE_ON;
+        else if (strcasecmp(cnt->conf.locate_motion_mode, "preview") == 0)
+            cnt->locate_motion_mode = LOCATE_PREVIEW;
+        else
+            cnt->locate_motion_mode = LOCATE_OFF;
+
+        if (strcasecmp(cnt->conf.locate_motion_style, "box") == 0)
+            cnt->locate_motion_style = LOCATE_BOX;
+        else if (strcasecmp(cnt->conf.locate_motion_style, "redbox") == 0)
+            cnt->locate_motion_style = LOCATE_REDBOX;
+        else if (strcasecmp(cnt->conf.locate_motion_style, "cross") == 0)
+            cnt->locate_motion_style = LOCATE_CROSS;
+        else if (strcasecmp(cnt->conf.locate_motion_style, "redcross") == 0)
+            cnt->locate_motion_style = LOCATE_REDCROSS;
+        else
+            cnt->locate_motion_style = LOCATE_BOX;
+
+        /* Sanity check for smart_mask_speed, silly value disables smart mask */
+        if (cnt->conf.smart_mask_speed < 0 || cnt->conf.smart_mask_speed > 10)
+            cnt->conf.smart_mask_speed = 0;
+
+        /* Has someone changed smart_mask_speed or framerate? */
+        if (cnt->conf.smart_mask_speed != cnt->smartmask_speed || 
+            ls->smartmask_lastrate != cnt->lastrate) {
+            if (cnt->conf.smart_mask_speed == 0) {
+                memset(cnt->imgs.smartmask, 0, cnt->imgs.motionsize);
+                memset(cnt->imgs.smartmask_final, 255, cnt->imgs.motionsize);
+            }
 
+            ls->smartmask_lastrate = cnt->lastrate;
+            cnt->smartmask_speed = cnt->conf.smart_mask_speed;
             /* 
-             * Set the sql mask file according to the SQL config options
-             * We update it for every frame in case the config was updated
-             * via remote control.
+             * Decay delay - based on smart_mask_speed (framerate independent)
+             * This is always 5*smartmask_speed seconds 
              */
-            cnt->sql_mask = cnt->conf.sql_log_image * (FTYPE_IMAGE + FTYPE_IMAGE_MOTION) +
-                            cnt->conf.sql_log_snapshot * FTYPE_IMAGE_SNAPSHOT +
-                            cnt->conf.sql_log_movie * (FTYPE_MPEG + FTYPE_MPEG_MOTION) +
-                            cnt->conf.sql_log_timelapse * FTYPE_MPEG_TIMELAPSE;
-#endif /* defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3) */
-
+            ls->smartmask_ratio = 5 * cnt->lastrate * (11 - cnt->smartmask_speed);
         }
 
-
-    /***** MOTION LOOP - FRAMERATE TIMING AND SLEEPING SECTION *****/
-
+#if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
 
         /* 
-         * Work out expected frame rate based on config setting which may
-         * have changed from http-control 
+         * Set the sql mask file according to the SQL config options
+         * We update it for every frame in case the config was updated
+         * via remote control.
          */
-        if (cnt->conf.frame_limit)
-            required_frame_time = 1000000L / cnt->conf.frame_limit;
-        else
-            required_frame_time = 0;
+        cnt->sql_mask = cnt->conf.sql_log_image * (FTYPE_IMAGE + FTYPE_IMAGE_MOTION) +
+                        cnt->conf.sql_log_snapshot * FTYPE_IMAGE_SNAPSHOT +
+                        cnt->conf.sql_log_movie * (FTYPE_MPEG + FTYPE_MPEG_MOTION) +
+                        cnt->conf.sql_log_timelapse * FTYPE_MPEG_TIMELAPSE;
+#endif /* defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3) */
 
-        /* Get latest time to calculate time taken to process video data */
-        gettimeofday(&tv2, NULL);
-        elapsedtime = (tv2.tv_usec + 1000000L * tv2.tv_sec) - timenow;
+    }
 
-        /* 
-         * Update history buffer but ignore first pass as timebefore
-         * variable will be inaccurate
-         */
-        if (passflag) {
-            rolling_average_data[rolling_frame] = timenow-timebefore;
-            rolling_elapsed_data[rolling_frame] = elapsedtime;
-        }
-        else
-            passflag = 1;
+    return 0;
+}
+
+/**
+ * motion_loop_stop
+ *
+ *   Cleans up a camera once its motion loop has ended.
+ */
+static void motion_loop_stop(struct context *cnt)
+{
+    cnt->lost_connection = 1;
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Thread exiting");
 
-        rolling_frame++;
-        if (rolling_frame >= rolling_average_limit)
-            rolling_frame = 0;
+    motion_cleanup(cnt);
 
-        /* Calculate 10 second average and use deviation in delay calculation */
-        rolling_average = 0L;
+    pthread_mutex_lock(&global_lock);
+    threads_running--;
+    pthread_mutex_unlock(&global_lock);
 
-        for (j = 0; j < rolling_average_limit; j++)
-            rolling_average += rolling_average_data[j];
+    if (!cnt->restart)
+        cnt->watchdog = WATCHDOG_OFF;
 
-        rolling_average /= rolling_average_limit;
-        frame_delay = required_frame_time-elapsedtime - (rolling_average - required_frame_time);
+    cnt->running = 0;
+    cnt->finish = 0;
+}
 
-        if (rolling_frame == 0 || rolling_frame == rolling_average_limit / 2) {
-            int idle_time = 0;
-            int overrun_time = 0;
-            for (j = 0; j < rolling_average_limit; j++)
-                if (rolling_elapsed_data[j] < required_frame_time)
-                    idle_time += required_frame_time - rolling_elapsed_data[j];
-                else
-                    overrun_time += rolling_elapsed_data[j] - required_frame_time;
+/**
+ * motion_shedding
+ *
+ *   Tells if camera cnt sheds load on its own. Under the governor the
+ *   cameras shed by priority instead, as the governor steps them down.
+ */
+static int motion_shedding(struct context *cnt)
+{
+    return cnt->conf.load_shedding && !cnt_list[0]->conf.governor;
+}
 
-            float fps = 1000000.0f / (float)rolling_average;
-            float time_range = rolling_average_limit * required_frame_time;
-            float percent_idle = ((float)idle_time / time_range) * 100.0f;
-            float percent_over = ((float)overrun_time / time_range) * 100.0f;
-            MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: fps: %f idle %0.2f%% over %0.2f%%", fps, percent_idle, percent_over);
-        }
+/**
+ * motion_loop
+ *
+ *   Thread function for the motion handling threads.
+ *
+ */
+static void *motion_loop(void *arg)
+{
+    struct context *cnt = arg;
+    struct motion_loop_state ls;
+
+    if (motion_loop_start(cnt, &ls) < 0)
+        goto err;
+
+#ifdef __OpenBSD__
+    /* 
+     * FIXMARK 
+     * Fixes zombie issue on OpenBSD 4.6
+     */
+    struct sigaction sig_handler_action;
+    struct sigaction sigchild_action;
+    setup_signals(&sig_handler_action, &sigchild_action);
+#endif
 
-        if (frame_delay > 0) {
-            /* Apply delay to meet frame time */
-            if (frame_delay > required_frame_time)
-                frame_delay = required_frame_time;
+    /*
+     * MAIN MOTION LOOP BEGINS HERE 
+     * Should go on forever... unless you bought vaporware :) 
+     */
 
-            /* Delay time in nanoseconds for SLEEP */
-            delay_time_nsec = frame_delay * 1000;
+#ifdef _PROFILING
+    ProfilerStart("motion.prof");
+#endif
 
-            if (delay_time_nsec > 999999999)
-                delay_time_nsec = 999999999;
+    while (!cnt->finish || cnt->makemovie) {
+        if (motion_loop_frame(cnt, &ls) < 0)
+            break;
 
-            /* SLEEP as defined in motion.h  A safe sleep using nanosleep */
-            SLEEP(0, delay_time_nsec);
-        }
+        /* 
+         * Sleep until the next frame is due. frame_limit may have changed
+         * from http-control.
+         */
+        scheduler_wait(&cnt->scheduler, cnt->conf.frame_limit, motion_shedding(cnt));
     }
 
 #ifdef _PROFILING
@@ -2212,27 +2632,56 @@ static void *motion_loop(void *arg)
      * If code continues here it is because the thread is exiting or restarting
      */
 err:
-    if (rolling_elapsed_data)
-        free(rolling_elapsed_data);
-    if (rolling_average_data)
-        free(rolling_average_data);
+    motion_loop_stop(cnt);
 
-    cnt->lost_connection = 1;
-    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Thread exiting");
+    pthread_exit(NULL);
+}
 
-    motion_cleanup(cnt);
+/*
+ * A camera run by the executor, one frame per run.
+ */
+struct motion_task {
+    struct executor_task task;          /* First, the executor hands it back */
+    struct context *cnt;
+    struct motion_loop_state state;
+    int started;
+};
 
-    pthread_mutex_lock(&global_lock);
-    threads_running--;
-    pthread_mutex_unlock(&global_lock);
+/**
+ * motion_task_run
+ *
+ *   Executor task running one frame of a camera and submitting itself again
+ *   for the next one, the counterpart of motion_loop. The first run starts
+ *   the camera and the last one cleans it up.
+ */
+static void motion_task_run(struct executor_task *task)
+{
+    struct motion_task *mt = (struct motion_task *)task;
+    struct context *cnt = mt->cnt;
 
-    if (!cnt->restart)
-        cnt->watchdog = WATCHDOG_OFF;
+    /* The worker runs other cameras in between */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
 
-    cnt->running = 0;
-    cnt->finish = 0;
+    if (!mt->started) {
+        mt->started = 1;
+        if (motion_loop_start(cnt, &mt->state) < 0)
+            goto err;
 
-    pthread_exit(NULL);
+        /* The first frame is due right away */
+        executor_submit(executor, task, cnt->scheduler.deadline);
+        return;
+    }
+
+    if ((cnt->finish && !cnt->makemovie) || motion_loop_frame(cnt, &mt->state) < 0)
+        goto err;
+
+    executor_submit(executor, task, scheduler_next(&cnt->scheduler, cnt->conf.frame_limit,
+                                                   motion_shedding(cnt)));
+    return;
+
+err:
+    motion_loop_stop(cnt);
+    free(mt);
 }
 
 /**
@@ -2562,7 +3011,8 @@ static void start_motion_thread(struct context *cnt, pthread_attr_t *thread_attr
      * for this thread and a warning is written to console and syslog.
      */
 
-    if (cnt->conf.stream_port != 0) {
+    /* The shared stream port was checked by main */
+    if (cnt->conf.stream_port != 0 && !cnt_list[0]->conf.stream_shared_port) {
         /* Compare against the control port. */
         if (cnt_list[0]->conf.webcontrol_port == cnt->conf.stream_port) {
             MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO,
@@ -2605,6 +3055,19 @@ static void start_motion_thread(struct context *cnt, pthread_attr_t *thread_attr
     /* Give the thread WATCHDOG_TMO to start */
     cnt->watchdog = WATCHDOG_TMO;
 
+    if (executor) {
+        struct motion_task *mt = mymalloc(sizeof(struct motion_task));
+
+        mt->task.run = motion_task_run;
+        mt->task.worker = -1;
+        mt->cnt = cnt;
+
+        /* Running from now on, main must not start it again before a worker does */
+        cnt->running = 1;
+        executor_submit(executor, &mt->task, monotonic_ns());
+        return;
+    }
+
     /* 
      * Create the actual thread. Use 'motion_loop' as the thread
      * function.
@@ -2680,6 +3143,28 @@ int main (int argc, char **argv)
             MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Motion restarted");
         }
 
+        /* Start the stream thread serving all cameras on the shared stream port */
+        if (cnt_list[0]->conf.stream_shared_port) {
+            if (cnt_list[0]->conf.webcontrol_port == cnt_list[0]->conf.stream_shared_port) {
+                MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Shared stream port number %d"
+                           " conflicts with the control port, streaming is disabled",
+                           cnt_list[0]->conf.stream_shared_port);
+                for (i = 0; cnt_list[i]; i++)
+                    cnt_list[i]->conf.stream_shared_port = 0;
+            } else if (stream_shared_start(cnt_list) == -1) {
+                MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Problem enabling the shared"
+                           " motion-stream server in port %d, streaming is disabled",
+                           cnt_list[0]->conf.stream_shared_port);
+                for (i = 0; cnt_list[i]; i++)
+                    cnt_list[i]->conf.stream_shared_port = 0;
+            }
+        }
+
+        /* Start the workers running the cameras if they share them */
+        if (cnt_list[0]->conf.executor)
+            executor = executor_start(cnt_list[0]->conf.executor_threads,
+                                      cnt_list[0]->conf.executor_affinity);
+
         /* 
          * Start the motion threads. First 'cnt_list' item is global if 'thread'
          * option is used, so start at 1 then and 0 otherwise.
@@ -2761,7 +3246,11 @@ int main (int argc, char **argv)
                         cnt_list[i]->finish = 1;
                     }
 
-                    if (cnt_list[i]->watchdog == -60) {
+                    if (cnt_list[i]->watchdog == -60 && executor) {
+                        /* The worker runs other cameras too, it cannot be killed */
+                        MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Thread %d - Watchdog timeout, did NOT restart "
+                                   "graceful, its executor worker is stuck", cnt_list[i]->threadnr);
+                    } else if (cnt_list[i]->watchdog == -60) {
                         MOTION_LOG(ERR, TYPE_ALL, NO_ERRNO, "%s: Thread %d - Watchdog timeout, did NOT restart graceful," 
                                    "killing it!", cnt_list[i]->threadnr);
                         pthread_cancel(cnt_list[i]->thread_id);
@@ -2775,6 +3264,8 @@ int main (int argc, char **argv)
                 }
             }
 
+            governor_run(cnt_list);
+
             MOTION_LOG(ALL, TYPE_ALL, NO_ERRNO, "%s: DEBUG-2 threads_running %d motion_threads_running %d finish %d", 
                        threads_running, motion_threads_running, finish);
         }
@@ -2783,6 +3274,13 @@ int main (int argc, char **argv)
 
         MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Threads finished");
 
+        if (executor) {
+            executor_stop(executor);
+            executor = NULL;
+        }
+
+        stream_shared_stop();
+
         /* Rest for a while if we're supposed to restart. */
         if (restart)
             SLEEP(2, 0);
@@ -3200,6 +3698,23 @@ size_t mystrftime(const struct context *cnt, char *s, size_t max, const char *us
                     ++pos_userformat;
                 break;
 
+            case '{': // long specifiers: %{cropx} %{cropy} %{cropw} %{croph}
+                if (strncmp(pos_userformat, "{cropx}", 7) == 0)
+                    sprintf(tempstr, "%d", cnt->current_image->crop.minx);
+                else if (strncmp(pos_userformat, "{cropy}", 7) == 0)
+                    sprintf(tempstr, "%d", cnt->current_image->crop.miny);
+                else if (strncmp(pos_userformat, "{cropw}", 7) == 0)
+                    sprintf(tempstr, "%d", cnt->current_image->crop.width);
+                else if (strncmp(pos_userformat, "{croph}", 7) == 0)
+                    sprintf(tempstr, "%d", cnt->current_image->crop.height);
+                else {
+                    *format++ = '%';
+                    *format++ = *pos_userformat;
+                    continue;
+                }
+                pos_userformat += 6;
+                break;
+
             default: // Any other code is copied with the %-sign
                 *format++ = '%';
                 *format++ = *pos_userformat;
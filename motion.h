@@ -155,7 +155,7 @@
 #define CONNECTION_KO           "Lost connection"
 #define CONNECTION_OK           "Connection OK"
 
-#define DEF_MAXSTREAMS          10   /* Maximum number of stream clients per camera */
+#define DEF_MAXSTREAMS          10   /* Default maximum number of stream clients per camera */
 #define DEF_MAXWEBQUEUE         10   /* Maximum number of stream client in queue */
 
 #define DEF_TIMESTAMP           "%Y-%m-%d\\n%T"
@@ -195,6 +195,16 @@
 #define NEWIMG_BEST       4
 #define NEWIMG_CENTER     8
 
+/* Which motion triggered images are saved as a crop of the motion area */
+#define CROPIMG_OFF       0
+#define CROPIMG_ON        1   /* Crop saved alongside the full frame */
+#define CROPIMG_ONLY      2   /* Crop saved instead of the full frame */
+
+/* Format of the motion (debug) images */
+#define MOTIONIMG_PICTURE 0   /* imgs.out encoded as a normal picture */
+#define MOTIONIMG_MASK    1   /* Lossless 1 bit mask file */
+#define MOTIONIMG_LABELS  2   /* Mask file including the label of each pixel */
+
 #define LOCATE_OFF        0
 #define LOCATE_ON         1
 #define LOCATE_PREVIEW    2
@@ -221,6 +231,7 @@ struct images;
 #include "track.h"
 #include "netcam.h"
 #include "filecam.h"
+#include "scheduler.h"
 
 #ifdef HAVE_MMAL
 #include "mmalcam.h"
@@ -241,6 +252,8 @@ struct images;
 #define IMAGE_SAVED      8
 #define IMAGE_PRECAP    16
 #define IMAGE_POSTCAP   32
+/* Motion detection was skipped, the flags are the ones of the image before */
+#define IMAGE_UNDETECTED 64
 
 struct image_data {
     unsigned char *image;
@@ -249,6 +262,8 @@ struct image_data {
     struct tm timestamp_tm;
     int shot;                   /* Sub second timestamp count */
     int total_shots;            /* Total shots taken so far */
+    long long capture_mono_ns;  /* When the source captured the picture, on the monotonic clock */
+    long long capture_real_ns;  /* The same on the wall clock, see vid_next */
 
     /* 
      * Movement center to img center distance 
@@ -259,11 +274,19 @@ struct image_data {
     unsigned int flags;         /* Se IMAGE_* defines */
 
     struct coord location;      /* coordinates for center and size of last motion detection*/
+    struct coord crop;          /* padded and aligned motion area saved by crop pictures */
 
     int total_labels;
 
     unsigned char *secondary_image;
     int secondary_size;
+
+    unsigned char *virgin;      /* Picture as captured while IMAGE_UNDETECTED in an idle scene,
+                                   see motion_idle_backfill */
+
+    unsigned char *encoded;     /* Picture encoded ahead by the encoder pool, see encode_image_burst,
+                                   or by the compress stage when image is NULL */
+    int encoded_size;
 };
 
 /* 
@@ -304,11 +327,15 @@ struct images {
     int image_ring_in;                /* Index in image ring buffer we last added a image into */
     int image_ring_out;               /* Index in image ring buffer we want to process next time */
 
+    struct arena *arena;              /* Where the buffers below come from, see arena.c */
+    struct frame_pool *frame_pool;    /* Shared picture buffers of size, see framepool.c */
+    struct frame_pool *secondary_pool; /* Shared buffers of secondary_size, NULL without secondary pictures */
+
     unsigned char *ref;               /* The reference frame */
-    unsigned char *out;               /* Picture buffer for motion images */
+    unsigned char *out;               /* Picture buffer for motion images, from frame_pool */
     int *ref_dyn;                     /* Dynamic objects to be excluded from reference frame */
-    unsigned char *image_virgin;      /* Last picture frame with no text or locate overlay */
-    struct image_data preview_image;  /* Picture buffer for best image when enables */
+    unsigned char *image_virgin;      /* Last picture frame with no text or locate overlay, shared with the ring */
+    struct image_data preview_image;  /* Best image when enabled, shares the ring picture */
     unsigned char *mask;              /* Buffer for the mask file */
     unsigned char *smartmask;
     unsigned char *smartmask_final;
@@ -320,6 +347,7 @@ struct images {
     int height;
     int type;
     int picture_type;                 /* Output picture type IMAGE_JPEG, IMAGE_PPM */        
+    int rgb_matrix;                   /* YUV_MATRIX_* used for RGB (ppm) output */
     int size;
     int motionsize;
     int labelgroup_max;
@@ -333,6 +361,11 @@ struct images {
     int secondary_size;
     float secondary_width_scale;
     float secondary_height_scale;
+
+    unsigned char *thumbnail;         /* Scaled down copy of the picture being saved */
+    int thumbnail_width;
+    int thumbnail_height;
+    int thumbnail_filter;             /* SCALE_FILTER_* */
 };
 
 /* Contains data for image rotation, see rotate.c. */
@@ -379,8 +412,16 @@ struct context {
 #ifdef HAVE_MMAL
     struct mmalcam_context *mmalcam;
 #endif
+    struct encoder_pool *encoders;           /* Parallel picture encoding, NULL when disabled */
+    struct capture_stage *capture_stage;     /* Captures ahead of the motion thread, NULL when it captures itself */
+    struct output_stage *output_stage;       /* Feeds pipes, stream and SDL, NULL when the motion thread does */
+    struct compress_stage *compress_stage;   /* Compresses the pre_capture buffer, NULL when it is kept raw */
+    struct frame_scheduler scheduler;        /* Paces the motion loop to frame_limit */
+    int governor_step;                       /* How far the governor has the camera give way */
     struct image_data *current_image;        /* Pointer to a structure where the image, diffs etc is stored */
     unsigned int new_img;
+    unsigned int crop_img;
+    unsigned int motion_img_format;
 
     int locate_motion_mode;
     int locate_motion_style;
@@ -437,6 +478,7 @@ struct context {
 
     struct stream stream;
     int stream_count;
+    struct stream_publisher *stream_publisher;
     
 #if defined(HAVE_MYSQL) || defined(HAVE_PGSQL) || defined(HAVE_SQLITE3)
     int sql_mask;
@@ -11,6 +11,9 @@
 
 #include "picture.h"
 #include "event.h"
+#include "yuv2rgb.h"
+#include "yuvscale.h"
+#include "encoder.h"
 
 #include <assert.h>
 
@@ -94,6 +97,11 @@ static GLOBAL(int) _jpeg_mem_size(j_compress_ptr cinfo)
  *
  * The tags we write in the main IFD are:
  *  0x010E   Image description
+ *  0x011A   X resolution of a cropped image, for its position
+ *  0x011B   Y resolution of a cropped image, for its position
+ *  0x011E   X position of a cropped image within the full frame
+ *  0x011F   Y position of a cropped image within the full frame
+ *  0x0128   Unit of the resolution of a cropped image
  *  0x8769   Exif sub-IFD
  *  0x882A   Time zone of time stamps
  * and in the Exif sub-IFD:
@@ -104,6 +112,11 @@ static GLOBAL(int) _jpeg_mem_size(j_compress_ptr cinfo)
  */
 
 #define TIFF_TAG_IMAGE_DESCRIPTION    0x010E
+#define TIFF_TAG_XRESOLUTION          0x011A
+#define TIFF_TAG_YRESOLUTION          0x011B
+#define TIFF_TAG_XPOSITION            0x011E
+#define TIFF_TAG_YPOSITION            0x011F
+#define TIFF_TAG_RESOLUTION_UNIT      0x0128
 #define TIFF_TAG_DATETIME             0x0132
 #define TIFF_TAG_EXIF_IFD             0x8769
 #define TIFF_TAG_TZ_OFFSET            0x882A
@@ -117,9 +130,14 @@ static GLOBAL(int) _jpeg_mem_size(j_compress_ptr cinfo)
 #define TIFF_TYPE_ASCII  2  /* ASCII text */
 #define TIFF_TYPE_USHORT 3  /* Unsigned 16-bit int */
 #define TIFF_TYPE_LONG   4  /* Unsigned 32-bit int */
+#define TIFF_TYPE_RATIONAL 5  /* Two unsigned 32-bit ints, numerator/denominator */
 #define TIFF_TYPE_UNDEF  7  /* Byte blob */
 #define TIFF_TYPE_SSHORT 8  /* Signed 16-bit int */
 
+/* Positions are in resolution units, pixels at CROP_RESOLUTION per inch */
+#define TIFF_RESOLUTION_INCH 2
+#define CROP_RESOLUTION      72
+
 static const char exif_marker_start[14] = {
     'E', 'x', 'i', 'f', 0, 0,   /* EXIF marker signature */
     'M', 'M', 0, 42,            /* TIFF file header (big-endian) */
@@ -205,6 +223,35 @@ static void put_stringentry(struct tiff_writing *into, unsigned tag, const char
     into->buf += 4;
 }
 
+static void put_shortentry(struct tiff_writing *into, unsigned tag, unsigned value)
+{
+    put_uint16(into->buf    , tag);
+    put_uint16(into->buf + 2, TIFF_TYPE_USHORT);
+    put_uint32(into->buf + 4, 1);
+    put_uint32(into->buf + 8, 0);
+    put_uint16(into->buf + 8, value);
+    into->buf += 12;
+}
+
+static void put_rationalentry(struct tiff_writing *into, unsigned tag, unsigned numerator, unsigned denominator)
+{
+    unsigned offset = into->data_offset;
+
+    while ((offset & 0x03) != 0) {  /* Alignment */
+        into->base[offset] = 0;
+        offset ++;
+    }
+
+    put_uint16(into->buf    , tag);
+    put_uint16(into->buf + 2, TIFF_TYPE_RATIONAL);
+    put_uint32(into->buf + 4, 1);
+    put_uint32(into->buf + 8, offset);
+    into->buf += 12;
+    put_uint32(into->base + offset    , numerator);
+    put_uint32(into->base + offset + 4, denominator);
+    into->data_offset = offset + 8;
+}
+
 static void put_subjectarea(struct tiff_writing *into, const struct coord *box)
 {
     put_uint16(into->buf    , EXIF_TAG_SUBJECT_AREA);
@@ -220,20 +267,46 @@ static void put_subjectarea(struct tiff_writing *into, const struct coord *box)
     into->data_offset += 8;
 }
 
+/**
+ * exif_description
+ *      Formats the exif_text option for the image being saved.
+ *
+ * Returns a string the caller must free, NULL when there is no exif_text.
+ */
+char *exif_description(const struct context *cnt, const struct tm *timestamp)
+{
+    char *description;
+
+    if (!cnt->conf.exif_text)
+        return NULL;
+
+    description = mymalloc(PATH_MAX);
+    mystrftime(cnt, description, PATH_MAX-1,
+               cnt->conf.exif_text,
+               timestamp, NULL, 0);
+
+    return description;
+}
+
 /*
  * put_jpeg_exif writes the EXIF APP1 chunk to the jpeg file.
  * It must be called after jpeg_start_compress() but before
  * any image data is written by jpeg_write_scanlines().
+ * When crop is given the image is a cut-out of the full frame and
+ * its top left corner (crop->minx, crop->miny) is stored as the
+ * TIFF X/Y position. TIFF measures positions in resolution units, so
+ * the resolution is written along, CROP_RESOLUTION pixels per inch.
  */
 static void put_jpeg_exif(j_compress_ptr cinfo,
-			  const struct context *cnt,
+			  const char *description,
 			  const struct tm *timestamp,
-			  const struct coord *box)
+			  const struct coord *box,
+			  const struct coord *crop)
 {
     /* description, datetime, and subtime are the values that are actually
      * put into the EXIF data
     */
-    char *description, *datetime, *subtime;
+    char *datetime, *subtime;
     char datetime_buf[22];
 
     if (timestamp) {
@@ -254,15 +327,6 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
     // use as much of it as is indicated by conf->frame_limit
     subtime = NULL;
 
-    if (cnt->conf.exif_text) {
-	    description = malloc(PATH_MAX);
-	    mystrftime(cnt, description, PATH_MAX-1,
-		        cnt->conf.exif_text,
-		        timestamp, NULL, 0);
-    } else {
-	    description = NULL;
-    }
-
     /* Calculate an upper bound on the size of the APP1 marker so
      * we can allocate a buffer for it.
      */
@@ -277,6 +341,11 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
 	    datasize += 5 + strlen(description); /* Add 5 for NUL and alignment */
     }
 
+    if (crop) {
+	    ifd0_tagcount += 5;
+	    datasize += 4 * (8 + 3); /* Four RATIONALs plus alignment */
+    }
+
     if (datetime) {
 	/* We write this to both the TIFF datetime tag (which most programs
 	 * treat as "last-modified-date") and the EXIF "time of creation of
@@ -342,6 +411,14 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
 
     if (description)
 	    put_stringentry(&writing, TIFF_TAG_IMAGE_DESCRIPTION, description, 0);
+
+    if (crop) {
+	    put_rationalentry(&writing, TIFF_TAG_XRESOLUTION, CROP_RESOLUTION, 1);
+	    put_rationalentry(&writing, TIFF_TAG_YRESOLUTION, CROP_RESOLUTION, 1);
+	    put_rationalentry(&writing, TIFF_TAG_XPOSITION, crop->minx, CROP_RESOLUTION);
+	    put_rationalentry(&writing, TIFF_TAG_YPOSITION, crop->miny, CROP_RESOLUTION);
+	    put_shortentry(&writing, TIFF_TAG_RESOLUTION_UNIT, TIFF_RESOLUTION_INCH);
+    }
     
     if (datetime)
 	    put_stringentry(&writing, TIFF_TAG_DATETIME, datetime, 1);
@@ -396,9 +473,6 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
     /* EXIF data lives in a JPEG APP1 marker */
     jpeg_write_marker(cinfo, JPEG_APP0 + 1, marker, marker_len);
 
-    if (description)
-	    free(description);
-    
     free(marker);
 }
 
@@ -411,15 +485,17 @@ static void put_jpeg_exif(j_compress_ptr cinfo,
  * - input_image is the image in YUV420P format.
  * - width and height are the dimensions of the image
  * - quality is the jpeg encoding quality 0-100%
+ * - description is the EXIF image description, may be NULL
+ * - tm and box are the EXIF time stamp and subject area, may be NULL
  *
  * Output:
  * - dest_image is a pointer to the jpeg image buffer
  *
  * Returns buffer size of jpeg image
  */
-static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
-				   unsigned char *input_image, int width, int height, int quality,
-				   struct context *cnt, struct tm *tm, struct coord *box)
+int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
+			    unsigned char *input_image, int width, int height, int quality,
+			    const char *description, struct tm *tm, struct coord *box)
 
 {
     int i, j, jpeg_image_size;
@@ -462,7 +538,7 @@ static int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
 
     jpeg_start_compress(&cinfo, TRUE);
 
-    put_jpeg_exif(&cinfo, cnt, tm, box);
+    put_jpeg_exif(&cinfo, description, tm, box, NULL);
 
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
@@ -520,7 +596,7 @@ static int put_jpeg_grey_memory(unsigned char *dest_image, int image_size, unsig
 
     jpeg_start_compress (&cjpeg, TRUE);
 
-    put_jpeg_exif(&cjpeg, NULL, NULL, NULL);
+    put_jpeg_exif(&cjpeg, NULL, NULL, NULL, NULL);
 
     row_ptr[0] = input_image;
 
@@ -537,6 +613,91 @@ static int put_jpeg_grey_memory(unsigned char *dest_image, int image_size, unsig
 }
 
 
+/* Destination of put_webp_yuv420p_memory, a buffer of fixed size */
+struct webp_dest {
+    unsigned char *buf;
+    size_t size;
+    size_t used;
+};
+
+/**
+ * webp_dest_write
+ *      WebPWriterFunction appending the encoded data to a webp_dest. Fails,
+ *      which aborts the encoding, when the data does not fit.
+ */
+static int webp_dest_write(const uint8_t *data, size_t data_size, const WebPPicture *picture)
+{
+    struct webp_dest *dest = picture->custom_ptr;
+
+    if (data_size > dest->size - dest->used)
+        return 0;
+
+    memcpy(dest->buf + dest->used, data, data_size);
+    dest->used += data_size;
+
+    return 1;
+}
+
+/**
+ * put_webp_yuv420p_memory
+ *      Converts an YUV420P coded image to a webp image into a memory buffer.
+ *      The input planes are encoded in place and the webp is written
+ *      straight to dest_image, so nothing is allocated per image.
+ *
+ * Inputs:
+ * - image_size is the size of the dest_image buffer.
+ * - input_image is the image in YUV420P format.
+ * - width and height are the dimensions of the image
+ * - quality is the webp encoding quality 0-100%
+ *
+ * Output:
+ * - dest_image is a pointer to the webp image buffer
+ *
+ * Returns buffer size of webp image, 0 if it does not fit or on error.
+ */
+int put_webp_yuv420p_memory(unsigned char *dest_image, int image_size,
+                            unsigned char *input_image, int width, int height, int quality)
+{
+    WebPConfig webp_config;
+    WebPPicture webp_image;
+    struct webp_dest dest;
+    int ok;
+
+    if (!WebPConfigPreset(&webp_config, WEBP_PRESET_DEFAULT, (float) quality) ||
+        !WebPPictureInit(&webp_image)) {
+        MOTION_LOG(ERR, TYPE_CORE, NO_ERRNO, "%s: libwebp version error");
+        return 0;
+    }
+
+    webp_image.use_argb = 0;
+    webp_image.colorspace = WEBP_YUV420;
+    webp_image.width = width;
+    webp_image.height = height;
+    webp_image.y = input_image;
+    webp_image.u = input_image + width * height;
+    webp_image.v = webp_image.u + (width * height) / 4;
+    webp_image.y_stride = width;
+    webp_image.uv_stride = width / 2;
+
+    dest.buf = dest_image;
+    dest.size = image_size;
+    dest.used = 0;
+    webp_image.writer = webp_dest_write;
+    webp_image.custom_ptr = &dest;
+
+    ok = WebPEncode(&webp_config, &webp_image);
+
+    if (!ok)
+        MOTION_LOG(WRN, TYPE_CORE, NO_ERRNO, "%s: libwebp image compression error %d",
+                   webp_image.error_code);
+
+    /* Frees what the encoder allocated, the planes are the caller's */
+    WebPPictureFree(&webp_image);
+
+    return ok ? (int)dest.used : 0;
+}
+
+
 /**
  * put_webp_yuv420p_file
  *      Converts an YUV420P coded image to a webp image and writes
@@ -619,6 +780,10 @@ static void put_webp_yuv420p_file(FILE *fp,
  * - image is the image in YUV420P format.
  * - width and height are the dimensions of the image
  * - quality is the jpeg encoding quality 0-100%
+ * - description is the EXIF image description, may be NULL
+ * - box is the motion area recorded as EXIF subject area, may be NULL
+ * - crop is the position of the image within the full frame when it
+ *   is a cut-out, NULL otherwise
  *
  * Output:
  * - The jpeg is written directly to the file given by the file pointer fp
@@ -628,7 +793,8 @@ static void put_webp_yuv420p_file(FILE *fp,
 static void put_jpeg_yuv420p_file(FILE *fp,
 				  unsigned char *image, int width, int height,
 				  int quality,
-				  struct context *cnt, struct tm *tm, struct coord *box)
+				  const char *description, struct tm *tm, struct coord *box,
+				  struct coord *crop)
 {
     int i, j;
 
@@ -669,7 +835,7 @@ static void put_jpeg_yuv420p_file(FILE *fp,
     jpeg_stdio_dest(&cinfo, fp);        // Data written to file
     jpeg_start_compress(&cinfo, TRUE);
 
-    put_jpeg_exif(&cinfo, cnt, tm, box);
+    put_jpeg_exif(&cinfo, description, tm, box, crop);
 
     for (j = 0; j < height; j += 16) {
         for (i = 0; i < 16; i++) {
@@ -723,7 +889,7 @@ static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, i
 
     jpeg_start_compress(&cjpeg, TRUE);
 
-    put_jpeg_exif(&cjpeg, NULL, NULL, NULL);
+    put_jpeg_exif(&cjpeg, NULL, NULL, NULL, NULL);
 
     row_ptr[0] = image;
 
@@ -737,28 +903,27 @@ static void put_jpeg_grey_file(FILE *picture, unsigned char *image, int width, i
 }
 
 
+/* Rows converted to RGB and written per fwrite by put_ppm_rgb24_file */
+#define PPM_CHUNK_ROWS 16
+
 /**
- * put_ppm_bgr24_file
- *      Converts an greyscale image to a PPM image and writes
+ * put_ppm_rgb24_file
+ *      Converts an YUV420P image to a PPM image and writes
  *      it to an already open file.
  * Inputs:
  * - image is the image in YUV420P format.
  * - width and height are the dimensions of the image
+ * - matrix is the YUV_MATRIX_* used for the conversion
  *
  * Output:
  * - The PPM is written directly to the file given by the file pointer fp
  *
  * Returns nothing
  */
-static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, int height)
+static void put_ppm_rgb24_file(FILE *picture, unsigned char *image, int width, int height, int matrix)
 {
-    int x, y;
-    unsigned char *l = image;
-    unsigned char *u = image + width * height;
-    unsigned char *v = u + (width * height) / 4;
-    int r, g, b;
-    int warningkiller;
-    unsigned char rgb[3];
+    unsigned char *rgb;
+    int y, rows;
 
     /*
      *  ppm header
@@ -768,45 +933,21 @@ static void put_ppm_bgr24_file(FILE *picture, unsigned char *image, int width, i
     fprintf(picture, "P6\n");
     fprintf(picture, "%d %d\n", width, height);
     fprintf(picture, "%d\n", 255);
-    for (y = 0; y < height; y++) {
 
-        for (x = 0; x < width; x++) {
-            r = 76283 * (((int)*l) - 16)+104595*(((int)*u) - 128);
-            g = 76283 * (((int)*l) - 16)- 53281*(((int)*u) - 128) - 25625 * (((int)*v) - 128);
-            b = 76283 * (((int)*l) - 16) + 132252 * (((int)*v) - 128);
-            r = r >> 16;
-            g = g >> 16;
-            b = b >> 16;
-            if (r < 0)
-                r = 0;
-            else if (r > 255)
-                r = 255;
-            if (g < 0)
-                g = 0;
-            else if (g > 255)
-                g = 255;
-            if (b < 0)
-                b = 0;
-            else if (b > 255)
-                b = 255;
-
-            rgb[0] = b;
-            rgb[1] = g;
-            rgb[2] = r;
-
-            l++;
-            if (x & 1) {
-                u++;
-                v++;
-            }
-            /* ppm is rgb not bgr */
-            warningkiller = fwrite(rgb, 1, 3, picture);
-        }
-        if (y & 1) {
-            u -= width / 2;
-            v -= width / 2;
+    rgb = mymalloc(width * PPM_CHUNK_ROWS * 3);
+
+    for (y = 0; y < height; y += PPM_CHUNK_ROWS) {
+        rows = height - y < PPM_CHUNK_ROWS ? height - y : PPM_CHUNK_ROWS;
+        /* ppm is rgb not bgr */
+        yuv420p_to_rgb(image, width, height, y, rows, rgb, RGB_FORMAT_RGB24, matrix);
+
+        if (fwrite(rgb, width * 3, rows, picture) != (size_t)rows) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Failed writing ppm image");
+            break;
         }
     }
+
+    free(rgb);
 }
 
 /**
@@ -950,6 +1091,9 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * - image_size is the size of the input image buffer
  * - *image points to the image buffer that contains the YUV420P or Grayscale image about to be put
  * - quality is the jpeg quality setting from the config file.
+ * - description, tm and box are the EXIF data of the image, any may be NULL.
+ *   They are given rather than taken from cnt->current_image as the stream
+ *   is encoded by the output stage while the motion thread moves on.
  *
  * Output:
  * - **dest_image is a pointer to a pointer that points to the destination buffer in which the
@@ -958,12 +1102,13 @@ void overlay_largest_label(struct context *cnt, unsigned char *out)
  * Returns the dest_image_size if successful. Otherwise 0.
  */
 int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image_size,
-                       unsigned char *image, int width, int height, int quality)
+                       unsigned char *image, int width, int height, int quality,
+                       const char *description, struct tm *tm, struct coord *box)
 {
     switch (cnt->imgs.type) {
     case VIDEO_PALETTE_YUV420P:
         return put_jpeg_yuv420p_memory(dest_image, image_size, image,
-                                       width, height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
+                                       width, height, quality, description, tm, box);
     case VIDEO_PALETTE_GREY:
         return put_jpeg_grey_memory(dest_image, image_size, image,
                                     width, height, quality);
@@ -977,15 +1122,20 @@ int put_picture_memory(struct context *cnt, unsigned char* dest_image, int image
 
 void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int quality)
 {
+    char *description;
+
     if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
-        put_ppm_bgr24_file(picture, image, cnt->imgs.width, cnt->imgs.height);
+        put_ppm_rgb24_file(picture, image, cnt->imgs.width, cnt->imgs.height, cnt->imgs.rgb_matrix);
     } else {
         switch (cnt->imgs.type) {
         case VIDEO_PALETTE_YUV420P:
             if (cnt->imgs.picture_type == IMAGE_TYPE_WEBP)
                 put_webp_yuv420p_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality);
-            if (cnt->imgs.picture_type == IMAGE_TYPE_JPEG)
-                put_jpeg_yuv420p_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
+            if (cnt->imgs.picture_type == IMAGE_TYPE_JPEG) {
+                description = exif_description(cnt, &(cnt->current_image->timestamp_tm));
+                put_jpeg_yuv420p_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality, description, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location), NULL);
+                free(description);
+            }
             break;
         case VIDEO_PALETTE_GREY:
             put_jpeg_grey_file(picture, image, cnt->imgs.width, cnt->imgs.height, quality);
@@ -999,12 +1149,20 @@ void put_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, in
 
 void put_sized_picture_fd(struct context *cnt, FILE *picture, unsigned char *image, int width, int height, int quality)
 {
+    char *description;
+
     if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
-        put_ppm_bgr24_file(picture, image, width, height);
+        put_ppm_rgb24_file(picture, image, width, height, cnt->imgs.rgb_matrix);
     } else {
         switch (cnt->imgs.type) {
         case VIDEO_PALETTE_YUV420P:
-            put_jpeg_yuv420p_file(picture, image, width, height, quality, cnt, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location));
+            if (cnt->imgs.picture_type == IMAGE_TYPE_WEBP)
+                put_webp_yuv420p_file(picture, image, width, height, quality);
+            if (cnt->imgs.picture_type == IMAGE_TYPE_JPEG) {
+                description = exif_description(cnt, &(cnt->current_image->timestamp_tm));
+                put_jpeg_yuv420p_file(picture, image, width, height, quality, description, &(cnt->current_image->timestamp_tm), &(cnt->current_image->location), NULL);
+                free(description);
+            }
             break;
         case VIDEO_PALETTE_GREY:
             put_jpeg_grey_file(picture, image, width, height, quality);
@@ -1094,6 +1252,335 @@ void put_encoded_picture(struct context *cnt, char *file, unsigned char *image,
     event(cnt, EVENT_FILECREATE, NULL, file, (void *)(unsigned long)ftype, NULL);
 }
 
+/* Crop pictures are sized in whole jpeg MCUs of a YUV420P image */
+#define CROP_ALIGN 16
+
+/**
+ * crop_axis
+ *      Grows the range lo..hi (inclusive) by pad on each side and turns it
+ *      into a start and a length that is a multiple of CROP_ALIGN, keeping
+ *      it within 0..size-1. The start is always even so the chroma planes
+ *      can be cut at the same place.
+ */
+static void crop_axis(int lo, int hi, int pad, int size, int *start, int *len)
+{
+    int end;
+
+    lo -= pad;
+    hi += pad + 1;
+
+    if (lo < 0)
+        lo = 0;
+    if (hi > size)
+        hi = size;
+
+    lo &= ~(CROP_ALIGN - 1);
+    end = (hi + CROP_ALIGN - 1) & ~(CROP_ALIGN - 1);
+
+    /* Frame size not a multiple of the MCU, move the crop back inside */
+    if (end > size) {
+        lo -= end - size;
+        end = size;
+    }
+
+    if (lo < 0) {
+        lo = 0;
+        end = size & ~(CROP_ALIGN - 1);
+    }
+
+    *start = lo;
+    *len = end - lo;
+}
+
+/**
+ * locate_crop_box
+ *      Works out the part of the picture saved by output_crop_pictures from
+ *      the motion area of imgdat and stores it in imgdat->crop. An image
+ *      without a motion area gives the full frame.
+ *
+ * Returns nothing.
+ */
+void locate_crop_box(struct context *cnt, struct image_data *imgdat)
+{
+    struct coord *crop = &imgdat->crop;
+    const struct coord *location = &imgdat->location;
+    int pad = cnt->conf.crop_picture_padding;
+
+    if (pad < 0)
+        pad = 0;
+
+    if (location->width > 0 && location->height > 0) {
+        crop_axis(location->minx, location->maxx, pad, cnt->imgs.width, &crop->minx, &crop->width);
+        crop_axis(location->miny, location->maxy, pad, cnt->imgs.height, &crop->miny, &crop->height);
+    } else {
+        crop->minx = 0;
+        crop->miny = 0;
+        crop->width = cnt->imgs.width;
+        crop->height = cnt->imgs.height;
+    }
+
+    crop->maxx = crop->minx + crop->width - 1;
+    crop->maxy = crop->miny + crop->height - 1;
+    crop->x = crop->minx + crop->width / 2;
+    crop->y = crop->miny + crop->height / 2;
+}
+
+/**
+ * put_cropped_picture
+ *      Saves the area imgdat->crop of the image as a picture of its own.
+ *      locate_crop_box must have been called for imgdat. The crop is cut
+ *      out of the primary image, also when secondary pictures are enabled.
+ *
+ * Returns nothing.
+ */
+void put_cropped_picture(struct context *cnt, char *file, struct image_data *imgdat, int ftype)
+{
+    FILE *picture;
+    struct coord *crop = &imgdat->crop;
+    struct coord box = imgdat->location;
+    int width = cnt->imgs.width;
+    int height = cnt->imgs.height;
+    /* The detection scratch buffer is free once the frame has been processed */
+    unsigned char *out = cnt->imgs.common_buffer;
+    unsigned char *in_u, *in_v, *out_u, *out_v;
+    char *description;
+    int y;
+
+    /* Copy the luma rows and, for colour images, the half size chroma rows */
+    for (y = 0; y < crop->height; y++)
+        memcpy(out + y * crop->width, imgdat->image + (crop->miny + y) * width + crop->minx, crop->width);
+
+    if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
+        in_u = imgdat->image + width * height;
+        in_v = in_u + (width * height) / 4;
+        out_u = out + crop->width * crop->height;
+        out_v = out_u + (crop->width * crop->height) / 4;
+
+        for (y = 0; y < crop->height / 2; y++) {
+            memcpy(out_u + y * crop->width / 2, in_u + (crop->miny / 2 + y) * width / 2 + crop->minx / 2, crop->width / 2);
+            memcpy(out_v + y * crop->width / 2, in_v + (crop->miny / 2 + y) * width / 2 + crop->minx / 2, crop->width / 2);
+        }
+    }
+
+    /* Subject area is relative to the crop */
+    box.x -= crop->minx;
+    box.y -= crop->miny;
+
+    picture = myfopen(file, "w", BUFSIZE_1MEG);
+    if (!picture) {
+        /* Report to syslog - suggest solution if the problem is access rights to target dir. */
+        if (errno ==  EACCES) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO,
+                       "%s: Can't write picture to file %s - check access rights to target directory\n"
+                       "Thread is going to finish due to this fatal error", file);
+            cnt->finish = 1;
+            cnt->restart = 0;
+            return;
+        } else {
+            /* If target dir is temporarily unavailable we may survive. */
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Can't write picture to file %s", file);
+            return;
+        }
+    }
+
+    if (cnt->imgs.picture_type == IMAGE_TYPE_PPM) {
+        put_ppm_rgb24_file(picture, out, crop->width, crop->height, cnt->imgs.rgb_matrix);
+    } else {
+        switch (cnt->imgs.type) {
+        case VIDEO_PALETTE_YUV420P:
+            if (cnt->imgs.picture_type == IMAGE_TYPE_WEBP)
+                put_webp_yuv420p_file(picture, out, crop->width, crop->height, cnt->conf.quality);
+            if (cnt->imgs.picture_type == IMAGE_TYPE_JPEG) {
+                description = exif_description(cnt, &imgdat->timestamp_tm);
+                put_jpeg_yuv420p_file(picture, out, crop->width, crop->height, cnt->conf.quality, description, &imgdat->timestamp_tm, &box, crop);
+                free(description);
+            }
+            break;
+        case VIDEO_PALETTE_GREY:
+            put_jpeg_grey_file(picture, out, crop->width, crop->height, cnt->conf.quality);
+            break;
+        default:
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Unknow image type %d",
+                       cnt->imgs.type);
+        }
+    }
+
+    myfclose(picture);
+    event(cnt, EVENT_FILECREATE, NULL, file, (void *)(unsigned long)ftype, NULL);
+}
+
+/* Mask file format, all numbers little endian:
+ *  "MMSK", version (u8), flags (u8, MASK_FLAG_*), reserved (u16),
+ *  width (u32), height (u32)
+ * then each row as
+ *  MASK_ROW_RUNS: run count (u16) followed by that many run lengths (u16),
+ *                 alternating unset and set pixels, starting with unset
+ *  MASK_ROW_BITS: (width + 7) / 8 bytes, one bit per pixel, msb first
+ * whichever is smaller, and with MASK_FLAG_LABELS the labels of the set
+ * pixels in row order as run count (u32) followed by label (u32) and
+ * length (u32) pairs.
+ */
+#define MASK_VERSION      1
+#define MASK_FLAG_LABELS  1
+#define MASK_ROW_RUNS     0
+#define MASK_ROW_BITS     1
+
+static void put_le16(FILE *fp, unsigned value)
+{
+    putc(value & 0xFF, fp);
+    putc((value >> 8) & 0xFF, fp);
+}
+
+static void put_le32(FILE *fp, unsigned value)
+{
+    put_le16(fp, value & 0xFFFF);
+    put_le16(fp, value >> 16);
+}
+
+/**
+ * put_mask_rows
+ *      Writes the 1 bit mask of the motion pixels (non zero in out), each
+ *      row as runs or as packed bits.
+ */
+static void put_mask_rows(FILE *picture, const unsigned char *out, int width, int height)
+{
+    unsigned short *runs = mymalloc((width + 1) * sizeof(*runs));
+    unsigned char bits;
+    int x, y, nruns, set, run;
+
+    for (y = 0; y < height; y++, out += width) {
+        nruns = 0;
+        set = 0;
+        run = 0;
+
+        for (x = 0; x < width; x++) {
+            if ((out[x] != 0) != set) {
+                runs[nruns++] = run;
+                set = !set;
+                run = 0;
+            }
+            run++;
+        }
+        runs[nruns++] = run;
+
+        if (2 + nruns * 2 < (width + 7) / 8) {
+            putc(MASK_ROW_RUNS, picture);
+            put_le16(picture, nruns);
+            for (x = 0; x < nruns; x++)
+                put_le16(picture, runs[x]);
+        } else {
+            putc(MASK_ROW_BITS, picture);
+            bits = 0;
+            for (x = 0; x < width; x++) {
+                bits = (bits << 1) | (out[x] != 0);
+                if ((x & 7) == 7) {
+                    putc(bits, picture);
+                    bits = 0;
+                }
+            }
+            if (width & 7)
+                putc(bits << (8 - (width & 7)), picture);
+        }
+    }
+
+    free(runs);
+}
+
+/**
+ * put_label_runs
+ *      Writes the labels of the motion pixels as runs of equal labels.
+ *      With picture NULL the runs are only counted.
+ *
+ * Returns the number of runs.
+ */
+static unsigned int put_label_runs(FILE *picture, const unsigned char *out, const int *labels, int size)
+{
+    unsigned int nruns = 0;
+    int i, label = 0, run = 0;
+
+    for (i = 0; i < size; i++) {
+        if (out[i] == 0)
+            continue;
+
+        if (run && labels[i] == label) {
+            run++;
+            continue;
+        }
+
+        if (run) {
+            nruns++;
+            if (picture) {
+                put_le32(picture, label);
+                put_le32(picture, run);
+            }
+        }
+        label = labels[i];
+        run = 1;
+    }
+
+    if (run) {
+        nruns++;
+        if (picture) {
+            put_le32(picture, label);
+            put_le32(picture, run);
+        }
+    }
+
+    return nruns;
+}
+
+/**
+ * put_motion_mask
+ *      Saves the motion pixels of imgs.out as a lossless mask file instead of
+ *      encoding imgs.out as a picture. With with_labels the label of each
+ *      motion pixel is added, if labeling was done for this frame.
+ *
+ * Returns nothing.
+ */
+void put_motion_mask(struct context *cnt, char *file, int with_labels, int ftype)
+{
+    FILE *picture;
+    int flags = 0;
+
+    picture = myfopen(file, "w", BUFSIZE_1MEG);
+    if (!picture) {
+        /* Report to syslog - suggest solution if the problem is access rights to target dir. */
+        if (errno ==  EACCES) {
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO,
+                       "%s: Can't write mask to file %s - check access rights to target directory\n"
+                       "Thread is going to finish due to this fatal error", file);
+            cnt->finish = 1;
+            cnt->restart = 0;
+            return;
+        } else {
+            /* If target dir is temporarily unavailable we may survive. */
+            MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Can't write mask to file %s", file);
+            return;
+        }
+    }
+
+    /* labelsize_max is cleared whenever labeling is not done */
+    if (with_labels && cnt->imgs.labelsize_max)
+        flags |= MASK_FLAG_LABELS;
+
+    fwrite("MMSK", 1, 4, picture);
+    putc(MASK_VERSION, picture);
+    putc(flags, picture);
+    put_le16(picture, 0);
+    put_le32(picture, cnt->imgs.width);
+    put_le32(picture, cnt->imgs.height);
+
+    put_mask_rows(picture, cnt->imgs.out, cnt->imgs.width, cnt->imgs.height);
+
+    if (flags & MASK_FLAG_LABELS) {
+        put_le32(picture, put_label_runs(NULL, cnt->imgs.out, cnt->imgs.labels, cnt->imgs.motionsize));
+        put_label_runs(picture, cnt->imgs.out, cnt->imgs.labels, cnt->imgs.motionsize);
+    }
+
+    myfclose(picture);
+    event(cnt, EVENT_FILECREATE, NULL, file, (void *)(unsigned long)ftype, NULL);
+}
+
 /**
  * get_pgm
  *      Get the pgm file used as fixed mask
@@ -1213,6 +1700,20 @@ void put_fixed_mask(struct context *cnt, const char *file)
  */
 void put_image(struct context *cnt, char* fullfilename, struct image_data * imgdat, int ftype)
 {
+    /* Already encoded by encode_image_burst, unless the encoder failed */
+    if (imgdat->encoded) {
+        int size = imgdat->encoded_size;
+
+        if (size > 0)
+            put_encoded_picture(cnt, fullfilename, imgdat->encoded, size, ftype);
+
+        free(imgdat->encoded);
+        imgdat->encoded = NULL;
+
+        if (size > 0)
+            return;
+    }
+
     if (imgdat->secondary_image && cnt->conf.output_secondary_pictures) {
         if (cnt->imgs.secondary_type == SECONDARY_TYPE_RAW) {
             put_sized_picture(cnt, fullfilename, imgdat->secondary_image, cnt->imgs.secondary_width, cnt->imgs.secondary_height, ftype);
@@ -1226,6 +1727,129 @@ void put_image(struct context *cnt, char* fullfilename, struct image_data * imgd
     }
 }
 
+/**
+ * encode_image_burst
+ *      Encodes the pictures put_image would save for count images in parallel
+ *      on the encoder pool. put_image then only writes the encoded picture,
+ *      so the files are still created in the order the images are saved.
+ *      Only for jpeg pictures of YUV420P images.
+ */
+void encode_image_burst(struct context *cnt, struct image_data **images, int count)
+{
+    struct encoder_job *jobs = mymalloc(count * sizeof(struct encoder_job));
+    struct image_data **owners = mymalloc(count * sizeof(struct image_data *));
+    struct image_data *saved_current_image = cnt->current_image;
+    struct image_data *imgdat;
+    int i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        imgdat = images[i];
+
+        if (imgdat->secondary_image && cnt->conf.output_secondary_pictures) {
+            /* An encoded secondary image is saved as it is */
+            if (cnt->imgs.secondary_type != SECONDARY_TYPE_RAW)
+                continue;
+            jobs[n].image = imgdat->secondary_image;
+            jobs[n].width = cnt->imgs.secondary_width;
+            jobs[n].height = cnt->imgs.secondary_height;
+        } else {
+            jobs[n].image = imgdat->image;
+            jobs[n].width = cnt->imgs.width;
+            jobs[n].height = cnt->imgs.height;
+        }
+
+        /* The exif_text specifiers refer to the current image */
+        cnt->current_image = imgdat;
+        jobs[n].description = exif_description(cnt, &imgdat->timestamp_tm);
+        jobs[n].quality = cnt->conf.quality;
+        jobs[n].timestamp_tm = &imgdat->timestamp_tm;
+        jobs[n].box = &imgdat->location;
+        jobs[n].dest_size = (jobs[n].width * jobs[n].height * 3) / 2;
+        jobs[n].dest = mymalloc(jobs[n].dest_size);
+        owners[n++] = imgdat;
+    }
+
+    cnt->current_image = saved_current_image;
+
+    if (n)
+        encoder_pool_run(cnt->encoders, jobs, n);
+
+    for (i = 0; i < n; i++) {
+        owners[i]->encoded = jobs[i].dest;
+        owners[i]->encoded_size = jobs[i].size;
+        free(jobs[i].description);
+    }
+
+    free(owners);
+    free(jobs);
+}
+
+/**
+ * put_thumbnail
+ *      save a scaled down copy of the picture saved for imgdat. The raw
+ *      secondary image is used when the full size picture comes from it.
+ */
+void put_thumbnail(struct context *cnt, char *file, struct image_data *imgdat, int ftype)
+{
+    if (cnt->imgs.type != VIDEO_PALETTE_YUV420P)
+        return;
+
+    if (imgdat->secondary_image && cnt->conf.output_secondary_pictures &&
+        cnt->imgs.secondary_type == SECONDARY_TYPE_RAW) {
+        yuv420p_scale(imgdat->secondary_image, cnt->imgs.secondary_width, cnt->imgs.secondary_height,
+                      cnt->imgs.thumbnail, cnt->imgs.thumbnail_width, cnt->imgs.thumbnail_height,
+                      cnt->imgs.thumbnail_filter);
+    } else {
+        yuv420p_scale(imgdat->image, cnt->imgs.width, cnt->imgs.height,
+                      cnt->imgs.thumbnail, cnt->imgs.thumbnail_width, cnt->imgs.thumbnail_height,
+                      cnt->imgs.thumbnail_filter);
+    }
+
+    put_sized_picture(cnt, file, cnt->imgs.thumbnail, cnt->imgs.thumbnail_width, cnt->imgs.thumbnail_height, ftype);
+}
+
+/**
+ * suffixed_filename
+ *      Builds the name of an extra picture saved next to fullfilename by
+ *      appending suffix to its name before the extension.
+ */
+static void suffixed_filename(char *dest, const char *fullfilename, const char *suffix)
+{
+    const char *ext = strrchr(fullfilename, '.');
+
+    if (ext)
+        snprintf(dest, PATH_MAX, "%.*s%s%s", (int)(ext - fullfilename), fullfilename, suffix, ext);
+    else
+        snprintf(dest, PATH_MAX, "%s%s", fullfilename, suffix);
+}
+
+/**
+ * put_event_image
+ *      save a motion triggered image as full frame, crop of the motion area
+ *      or both, as selected by output_crop_pictures, and its thumbnail.
+ *      Crops saved next to the full frame get a 'c' appended to the name,
+ *      thumbnails a 't'.
+ */
+void put_event_image(struct context *cnt, char *fullfilename, struct image_data *imgdat, int ftype)
+{
+    char extrafilename[PATH_MAX];
+
+    if (cnt->crop_img != CROPIMG_ONLY)
+        put_image(cnt, fullfilename, imgdat, ftype);
+
+    if (cnt->crop_img == CROPIMG_ON) {
+        suffixed_filename(extrafilename, fullfilename, "c");
+        put_cropped_picture(cnt, extrafilename, imgdat, ftype);
+    } else if (cnt->crop_img == CROPIMG_ONLY) {
+        put_cropped_picture(cnt, fullfilename, imgdat, ftype);
+    }
+
+    if (cnt->conf.output_thumbnails) {
+        suffixed_filename(extrafilename, fullfilename, "t");
+        put_thumbnail(cnt, extrafilename, imgdat, ftype);
+    }
+}
+
 /**
  * preview_save
  *      save preview_shot
@@ -1247,6 +1871,9 @@ void preview_save(struct context *cnt)
         /* Set global context to the image we are processing. */
         cnt->current_image = &cnt->imgs.preview_image;
 
+        if (cnt->crop_img != CROPIMG_OFF)
+            locate_crop_box(cnt, &cnt->imgs.preview_image);
+
         /* Use filename of movie i.o. jpeg_filename when set to 'preview'. */
         use_imagepath = strcmp(cnt->conf.imagepath, "preview");
 
@@ -1264,7 +1891,7 @@ void preview_save(struct context *cnt)
 
             previewname[basename_len] = '\0';
             strcat(previewname, imageext(cnt));
-            put_image(cnt, previewname, &cnt->imgs.preview_image, FTYPE_IMAGE);
+            put_event_image(cnt, previewname, &cnt->imgs.preview_image, FTYPE_IMAGE);
         } else {
             /*
              * Save best preview-shot also when no movies are recorded or imagepath
@@ -1283,7 +1910,7 @@ void preview_save(struct context *cnt)
             mystrftime(cnt, filename, sizeof(filename), imagepath, &cnt->imgs.preview_image.timestamp_tm, NULL, 0);
             snprintf(previewname, PATH_MAX, "%s/%s.%s", cnt->conf.filepath, filename, imageext(cnt));
 
-            put_image(cnt, previewname, &cnt->imgs.preview_image, FTYPE_IMAGE);
+            put_event_image(cnt, previewname, &cnt->imgs.preview_image, FTYPE_IMAGE);
         }
 
         /* Restore global context values. */
@@ -17,11 +17,24 @@ void overlay_fixed_mask(struct context *, unsigned char *);
 void put_fixed_mask(struct context *, const char *);
 void overlay_largest_label(struct context *, unsigned char *);
 void put_picture_fd(struct context *, FILE *, unsigned char *, int);
-int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, int, int, int);
+int put_picture_memory(struct context *, unsigned char*, int, unsigned char *, int, int, int,
+                       const char *, struct tm *, struct coord *);
 void put_picture(struct context *, char *, unsigned char *, int);
 void put_sized_picture(struct context *cnt, char *file, unsigned char *image, int width, int height, int quality);
 void put_encoded_picture(struct context *cnt, char *file, unsigned char *image, int size, int ftype);
 void put_image(struct context *cnt, char* fullfilename, struct image_data * imgdat, int ftype);
+void locate_crop_box(struct context *cnt, struct image_data *imgdat);
+void put_cropped_picture(struct context *cnt, char *file, struct image_data *imgdat, int ftype);
+int put_jpeg_yuv420p_memory(unsigned char *dest_image, int image_size,
+                            unsigned char *input_image, int width, int height, int quality,
+                            const char *description, struct tm *tm, struct coord *box);
+int put_webp_yuv420p_memory(unsigned char *dest_image, int image_size,
+                            unsigned char *input_image, int width, int height, int quality);
+char *exif_description(const struct context *cnt, const struct tm *timestamp);
+void encode_image_burst(struct context *cnt, struct image_data **images, int count);
+void put_motion_mask(struct context *cnt, char *file, int with_labels, int ftype);
+void put_thumbnail(struct context *cnt, char *file, struct image_data *imgdat, int ftype);
+void put_event_image(struct context *cnt, char *fullfilename, struct image_data *imgdat, int ftype);
 unsigned char *get_pgm(FILE *, int, int);
 void preview_save(struct context *);
 
@@ -0,0 +1,839 @@
+/*
+ * pipeline.c
+ *
+ *  Capture and output stages running beside the motion thread.
+ *
+ *  The motion thread keeps detection and all decisions: the ring buffer,
+ *  events, movies and picture files. The capture stage fetches the next
+ *  frame from the camera while the motion thread works on the current one,
+ *  and the output stage feeds the pictures to the loopback pipes, the stream
+ *  and SDL, so a slow sink does not hold up detection. With
+ *  pre_capture_compress the compress stage encodes the pictures of the ring
+ *  buffer as jpeg once detection is done with them, see compress_stage_put.
+ *
+ *  The stages exchange frame references through bounded single producer,
+ *  single consumer queues. Frames come from a small pool per stage and go
+ *  back to it through a second queue, so nothing is allocated per frame.
+ *  Frames pass through each queue in order. When the output stage falls
+ *  behind new stream and SDL frames are dropped rather than waited for,
+ *  frames for the loopback pipes are waited for so they get every frame.
+ *
+ *  Pictures are buffers from the frame pools of the camera, see framepool.c.
+ *  A captured picture moves into the ring without a copy and the output
+ *  stage holds references to the pictures it feeds.
+ */
+
+#include "motion.h"
+#include "event.h"
+#include "pipeline.h"
+#include "framepool.h"
+#include "picture.h"
+#include "executor.h"
+
+#if (defined(BSD) && !defined(PWCBSD))
+#include "video_freebsd.h"
+#else
+#include "video.h"
+#endif /* BSD */
+
+struct frame_queue {
+    void **refs;
+    unsigned int mask;              /* Size of refs - 1, size is a power of 2 */
+    unsigned int head;              /* Next ref to pop, advanced by the consumer */
+    unsigned int tail;              /* Next free slot, advanced by the producer */
+    int waiting;                    /* The consumer sleeps on ready */
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+};
+
+struct capture_frame {
+    struct image_data img;
+    int ret;                        /* What vid_next returned for img */
+};
+
+struct capture_stage {
+    struct context *cnt;
+    pthread_t thread;
+    volatile int finish;
+    struct frame_queue *filled;     /* Captured frames for the motion thread */
+    struct frame_queue *spare;      /* Frames for the capture thread to fill */
+    struct capture_frame frames[PIPELINE_CAPTURE_FRAMES];
+};
+
+struct output_frame {
+    unsigned int sinks;             /* OUTPUT_* to feed */
+    struct image_data img;          /* References the picture and secondary picture */
+    unsigned char *motion;          /* References the motion picture */
+    char *description;              /* EXIF description of the stream picture, NULL for none */
+};
+
+struct output_stage {
+    struct context *cnt;
+    pthread_t thread;
+    volatile int finish;
+    struct frame_queue *queued;     /* Frames for the output thread */
+    struct frame_queue *spare;      /* Frames for the motion thread to fill */
+    int dropped;                    /* Frames dropped since the stage started */
+    struct output_frame frames[PIPELINE_OUTPUT_FRAMES];
+};
+
+struct compress_frame {
+    int pos;                        /* Ring buffer image the picture belongs to */
+    unsigned char *image;           /* References the picture */
+    struct coord box;               /* EXIF subject area */
+    struct tm timestamp_tm;
+    unsigned char *jpeg;
+    int size;
+};
+
+struct compress_stage {
+    struct executor_task task;      /* First, the executor hands it back */
+    struct context *cnt;
+    pthread_t thread;
+    struct executor *executor;      /* Runs task, NULL for a thread of its own */
+    pthread_mutex_t lock;           /* Protects scheduled and finish on the executor */
+    int scheduled;                  /* task is submitted or running */
+    volatile int finish;
+    int width;
+    int height;
+    int quality;
+    unsigned char *scratch;         /* Full size buffer the jpeg is encoded into */
+    int scratch_size;
+    struct frame_queue *queued;     /* Pictures for the compress thread or task */
+    struct frame_queue *done;       /* Compressed pictures for the motion thread */
+    struct frame_queue *spare;      /* Frames for the motion thread to fill, only used by it */
+    int skipped;                    /* Pictures left raw since the stage started */
+    struct compress_frame frames[PIPELINE_COMPRESS_FRAMES];
+};
+
+/**
+ * frame_queue_new
+ *      Creates a queue holding at least size refs.
+ */
+struct frame_queue *frame_queue_new(int size)
+{
+    struct frame_queue *queue;
+    unsigned int slots = 1;
+
+    while (slots < (unsigned int)size)
+        slots <<= 1;
+
+    queue = mymalloc(sizeof(struct frame_queue));
+    queue->refs = mymalloc(slots * sizeof(void *));
+    queue->mask = slots - 1;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+
+    return queue;
+}
+
+void frame_queue_free(struct frame_queue *queue)
+{
+    if (!queue)
+        return;
+
+    pthread_cond_destroy(&queue->ready);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->refs);
+    free(queue);
+}
+
+/**
+ * frame_queue_push
+ *      Adds ref at the tail of the queue. Only one thread may push.
+ *
+ * Returns 1 on success, 0 when the queue is full.
+ */
+int frame_queue_push(struct frame_queue *queue, void *ref)
+{
+    unsigned int tail = queue->tail;
+
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) > queue->mask)
+        return 0;
+
+    queue->refs[tail & queue->mask] = ref;
+
+    /*
+     * Publish the ref with the new tail. Pairs with frame_queue_wait: either
+     * the consumer sees the tail or we see it waiting and wake it.
+     */
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return 1;
+}
+
+/**
+ * frame_queue_pop
+ *      Takes the ref at the head of the queue. Only one thread may pop.
+ *
+ * Returns the ref, NULL when the queue is empty.
+ */
+void *frame_queue_pop(struct frame_queue *queue)
+{
+    unsigned int head = queue->head;
+    void *ref;
+
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    ref = queue->refs[head & queue->mask];
+    /* Hand the slot back to the producer only after reading it */
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+    return ref;
+}
+
+static int frame_queue_empty(struct frame_queue *queue)
+{
+    return queue->head == __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * frame_queue_wait
+ *      Takes the ref at the head of the queue, sleeping until one is pushed.
+ *      Refs still queued are returned after stop is set.
+ *
+ * Returns the ref, NULL when the queue is empty and *stop is set. stop may
+ * be NULL to wait for a ref whatever happens.
+ */
+void *frame_queue_wait(struct frame_queue *queue, volatile int *stop)
+{
+    void *ref;
+
+    while (!(ref = frame_queue_pop(queue))) {
+        pthread_mutex_lock(&queue->lock);
+        __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+
+        while (frame_queue_empty(queue) && !(stop && __atomic_load_n(stop, __ATOMIC_ACQUIRE)))
+            pthread_cond_wait(&queue->ready, &queue->lock);
+
+        __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->lock);
+
+        if (frame_queue_empty(queue))
+            return NULL;
+    }
+
+    return ref;
+}
+
+/**
+ * frame_queue_wake
+ *      Wakes the consumer sleeping in frame_queue_wait to check its stop flag.
+ */
+void frame_queue_wake(struct frame_queue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    pthread_cond_broadcast(&queue->ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static void capture_stage_free(struct capture_stage *stage)
+{
+    int i;
+
+    for (i = 0; i < PIPELINE_CAPTURE_FRAMES; i++) {
+        frame_unref(stage->frames[i].img.image);
+        frame_unref(stage->frames[i].img.secondary_image);
+    }
+
+    frame_queue_free(stage->spare);
+    frame_queue_free(stage->filled);
+    free(stage);
+}
+
+static void *capture_thread(void *arg)
+{
+    struct capture_stage *stage = arg;
+    struct context *cnt = stage->cnt;
+    struct capture_frame *frame;
+    int ret;
+
+    /* Log with the thread number of the camera we capture for */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    while ((frame = frame_queue_wait(stage->spare, &stage->finish))) {
+        ret = vid_next(cnt, frame->img.image, &frame->img);
+        frame->ret = ret;
+        frame_queue_push(stage->filled, frame);
+
+        /* The motion thread closes the device and stops us */
+        if (ret < 0)
+            break;
+    }
+
+    return NULL;
+}
+
+/**
+ * capture_stage_start
+ *      Starts a thread capturing frames from the camera of cnt ahead of the
+ *      motion thread. V4L devices stay with the motion thread since round
+ *      robin hands them between camera threads.
+ *
+ * Returns the stage, NULL if frames are to be captured by the motion thread.
+ */
+struct capture_stage *capture_stage_start(struct context *cnt)
+{
+    struct capture_stage *stage;
+    int i;
+
+    if (cnt->video_dev < 0 ||
+        (!cnt->video_source.video_source_next_fn && !cnt->conf.netcam_url))
+        return NULL;
+
+    stage = mymalloc(sizeof(struct capture_stage));
+    stage->cnt = cnt;
+    stage->filled = frame_queue_new(PIPELINE_CAPTURE_FRAMES);
+    stage->spare = frame_queue_new(PIPELINE_CAPTURE_FRAMES);
+
+    for (i = 0; i < PIPELINE_CAPTURE_FRAMES; i++) {
+        stage->frames[i].img.image = frame_pool_get(cnt->imgs.frame_pool);
+        if (cnt->imgs.secondary_pool)
+            stage->frames[i].img.secondary_image = frame_pool_get(cnt->imgs.secondary_pool);
+        frame_queue_push(stage->spare, &stage->frames[i]);
+    }
+
+    if (pthread_create(&stage->thread, NULL, capture_thread, stage)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start capture thread, capturing"
+                   " in the motion thread");
+        capture_stage_free(stage);
+        return NULL;
+    }
+
+    return stage;
+}
+
+/**
+ * capture_stage_next
+ *      Fetches the next frame into img, from the capture stage if there is
+ *      one or else straight from the camera. The pictures of img must come
+ *      from the frame pools of cnt, such as the ring buffer images. A picture
+ *      captured ahead replaces them without a copy.
+ *
+ * Returns what vid_next returned for the frame.
+ */
+int capture_stage_next(struct context *cnt, struct image_data *img)
+{
+    struct capture_stage *stage = cnt->capture_stage;
+    struct capture_frame *frame;
+    int ret;
+
+    if (!stage) {
+        /* Others may still look at the old pictures, capture into new ones */
+        img->image = frame_unshare(img->image, 0);
+        img->secondary_image = frame_unshare(img->secondary_image, 0);
+        return vid_next(cnt, img->image, img);
+    }
+
+    frame = frame_queue_wait(stage->filled, NULL);
+    ret = frame->ret;
+
+    /* Stamped when it was captured, not now */
+    img->capture_mono_ns = frame->img.capture_mono_ns;
+    img->capture_real_ns = frame->img.capture_real_ns;
+
+    if (ret == 0) {
+        frame_unref(img->image);
+        img->image = frame->img.image;
+        frame->img.image = frame_pool_get(cnt->imgs.frame_pool);
+
+        if (cnt->imgs.secondary_pool) {
+            frame_unref(img->secondary_image);
+            img->secondary_image = frame->img.secondary_image;
+            frame->img.secondary_image = frame_pool_get(cnt->imgs.secondary_pool);
+        }
+        img->secondary_size = frame->img.secondary_size;
+    }
+
+    frame_queue_push(stage->spare, frame);
+
+    return ret;
+}
+
+/**
+ * capture_stage_stop
+ *      Stops the capture thread and frees the stage. Frames captured but not
+ *      taken are lost.
+ */
+void capture_stage_stop(struct capture_stage *stage)
+{
+    if (!stage)
+        return;
+
+    __atomic_store_n(&stage->finish, 1, __ATOMIC_RELEASE);
+    frame_queue_wake(stage->spare);
+    pthread_join(stage->thread, NULL);
+
+    capture_stage_free(stage);
+}
+
+/**
+ * output_frame_run
+ *      Feeds the pictures of one output frame to its sinks.
+ */
+static void output_frame_run(struct context *cnt, unsigned int sinks, struct image_data *img,
+                             unsigned char *motion, char *description)
+{
+    if (sinks & OUTPUT_PIPE)
+        event(cnt, EVENT_IMAGE, img->image, NULL, &cnt->pipe, &img->timestamp_tm);
+
+    if (sinks & OUTPUT_STREAM)
+        event(cnt, EVENT_STREAM, NULL, description, img, &img->timestamp_tm);
+
+#ifdef HAVE_SDL
+    if (sinks & OUTPUT_SDL)
+        event(cnt, EVENT_SDL_PUT, img->image, NULL, NULL, &img->timestamp_tm);
+#endif
+
+    if (sinks & OUTPUT_MOTION_PIPE)
+        event(cnt, EVENT_IMAGEM, motion, NULL, &cnt->mpipe, &img->timestamp_tm);
+}
+
+static void output_stage_free(struct output_stage *stage)
+{
+    frame_queue_free(stage->spare);
+    frame_queue_free(stage->queued);
+    free(stage);
+}
+
+static void *output_thread(void *arg)
+{
+    struct output_stage *stage = arg;
+    struct context *cnt = stage->cnt;
+    struct output_frame *frame;
+
+    /* Log with the thread number of the camera we output for */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)cnt->threadnr));
+
+    while ((frame = frame_queue_wait(stage->queued, &stage->finish))) {
+        output_frame_run(cnt, frame->sinks, &frame->img, frame->motion, frame->description);
+
+        free(frame->description);
+        frame_unref(frame->img.image);
+        frame_unref(frame->img.secondary_image);
+        frame_unref(frame->motion);
+        frame_queue_push(stage->spare, frame);
+    }
+
+    return NULL;
+}
+
+/**
+ * output_stage_start
+ *      Starts a thread feeding the output sinks of cnt. The loopback pipes
+ *      must be open already.
+ *
+ * Returns the stage, NULL if the sinks are to be fed by the motion thread.
+ */
+struct output_stage *output_stage_start(struct context *cnt)
+{
+    struct output_stage *stage;
+    int i;
+
+    stage = mymalloc(sizeof(struct output_stage));
+    stage->cnt = cnt;
+    stage->queued = frame_queue_new(PIPELINE_OUTPUT_FRAMES);
+    stage->spare = frame_queue_new(PIPELINE_OUTPUT_FRAMES);
+
+    for (i = 0; i < PIPELINE_OUTPUT_FRAMES; i++)
+        frame_queue_push(stage->spare, &stage->frames[i]);
+
+    if (pthread_create(&stage->thread, NULL, output_thread, stage)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start output thread, feeding"
+                   " pipes and stream from the motion thread");
+        output_stage_free(stage);
+        return NULL;
+    }
+
+    return stage;
+}
+
+/**
+ * output_stage_put
+ *      Queues pictures for the output sinks, or feeds them right away when
+ *      cnt has no output stage. Sinks which are not open are left out. When
+ *      the stage is behind, pictures for a loopback pipe wait for it and
+ *      the others are dropped.
+ *
+ * Inputs:
+ * - sinks is a mask of OUTPUT_*
+ * - image is the picture for the loopback pipe, the stream and SDL
+ * - img, if not NULL, gives the timestamp, the motion area and the secondary
+ *   picture for the stream. It is copied, the output thread never looks at
+ *   the images of the motion thread.
+ * - motion is the picture for the motion loopback pipe
+ *
+ * Returns nothing. The pictures must come from the frame pools of cnt, they
+ * are referenced rather than copied. Whoever draws on them afterwards takes
+ * a private copy first, see frame_unshare.
+ */
+void output_stage_put(struct context *cnt, unsigned int sinks, unsigned char *image,
+                      struct image_data *img, unsigned char *motion)
+{
+    struct output_stage *stage = cnt->output_stage;
+    struct output_frame *frame;
+    struct image_data tmp;
+    char *description = NULL;
+
+    if (cnt->pipe < 0)
+        sinks &= ~OUTPUT_PIPE;
+    if (cnt->mpipe < 0)
+        sinks &= ~OUTPUT_MOTION_PIPE;
+    if (!cnt->stream_publisher)
+        sinks &= ~OUTPUT_STREAM;
+
+    if (!sinks)
+        return;
+
+    if (img) {
+        tmp = *img;
+    } else {
+        memset(&tmp, 0, sizeof(tmp));
+        tmp.timestamp_tm = *cnt->currenttime_tm;
+    }
+    tmp.image = image;
+    tmp.virgin = NULL;
+    tmp.encoded = NULL;
+
+    /* exif_text is formatted from the current image, here on the motion thread */
+    if (sinks & OUTPUT_STREAM)
+        description = exif_description(cnt, &tmp.timestamp_tm);
+
+    if (!stage) {
+        output_frame_run(cnt, sinks, &tmp, motion, description);
+        free(description);
+        return;
+    }
+
+    frame = frame_queue_pop(stage->spare);
+
+    /* The loopback pipes get every frame in order, as when they were written here */
+    if (!frame && (sinks & (OUTPUT_PIPE | OUTPUT_MOTION_PIPE)))
+        frame = frame_queue_wait(stage->spare, NULL);
+
+    if (!frame) {
+        if (stage->dropped++ % 100 == 0)
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Output is falling behind, %d stream "
+                       "frames dropped", stage->dropped);
+        free(description);
+        return;
+    }
+
+    frame->sinks = sinks;
+    frame->img = tmp;
+    frame->img.image = NULL;
+    frame->img.secondary_image = NULL;
+    frame->motion = NULL;
+    frame->description = description;
+
+    if (sinks & (OUTPUT_PIPE | OUTPUT_STREAM | OUTPUT_SDL))
+        frame->img.image = frame_ref(image);
+
+    if ((sinks & OUTPUT_STREAM) && cnt->conf.stream_secondary)
+        frame->img.secondary_image = frame_ref(tmp.secondary_image);
+
+    if (sinks & OUTPUT_MOTION_PIPE)
+        frame->motion = frame_ref(motion);
+
+    frame_queue_push(stage->queued, frame);
+}
+
+/**
+ * output_stage_stop
+ *      Feeds the frames still queued to the sinks, stops the output thread
+ *      and frees the stage.
+ */
+void output_stage_stop(struct output_stage *stage)
+{
+    if (!stage)
+        return;
+
+    __atomic_store_n(&stage->finish, 1, __ATOMIC_RELEASE);
+    frame_queue_wake(stage->queued);
+    pthread_join(stage->thread, NULL);
+
+    output_stage_free(stage);
+}
+
+static void compress_stage_free(struct compress_stage *stage)
+{
+    pthread_mutex_destroy(&stage->lock);
+    frame_queue_free(stage->spare);
+    frame_queue_free(stage->done);
+    frame_queue_free(stage->queued);
+    free(stage->scratch);
+    free(stage);
+}
+
+/**
+ * compress_frame_run
+ *      Compresses the picture of frame and hands it back to the motion thread.
+ */
+static void compress_frame_run(struct compress_stage *stage, struct compress_frame *frame)
+{
+    frame->size = put_jpeg_yuv420p_memory(stage->scratch, stage->scratch_size, frame->image,
+                                          stage->width, stage->height, stage->quality, NULL,
+                                          &frame->timestamp_tm, &frame->box);
+
+    /* Only keep what the jpeg needs, that is the point */
+    if (frame->size > 0) {
+        frame->jpeg = mymalloc(frame->size);
+        memcpy(frame->jpeg, stage->scratch, frame->size);
+    }
+
+    frame_queue_push(stage->done, frame);
+}
+
+static void *compress_thread(void *arg)
+{
+    struct compress_stage *stage = arg;
+    struct compress_frame *frame;
+
+    /* Log with the thread number of the camera we compress for */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)stage->cnt->threadnr));
+
+    while ((frame = frame_queue_wait(stage->queued, &stage->finish)))
+        compress_frame_run(stage, frame);
+
+    return NULL;
+}
+
+/**
+ * compress_stage_drop
+ *      Drops the pictures left in the queues of a stage which is stopped.
+ */
+static void compress_stage_drop(struct compress_stage *stage)
+{
+    struct compress_frame *frame;
+
+    while ((frame = frame_queue_pop(stage->queued)) || (frame = frame_queue_pop(stage->done))) {
+        free(frame->jpeg);
+        frame->jpeg = NULL;
+        frame_unref(frame->image);
+        frame->image = NULL;
+    }
+}
+
+/**
+ * compress_task_run
+ *      Executor task compressing the pictures queued so far, the counterpart
+ *      of compress_thread. A stage stopped while its task was submitted or
+ *      running is freed by the task.
+ */
+static void compress_task_run(struct executor_task *task)
+{
+    struct compress_stage *stage = (struct compress_stage *)task;
+    struct compress_frame *frame;
+    int finish, resubmit;
+
+    /* The worker runs other cameras in between */
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)stage->cnt->threadnr));
+
+    while (!__atomic_load_n(&stage->finish, __ATOMIC_ACQUIRE) &&
+           (frame = frame_queue_pop(stage->queued)))
+        compress_frame_run(stage, frame);
+
+    pthread_mutex_lock(&stage->lock);
+
+    finish = stage->finish;
+    resubmit = stage->scheduled = !finish && !frame_queue_empty(stage->queued);
+
+    pthread_mutex_unlock(&stage->lock);
+
+    if (finish) {
+        compress_stage_drop(stage);
+        compress_stage_free(stage);
+    } else if (resubmit) {
+        /* Queued after the last pop */
+        executor_submit(stage->executor, task, monotonic_ns());
+    }
+}
+
+/**
+ * compress_stage_start
+ *      Starts compressing the pictures of the ring buffer of cnt when
+ *      pre_capture_compress is on, in a thread of its own or, when ex is
+ *      given, in a task run by the executor. Only YUV420P pictures are
+ *      compressed.
+ *
+ * Returns the stage, NULL if the ring buffer keeps raw pictures.
+ */
+struct compress_stage *compress_stage_start(struct context *cnt, struct executor *ex)
+{
+    struct compress_stage *stage;
+    int i;
+
+    if (!cnt->conf.pre_capture_compress)
+        return NULL;
+
+    if (cnt->imgs.type != VIDEO_PALETTE_YUV420P) {
+        MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: pre_capture_compress needs YUV420P pictures, "
+                   "the pre_capture buffer is kept raw");
+        return NULL;
+    }
+
+    stage = mymalloc(sizeof(struct compress_stage));
+    stage->cnt = cnt;
+    stage->width = cnt->imgs.width;
+    stage->height = cnt->imgs.height;
+    stage->quality = cnt->conf.quality;
+    stage->executor = ex;
+    stage->task.run = compress_task_run;
+    stage->task.worker = -1;
+    pthread_mutex_init(&stage->lock, NULL);
+    stage->scratch_size = (stage->width * stage->height * 3) / 2;
+    stage->scratch = mymalloc(stage->scratch_size);
+    stage->queued = frame_queue_new(PIPELINE_COMPRESS_FRAMES);
+    stage->done = frame_queue_new(PIPELINE_COMPRESS_FRAMES);
+    stage->spare = frame_queue_new(PIPELINE_COMPRESS_FRAMES);
+
+    for (i = 0; i < PIPELINE_COMPRESS_FRAMES; i++)
+        frame_queue_push(stage->spare, &stage->frames[i]);
+
+    if (!ex && pthread_create(&stage->thread, NULL, compress_thread, stage)) {
+        MOTION_LOG(ERR, TYPE_ALL, SHOW_ERRNO, "%s: Could not start compress thread, the "
+                   "pre_capture buffer is kept raw");
+        compress_stage_free(stage);
+        return NULL;
+    }
+
+    return stage;
+}
+
+/**
+ * compress_stage_put
+ *      Queues the picture of img, an image of the ring buffer detection is
+ *      done with, to be compressed. Images waiting to be saved stay raw and
+ *      so does img when the stage is busy.
+ */
+void compress_stage_put(struct context *cnt, struct image_data *img)
+{
+    struct compress_stage *stage = cnt->compress_stage;
+    struct compress_frame *frame;
+    int submit;
+
+    if (!stage)
+        return;
+
+    compress_stage_collect(cnt);
+
+    if (!img->image || cnt->imgs.image_ring_size < 2 || (img->flags & IMAGE_SAVE))
+        return;
+
+    frame = frame_queue_pop(stage->spare);
+
+    if (!frame) {
+        if (stage->skipped++ % 100 == 0)
+            MOTION_LOG(WRN, TYPE_ALL, NO_ERRNO, "%s: Compression is falling behind, %d "
+                       "pre_capture pictures kept raw", stage->skipped);
+        return;
+    }
+
+    frame->pos = img - cnt->imgs.image_ring;
+    frame->image = frame_ref(img->image);
+    frame->box = img->location;
+    frame->timestamp_tm = img->timestamp_tm;
+    frame->jpeg = NULL;
+    frame->size = 0;
+
+    frame_queue_push(stage->queued, frame);
+
+    if (!stage->executor)
+        return;
+
+    pthread_mutex_lock(&stage->lock);
+    submit = !stage->scheduled;
+    stage->scheduled = 1;
+    pthread_mutex_unlock(&stage->lock);
+
+    /* Compressed by a worker free for it, not on the way of detection */
+    if (submit)
+        executor_submit(stage->executor, &stage->task, monotonic_ns());
+}
+
+/**
+ * compress_stage_collect
+ *      Swaps the raw pictures of the ring buffer which have been compressed
+ *      for their jpeg. A picture is only swapped when its image still holds
+ *      it and does not wait to be saved, else the jpeg is dropped.
+ */
+void compress_stage_collect(struct context *cnt)
+{
+    struct compress_stage *stage = cnt->compress_stage;
+    struct compress_frame *frame;
+    struct image_data *img;
+
+    if (!stage)
+        return;
+
+    while ((frame = frame_queue_pop(stage->done))) {
+        img = NULL;
+
+        /* The ring may have been resized meanwhile */
+        if (frame->pos < cnt->imgs.image_ring_size)
+            img = &cnt->imgs.image_ring[frame->pos];
+
+        if (frame->jpeg && img && img->image == frame->image && img != cnt->current_image &&
+            !(img->flags & IMAGE_SAVE)) {
+            free(img->encoded);
+            img->encoded = frame->jpeg;
+            img->encoded_size = frame->size;
+            frame_unref(img->image);
+            img->image = NULL;
+        } else {
+            free(frame->jpeg);
+        }
+
+        frame->jpeg = NULL;
+        frame_unref(frame->image);
+        frame->image = NULL;
+        frame_queue_push(stage->spare, frame);
+    }
+}
+
+/**
+ * compress_stage_stop
+ *      Stops the compress thread of cnt once it has compressed the pictures
+ *      queued, collects them and frees the stage. On the executor the task
+ *      is not waited for, a worker may be the one stopping the camera. A
+ *      task still submitted or running drops the pictures and frees the
+ *      stage itself.
+ */
+void compress_stage_stop(struct context *cnt)
+{
+    struct compress_stage *stage = cnt->compress_stage;
+    int scheduled;
+
+    if (!stage)
+        return;
+
+    if (stage->executor) {
+        pthread_mutex_lock(&stage->lock);
+        __atomic_store_n(&stage->finish, 1, __ATOMIC_RELEASE);
+        scheduled = stage->scheduled;
+        pthread_mutex_unlock(&stage->lock);
+
+        if (scheduled) {
+            cnt->compress_stage = NULL;
+            return;
+        }
+    } else {
+        __atomic_store_n(&stage->finish, 1, __ATOMIC_RELEASE);
+        frame_queue_wake(stage->queued);
+        pthread_join(stage->thread, NULL);
+    }
+
+    /* What was compressed goes to the ring, the rest is dropped */
+    compress_stage_collect(cnt);
+    compress_stage_drop(stage);
+
+    compress_stage_free(stage);
+    cnt->compress_stage = NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * pipeline.h
+ *
+ *  Capture and output stages running beside the motion thread.
+ */
+
+#ifndef PIPELINE_H_
+#define PIPELINE_H_
+
+struct context;
+struct image_data;
+struct capture_stage;
+struct output_stage;
+struct compress_stage;
+struct frame_queue;
+struct executor;
+
+/* Frames captured ahead of the motion thread */
+#define PIPELINE_CAPTURE_FRAMES 2
+/* Frames queued for the output sinks before new ones are dropped */
+#define PIPELINE_OUTPUT_FRAMES  4
+/* Ring buffer pictures being compressed before new ones are left raw */
+#define PIPELINE_COMPRESS_FRAMES 4
+
+/* Output sinks fed by the output stage, in the order they are fed */
+#define OUTPUT_PIPE             1   /* Picture to the video loopback pipe */
+#define OUTPUT_STREAM           2   /* Picture to the stream clients */
+#define OUTPUT_SDL              4   /* Picture to the SDL window */
+#define OUTPUT_MOTION_PIPE      8   /* Motion picture to the motion loopback pipe */
+
+extern struct frame_queue *frame_queue_new(int size);
+extern void frame_queue_free(struct frame_queue *queue);
+extern int frame_queue_push(struct frame_queue *queue, void *ref);
+extern void *frame_queue_pop(struct frame_queue *queue);
+extern void *frame_queue_wait(struct frame_queue *queue, volatile int *stop);
+extern void frame_queue_wake(struct frame_queue *queue);
+
+extern struct capture_stage *capture_stage_start(struct context *cnt);
+extern int capture_stage_next(struct context *cnt, struct image_data *img);
+extern void capture_stage_stop(struct capture_stage *stage);
+
+extern struct output_stage *output_stage_start(struct context *cnt);
+extern void output_stage_put(struct context *cnt, unsigned int sinks, unsigned char *image,
+                             struct image_data *img, unsigned char *motion);
+extern void output_stage_stop(struct output_stage *stage);
+
+extern struct compress_stage *compress_stage_start(struct context *cnt, struct executor *ex);
+extern void compress_stage_put(struct context *cnt, struct image_data *img);
+extern void compress_stage_collect(struct context *cnt);
+extern void compress_stage_stop(struct context *cnt);
+
+#endif /* PIPELINE_H_ */
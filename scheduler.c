@@ -0,0 +1,280 @@
+/*
+ * scheduler.c
+ *
+ *  Paces the motion loop to frame_limit on the monotonic clock.
+ *
+ *  Each frame has an absolute deadline, one interval after the one before,
+ *  and the loop sleeps until it with clock_nanosleep. Sleeping to a deadline
+ *  instead of for a computed delay keeps the rate from drifting, and the
+ *  monotonic clock does not jump when the wall clock is set.
+ *
+ *  A frame which overruns its slot makes the next ones start right away to
+ *  catch up. Once the loop is more than SCHEDULER_CATCHUP_FRAMES behind the
+ *  missed slots are skipped instead, so a stall is not followed by a burst.
+ *
+ *  The statistics are running sums over the report period, a few additions
+ *  per frame whatever the frame rate. They include the latency from capture
+ *  of a frame to its output, from the capture time its source stamped it with.
+ *
+ *  With load shedding on, each report also adjusts how much work the loop
+ *  sheds to keep up. A report with SHED_OVER_PERCENT overrun or more and
+ *  hardly any idle time left to make up for it sheds one more level, and
+ *  SHED_CALM_REPORTS calm ones in a row restore one. The
+ *  motion loop applies the level, see SHED_* in scheduler.h. Capture and
+ *  recording are never shed.
+ */
+
+#include "motion.h"
+#include "scheduler.h"
+#include <stddef.h>
+
+#define NSEC_PER_SEC    1000000000LL
+
+/**
+ * monotonic_ns
+ *      Returns the time of CLOCK_MONOTONIC in nanoseconds.
+ */
+long long monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/**
+ * realtime_ns
+ *      Returns the time of CLOCK_REALTIME in nanoseconds.
+ */
+long long realtime_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static long long scheduler_interval(int frame_limit)
+{
+    return frame_limit > 0 ? NSEC_PER_SEC / frame_limit : 0;
+}
+
+static void scheduler_sleep_until(long long deadline)
+{
+    struct timespec ts;
+
+    ts.tv_sec = deadline / NSEC_PER_SEC;
+    ts.tv_nsec = deadline % NSEC_PER_SEC;
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static const char *shed_level_names[] = {
+    "none",
+    "detection on every other frame",
+    "stream on every other frame",
+    "detection at half resolution"
+};
+
+/**
+ * scheduler_shed
+ *      Moves the load shedding level by the overrun of the last report.
+ */
+static void scheduler_shed(struct frame_scheduler *sched)
+{
+    int level = sched->shed_level;
+
+    if (!sched->shedding) {
+        level = SHED_NONE;
+    } else if (sched->percent_over >= SHED_OVER_PERCENT && sched->percent_idle < SHED_IDLE_PERCENT) {
+        sched->calm_reports = 0;
+        if (level < SHED_DETECT_REDUCED)
+            level++;
+    } else if (sched->percent_over < SHED_CALM_PERCENT) {
+        if (++sched->calm_reports >= SHED_CALM_REPORTS && level > SHED_NONE) {
+            sched->calm_reports = 0;
+            level--;
+        }
+    } else {
+        sched->calm_reports = 0;
+    }
+
+    if (level != sched->shed_level) {
+        MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: Load shedding level %d: %s", level,
+                   shed_level_names[level]);
+        __atomic_store_n(&sched->shed_level, level, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * scheduler_report
+ *      Logs the frame rate and the time spent idle and over the interval
+ *      since the last report, then starts over.
+ */
+static void scheduler_report(struct frame_scheduler *sched, long long now)
+{
+    float elapsed = (float)(now - sched->report_start);
+
+    float fps = sched->frames * (float)NSEC_PER_SEC / elapsed;
+    float percent_idle = sched->idle_time / elapsed * 100.0f;
+    float percent_over = sched->over_time / elapsed * 100.0f;
+    float latency_ms = sched->latency_frames ?
+                       sched->latency_time / 1000000.0f / sched->latency_frames : 0;
+
+    /* The governor reads the report from main */
+    __atomic_store(&sched->fps, &fps, __ATOMIC_RELAXED);
+    __atomic_store(&sched->percent_idle, &percent_idle, __ATOMIC_RELAXED);
+    __atomic_store(&sched->percent_over, &percent_over, __ATOMIC_RELAXED);
+    __atomic_store(&sched->latency_ms, &latency_ms, __ATOMIC_RELAXED);
+
+    MOTION_LOG(NTC, TYPE_ALL, NO_ERRNO, "%s: fps: %f idle %0.2f%% over %0.2f%% skipped %d "
+               "shedding %d latency %0.1f ms", fps, percent_idle, percent_over,
+               sched->skipped, scheduler_shed_level(sched), latency_ms);
+
+    scheduler_shed(sched);
+
+    sched->report_start = now;
+    sched->frames = 0;
+    sched->skipped = 0;
+    sched->idle_time = 0;
+    sched->over_time = 0;
+    sched->latency_frames = 0;
+    sched->latency_time = 0;
+}
+
+/**
+ * scheduler_shed_level
+ *      Returns the SHED_* level the motion loop applies, the higher of the
+ *      one of the camera and the one the governor imposes.
+ */
+int scheduler_shed_level(struct frame_scheduler *sched)
+{
+    int shed_level = __atomic_load_n(&sched->shed_level, __ATOMIC_RELAXED);
+    int shed_floor = __atomic_load_n(&sched->shed_floor, __ATOMIC_RELAXED);
+
+    return shed_level > shed_floor ? shed_level : shed_floor;
+}
+
+/**
+ * scheduler_latency
+ *      Counts the time from capture to output of the frame captured at
+ *      capture_ns on the monotonic clock, once per frame. 0 is unknown.
+ */
+void scheduler_latency(struct frame_scheduler *sched, long long capture_ns)
+{
+    if (capture_ns <= sched->last_capture)
+        return;
+
+    sched->last_capture = capture_ns;
+    sched->latency_time += monotonic_ns() - capture_ns;
+    sched->latency_frames++;
+}
+
+/**
+ * scheduler_init
+ *      Starts the schedule with the first frame due now. What the governor
+ *      imposes is kept, only the fields of the camera are cleared.
+ */
+void scheduler_init(struct frame_scheduler *sched, int frame_limit)
+{
+    long long now = monotonic_ns();
+
+    /* The governor may set shed_floor and rate_cap from main meanwhile */
+    memset(sched, 0, offsetof(struct frame_scheduler, shed_floor));
+
+    sched->interval = scheduler_interval(frame_limit);
+    sched->deadline = now;
+    sched->frame_start = now;
+    sched->report_start = now;
+}
+
+/**
+ * scheduler_frame_start
+ *      Marks the start of a frame, to measure how long it takes.
+ */
+void scheduler_frame_start(struct frame_scheduler *sched)
+{
+    sched->frame_start = monotonic_ns();
+}
+
+/**
+ * scheduler_rebase
+ *      Moves the schedule so the current frame is due now. Used when the
+ *      camera sets the pace, the next frame is then due one interval after
+ *      this one arrived.
+ */
+void scheduler_rebase(struct frame_scheduler *sched)
+{
+    sched->frame_start = sched->deadline = monotonic_ns();
+}
+
+/**
+ * scheduler_next
+ *      Ends the current frame and works out when the next one is due, without
+ *      waiting for it. frame_limit may have changed since the last frame, 0
+ *      means no limit, and the governor may cap it lower. shedding tells if
+ *      load shedding is enabled.
+ *
+ * Returns the deadline of the next frame on the monotonic clock.
+ */
+long long scheduler_next(struct frame_scheduler *sched, int frame_limit, int shedding)
+{
+    long long now = monotonic_ns();
+    long long interval;
+    long long busy = now - sched->frame_start;
+    long long missed;
+    int rate_cap = __atomic_load_n(&sched->rate_cap, __ATOMIC_RELAXED);
+
+    if (rate_cap > 0 && (frame_limit == 0 || rate_cap < frame_limit))
+        frame_limit = rate_cap;
+
+    interval = scheduler_interval(frame_limit);
+
+    /* A new frame rate starts a new schedule from this frame */
+    if (interval != sched->interval) {
+        sched->interval = interval;
+        sched->deadline = sched->frame_start;
+    }
+
+    sched->frames++;
+    sched->shedding = shedding;
+
+    if (interval == 0) {
+        sched->deadline = now;
+    } else {
+        sched->deadline += interval;
+
+        if (busy > interval)
+            sched->over_time += busy - interval;
+
+        if (now > sched->deadline + SCHEDULER_CATCHUP_FRAMES * interval) {
+            /* Too far behind to catch up, give up the missed slots */
+            missed = (now - sched->deadline) / interval;
+            sched->deadline += missed * interval;
+            sched->skipped += missed;
+        }
+    }
+
+    if (now - sched->report_start >= SCHEDULER_REPORT_SECONDS * NSEC_PER_SEC)
+        scheduler_report(sched, now);
+
+    if (sched->deadline > now)
+        sched->idle_time += sched->deadline - now;
+
+    return sched->deadline;
+}
+
+/**
+ * scheduler_wait
+ *      Ends the current frame and sleeps until the next one is due, see
+ *      scheduler_next.
+ */
+void scheduler_wait(struct frame_scheduler *sched, int frame_limit, int shedding)
+{
+    long long deadline = scheduler_next(sched, frame_limit, shedding);
+
+    if (deadline > monotonic_ns())
+        scheduler_sleep_until(deadline);
+}
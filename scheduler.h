@@ -0,0 +1,69 @@
+/*
+ * scheduler.h
+ *
+ *  Paces the motion loop to frame_limit on the monotonic clock.
+ */
+
+#ifndef SCHEDULER_H_
+#define SCHEDULER_H_
+
+/* Frames started late in a row to catch up before the missed slots are skipped */
+#define SCHEDULER_CATCHUP_FRAMES    2
+/* Seconds between two timing reports in the log */
+#define SCHEDULER_REPORT_SECONDS    5
+
+/* Load shedding levels, each level also sheds what the ones below it do */
+#define SHED_NONE                   0
+#define SHED_DETECT_ALTERNATE       1   /* Detect motion on every other frame */
+#define SHED_STREAM_RATE            2   /* Stream every other frame */
+#define SHED_DETECT_REDUCED         3   /* Detect motion at half the resolution */
+
+/* Overrun percentage of a report, with less idle time than SHED_IDLE_PERCENT, which sheds one more level */
+#define SHED_OVER_PERCENT           10
+#define SHED_IDLE_PERCENT           5
+/* Reports in a row under SHED_CALM_PERCENT overrun before a level is restored */
+#define SHED_CALM_PERCENT           1
+#define SHED_CALM_REPORTS           3
+
+struct frame_scheduler {
+    long long interval;             /* Nanoseconds per frame, 0 for no limit */
+    long long deadline;             /* When the next frame is due */
+    long long frame_start;          /* When the current frame started */
+    long long report_start;         /* When the running statistics started */
+
+    /* Running statistics since report_start */
+    int frames;
+    int skipped;                    /* Frame slots given up after overruns */
+    long long idle_time;            /* Time slept waiting for deadlines */
+    long long over_time;            /* Time frames took beyond the interval */
+    int latency_frames;
+    long long latency_time;         /* Time from capture to output of the frames */
+    long long last_capture;         /* Capture time of the last frame counted */
+
+    /* Last complete report, for whoever wants to act on the load */
+    float fps;
+    float percent_idle;
+    float percent_over;
+    float latency_ms;               /* Average from capture to output, 0 if unknown */
+
+    int shedding;                   /* Load shedding is enabled */
+    int shed_level;                 /* SHED_* currently applied */
+    int calm_reports;               /* Reports in a row without overrun */
+
+    /* Set by the governor, see governor.c. Last, scheduler_init keeps them */
+    int shed_floor;                 /* SHED_* applied at least */
+    int rate_cap;                   /* Frames per second at most, 0 for no cap */
+};
+
+extern long long monotonic_ns(void);
+extern long long realtime_ns(void);
+
+extern void scheduler_init(struct frame_scheduler *sched, int frame_limit);
+extern void scheduler_frame_start(struct frame_scheduler *sched);
+extern void scheduler_rebase(struct frame_scheduler *sched);
+extern int scheduler_shed_level(struct frame_scheduler *sched);
+extern void scheduler_latency(struct frame_scheduler *sched, long long capture_ns);
+extern long long scheduler_next(struct frame_scheduler *sched, int frame_limit, int shedding);
+extern void scheduler_wait(struct frame_scheduler *sched, int frame_limit, int shedding);
+
+#endif /* SCHEDULER_H_ */
@@ -20,56 +20,159 @@
 
 #include "md5.h"
 #include "picture.h"
+#include "yuvscale.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <ctype.h>
 #include <sys/fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
 
 #define STREAM_REALM       "Motion Stream Security Access"
 #define KEEP_ALIVE_TIMEOUT 100
+#define STREAM_EVENTS      16
+#define STREAM_REQUEST_SIZE 1024    /* Longest request read from a client */
+#define STREAM_ETAG_SIZE    48      /* Room for a quoted snapshot ETag */
 
-typedef void* (*auth_handler)(void*);
-struct auth_param {
-    struct context *cnt;
-    int sock;
-    int sock_flags;
-    int* thread_count;
-    struct config *conf;
+#define STREAM_POOL_MIN_SHIFT  14   /* Smallest pooled payload, 16 kB */
+#define STREAM_POOL_CLASSES    11   /* Up to 16 MB, larger payloads are not pooled */
+#define STREAM_POOL_KEEP       4    /* Free buffers kept per size class */
+#define STREAM_ZEROCOPY_MIN    16384 /* Smaller payloads are cheaper to copy */
+
+#define STREAM_TIER_FULL       0    /* The stream as configured */
+#define STREAM_TIER_NAME       16   /* Longest tier name in stream_tiers, with the NUL */
+#define STREAM_LAG_DROPS       3    /* Frames dropped in a row before switching to the lag tier */
+#define STREAM_LAG_RECOVER     100  /* Frames sent in a row without backlog before switching back */
+
+static const char stream_boundary_tail[] = "\r\n";
+
+/* Content types of the STREAM_FORMAT_* */
+static const char *stream_format_types[] = { "image/jpeg", "image/webp" };
+
+#define HASHLEN 16
+typedef char HASH[HASHLEN];
+#define HASHHEXLEN 32
+typedef char HASHHEX[HASHHEXLEN+1];
+#define IN
+#define OUT
+
+/* List of clients in the same state */
+struct stream_set {
+    struct stream *head;
+    struct stream *tail;
+    int count;
 };
 
-pthread_mutex_t stream_auth_mutex;
+/*
+ * Size classed pool of frame buffers. Payloads are powers of two so a few
+ * buffers serve all frame sizes of a camera without a malloc per frame.
+ */
+struct stream_pool {
+    pthread_mutex_t lock;
+    struct stream_buffer *free[STREAM_POOL_CLASSES];
+    int free_count[STREAM_POOL_CLASSES];
+};
 
-/**
- * set_sock_timeout
- *
- * Returns : 0 or 1 on timeout
+/*
+ * One encoding of the stream. Tier 0 is the stream as configured, followed
+ * by those of stream_tiers and, with stream_lag_quality set, the lag tier.
+ * With stream_webp on, the same tiers follow once more in WebP format.
+ * Each tier is encoded at most once per frame, and only while clients of
+ * the tier wait for a frame.
  */
-static int set_sock_timeout(int sock, int sec)
-{
-    struct timeval tv;
+struct stream_tier {
+    char name[STREAM_TIER_NAME];    /* Selects the tier in the url, empty if it can't be */
+    int format;                     /* STREAM_FORMAT_* the tier is encoded in */
+    int width;                      /* Largest size, 0 for the size of the image */
+    int height;
+    int half;                       /* Half the size of the image, for the lag tier */
+    int quality;
+    int maxrate;
+    unsigned char *scaled;          /* Downscaled image, used by the motion thread only */
+    int scaled_size;
+
+    struct stream_buffer *frame;    /* Latest published frame, holds a reference */
+    unsigned long int frame_nr;
+    unsigned long int published;    /* Monotonic us the frame was published */
+    volatile int wanted;            /* Clients due for a newer frame than published */
+    struct stream_set ready;        /* Due for a newer frame than they were sent */
+    struct stream_set paced;        /* Sent a frame, by send time, until due again */
+    struct stream_set snapshots;    /* Snapshot requests waiting for a newer frame */
+};
+
+/*
+ * Per camera state of the stream. The motion thread publishes each encoded
+ * frame in its tier and the stream thread serving the camera sends it to
+ * the clients.
+ */
+struct stream_publisher {
+    struct context *cnt;
+    struct stream_server *server;   /* Stream thread serving the camera */
+    struct stream_publisher *next;  /* Other cameras served by the same thread */
+    time_t started;                 /* Tells the snapshot ETags of a restart apart */
+
+    pthread_mutex_t frame_lock;     /* Protects frame and frame_nr of the tiers */
+    struct stream_tier *tiers;
+    int tier_count;
+    int format_tiers;               /* Tiers per format, tier t + format_tiers is t in WebP */
+    int lag_tier;                   /* Tier lagging clients are moved to, -1 if none */
+
+    struct stream_pool pool;
+
+    /* Clients of the camera have to authenticate before they are streamed */
+    int auth_method;                /* stream_auth_method */
+    int auth_error;                 /* Credentials unusable, clients get an error */
+    char *auth_basic;               /* Basic credentials expected, base64 encoded */
+    HASHHEX auth_ha1;               /* Digest H(A1) of the configured credentials */
+};
 
-    tv.tv_sec = sec;
-    tv.tv_usec = 0;
+/*
+ * A stream thread with its listen socket, serving the clients of one camera
+ * or, with stream_shared_port set, those of all cameras.
+ */
+struct stream_server {
+    pthread_t thread;
+    int threadnr;                   /* Logged as, 0 when shared */
+    int socket;                     /* Listen socket */
+    int shared;                     /* Urls name the camera */
+    int zerocopy;                   /* stream_zerocopy */
+    int epoll_fd;
+    int wakeup_fd;                  /* eventfd signalled on a new frame or stop */
+    int listening;                  /* Listen socket is polled for new clients */
+    volatile int finish;
 
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*) &tv, sizeof(tv))) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: set socket timeout failed");
-        return 1;
-    }
-    return 0;
-}
+    /*
+     * Held by the stream thread while handling events. Cameras take it to
+     * start or stop being served, never to publish a frame.
+     */
+    pthread_mutex_t lock;
+    struct stream_publisher *publishers;
+
+    struct stream *clients;         /* Slots for up to max_clients clients */
+    int max_clients;
+    struct stream_set unused;       /* Free client slots */
+    struct stream_set closed;       /* Closed while handling the current events */
+    struct stream_set requests;     /* Clients sending their request, oldest first */
+    unsigned int nonce_seed;
+};
+
+/* Serves all cameras when stream_shared_port is set */
+static struct stream_server *stream_shared;
 
 /**
- * read_http_request
+ * http_parse_request
+ *      Checks the request line of a complete HTTP request and copies the
+ *      requested url to uri if given.
  *
- *
- * Returns : 1 on success or 0 if any error happens
+ * Returns: NULL if the request is fine, else the response to send.
  */
-static int read_http_request(int sock, char* buffer, int buflen, char* uri, int uri_len)
+static const char *http_parse_request(const char *buffer, char *uri, int uri_len)
 {
-    int nread = 0;
-    int ret,readb = 1;
     char method[10] = {'\0'};
     char url[512] = {'\0'};
     char protocol[10] = {'\0'};
@@ -79,64 +182,18 @@ static int read_http_request(int sock, char* buffer, int buflen, char* uri, int
         "Content-type: text/plain\r\n\r\n"
         "Bad Request\n";
 
-    static const char *bad_method_response_template_raw =
+    static const char *bad_method_response_raw =
         "HTTP/1.0 501 Method Not Implemented\r\n"
         "Content-type: text/plain\r\n\r\n"
         "Method Not Implemented\n";
 
-    static const char *timeout_response_template_raw =
-        "HTTP/1.0 408 Request Timeout\r\n"
-        "Content-type: text/plain\r\n\r\n"
-        "Request Timeout\n";
-
-    buffer[0] = '\0';
-
-    while ((strstr(buffer, "\r\n\r\n") == NULL) && (readb != 0) && (nread < buflen)) {
-
-        readb = read(sock, buffer+nread, buflen - nread);
-
-        if (readb == -1) {
-            nread = -1;
-            break;
-        }
-
-        nread += readb;
-
-        if (nread > buflen) {
-            MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream End buffer reached"
-                      " waiting for buffer ending");
-            break;
-        }
-
-        buffer[nread] = '\0';
-    }
-
-    /*
-     * Make sure the last read didn't fail. If it did, there's a
-     * problem with the connection, so give up.
-     */
-    if (nread == -1) {
-        if(errno == EAGAIN) { // Timeout
-            ret = write(sock, timeout_response_template_raw, strlen(timeout_response_template_raw));
-            return 0;
-        }
-
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream READ give up!");
-        return 0;
-    }
-
-    ret = sscanf(buffer, "%9s %511s %9s", method, url, protocol);
-
-    if (ret != 3) {
-        ret = write(sock, bad_request_response_raw, sizeof(bad_request_response_raw));
-        return 0;
-    }
+    if (sscanf(buffer, "%9s %511s %9s", method, url, protocol) != 3)
+        return bad_request_response_raw;
 
     /* Check Protocol */
     if (strcmp(protocol, "HTTP/1.0") && strcmp (protocol, "HTTP/1.1")) {
         /* We don't understand this protocol. Report a bad response. */
-        ret = write(sock, bad_request_response_raw, sizeof(bad_request_response_raw));
-        return 0;
+        return bad_request_response_raw;
     }
 
     if (strcmp(method, "GET")) {
@@ -144,125 +201,65 @@ static int read_http_request(int sock, char* buffer, int buflen, char* uri, int
          * This server only implements the GET method. If client
          * uses other method, report the failure.
          */
-        char response[1024];
-        snprintf(response, sizeof(response), bad_method_response_template_raw, method);
-        ret = write(sock, response, strlen (response));
-
-        return 0;
+        return bad_method_response_raw;
     }
 
-    if(uri)
-        strncpy(uri, url, uri_len);
+    if (uri) {
+        strncpy(uri, url, uri_len - 1);
+        uri[uri_len - 1] = '\0';
+    }
 
-    return 1;
+    return NULL;
 }
 
-static void stream_add_client(struct stream *list, int sc);
-
 /**
- * handle_basic_auth
- *
+ * stream_auth_header
+ *      Copies the credentials of the Authorization header of a request for
+ *      scheme to auth, which holds STREAM_REQUEST_SIZE bytes. The request
+ *      is left as it is, the tier, format and ETag are read from it later.
  *
+ * Returns: 1 if the request has such a header, 0 if not.
  */
-static void* handle_basic_auth(void* param)
+static int stream_auth_header(const char *request, const char *scheme, char *auth)
 {
-    struct auth_param *p = (struct auth_param*)param;
-    char buffer[1024] = {'\0'};
-    ssize_t length = 1023;
-    char *auth, *h, *authentication;
-    int ret;
-    static const char *request_auth_response_template=
-        "HTTP/1.0 401 Authorization Required\r\n"
-        "Server: Motion/"VERSION"\r\n"
-        "Max-Age: 0\r\n"
-        "Expires: 0\r\n"
-        "Cache-Control: no-cache, private\r\n"
-        "Pragma: no-cache\r\n"
-        "WWW-Authenticate: Basic realm=\""STREAM_REALM"\"\r\n\r\n";
-
-    pthread_mutex_lock(&stream_auth_mutex);
-    p->thread_count++;
-    pthread_mutex_unlock(&stream_auth_mutex);
-
-    if (!read_http_request(p->sock,buffer, length, NULL, 0))
-        goto Invalid_Request;
-
-
-    auth = strstr(buffer, "Authorization: Basic");
-
-    if (!auth)
-        goto Error;
-
-    auth += sizeof("Authorization: Basic");
-    h = strstr(auth, "\r\n");
-
-    if(!h)
-        goto Error;
-
-    *h='\0';
-
-    if (p->conf->stream_authentication != NULL) {
-
-        char *userpass = NULL;
-        size_t auth_size = strlen(p->conf->stream_authentication);
-
-        authentication = (char *) mymalloc(BASE64_LENGTH(auth_size) + 1);
-        userpass = mymalloc(auth_size + 4);
-        /* base64_encode can read 3 bytes after the end of the string, initialize it. */
-        memset(userpass, 0, auth_size + 4);
-        strcpy(userpass, p->conf->stream_authentication);
-        base64_encode(userpass, authentication, auth_size);
-        free(userpass);
-
-        if (strcmp(auth, authentication)) {
-            free(authentication);
-            goto Error;
-        }
-        free(authentication);
-    }
-
-    // OK - Access
+    const char *value, *h;
 
-    /* Set socket to non blocking */
-    if (fcntl(p->sock, F_SETFL, p->sock_flags) < 0) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: fcntl");
-        goto Error;
-    }
+    value = strstr(request, scheme);
 
-    /* Lock the mutex */
-    pthread_mutex_lock(&stream_auth_mutex);
+    if (!value)
+        return 0;
 
-    stream_add_client(&p->cnt->stream, p->sock);
-    p->cnt->stream_count++;
-    p->thread_count--;
+    value += strlen(scheme) + 1;
+    h = strstr(value, "\r\n");
 
-    /* Unlock the mutex */
-    pthread_mutex_unlock(&stream_auth_mutex);
+    if (!h)
+        return 0;
 
-    free(p);
-    pthread_exit(NULL);
+    /* The request is no longer than STREAM_REQUEST_SIZE - 1 */
+    memcpy(auth, value, h - value);
+    auth[h - value] = '\0';
 
-Error:
-    ret = write(p->sock, request_auth_response_template, strlen (request_auth_response_template));
+    return 1;
+}
 
-Invalid_Request:
-    close(p->sock);
+/**
+ * stream_auth_basic
+ *      Checks the Basic credentials of a request against the base64 encoded
+ *      credentials computed at start up. Without configured credentials any
+ *      Basic credentials are accepted.
+ *
+ * Returns: 1 if the client may stream, 0 if not.
+ */
+static int stream_auth_basic(const char *expected, const char *request)
+{
+    char auth[STREAM_REQUEST_SIZE];
 
-    pthread_mutex_lock(&stream_auth_mutex);
-    p->thread_count--;
-    pthread_mutex_unlock(&stream_auth_mutex);
+    if (!stream_auth_header(request, "Authorization: Basic", auth))
+        return 0;
 
-    free(p);
-    pthread_exit(NULL);
+    return !expected || strcmp(auth, expected) == 0;
 }
 
-
-#define HASHLEN 16
-typedef char HASH[HASHLEN];
-#define HASHHEXLEN 32
-typedef char HASHHEX[HASHHEXLEN+1];
-#define IN
-#define OUT
 /**
  * CvtHex
  *      Calculates H(A1) as per HTTP Digest spec -- taken from RFC 2617.
@@ -380,324 +377,114 @@ static void DigestCalcResponse(
 
 
 /**
- * handle_md5_digest
- *
+ * digest_param
+ *      Finds name="value" in a Digest Authorization header.
  *
+ * Returns: the start of the value, NULL if not found.
  */
-static void* handle_md5_digest(void* param)
+static char *digest_param(char *auth, const char *name, int *len)
 {
-    struct auth_param *p = (struct auth_param*)param;
-    char buffer[1024] = {'\0'};
-    ssize_t length = 1023;
-    char *auth, *h, *username, *realm, *uri, *nonce, *response;
-    int username_len, realm_len, uri_len, nonce_len, response_len;
-#define SERVER_NONCE_LEN 17
-    char server_nonce[SERVER_NONCE_LEN];
-#define SERVER_URI_LEN 512
-    char server_uri[SERVER_URI_LEN];
-    char* server_user = NULL, *server_pass = NULL;
-    int ret;
-    unsigned int rand1,rand2;
-    HASHHEX HA1;
-    HASHHEX HA2 = "";
-    HASHHEX server_response;
-    static const char *request_auth_response_template=
-        "HTTP/1.0 401 Authorization Required\r\n"
-        "Server: Motion/"VERSION"\r\n"
-        "Max-Age: 0\r\n"
-        "Expires: 0\r\n"
-        "Cache-Control: no-cache, private\r\n"
-        "Pragma: no-cache\r\n"
-        "WWW-Authenticate: Digest";
-    static const char *auth_failed_html_template=
-        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
-        "<HTML><HEAD>\r\n"
-        "<TITLE>401 Authorization Required</TITLE>\r\n"
-        "</HEAD><BODY>\r\n"
-        "<H1>Authorization Required</H1>\r\n"
-        "This server could not verify that you are authorized to access the document "
-        "requested.  Either you supplied the wrong credentials (e.g., bad password), "
-        "or your browser doesn't understand how to supply the credentials required.\r\n"
-        "</BODY></HTML>\r\n";
-    static const char *internal_error_template=
-        "HTTP/1.0 500 Internal Server Error\r\n"
-        "Server: Motion/"VERSION"\r\n"
-        "Content-Type: text/html\r\n"
-        "Connection: Close\r\n\r\n"
-        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
-        "<HTML><HEAD>\r\n"
-        "<TITLE>500 Internal Server Error</TITLE>\r\n"
-        "</HEAD><BODY>\r\n"
-        "<H1>500 Internal Server Error</H1>\r\n"
-        "</BODY></HTML>\r\n";
-
-    pthread_mutex_lock(&stream_auth_mutex);
-    p->thread_count++;
-    pthread_mutex_unlock(&stream_auth_mutex);
-
-    set_sock_timeout(p->sock, KEEP_ALIVE_TIMEOUT);
-    srand(time(NULL));
-    rand1 = (unsigned int)(42000000.0 * rand() / (RAND_MAX + 1.0));
-    rand2 = (unsigned int)(42000000.0 * rand() / (RAND_MAX + 1.0));
-    snprintf(server_nonce, SERVER_NONCE_LEN, "%08x%08x", rand1, rand2);
-
-    if (!p->conf->stream_authentication) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error no authentication data");
-        goto InternalError;
-    }
-    h = strstr(p->conf->stream_authentication, ":");
-
-    if (!h) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error no authentication data (no ':' found)");
-        goto InternalError;
-    }
-
-    server_user = (char*)malloc((h - p->conf->stream_authentication) + 1);
-    server_pass = (char*)malloc(strlen(h) + 1);
-
-    if (!server_user || !server_pass) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error malloc failed");
-        goto InternalError;
-    }
-
-    strncpy(server_user, p->conf->stream_authentication, h-p->conf->stream_authentication);
-    server_user[h - p->conf->stream_authentication] = '\0';
-    strncpy(server_pass, h + 1, strlen(h + 1));
-    server_pass[strlen(h + 1)] = '\0';
-
-    while(1) {
-        if(!read_http_request(p->sock, buffer, length, server_uri, SERVER_URI_LEN - 1))
-            goto Invalid_Request;
-
-        auth = strstr(buffer, "Authorization: Digest");
-        if(!auth)
-            goto Error;
-
-        auth += sizeof("Authorization: Digest");
-        h = strstr(auth, "\r\n");
-
-        if (!h)
-            goto Error;
-        *h = '\0';
-
-        // Username
-        h=strstr(auth, "username=\"");
-
-        if (!h)
-            goto Error;
-
-        username = h + 10;
-        h = strstr(username + 1, "\"");
-
-        if (!h)
-            goto Error;
-
-        username_len = h - username;
-
-        // Realm
-        h = strstr(auth, "realm=\"");
-        if (!h)
-            goto Error;
-
-        realm = h + 7;
-        h = strstr(realm + 1, "\"");
-
-        if (!h)
-            goto Error;
-
-        realm_len = h - realm;
-
-        // URI
-        h = strstr(auth, "uri=\"");
-
-        if (!h)
-            goto Error;
-
-        uri = h + 5;
-        h = strstr(uri + 1, "\"");
-
-        if (!h)
-            goto Error;
-
-        uri_len = h - uri;
-
-        // Nonce
-        h = strstr(auth, "nonce=\"");
-
-        if (!h)
-            goto Error;
-
-        nonce = h + 7;
-        h = strstr(nonce + 1, "\"");
-
-        if (!h)
-            goto Error;
-
-        nonce_len = h - nonce;
-
-        // Response
-        h = strstr(auth, "response=\"");
-
-        if (!h)
-            goto Error;
-
-        response = h + 10;
-        h = strstr(response + 1, "\"");
-
-        if (!h)
-            goto Error;
-
-        response_len = h - response;
-
-        username[username_len] = '\0';
-        realm[realm_len] = '\0';
-        uri[uri_len] = '\0';
-        nonce[nonce_len] = '\0';
-        response[response_len] = '\0';
-
-        DigestCalcHA1((char*)"md5", server_user, (char*)STREAM_REALM, server_pass, (char*)server_nonce, (char*)NULL, HA1);
-        DigestCalcResponse(HA1, server_nonce, NULL, NULL, (char*)"", (char*)"GET", server_uri, HA2, server_response);
+    char *value, *h;
 
-        if (strcmp(server_response, response) == 0)
-            break;
-Error:
-        rand1 = (unsigned int)(42000000.0 * rand() / (RAND_MAX + 1.0));
-        rand2 = (unsigned int)(42000000.0 * rand() / (RAND_MAX + 1.0));
-        snprintf(server_nonce, SERVER_NONCE_LEN, "%08x%08x", rand1, rand2);
-        snprintf(buffer, length, "%s realm=\""STREAM_REALM"\", nonce=\"%s\"\r\n"
-                "Content-Type: text/html\r\n"
-                "Keep-Alive: timeout=%i\r\n"
-                "Connection: keep-alive\r\n"
-                "Content-Length: %Zu\r\n\r\n",
-                request_auth_response_template, server_nonce,
-                KEEP_ALIVE_TIMEOUT, strlen(auth_failed_html_template));
-        ret = write(p->sock, buffer, strlen(buffer));
-        ret = write(p->sock, auth_failed_html_template, strlen(auth_failed_html_template));
-    }
-
-    // OK - Access
-
-    /* Set socket to non blocking */
-    if (fcntl(p->sock, F_SETFL, p->sock_flags) < 0) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: fcntl");
-        goto Error;
-    }
+    value = strstr(auth, name);
+    if (!value)
+        return NULL;
 
-    if(server_user)
-        free(server_user);
+    value += strlen(name);
+    h = strstr(value + 1, "\"");
+    if (!h)
+        return NULL;
 
-    if(server_pass)
-        free(server_pass);
-
-    /* Lock the mutex */
-    pthread_mutex_lock(&stream_auth_mutex);
-
-    stream_add_client(&p->cnt->stream, p->sock);
-    p->cnt->stream_count++;
-
-    p->thread_count--;
-    /* Unlock the mutex */
-    pthread_mutex_unlock(&stream_auth_mutex);
+    *len = h - value;
+    return value;
+}
 
-    free(p);
-    pthread_exit(NULL);
+/**
+ * stream_auth_digest
+ *      Checks the Digest response of a request against the nonce the client
+ *      was challenged with and H(A1) computed at start up.
+ *
+ * Returns: 1 if the client may stream, 0 if not.
+ */
+static int stream_auth_digest(HASHHEX ha1, char *nonce, char *uri, const char *request)
+{
+    char auth[STREAM_REQUEST_SIZE];
+    char *username, *realm, *client_uri, *client_nonce, *response;
+    int username_len, realm_len, uri_len, nonce_len, response_len;
+    HASHHEX HA2 = "";
+    HASHHEX server_response;
 
-InternalError:
-    if(server_user)
-        free(server_user);
+    if (!stream_auth_header(request, "Authorization: Digest", auth))
+        return 0;
 
-    if(server_pass)
-        free(server_pass);
+    username = digest_param(auth, "username=\"", &username_len);
+    realm = digest_param(auth, "realm=\"", &realm_len);
+    client_uri = digest_param(auth, "uri=\"", &uri_len);
+    client_nonce = digest_param(auth, "nonce=\"", &nonce_len);
+    response = digest_param(auth, "response=\"", &response_len);
 
-    ret = write(p->sock, internal_error_template, strlen(internal_error_template));
+    if (!username || !realm || !client_uri || !client_nonce || !response)
+        return 0;
 
-Invalid_Request:
-    close(p->sock);
+    response[response_len] = '\0';
 
-    pthread_mutex_lock(&stream_auth_mutex);
-    p->thread_count--;
-    pthread_mutex_unlock(&stream_auth_mutex);
+    DigestCalcResponse(ha1, nonce, NULL, NULL, (char*)"", (char*)"GET", uri, HA2, server_response);
 
-    free(p);
-    pthread_exit(NULL);
+    return strcmp(server_response, response) == 0;
 }
 
 /**
- * do_client_auth
- *
+ * stream_auth_init
+ *      Computes what the clients' credentials are checked against once, so
+ *      that checking a request needs no more than comparing or one digest.
  *
+ * Returns: 0 on success, -1 if the credentials are unusable.
  */
-static void do_client_auth(struct context *cnt, int sc)
+static int stream_auth_init(struct stream_publisher *publisher, const char *authentication, int method)
 {
-    pthread_t thread_id;
-    pthread_attr_t attr;
-    auth_handler handle_func;
-    struct auth_param* handle_param = NULL;
-    int flags;
-    static int first_call = 0;
-    static int thread_count = 0;
-
-    if(first_call == 0) {
-        first_call = 1;
-        /* Initialize the mutex */
-        pthread_mutex_init(&stream_auth_mutex, NULL);
-    }
+    char *userpass, *h;
+    size_t auth_size;
 
-    switch(cnt->conf.stream_auth_method)
-    {
-    case 1: // Basic
-      handle_func = handle_basic_auth;
-      break;
-    case 2: // MD5 Digest
-      handle_func = handle_md5_digest;
-      break;
-    default:
-      MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error unknown stream authentication method");
-      goto Error;
-      break;
-    }
+    publisher->auth_method = method;
 
-    handle_param = mymalloc(sizeof(struct auth_param));
-    handle_param->cnt = cnt;
-    handle_param->sock = sc;
-    handle_param->conf = &cnt->conf;
-    handle_param->thread_count = &thread_count;
+    if (method == 1) {
+        if (!authentication)
+            return 0;
 
-    /* Set socket to blocking */
-    if ((flags = fcntl(sc, F_GETFL, 0)) < 0) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: fcntl");
-        goto Error;
+        auth_size = strlen(authentication);
+        publisher->auth_basic = mymalloc(BASE64_LENGTH(auth_size) + 1);
+        userpass = mymalloc(auth_size + 4);
+        /* base64_encode can read 3 bytes after the end of the string, initialize it. */
+        memset(userpass, 0, auth_size + 4);
+        strcpy(userpass, authentication);
+        base64_encode(userpass, publisher->auth_basic, auth_size);
+        free(userpass);
+        return 0;
     }
-    handle_param->sock_flags = flags;
 
-    if (fcntl(sc, F_SETFL, flags & (~O_NONBLOCK)) < 0) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: fcntl");
-        goto Error;
-    }
+    if (method == 2) {
+        if (!authentication) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, "%s: Error no authentication data");
+            return -1;
+        }
 
-    if (thread_count >= DEF_MAXSTREAMS)
-        goto Error;
+        h = strstr(authentication, ":");
 
-    if (pthread_attr_init(&attr)) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error pthread_attr_init");
-        goto Error;
-    }
+        if (!h) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, "%s: Error no authentication data (no ':' found)");
+            return -1;
+        }
 
-    if (pthread_create(&thread_id, &attr, handle_func, handle_param)) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error pthread_create");
-        goto Error;
+        userpass = mystrdup(authentication);
+        userpass[h - authentication] = '\0';
+        DigestCalcHA1((char*)"md5", userpass, (char*)STREAM_REALM, userpass + (h - authentication) + 1,
+                      NULL, NULL, publisher->auth_ha1);
+        free(userpass);
+        return 0;
     }
-    pthread_detach(thread_id);
-
-    if (pthread_attr_destroy(&attr))
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error pthread_attr_destroy");
 
-    return;
-
-Error:
-    close(sc);
-    if(handle_param)
-        free(handle_param);
+    MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, "%s: Error unknown stream authentication method");
+    return -1;
 }
 
 /**
@@ -809,241 +596,1570 @@ static int http_acceptsock(int sl)
         return sc;
     }
 
-    MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream accept()");
+    /* The stream thread accepts from a non blocking socket until none are left */
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream accept()");
 
     return -1;
 }
 
 
 /**
- * stream_flush
- *      Sends any outstanding data to all connected clients.
- *      It continuously goes through the client list until no data is able
- *      to be sent (either because there isn't any, or because the clients
- *      are not able to accept it).
- */
-static void stream_flush(struct stream *list, int *stream_count, int lim)
-{
-    int written;            /* The number of bytes actually written. */
-    struct stream *client;  /* Pointer to the client being served. */
-    int workdone = 0;       /* Flag set any time data is successfully
-                               written. */
-
-    client = list->next;
-
-    while (client) {
-
-        /* If data waiting for client, try to send it. */
-        if (client->tmpbuffer) {
-
-            /*
-             * We expect that list->filepos < list->tmpbuffer->size
-             * should always be true.  The check is more for safety,
-             * in case of trouble is some other part of the code.
-             * Note that if it is false, the following section will
-             * clean up.
-             */
-            if (client->filepos < client->tmpbuffer->size) {
-
-                /*
-                 * Here we are finally ready to write out the
-                 * data.  Remember that (because the socket
-                 * has been set non-blocking) we may only
-                 * write out part of the buffer.  The var
-                 * 'filepos' contains how much of the buffer
-                 * has already been written.
-                 */
-                written = write(client->socket,
-                          client->tmpbuffer->ptr + client->filepos,
-                          client->tmpbuffer->size - client->filepos);
-
-                /*
-                 * If any data has been written, update the
-                 * data pointer and set the workdone flag.
-                 */
-                if (written > 0) {
-                    client->filepos += written;
-                    workdone = 1;
-                }
-            } else
-                written = 0;
-
-            /*
-             * If we have written the entire buffer to the socket,
-             * or if there was some error (other than EAGAIN, which
-             * means the system couldn't take it), this request is
-             * finished.
-             */
-            if ((client->filepos >= client->tmpbuffer->size) ||
-                (written < 0 && errno != EAGAIN)) {
-                /* If no other clients need this buffer, free it. */
-                if (--client->tmpbuffer->ref <= 0) {
-                    free(client->tmpbuffer->ptr);
-                    free(client->tmpbuffer);
-                }
-
-                /* Mark this client's buffer as empty. */
-                client->tmpbuffer = NULL;
-                client->nr++;
-            }
-
-            /*
-             * If the client is no longer connected, or the total
-             * number of frames already sent to this client is
-             * greater than our configuration limit, disconnect
-             * the client and free the stream struct.
-             */
-            if ((written < 0 && errno != EAGAIN) ||
-                (lim && !client->tmpbuffer && client->nr > lim)) {
-                void *tmp;
-
-                close(client->socket);
-
-                if (client->next)
-                    client->next->prev = client->prev;
-
-                client->prev->next = client->next;
-                tmp = client;
-                client = client->prev;
-                free(tmp);
-                (*stream_count)--;
-            }
-        }   /* End if (client->tmpbuffer) */
-
-        /*
-         * Step the the next client in the list.  If we get to the
-         * end of the list, check if anything was written during
-         * that loop; (if so) reset the 'workdone' flag and go back
-         * to the beginning.
-         */
-        client = client->next;
-
-        if (!client && workdone) {
-            client = list->next;
-            workdone = 0;
-        }
-    }   /* End while (client) */
-}
-
-/**
- * stream_tmpbuffer
- *      Routine to create a new "tmpbuffer", which is a common
- *      object used by all clients connected to a single camera.
+ * stream_time_us
  *
- * Returns: new allocated stream_buffer.
+ * Returns: monotonic time in microseconds, used for client pacing.
  */
-static struct stream_buffer *stream_tmpbuffer(int size)
+static unsigned long int stream_time_us(void)
 {
-    struct stream_buffer *tmpbuffer = mymalloc(sizeof(struct stream_buffer));
-    tmpbuffer->ref = 0;
-    tmpbuffer->ptr = mymalloc(size);
+    struct timespec now;
 
-    return tmpbuffer;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
 }
 
 /**
- * stream_add_client
- *
+ * stream_pool_get
+ *      Takes a frame buffer with room for a payload of size bytes from the
+ *      pool, allocating one if none is free. The caller owns the one
+ *      reference the buffer starts with.
  *
+ * Returns: the stream_buffer.
  */
-static void stream_add_client(struct stream *list, int sc)
+static struct stream_buffer *stream_pool_get(struct stream_pool *pool, long size)
 {
-    struct stream *new = mymalloc(sizeof(struct stream));
-    static const char header[] = "HTTP/1.0 200 OK\r\n"
-                                 "Server: Motion/"VERSION"\r\n"
-                                 "Connection: close\r\n"
-                                 "Max-Age: 0\r\n"
-                                 "Expires: 0\r\n"
-                                 "Cache-Control: no-cache, private\r\n"
-                                 "Pragma: no-cache\r\n"
-                                 "Content-Type: multipart/x-mixed-replace; "
-                                 "boundary=--BoundaryString\r\n\r\n";
+    struct stream_buffer *tmpbuffer = NULL;
+    int class = 0;
 
+    while (class < STREAM_POOL_CLASSES && (1L << (STREAM_POOL_MIN_SHIFT + class)) < size)
+        class++;
+
+    if (class < STREAM_POOL_CLASSES) {
+        pthread_mutex_lock(&pool->lock);
+        if ((tmpbuffer = pool->free[class]) != NULL) {
+            pool->free[class] = tmpbuffer->next;
+            pool->free_count[class]--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (!tmpbuffer) {
+        tmpbuffer = mymalloc(sizeof(struct stream_buffer));
+        tmpbuffer->pool = class < STREAM_POOL_CLASSES ? pool : NULL;
+        tmpbuffer->pool_class = class;
+        tmpbuffer->ptr = mymalloc(class < STREAM_POOL_CLASSES ?
+                                  1L << (STREAM_POOL_MIN_SHIFT + class) : size);
+    }
+
+    tmpbuffer->ref = 1;
+    tmpbuffer->size = 0;
+    tmpbuffer->format = STREAM_FORMAT_JPEG;
+    tmpbuffer->head_size = 0;
+    tmpbuffer->tail = NULL;
+    tmpbuffer->tail_size = 0;
+    tmpbuffer->next = NULL;
+
+    return tmpbuffer;
+}
+
+/**
+ * stream_pool_free
+ *      Frees all buffers kept in the pool.
+ */
+static void stream_pool_free(struct stream_pool *pool)
+{
+    struct stream_buffer *tmpbuffer;
+    int class;
+
+    for (class = 0; class < STREAM_POOL_CLASSES; class++) {
+        while ((tmpbuffer = pool->free[class]) != NULL) {
+            pool->free[class] = tmpbuffer->next;
+            free(tmpbuffer->ptr);
+            free(tmpbuffer);
+        }
+        pool->free_count[class] = 0;
+    }
+}
+
+/**
+ * stream_buffer_release
+ *      Drops one reference to a buffer and returns it to its pool, or frees
+ *      it, with the last one. References are taken by the motion thread
+ *      publishing a frame and by the stream thread sending it, so they are
+ *      counted atomically.
+ */
+static void stream_buffer_release(struct stream_buffer *tmpbuffer)
+{
+    struct stream_pool *pool = tmpbuffer->pool;
+    int class = tmpbuffer->pool_class;
+
+    if (__sync_sub_and_fetch(&tmpbuffer->ref, 1) != 0)
+        return;
+
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->free_count[class] < STREAM_POOL_KEEP) {
+            tmpbuffer->next = pool->free[class];
+            pool->free[class] = tmpbuffer;
+            pool->free_count[class]++;
+            tmpbuffer = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    if (tmpbuffer) {
+        free(tmpbuffer->ptr);
+        free(tmpbuffer);
+    }
+}
+
+/**
+ * stream_buffer_length
+ *
+ * Returns: the number of bytes sent for the buffer, header and tail included.
+ */
+static long stream_buffer_length(const struct stream_buffer *tmpbuffer)
+{
+    return tmpbuffer->head_size + tmpbuffer->size + tmpbuffer->tail_size;
+}
+
+/**
+ * stream_client_end
+ *
+ * Returns: the offset in its buffer at which the client is done sending it.
+ *          Snapshots are sent the payload only, without the multipart tail.
+ */
+static long stream_client_end(const struct stream *client)
+{
+    if (client->snapshot)
+        return client->tmpbuffer->head_size + client->tmpbuffer->size;
+
+    return stream_buffer_length(client->tmpbuffer);
+}
+
+/**
+ * stream_buffer_iov
+ *      Describes what is left to send of a buffer from offset pos up to end
+ *      as up to three slices: part header, payload and tail. The payload is
+ *      never copied, all clients send it straight from the shared buffer.
+ *
+ * Returns: the number of slices filled in.
+ */
+static int stream_buffer_iov(struct stream_buffer *tmpbuffer, long pos, long end, struct iovec *iov)
+{
+    struct iovec slices[3];
+    int i, n = 0;
+
+    slices[0].iov_base = tmpbuffer->head;
+    slices[0].iov_len = tmpbuffer->head_size;
+    slices[1].iov_base = tmpbuffer->ptr;
+    slices[1].iov_len = tmpbuffer->size;
+    slices[2].iov_base = (void *)tmpbuffer->tail;
+    slices[2].iov_len = tmpbuffer->tail_size;
+
+    for (i = 0; i < 3 && end > 0; i++) {
+        if (pos >= (long)slices[i].iov_len) {
+            pos -= slices[i].iov_len;
+            end -= slices[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)slices[i].iov_base + pos;
+        iov[n].iov_len = (end < (long)slices[i].iov_len ? end : (long)slices[i].iov_len) - pos;
+        end -= slices[i].iov_len;
+        pos = 0;
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * stream_zerocopy_pin
+ *      Keeps a reference to a buffer sent with MSG_ZEROCOPY until the kernel
+ *      reports that send as completed. Each successful send with the flag
+ *      counts as one in the socket's notification sequence.
+ */
+static void stream_zerocopy_pin(struct stream *client, struct stream_buffer *tmpbuffer)
+{
+    int last = client->zc_pin_count - 1;
+
+    if (last >= 0 && client->zc_pins[last] == tmpbuffer) {
+        client->zc_pin_seq[last] = client->zc_seq++;
+        return;
+    }
+
+    __sync_add_and_fetch(&tmpbuffer->ref, 1);
+    client->zc_pins[last + 1] = tmpbuffer;
+    client->zc_pin_seq[last + 1] = client->zc_seq++;
+    client->zc_pin_count++;
+}
+
+/**
+ * stream_zerocopy_unpin
+ *      Releases the pinned buffers of all sends up to and including seq.
+ */
+static void stream_zerocopy_unpin(struct stream *client, unsigned int seq)
+{
+    int done = 0, i;
+
+    while (done < client->zc_pin_count && (int)(seq - client->zc_pin_seq[done]) >= 0)
+        stream_buffer_release(client->zc_pins[done++]);
+
+    for (i = done; i < client->zc_pin_count; i++) {
+        client->zc_pins[i - done] = client->zc_pins[i];
+        client->zc_pin_seq[i - done] = client->zc_pin_seq[i];
+    }
+    client->zc_pin_count -= done;
+}
+
+/**
+ * stream_zerocopy_complete
+ *      Reads the MSG_ZEROCOPY completion notifications of a client from the
+ *      socket error queue.
+ *
+ * Returns: 0, or -1 if the socket has a real error pending.
+ */
+static int stream_zerocopy_complete(struct stream *client)
+{
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    struct sock_extended_err *serr;
+    int error = 0;
+    socklen_t errlen = sizeof(error);
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(client->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno == 0 && serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                stream_zerocopy_unpin(client, serr->ee_data);
+        }
+    }
+
+    if (getsockopt(client->socket, SOL_SOCKET, SO_ERROR, &error, &errlen) < 0 || error)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * stream_set_add
+ *      Appends a client to a set, a client is in at most one set at a time.
+ */
+static void stream_set_add(struct stream_set *set, struct stream *client)
+{
+    client->set = set;
+    client->next = NULL;
+    client->prev = set->tail;
+
+    if (set->tail)
+        set->tail->next = client;
+    else
+        set->head = client;
+
+    set->tail = client;
+    set->count++;
+}
+
+/**
+ * stream_set_remove
+ *      Removes a client from the set it is in, if any.
+ */
+static void stream_set_remove(struct stream *client)
+{
+    struct stream_set *set = client->set;
+
+    if (!set)
+        return;
+
+    if (client->prev)
+        client->prev->next = client->next;
+    else
+        set->head = client->next;
+
+    if (client->next)
+        client->next->prev = client->prev;
+    else
+        set->tail = client->prev;
+
+    set->count--;
+    client->set = NULL;
+    client->prev = NULL;
+    client->next = NULL;
+}
+
+/**
+ * stream_listen
+ *      Starts or stops polling the listen socket. New connections are left
+ *      in the listen queue while the client limit is reached.
+ */
+static void stream_listen(struct stream_server *server, int on)
+{
+    struct epoll_event ev;
+
+    if (server->listening == on)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = on ? EPOLLIN : 0;
+    ev.data.ptr = &server->socket;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, server->socket, &ev) < 0)
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: epoll_ctl on motion-stream listen socket");
+    else
+        server->listening = on;
+}
+
+/**
+ * stream_close_client
+ *      Closes a client connection. The client slot is moved to the closed
+ *      set and only reused after stream_reap, as further events for it may
+ *      still be pending.
+ */
+static void stream_close_client(struct stream_server *server, struct stream *client)
+{
+    if (client->dropped)
+        MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO, "%s: motion-stream client %s left after %d frames,"
+                   " %d dropped as it fell behind", client->addr, client->nr, client->dropped);
+
+    if (client->tmpbuffer) {
+        stream_buffer_release(client->tmpbuffer);
+        client->tmpbuffer = NULL;
+    }
+
+    free(client->request);
+    client->request = NULL;
+
+    /*
+     * Notifications for sends still in flight are lost with the socket.
+     * The kernel holds its own reference to the pages, so all a recycled
+     * buffer can do is garble the last bytes sent to a leaving client.
+     */
+    while (client->zc_pin_count > 0)
+        stream_buffer_release(client->zc_pins[--client->zc_pin_count]);
+
+    /* Closing the socket also removes it from the epoll set */
+    close(client->socket);
+    client->socket = -1;
+
+    if (client->publisher) {
+        client->publisher->cnt->stream_count--;
+        client->publisher = NULL;
+    }
+
+    stream_set_remove(client);
+    stream_set_add(&server->closed, client);
+}
+
+/**
+ * stream_reap
+ *      Frees the slots of the clients closed while handling the last batch
+ *      of events.
+ */
+static void stream_reap(struct stream_server *server)
+{
+    struct stream *client;
+
+    while ((client = server->closed.head) != NULL) {
+        stream_set_remove(client);
+        stream_set_add(&server->unused, client);
+    }
+
+    if (server->unused.head)
+        stream_listen(server, 1);
+}
+
+/**
+ * stream_write_client
+ *      Sends as much of the client's pending buffer as the socket accepts.
+ *      The sockets are polled edge triggered, so we write until the socket
+ *      would block or the buffer is done. Once done the client waits in the
+ *      ready set if it is due for a new frame already or, if the number of
+ *      frames sent is greater than our configuration limit, is disconnected.
+ */
+static void stream_write_client(struct stream_server *server, struct stream *client)
+{
+    struct stream_publisher *publisher = client->publisher;
+    struct iovec iov[3];
+    struct msghdr msg;
+    ssize_t written;
+    int flags;
+
+    while (client->tmpbuffer) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = stream_buffer_iov(client->tmpbuffer, client->filepos,
+                                           stream_client_end(client), iov);
+
+        flags = MSG_NOSIGNAL;
+#ifdef MSG_ZEROCOPY
+        if (client->zerocopy && client->tmpbuffer->size >= STREAM_ZEROCOPY_MIN &&
+            client->zc_pin_count < STREAM_ZEROCOPY_PINS)
+            flags |= MSG_ZEROCOPY;
+#endif
+
+        written = sendmsg(client->socket, &msg, flags);
+
+#ifdef MSG_ZEROCOPY
+        if (written < 0 && errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+            /* Out of socket option memory for pinning pages, copy instead */
+            written = sendmsg(client->socket, &msg, MSG_NOSIGNAL);
+            flags = MSG_NOSIGNAL;
+        }
+#endif
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* EAGAIN: we get an EPOLLOUT event once there is room again */
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                stream_close_client(server, client);
+            return;
+        }
+
+#ifdef MSG_ZEROCOPY
+        if (flags & MSG_ZEROCOPY)
+            stream_zerocopy_pin(client, client->tmpbuffer);
+#endif
+
+        client->filepos += written;
+
+        if (client->filepos >= stream_client_end(client)) {
+            stream_buffer_release(client->tmpbuffer);
+            client->tmpbuffer = NULL;
+            client->nr++;
+
+            if (client->snapshot)
+                stream_close_client(server, client);
+            else if (publisher->cnt->conf.stream_limit && client->nr > publisher->cnt->conf.stream_limit)
+                stream_close_client(server, client);
+            else if (client->due)
+                stream_set_add(&publisher->tiers[client->tier].ready, client);
+        }
+    }
+}
+
+/**
+ * stream_start_client
+ *      Starts sending an (authenticated) client the multipart header, after
+ *      which it is due for the first frame.
+ */
+static void stream_start_client(struct stream *client)
+{
+    static char header[] = "HTTP/1.0 200 OK\r\n"
+                           "Server: Motion/"VERSION"\r\n"
+                           "Connection: close\r\n"
+                           "Max-Age: 0\r\n"
+                           "Expires: 0\r\n"
+                           "Cache-Control: no-cache, private\r\n"
+                           "Pragma: no-cache\r\n"
+                           "Content-Type: multipart/x-mixed-replace; "
+                           "boundary=--BoundaryString\r\n\r\n";
+    /* Shared by all clients, the reference it starts with is never dropped */
+    static struct stream_buffer header_buffer = {
+        .ptr = (unsigned char *)header,
+        .ref = 1,
+        .size = sizeof(header) - 1,
+    };
+
+    client->tmpbuffer = &header_buffer;
+    client->filepos = 0;
+    __sync_add_and_fetch(&header_buffer.ref, 1);
+
+    /* The client is due for the first frame as soon as it has the header */
+    client->due = 1;
+}
+
+/**
+ * stream_send_response
+ *      Sends a short response, or response header, to a client nothing was
+ *      sent to yet. The socket buffer of a new connection takes it whole, so
+ *      a failed or partial send is not retried.
+ */
+static void stream_send_response(struct stream *client, const char *response)
+{
+    if (send(client->socket, response, strlen(response), MSG_NOSIGNAL) < 0)
+        MOTION_LOG(DBG, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream response to %s", client->addr);
+}
+
+/**
+ * stream_digest_challenge
+ *      Answers a request without valid Digest credentials with a new nonce.
+ *      The client is expected to retry on the same connection.
+ */
+static void stream_digest_challenge(struct stream_server *server, struct stream *client)
+{
+    char response[2048];
+    unsigned int rand1, rand2;
+    static const char *request_auth_response_template=
+        "HTTP/1.0 401 Authorization Required\r\n"
+        "Server: Motion/"VERSION"\r\n"
+        "Max-Age: 0\r\n"
+        "Expires: 0\r\n"
+        "Cache-Control: no-cache, private\r\n"
+        "Pragma: no-cache\r\n"
+        "WWW-Authenticate: Digest";
+    static const char *auth_failed_html_template=
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+        "<HTML><HEAD>\r\n"
+        "<TITLE>401 Authorization Required</TITLE>\r\n"
+        "</HEAD><BODY>\r\n"
+        "<H1>Authorization Required</H1>\r\n"
+        "This server could not verify that you are authorized to access the document "
+        "requested.  Either you supplied the wrong credentials (e.g., bad password), "
+        "or your browser doesn't understand how to supply the credentials required.\r\n"
+        "</BODY></HTML>\r\n";
+
+    rand1 = (unsigned int)(42000000.0 * rand_r(&server->nonce_seed) / (RAND_MAX + 1.0));
+    rand2 = (unsigned int)(42000000.0 * rand_r(&server->nonce_seed) / (RAND_MAX + 1.0));
+    snprintf(client->nonce, STREAM_NONCE_SIZE, "%08x%08x", rand1, rand2);
+
+    snprintf(response, sizeof(response), "%s realm=\""STREAM_REALM"\", nonce=\"%s\"\r\n"
+             "Content-Type: text/html\r\n"
+             "Keep-Alive: timeout=%i\r\n"
+             "Connection: keep-alive\r\n"
+             "Content-Length: %zu\r\n\r\n%s",
+             request_auth_response_template, client->nonce,
+             KEEP_ALIVE_TIMEOUT, strlen(auth_failed_html_template), auth_failed_html_template);
+    stream_send_response(client, response);
+
+    /* Wait for the next request, with a new timeout */
+    client->request_len = 0;
+    client->last = stream_time_us();
+    stream_set_remove(client);
+    stream_set_add(&server->requests, client);
+}
+
+/**
+ * stream_tier_interval
+ *
+ * Returns: the time in us between two frames of a tier.
+ */
+static unsigned long int stream_tier_interval(const struct stream_tier *tier)
+{
+    return 1000000L / (tier->maxrate > 0 ? tier->maxrate : 1);
+}
+
+/**
+ * stream_etag
+ *      Names a frame of a tier for the ETag and If-None-Match headers.
+ */
+static void stream_etag(struct stream_publisher *publisher, int t, unsigned long int frame_nr,
+                        char *etag)
+{
+    snprintf(etag, STREAM_ETAG_SIZE, "\"%lx-%d-%lu\"", (unsigned long)publisher->started,
+             t, frame_nr);
+}
+
+/**
+ * stream_etag_match
+ *
+ * Returns: whether the If-None-Match header of a request lists etag.
+ */
+static int stream_etag_match(const char *request, const char *etag)
+{
+    const char *match = strstr(request, "If-None-Match:");
+    const char *found;
+
+    if (!match)
+        return 0;
+
+    found = strstr(match, etag);
+
+    return found && found < match + strcspn(match, "\r\n");
+}
+
+/**
+ * stream_send_snapshot
+ *      Starts sending a snapshot client a frame of its tier as a plain image,
+ *      after which it is closed.
+ */
+static void stream_send_snapshot(struct stream_server *server, struct stream *client,
+                                 struct stream_buffer *frame, unsigned long int frame_nr)
+{
+    char header[512], etag[STREAM_ETAG_SIZE];
+
+    stream_etag(client->publisher, client->tier, frame_nr, etag);
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\n"
+             "Server: Motion/"VERSION"\r\n"
+             "Connection: close\r\n"
+             "Cache-Control: no-cache\r\n"
+             "ETag: %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %ld\r\n\r\n", etag, stream_format_types[frame->format],
+             frame->size);
+    stream_send_response(client, header);
+
+    /* The frame is sent without its multipart header */
+    client->tmpbuffer = frame;
+    client->filepos = frame->head_size;
+    client->frame_nr = frame_nr;
+    __sync_add_and_fetch(&frame->ref, 1);
+
+    stream_write_client(server, client);
+}
+
+/**
+ * stream_start_snapshot
+ *      Answers a snapshot request straight from the latest frame of the
+ *      client's tier while that frame is recent, with 304 Not Modified if
+ *      the client has it already. Otherwise the client waits for the next
+ *      frame, which is then encoded for it even if nobody streams the tier.
+ */
+static void stream_start_snapshot(struct stream_server *server, struct stream *client)
+{
+    struct stream_publisher *publisher = client->publisher;
+    struct stream_tier *tier = &publisher->tiers[client->tier];
+    struct stream_buffer *frame;
+    unsigned long int frame_nr, published;
+    char response[512], etag[STREAM_ETAG_SIZE];
+
+    client->snapshot = 1;
+
+    pthread_mutex_lock(&publisher->frame_lock);
+    frame = tier->frame;
+    frame_nr = tier->frame_nr;
+    published = tier->published;
+    if (frame)
+        __sync_add_and_fetch(&frame->ref, 1);
+    pthread_mutex_unlock(&publisher->frame_lock);
+
+    if (frame && stream_time_us() - published < stream_tier_interval(tier)) {
+        stream_etag(publisher, client->tier, frame_nr, etag);
+
+        if (stream_etag_match(client->request, etag)) {
+            snprintf(response, sizeof(response),
+                     "HTTP/1.0 304 Not Modified\r\n"
+                     "Server: Motion/"VERSION"\r\n"
+                     "Connection: close\r\n"
+                     "Cache-Control: no-cache\r\n"
+                     "ETag: %s\r\n\r\n", etag);
+            stream_send_response(client, response);
+            stream_close_client(server, client);
+        } else {
+            stream_send_snapshot(server, client, frame, frame_nr);
+        }
+
+        stream_buffer_release(frame);
+        return;
+    }
+
+    if (frame)
+        stream_buffer_release(frame);
+
+    /* Wait for a frame newer than the one published */
+    client->frame_nr = frame_nr;
+    stream_set_add(&tier->snapshots, client);
+}
+
+/**
+ * stream_snapshot_url
+ *
+ * Returns: whether the last part of the url path asks for a snapshot.
+ */
+static int stream_snapshot_url(const char *uri)
+{
+    size_t len = strcspn(uri, "?");
+
+    while (len > 0 && uri[len - 1] == '/')
+        len--;
+
+    return len >= 9 && strncmp(uri + len - 9, "/snapshot", 9) == 0;
+}
+
+/**
+ * stream_query_param
+ *      Finds the value of parameter name, given with the = appended, in the
+ *      query of a url.
+ *
+ * Returns: the value, NULL if the parameter is not given. len is set to the
+ *          length of the value.
+ */
+static const char *stream_query_param(const char *uri, const char *name, size_t *len)
+{
+    const char *query = strchr(uri, '?');
+    const char *h;
+
+    if (!query)
+        return NULL;
+
+    for (h = strstr(query, name); h; h = strstr(h + 1, name)) {
+        if (h[-1] == '?' || h[-1] == '&') {
+            h += strlen(name);
+            *len = strcspn(h, "&");
+            return h;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * stream_select_format
+ *      Picks the format of a client, WebP if offered and asked for by a
+ *      format=webp query parameter or, lacking a format parameter, by an
+ *      Accept header listing image/webp.
+ *
+ * Returns: the STREAM_FORMAT_* to send the client.
+ */
+static int stream_select_format(struct stream_publisher *publisher, const char *uri,
+                                const char *request)
+{
+    const char *format, *accept;
+    size_t len;
+
+    if (publisher->tier_count == publisher->format_tiers)
+        return STREAM_FORMAT_JPEG;
+
+    if ((format = stream_query_param(uri, "format=", &len)) != NULL)
+        return (len == 4 && strncmp(format, "webp", 4) == 0) ? STREAM_FORMAT_WEBP : STREAM_FORMAT_JPEG;
+
+    accept = strstr(request, "Accept:");
+    format = accept ? strstr(accept, "image/webp") : NULL;
+
+    if (format && format < accept + strcspn(accept, "\r\n"))
+        return STREAM_FORMAT_WEBP;
+
+    return STREAM_FORMAT_JPEG;
+}
+
+/**
+ * stream_select_tier
+ *      Finds the tier a client asked for by the last part of the url path or
+ *      by a tier=name query parameter, which takes precedence.
+ *
+ * Returns: the tier, the configured stream for any url not naming a tier.
+ */
+static int stream_select_tier(struct stream_publisher *publisher, const char *uri)
+{
+    const char *query = strchr(uri, '?');
+    const char *name;
+    size_t len;
+    int t;
+
+    name = stream_query_param(uri, "tier=", &len);
+
+    if (!name) {
+        len = query ? (size_t)(query - uri) : strlen(uri);
+
+        while (len > 0 && uri[len - 1] == '/')
+            len--;
+
+        for (name = uri + len; name > uri && name[-1] != '/'; name--);
+        len -= name - uri;
+    }
+
+    for (t = 0; t < publisher->format_tiers; t++) {
+        if (publisher->tiers[t].name[0] && strlen(publisher->tiers[t].name) == len &&
+            strncmp(publisher->tiers[t].name, name, len) == 0)
+            return t;
+    }
+
+    return STREAM_TIER_FULL;
+}
+
+/**
+ * stream_max_clients
+ *
+ * Returns: the number of clients camera cnt may have, DEF_MAXSTREAMS if
+ *          stream_max_clients sets no limit.
+ */
+static int stream_max_clients(struct context *cnt)
+{
+    return cnt->conf.stream_max_clients > 0 ? cnt->conf.stream_max_clients : DEF_MAXSTREAMS;
+}
+
+/**
+ * stream_route
+ *      Finds the camera a request is for. A server of its own serves one
+ *      camera at any url, the shared one serves /<thread number>/stream and
+ *      /<thread number>/snapshot.
+ *
+ * Returns: the camera, NULL if none serves the url. path is set to the
+ *          part of the url following the camera.
+ */
+static struct stream_publisher *stream_route(struct stream_server *server, const char *uri,
+                                             const char **path)
+{
+    struct stream_publisher *publisher;
+    char *end;
+    long threadnr;
+    int len;
+
+    if (!server->shared) {
+        *path = uri;
+        return server->publishers;
+    }
+
+    if (uri[0] != '/' || !isdigit((unsigned char)uri[1]))
+        return NULL;
+
+    threadnr = strtol(uri + 1, &end, 10);
+
+    if (strncmp(end, "/stream", 7) == 0)
+        len = 7;
+    else if (strncmp(end, "/snapshot", 9) == 0)
+        len = 9;
+    else
+        return NULL;
+
+    if (end[len] != '\0' && end[len] != '/' && end[len] != '?')
+        return NULL;
+
+    for (publisher = server->publishers; publisher; publisher = publisher->next) {
+        if (publisher->cnt->threadnr == threadnr) {
+            *path = end;
+            return publisher;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * stream_handle_request
+ *      Checks the complete request of a client and, unless it has to
+ *      authenticate first, starts streaming it the tier it asked for.
+ */
+static void stream_handle_request(struct stream_server *server, struct stream *client)
+{
+    struct stream_publisher *publisher;
+    char uri[512];
+    const char *response, *path;
+    int ok = 1, tier;
+    static const char *not_found_response_raw =
+        "HTTP/1.0 404 Not Found\r\n"
+        "Content-type: text/plain\r\n\r\n"
+        "Not Found\n";
+    static const char *unavailable_response_raw =
+        "HTTP/1.0 503 Service Unavailable\r\n"
+        "Content-type: text/plain\r\n\r\n"
+        "Too many clients\n";
+    static const char *basic_auth_response_template=
+        "HTTP/1.0 401 Authorization Required\r\n"
+        "Server: Motion/"VERSION"\r\n"
+        "Max-Age: 0\r\n"
+        "Expires: 0\r\n"
+        "Cache-Control: no-cache, private\r\n"
+        "Pragma: no-cache\r\n"
+        "WWW-Authenticate: Basic realm=\""STREAM_REALM"\"\r\n\r\n";
+    static const char *internal_error_template=
+        "HTTP/1.0 500 Internal Server Error\r\n"
+        "Server: Motion/"VERSION"\r\n"
+        "Content-Type: text/html\r\n"
+        "Connection: Close\r\n\r\n"
+        "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+        "<HTML><HEAD>\r\n"
+        "<TITLE>500 Internal Server Error</TITLE>\r\n"
+        "</HEAD><BODY>\r\n"
+        "<H1>500 Internal Server Error</H1>\r\n"
+        "</BODY></HTML>\r\n";
+
+    if ((response = http_parse_request(client->request, uri, sizeof(uri))) != NULL) {
+        stream_send_response(client, response);
+        stream_close_client(server, client);
+        return;
+    }
+
+    if ((publisher = stream_route(server, uri, &path)) == NULL) {
+        stream_send_response(client, not_found_response_raw);
+        stream_close_client(server, client);
+        return;
+    }
+
+    /* Picked from the request as the client sent it, before anything else reads it */
+    tier = stream_select_tier(publisher, path);
+
+    if (stream_select_format(publisher, path, client->request) == STREAM_FORMAT_WEBP)
+        tier += publisher->format_tiers;
+
+    if (publisher->auth_error) {
+        stream_send_response(client, internal_error_template);
+        stream_close_client(server, client);
+        return;
+    }
+
+    if (publisher->auth_method == 1)
+        ok = stream_auth_basic(publisher->auth_basic, client->request);
+    else if (publisher->auth_method == 2)
+        ok = stream_auth_digest(publisher->auth_ha1, client->nonce, uri, client->request);
+
+    if (!ok) {
+        if (publisher->auth_method == 2) {
+            stream_digest_challenge(server, client);
+        } else {
+            stream_send_response(client, basic_auth_response_template);
+            stream_close_client(server, client);
+        }
+        return;
+    }
+
+    /* A server of its own has a slot for each client the camera may have */
+    if (server->shared && publisher->cnt->stream_count >= stream_max_clients(publisher->cnt)) {
+        stream_send_response(client, unavailable_response_raw);
+        stream_close_client(server, client);
+        return;
+    }
+
+    // OK - Access
+    stream_set_remove(client);
+
+    client->publisher = publisher;
+    publisher->cnt->stream_count++;
+    client->tier = tier;
+
+    if (stream_snapshot_url(path)) {
+        stream_start_snapshot(server, client);
+    } else {
+        stream_start_client(client);
+        stream_write_client(server, client);
+    }
+
+    free(client->request);
+    client->request = NULL;
+    client->request_len = 0;
+}
+
+/**
+ * stream_read_request
+ *      Reads what a client sent of its request so far, and handles the
+ *      request once it is complete.
+ */
+static void stream_read_request(struct stream_server *server, struct stream *client)
+{
+    static const char *bad_request_response_raw =
+        "HTTP/1.0 400 Bad Request\r\n"
+        "Content-type: text/plain\r\n\r\n"
+        "Bad Request\n";
+    ssize_t readb;
+
+    /* Digest clients stay here after a challenge to send another request */
+    while (client->request) {
+        readb = read(client->socket, client->request + client->request_len,
+                     STREAM_REQUEST_SIZE - 1 - client->request_len);
+
+        if (readb < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream READ give up!");
+                stream_close_client(server, client);
+            }
+            return;
+        }
+
+        /* Connection closed before the request was complete */
+        if (readb == 0) {
+            stream_close_client(server, client);
+            return;
+        }
+
+        client->request_len += readb;
+        client->request[client->request_len] = '\0';
+
+        if (strstr(client->request, "\r\n\r\n")) {
+            stream_handle_request(server, client);
+        } else if (client->request_len >= STREAM_REQUEST_SIZE - 1) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, "%s: motion-stream End buffer reached"
+                       " waiting for buffer ending");
+            stream_send_response(client, bad_request_response_raw);
+            stream_close_client(server, client);
+        }
+    }
+}
+
+/**
+ * stream_expire_requests
+ *      Closes the clients that did not send a complete request in time.
+ *
+ * Returns: the time in us until the next request times out, -1 if none.
+ */
+static long stream_expire_requests(struct stream_server *server, unsigned long int now)
+{
+    struct stream *client;
+    static const long timeout = KEEP_ALIVE_TIMEOUT * 1000000L;
+    static const char *timeout_response_template_raw =
+        "HTTP/1.0 408 Request Timeout\r\n"
+        "Content-type: text/plain\r\n\r\n"
+        "Request Timeout\n";
+
+    while ((client = server->requests.head) != NULL && now - client->last >= (unsigned long int)timeout) {
+        stream_send_response(client, timeout_response_template_raw);
+        stream_close_client(server, client);
+    }
+
+    if (!client)
+        return -1;
+
+    return timeout - (now - client->last);
+}
+
+/**
+ * stream_add_client
+ *      Adds a connected client, which is sent the stream once it sent its
+ *      request.
+ */
+static void stream_add_client(struct stream_server *server, int sc)
+{
+    struct stream *new;
+    struct epoll_event ev;
+    struct sockaddr_storage sin;
+    socklen_t addrlen = sizeof(sin);
+
+    new = server->unused.head;
+    stream_set_remove(new);
     memset(new, 0, sizeof(struct stream));
     new->socket = sc;
 
-    if ((new->tmpbuffer = stream_tmpbuffer(sizeof(header))) == NULL) {
-        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error creating tmpbuffer in stream_add_client");
-    } else {
-        memcpy(new->tmpbuffer->ptr, header, sizeof(header)-1);
-        new->tmpbuffer->size = sizeof(header)-1;
+    if (getpeername(sc, (struct sockaddr *)&sin, &addrlen) < 0 ||
+        getnameinfo((struct sockaddr *)&sin, addrlen, new->addr, sizeof(new->addr),
+                    NULL, 0, NI_NUMERICHOST) != 0)
+        strcpy(new->addr, "unknown");
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = new;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, sc, &ev) < 0) {
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: epoll_ctl adding motion-stream client");
+        close(sc);
+        new->socket = -1;
+        stream_set_add(&server->unused, new);
+        return;
+    }
+
+#ifdef SO_ZEROCOPY
+    if (server->zerocopy) {
+        int one = 1;
+
+        if (setsockopt(sc, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0)
+            new->zerocopy = 1;
+        else
+            MOTION_LOG(WRN, TYPE_STREAM, SHOW_ERRNO, "%s: MSG_ZEROCOPY not supported, copying stream data");
+    }
+#endif
+
+    /* The request is read as it arrives, EPOLLIN is signalled for it */
+    new->request = mymalloc(STREAM_REQUEST_SIZE);
+    new->last = stream_time_us();
+    stream_set_add(&server->requests, new);
+}
+
+/**
+ * stream_accept
+ *      Accepts the connections waiting on the listen socket, as long as
+ *      there are free client slots.
+ */
+static void stream_accept(struct stream_server *server)
+{
+    int sc;
+
+    for (;;) {
+        if (!server->unused.head) {
+            stream_listen(server, 0);
+            return;
+        }
+
+        if ((sc = http_acceptsock(server->socket)) < 0)
+            return;
+
+        stream_add_client(server, sc);
     }
+}
 
-    new->prev = list;
-    new->next = list->next;
+/**
+ * stream_backlogged
+ *      Checks how much of what the client was sent is still queued in its
+ *      socket. More than the last frame sent means the client is at least
+ *      a whole frame behind and another frame would only queue up as well.
+ *
+ * Returns: 1 if the client is backlogged, 0 if not.
+ */
+static int stream_backlogged(struct stream *client)
+{
+    int queued;
 
-    if (new->next)
-        new->next->prev = new;
+    if (ioctl(client->socket, SIOCOUTQ, &queued) < 0)
+        return 0;
+
+    return queued > client->last_size;
+}
 
-    list->next = new;
+/**
+ * stream_move_tier
+ *      Moves a ready client to another tier, where it waits for the next
+ *      frame of that tier.
+ */
+static void stream_move_tier(struct stream_publisher *publisher, struct stream *client, int tier)
+{
+    stream_set_remove(client);
+    client->tier = tier;
+    client->frame_nr = 0;
+    client->lag_count = 0;
+    stream_set_add(&publisher->tiers[tier].ready, client);
 }
 
 /**
- * stream_add_write
+ * stream_deliver_tier
+ *      Paces the clients of a tier by its maxrate and hands the latest
+ *      frame of the tier to the ready ones.
+ *
+ *      A client sent a frame waits in the paced set, which is ordered by
+ *      send time, until it is due again. Due clients done sending wait in
+ *      the ready set for a frame newer than the one they got. So the work
+ *      done here is proportional to the clients due, not to all clients.
+ *
+ *      Clients always get the latest frame. A client still backlogged with
+ *      earlier frames skips frames until it catches up, and with
+ *      stream_lag_quality set, moves from the configured stream to the lag
+ *      tier after several in a row.
  *
+ * Returns: the time in us until the next client of the tier is due, -1 if none.
+ */
+static long stream_deliver_tier(struct stream_server *server, struct stream_publisher *publisher,
+                                int t, unsigned long int now)
+{
+    struct stream_tier *tier = &publisher->tiers[t];
+    struct stream_buffer *frame;
+    struct stream *client, *next;
+    unsigned long int frame_nr, interval;
+    int base = t % publisher->format_tiers;
+
+    interval = stream_tier_interval(tier);
+
+    while ((client = tier->paced.head) != NULL && now - client->last >= interval) {
+        stream_set_remove(client);
+        client->due = 1;
+
+        /* Clients still sending join the ready set once done */
+        if (!client->tmpbuffer)
+            stream_set_add(&tier->ready, client);
+    }
+
+    pthread_mutex_lock(&publisher->frame_lock);
+    frame = tier->frame;
+    frame_nr = tier->frame_nr;
+    if (frame)
+        __sync_add_and_fetch(&frame->ref, 1);
+    pthread_mutex_unlock(&publisher->frame_lock);
+
+    if (frame) {
+        for (client = tier->snapshots.head; client; client = next) {
+            next = client->next;
+
+            if (client->frame_nr != frame_nr) {
+                stream_set_remove(client);
+                stream_send_snapshot(server, client, frame, frame_nr);
+            }
+        }
+
+        for (client = tier->ready.head; client; client = next) {
+            next = client->next;
+
+            if (client->frame_nr == frame_nr)
+                continue;
+
+            if (stream_backlogged(client)) {
+                client->dropped++;
+                client->sent_count = 0;
+
+                if (++client->lag_count >= STREAM_LAG_DROPS && base == STREAM_TIER_FULL &&
+                    publisher->lag_tier > 0) {
+                    MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO, "%s: motion-stream client %s"
+                               " can not keep up, sending it the reduced stream", client->addr);
+                    stream_move_tier(publisher, client, t + publisher->lag_tier);
+                }
+                continue;
+            }
+
+            client->lag_count = 0;
+
+            if (base == publisher->lag_tier && ++client->sent_count > STREAM_LAG_RECOVER) {
+                MOTION_LOG(INF, TYPE_STREAM, NO_ERRNO, "%s: motion-stream client %s"
+                           " caught up, sending it the full stream", client->addr);
+                stream_move_tier(publisher, client, t - base);
+                continue;
+            }
+
+            stream_set_remove(client);
+            stream_set_add(&tier->paced, client);
+            client->due = 0;
+            client->last = now;
+            client->frame_nr = frame_nr;
+            client->last_size = stream_buffer_length(frame);
+            client->tmpbuffer = frame;
+            __sync_add_and_fetch(&frame->ref, 1);
+            client->filepos = 0;
+
+            stream_write_client(server, client);
+        }
+
+        stream_buffer_release(frame);
+    }
+
+    /* Tell the motion thread whether encoding the next frame is useful */
+    tier->wanted = tier->ready.count + tier->snapshots.count;
+
+    if (!tier->paced.head)
+        return -1;
+
+    return interval - (now - tier->paced.head->last);
+}
+
+/**
+ * stream_deliver
+ *      Hands out the latest frames of all tiers of all cameras served and
+ *      times out requests.
  *
+ * Returns: the epoll timeout in ms until the next client is due, -1 if none.
  */
-static void stream_add_write(struct stream *list, struct stream_buffer *tmpbuffer, unsigned int fps)
+static int stream_deliver(struct stream_server *server)
 {
-    struct timeval curtimeval;
-    unsigned long int curtime;
+    struct stream_publisher *publisher;
+    unsigned long int now = stream_time_us();
+    long wait, timeout;
+    int t;
 
-    gettimeofday(&curtimeval, NULL);
-    curtime = curtimeval.tv_usec + 1000000L * curtimeval.tv_sec;
+    timeout = stream_expire_requests(server, now);
 
-    while (list->next) {
-        list = list->next;
+    for (publisher = server->publishers; publisher; publisher = publisher->next) {
+        for (t = 0; t < publisher->tier_count; t++) {
+            wait = stream_deliver_tier(server, publisher, t, now);
 
-        if (list->tmpbuffer == NULL && ((curtime - list->last) >= 1000000L / fps)) {
-            list->last = curtime;
-            list->tmpbuffer = tmpbuffer;
-            tmpbuffer->ref++;
-            list->filepos = 0;
+            if (wait >= 0 && (timeout < 0 || wait < timeout))
+                timeout = wait;
         }
     }
 
-    if (tmpbuffer->ref <= 0) {
-        free(tmpbuffer->ptr);
-        free(tmpbuffer);
+    if (timeout < 0)
+        return -1;
+
+    return (timeout + 999) / 1000;
+}
+
+/**
+ * stream_loop
+ *      The stream thread. Accepts clients, sends them the frames published
+ *      by the motion threads and paces them, all driven by epoll so that
+ *      slow clients never hold up a motion loop.
+ */
+static void *stream_loop(void *arg)
+{
+    struct stream_server *server = arg;
+    struct epoll_event events[STREAM_EVENTS];
+    struct stream *client;
+    uint64_t wakeups;
+    int timeout = -1;
+    int i, n;
+
+    pthread_setspecific(tls_key_threadnr, (void *)((unsigned long)server->threadnr));
+
+    while (!server->finish) {
+        n = epoll_wait(server->epoll_fd, events, STREAM_EVENTS, timeout);
+
+        if (n < 0) {
+            if (errno != EINTR) {
+                MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream epoll_wait");
+                SLEEP(1, 0);
+            }
+            n = 0;
+        }
+
+        pthread_mutex_lock(&server->lock);
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == server) {
+                /* New frame published or stop requested */
+                if (read(server->wakeup_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN)
+                    MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream wakeup read");
+            } else if (events[i].data.ptr == &server->socket) {
+                stream_accept(server);
+            } else {
+                client = events[i].data.ptr;
+
+                if (client->socket == -1)
+                    continue;
+
+                /* Zerocopy completions are reported through the error queue */
+                if ((events[i].events & EPOLLERR) && stream_zerocopy_complete(client) < 0)
+                    stream_close_client(server, client);
+                else if (client->request)
+                    stream_read_request(server, client);
+                else if (events[i].events & (EPOLLHUP | EPOLLRDHUP))
+                    stream_close_client(server, client);
+                else if (events[i].events & EPOLLOUT)
+                    stream_write_client(server, client);
+            }
+        }
+
+        timeout = stream_deliver(server);
+        stream_reap(server);
+
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * stream_init_tiers
+ *      Sets up the configured stream, the tiers listed in stream_tiers as
+ *      name=WIDTHxHEIGHT[:quality[:maxrate]] separated by commas or spaces
+ *      and the lag tier, and with stream_webp on, their WebP twins.
+ */
+static void stream_init_tiers(struct context *cnt, struct stream_publisher *publisher)
+{
+    struct stream_tier *tier;
+    char *tiers = NULL, *entry, *saveptr = NULL;
+    int count = 2;
+
+    /* Room for the configured stream, the lag tier and at most one tier per separator */
+    if (cnt->conf.stream_tiers) {
+        tiers = mystrdup(cnt->conf.stream_tiers);
+        for (entry = tiers; *entry; entry++) {
+            if (*entry == ',' || *entry == ' ')
+                count++;
+        }
+        count++;
+    }
+
+    if (cnt->conf.stream_webp)
+        count *= STREAM_FORMATS;
+
+    publisher->tiers = mymalloc(count * sizeof(struct stream_tier));
+    publisher->tiers[STREAM_TIER_FULL].quality = cnt->conf.stream_quality;
+    publisher->tiers[STREAM_TIER_FULL].maxrate = cnt->conf.stream_maxrate;
+    publisher->tier_count = 1;
+
+    entry = tiers ? strtok_r(tiers, ", ", &saveptr) : NULL;
+
+    for (; entry; entry = strtok_r(NULL, ", ", &saveptr)) {
+        tier = &publisher->tiers[publisher->tier_count];
+        tier->quality = cnt->conf.stream_quality;
+        tier->maxrate = cnt->conf.stream_maxrate;
+
+        if (sscanf(entry, "%15[^=]=%dx%d:%d:%d", tier->name, &tier->width, &tier->height,
+                   &tier->quality, &tier->maxrate) < 3 ||
+            tier->width < 2 || tier->height < 2 || tier->quality < 1 || tier->quality > 100) {
+            MOTION_LOG(ERR, TYPE_STREAM, NO_ERRNO, "%s: Ignoring invalid stream tier %s", entry);
+            memset(tier, 0, sizeof(struct stream_tier));
+            continue;
+        }
+
+        MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Stream tier %s: %dx%d, quality %d, maxrate %d",
+                   tier->name, tier->width, tier->height, tier->quality, tier->maxrate);
+        publisher->tier_count++;
+    }
+
+    free(tiers);
+
+    publisher->lag_tier = -1;
+
+    if (cnt->conf.stream_lag_quality) {
+        tier = &publisher->tiers[publisher->tier_count];
+        tier->half = 1;
+        tier->quality = cnt->conf.stream_lag_quality;
+        tier->maxrate = cnt->conf.stream_maxrate;
+        publisher->lag_tier = publisher->tier_count++;
+    }
+
+    publisher->format_tiers = publisher->tier_count;
+
+    if (cnt->conf.stream_webp) {
+        for (count = 0; count < publisher->format_tiers; count++) {
+            tier = &publisher->tiers[publisher->tier_count++];
+            memcpy(tier, &publisher->tiers[count], sizeof(struct stream_tier));
+            tier->format = STREAM_FORMAT_WEBP;
+        }
     }
 }
 
+/**
+ * stream_server_free
+ *      Closes the listen socket and the polling descriptors of a server whose
+ *      thread is not running and frees it.
+ */
+static void stream_server_free(struct stream_server *server)
+{
+    if (server->socket >= 0)
+        close(server->socket);
+    if (server->epoll_fd >= 0)
+        close(server->epoll_fd);
+    if (server->wakeup_fd >= 0)
+        close(server->wakeup_fd);
+    pthread_mutex_destroy(&server->lock);
+    free(server->clients);
+    free(server);
+}
 
 /**
- * stream_check_write
- *      We walk through the chain of stream structs until we reach the end.
- *      Here we check if the tmpbuffer points to NULL.
- *      We return 1 if it finds a list->tmpbuffer which is a NULL pointer which would
- *      be the next client ready to be sent a new image. If not a 0 is returned.
+ * stream_server_start
+ *      Binds the listen socket of a stream server with room for max_clients
+ *      clients and starts its stream thread, logging as threadnr.
  *
- * Returns:
+ * Returns: the server, NULL on failure.
  */
-static int stream_check_write(struct stream *list)
+static struct stream_server *stream_server_start(int port, int localhost, int ipv6, int max_clients,
+                                                 int zerocopy, int threadnr)
 {
-    while (list->next) {
-        list = list->next;
+    struct stream_server *server;
+    struct epoll_event ev;
+    int i;
+
+    server = mymalloc(sizeof(struct stream_server));
+    pthread_mutex_init(&server->lock, NULL);
+    server->threadnr = threadnr;
+    server->zerocopy = zerocopy;
+    server->socket = http_bindsock(port, localhost, ipv6);
+    server->epoll_fd = -1;
+    server->wakeup_fd = -1;
+
+    server->max_clients = max_clients > 0 ? max_clients : DEF_MAXSTREAMS;
+    server->clients = mymalloc(server->max_clients * sizeof(struct stream));
+    for (i = 0; i < server->max_clients; i++) {
+        server->clients[i].socket = -1;
+        stream_set_add(&server->unused, &server->clients[i]);
+    }
 
-        if (list->tmpbuffer == NULL)
-            return 1;
+    server->nonce_seed = time(NULL) ^ threadnr;
+
+    if (server->socket == -1)
+        goto Error;
+
+    server->epoll_fd = epoll_create(STREAM_EVENTS);
+    server->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+
+    if (server->epoll_fd < 0 || server->wakeup_fd < 0) {
+        MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream epoll/eventfd setup failed");
+        goto Error;
     }
-    return 0;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = server;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wakeup_fd, &ev) < 0)
+        goto Error;
+
+    ev.data.ptr = &server->socket;
+
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->socket, &ev) < 0)
+        goto Error;
+
+    server->listening = 1;
+
+    if (fcntl(server->socket, F_SETFL, fcntl(server->socket, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: fcntl on motion-stream listen socket");
+        goto Error;
+    }
+
+    if (pthread_create(&server->thread, NULL, stream_loop, server)) {
+        MOTION_LOG(CRT, TYPE_STREAM, SHOW_ERRNO, "%s: Could not start motion-stream thread");
+        goto Error;
+    }
+
+    return server;
+
+Error:
+    stream_server_free(server);
+    return NULL;
+}
+
+/**
+ * stream_wakeup
+ *      Wakes up the stream thread.
+ */
+static void stream_wakeup(struct stream_server *server)
+{
+    uint64_t one = 1;
+
+    if (write(server->wakeup_fd, &one, sizeof(one)) < 0)
+        MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: motion-stream wakeup write");
 }
 
+/**
+ * stream_server_stop
+ *      Stops the stream thread of a server, closes its remaining clients
+ *      and frees it.
+ */
+static void stream_server_stop(struct stream_server *server)
+{
+    int i;
+
+    server->finish = 1;
+    stream_wakeup(server);
+    pthread_join(server->thread, NULL);
+
+    for (i = 0; i < server->max_clients; i++) {
+        if (server->clients[i].socket != -1)
+            stream_close_client(server, &server->clients[i]);
+    }
+
+    stream_server_free(server);
+}
 
 /**
  * stream_init
  *      This function is called from motion.c for each motion thread starting up.
- *      The function setup the incoming tcp socket that the clients connect to.
+ *      Unless all cameras share the stream thread started by stream_shared_start,
+ *      the function setup the incoming tcp socket that the clients connect to
+ *      and starts the stream thread serving them.
  *      The function returns an integer representing the socket.
  *
  * Returns: stream socket descriptor.
  */
 int stream_init(struct context *cnt)
 {
-    cnt->stream.socket = http_bindsock(cnt->conf.stream_port, cnt->conf.stream_localhost,
-                                       cnt->conf.ipv6_enabled);
+    struct stream_publisher *publisher;
+    struct stream_server *server = stream_shared;
+
     cnt->stream.next = NULL;
     cnt->stream.prev = NULL;
+    cnt->stream.socket = -1;
+    cnt->stream_count = 0;
+
+    if (!server) {
+        server = stream_server_start(cnt->conf.stream_port, cnt->conf.stream_localhost,
+                                     cnt->conf.ipv6_enabled, cnt->conf.stream_max_clients,
+                                     cnt->conf.stream_zerocopy, cnt->threadnr);
+        if (!server)
+            return -1;
+    }
+
+    publisher = mymalloc(sizeof(struct stream_publisher));
+    publisher->cnt = cnt;
+    publisher->server = server;
+    publisher->started = time(NULL);
+    pthread_mutex_init(&publisher->frame_lock, NULL);
+    pthread_mutex_init(&publisher->pool.lock, NULL);
+
+    stream_init_tiers(cnt, publisher);
+
+    if (cnt->conf.stream_auth_method &&
+        stream_auth_init(publisher, cnt->conf.stream_authentication, cnt->conf.stream_auth_method) < 0)
+        publisher->auth_error = 1;
+
+    pthread_mutex_lock(&server->lock);
+    publisher->next = server->publishers;
+    server->publishers = publisher;
+    pthread_mutex_unlock(&server->lock);
+
+    cnt->stream_publisher = publisher;
+    cnt->stream.socket = server->socket;
+
     return cnt->stream.socket;
 }
 
@@ -1054,86 +2170,186 @@ int stream_init(struct context *cnt)
  */
 void stream_stop(struct context *cnt)
 {
-    struct stream *list;
-    struct stream *next = cnt->stream.next;
+    struct stream_publisher *publisher = cnt->stream_publisher;
+    struct stream_publisher **link;
+    struct stream_server *server;
+    int i;
+
+    if (!publisher)
+        return;
+
+    server = publisher->server;
 
     MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Closing motion-stream listen socket"
                " & active motion-stream sockets");
 
-    close(cnt->stream.socket);
-    cnt->stream.socket = -1;
+    /* A camera of its own stops its thread, a shared one detaches from it */
+    if (server != stream_shared) {
+        stream_server_stop(server);
+    } else {
+        pthread_mutex_lock(&server->lock);
 
-    while (next) {
-        list = next;
-        next = list->next;
+        for (i = 0; i < server->max_clients; i++) {
+            if (server->clients[i].socket != -1 && server->clients[i].publisher == publisher)
+                stream_close_client(server, &server->clients[i]);
+        }
+        stream_reap(server);
 
-        if (list->tmpbuffer) {
-            free(list->tmpbuffer->ptr);
-            free(list->tmpbuffer);
+        for (link = &server->publishers; *link; link = &(*link)->next) {
+            if (*link == publisher) {
+                *link = publisher->next;
+                break;
+            }
         }
 
-        close(list->socket);
-        free(list);
+        pthread_mutex_unlock(&server->lock);
+    }
+
+    cnt->stream.socket = -1;
+    cnt->stream_count = 0;
+
+    for (i = 0; i < publisher->tier_count; i++) {
+        if (publisher->tiers[i].frame)
+            stream_buffer_release(publisher->tiers[i].frame);
+        free(publisher->tiers[i].scaled);
     }
+    free(publisher->tiers);
+    stream_pool_free(&publisher->pool);
+    pthread_mutex_destroy(&publisher->pool.lock);
+    pthread_mutex_destroy(&publisher->frame_lock);
+    free(publisher->auth_basic);
+    free(publisher);
+    cnt->stream_publisher = NULL;
 
     MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Closed motion-stream listen socket"
                " & active motion-stream sockets");
 }
 
-void stream_put_pre(struct context *cnt)
+/**
+ * stream_shared_start
+ *      Called from main before the motion threads are started when
+ *      stream_shared_port is set. Binds the port and starts the one stream
+ *      thread serving all cameras, at /<thread number>/stream.
+ *
+ * Returns: 0 on success, -1 if the port could not be set up.
+ */
+int stream_shared_start(struct context **cnt_list)
 {
-    struct timeval timeout;
-    fd_set fdread;
-    int sl = cnt->stream.socket;
-    int sc;
+    struct context **cnt = cnt_list;
+    int max_clients = 0;
 
-    /*
-     * Timeout struct used to timeout the time we wait for a client
-     * and we do not wait at all.
-     */
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    FD_ZERO(&fdread);
-    FD_SET(cnt->stream.socket, &fdread);
+    /* With several cameras, the first context only holds the common options */
+    if (cnt[1])
+        cnt++;
 
-    /*
-     * If we have not reached the max number of allowed clients per
-     * thread we will check to see if new clients are waiting to connect.
-     * If this is the case we add the client as a new stream struct and
-     * add this to the end of the chain of stream structs that are linked
-     * to each other.
-     */
-    if ((cnt->stream_count < DEF_MAXSTREAMS) &&
-        (select(sl + 1, &fdread, NULL, NULL, &timeout) > 0)) {
-        sc = http_acceptsock(sl);
-        if (cnt->conf.stream_auth_method == 0) {
-            stream_add_client(&cnt->stream, sc);
-            cnt->stream_count++;
-        } else  {
-            do_client_auth(cnt, sc);
-        }
-    }
+    for (; *cnt; cnt++)
+        max_clients += stream_max_clients(*cnt);
+
+    stream_shared = stream_server_start(cnt_list[0]->conf.stream_shared_port,
+                                        cnt_list[0]->conf.stream_localhost,
+                                        cnt_list[0]->conf.ipv6_enabled, max_clients,
+                                        cnt_list[0]->conf.stream_zerocopy, 0);
+    if (!stream_shared)
+        return -1;
+
+    stream_shared->shared = 1;
+
+    MOTION_LOG(NTC, TYPE_STREAM, NO_ERRNO, "%s: Serving the streams of all cameras on port %d",
+               cnt_list[0]->conf.stream_shared_port);
+
+    return 0;
+}
+
+/**
+ * stream_shared_stop
+ *      Called from main once all motion threads have finished, stops the
+ *      shared stream thread.
+ */
+void stream_shared_stop(void)
+{
+    if (!stream_shared)
+        return;
+
+    stream_server_stop(stream_shared);
+    stream_shared = NULL;
+}
+
+/**
+ * stream_publish
+ *      Makes tmpbuffer the latest frame of a tier, taking over the caller's
+ *      reference, and wakes up the stream thread to send it.
+ */
+static void stream_publish(struct stream_publisher *publisher, int t, struct stream_buffer *tmpbuffer)
+{
+    struct stream_tier *tier = &publisher->tiers[t];
+    struct stream_buffer *old;
+
+    pthread_mutex_lock(&publisher->frame_lock);
+    old = tier->frame;
+    tier->frame = tmpbuffer;
+    tier->frame_nr++;
+    tier->published = stream_time_us();
+    pthread_mutex_unlock(&publisher->frame_lock);
 
-    /* Lock the mutex */
-    if (cnt->conf.stream_auth_method != 0)
-        pthread_mutex_lock(&stream_auth_mutex);
+    if (old)
+        stream_buffer_release(old);
 
+    stream_wakeup(publisher->server);
+}
 
-    /* Call flush to send any previous partial-sends which are waiting. */
-    stream_flush(&cnt->stream, &cnt->stream_count, cnt->conf.stream_limit);
+/**
+ * stream_part_head
+ *      Writes the multipart header preceding an image of the buffer's format
+ *      and payload size and sets the CRLF closing the part.
+ */
+static void stream_part_head(struct stream_buffer *tmpbuffer)
+{
+    tmpbuffer->head_size = snprintf(tmpbuffer->head, sizeof(tmpbuffer->head),
+                                    "--BoundaryString\r\n"
+                                    "Content-type: %s\r\n"
+                                    "Content-Length: %9ld\r\n\r\n",
+                                    stream_format_types[tmpbuffer->format], tmpbuffer->size);
+    tmpbuffer->tail = stream_boundary_tail;
+    tmpbuffer->tail_size = sizeof(stream_boundary_tail) - 1;
 }
 
-void stream_put_post(struct context *cnt)
+/**
+ * stream_encode
+ *      Encodes an image in the given STREAM_FORMAT_* into a pooled buffer
+ *      with the part header set. Only YUV420P images are encoded as WebP,
+ *      others and images WebP fails on are sent as jpeg, with the EXIF data
+ *      description, tm and box.
+ *
+ * Returns: the buffer, holding one reference.
+ */
+static struct stream_buffer *stream_encode(struct context *cnt, unsigned char *image,
+                                           int width, int height, int size, int quality,
+                                           int format, const char *description,
+                                           struct tm *tm, struct coord *box)
 {
+    struct stream_buffer *tmpbuffer;
+
     /*
-     * Now we call flush again.  This time (assuming some clients were
-     * ready for the new frame) the new data will be written out.
+     * The image can not be larger than the raw one, and as the pool hands
+     * out recycled buffers, only the pages actually written by the encoder
+     * are ever touched.
      */
-    stream_flush(&cnt->stream, &cnt->stream_count, cnt->conf.stream_limit);
+    tmpbuffer = stream_pool_get(&cnt->stream_publisher->pool, size);
+
+    if (format == STREAM_FORMAT_WEBP && cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
+        tmpbuffer->size = put_webp_yuv420p_memory(tmpbuffer->ptr, size, image,
+                                                  width, height, quality);
+        if (tmpbuffer->size > 0)
+            tmpbuffer->format = STREAM_FORMAT_WEBP;
+    }
+
+    if (tmpbuffer->format == STREAM_FORMAT_JPEG)
+        tmpbuffer->size = put_picture_memory(cnt, tmpbuffer->ptr, size, image,
+                                             width, height, quality, description, tm, box);
 
-    /* Unlock the mutex */
-    if (cnt->conf.stream_auth_method != 0)
-        pthread_mutex_unlock(&stream_auth_mutex);
+    stream_part_head(tmpbuffer);
+
+    return tmpbuffer;
 }
 
 /*
@@ -1146,153 +2362,115 @@ void stream_put_post(struct context *cnt)
  *      per captured picture frame.
  *      It is always run in setup mode for each picture frame captured and with
  *      the special setup image.
- *      The function does two things:
- *          It looks for possible waiting new clients and adds them.
- *          It sends latest picture frame to all connected clients.
- *      Note: Clients that have disconnected are handled in the stream_flush()
- *          function.
+ *      For each tier with clients waiting for a new frame, the function scales
+ *      and encodes the picture once per format asked for and publishes it to
+ *      the stream thread, which sends it to the clients of the tier.
+ *      description, tm and box are the EXIF data of the picture, any may be
+ *      NULL. The subject area box is only kept on pictures of full size.
  */
-void stream_put(struct context *cnt, unsigned char *image, int width, int height, int size)
+void stream_put(struct context *cnt, unsigned char *image, int width, int height, int size,
+                const char *description, struct tm *tm, struct coord *box)
 {
-    struct stream_buffer *tmpbuffer;
-    const char jpeghead[] = "--BoundaryString\r\n"
-                            "Content-type: image/jpeg\r\n"
-                            "Content-Length:                ";
-    int headlength = sizeof(jpeghead) - 1;    /* Don't include terminator. */
-    char len[20];    /* Will be used for sprintf, must be >= 16 */
+    struct stream_publisher *publisher = cnt->stream_publisher;
+    struct stream_tier *tier;
+    unsigned char *tier_image;
+    int tier_width, tier_height, tier_size;
+    int t, f, wanted;
+
+    if (!publisher)
+        return;
+
+    for (t = 0; t < publisher->format_tiers; t++) {
+        tier = &publisher->tiers[t];
+
+        /* The image is scaled once for all formats of the tier */
+        wanted = 0;
+        for (f = t; f < publisher->tier_count; f += publisher->format_tiers)
+            wanted |= publisher->tiers[f].wanted;
+
+        if (!wanted)
+            continue;
+
+        tier_image = image;
+        tier_width = width;
+        tier_height = height;
+        tier_size = size;
+
+        /* Only YUV420P images are scaled, the tiers get others as they are */
+        if (cnt->imgs.type == VIDEO_PALETTE_YUV420P) {
+            if (tier->half) {
+                tier_width = width / 2;
+                tier_height = height / 2;
+            } else if (tier->width) {
+                /* Fit in the size of the tier by one factor, keeping the aspect ratio */
+                if ((long long)tier->width * height <= (long long)tier->height * width) {
+                    tier_width = tier->width < width ? tier->width : width;
+                    tier_height = (long long)height * tier_width / width;
+                } else {
+                    tier_height = tier->height < height ? tier->height : height;
+                    tier_width = (long long)width * tier_height / height;
+                }
+            }
 
-    stream_put_pre(cnt);
+            /* Keep the sizes even for the 4:2:0 chroma planes */
+            tier_width = tier_width > 2 ? tier_width & ~1 : 2;
+            tier_height = tier_height > 2 ? tier_height & ~1 : 2;
+        }
 
-    /* Check if any clients have available buffers. */
-    if (stream_check_write(&cnt->stream)) {
-        /*
-         * Yes - create a new tmpbuffer for current image.
-         * Note that this should create a buffer which is *much* larger
-         * than necessary, but it is difficult to estimate the
-         * minimum size actually required.
-         */
-        tmpbuffer = stream_tmpbuffer(size);
-
-        /* Check if allocation was ok. */
-        if (tmpbuffer) {
-            int imgsize;
-
-            /*
-             * We need a pointer that points to the picture buffer
-             * just after the mjpeg header. We create a working pointer wptr
-             * to be used in the call to put_picture_memory which we can change
-             * and leave tmpbuffer->ptr intact.
-             */
-            unsigned char *wptr = tmpbuffer->ptr;
-
-            /*
-             * For web protocol, our image needs to be preceded
-             * with a little HTTP, so we put that into the buffer
-             * first.
-             */
-            memcpy(wptr, jpeghead, headlength);
-
-            /* Update our working pointer to point past header. */
-            wptr += headlength;
-
-            /* Create a jpeg image and place into tmpbuffer. */
-            tmpbuffer->size = put_picture_memory(cnt, wptr, size, image,
-                                                 width, height, cnt->conf.stream_quality);
-
-            /* Fill in the image length into the header. */
-            imgsize = sprintf(len, "%9ld\r\n\r\n", tmpbuffer->size);
-            memcpy(wptr - imgsize, len, imgsize);
-
-            /* Append a CRLF for good measure. */
-            memcpy(wptr + tmpbuffer->size, "\r\n", 2);
-
-            /*
-             * Now adjust tmpbuffer->size to reflect the
-             * header at the beginning and the extra CRLF
-             * at the end.
-             */
-            tmpbuffer->size += headlength + 2;
-
-            /*
-             * And finally put this buffer to all clients with
-             * no outstanding data from previous frames.
-             */
-            stream_add_write(&cnt->stream, tmpbuffer, cnt->conf.stream_maxrate);
-        } else {
-            MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error creating tmpbuffer");
+        if (tier_width != width || tier_height != height) {
+            tier_size = tier_width * tier_height * 3 / 2;
+
+            /* The jpeg encoder reads whole 16 line blocks, allow for that past the end */
+            if (tier->scaled_size < tier_size + tier_width * 16) {
+                tier->scaled_size = tier_size + tier_width * 16;
+                tier->scaled = myrealloc(tier->scaled, tier->scaled_size, "stream_put");
+            }
+
+            yuv420p_scale(image, width, height, tier->scaled, tier_width, tier_height,
+                          SCALE_FILTER_BOX);
+            tier_image = tier->scaled;
         }
-    }
 
-    stream_put_post(cnt);
+        for (f = t; f < publisher->tier_count; f += publisher->format_tiers) {
+            if (publisher->tiers[f].wanted)
+                stream_publish(publisher, f, stream_encode(cnt, tier_image, tier_width, tier_height,
+                                                           tier_size, publisher->tiers[f].quality,
+                                                           publisher->tiers[f].format, description, tm,
+                                                           tier_width == cnt->imgs.width &&
+                                                           tier_height == cnt->imgs.height ? box : NULL));
+        }
+    }
 }
 
-void stream_put_encoded(struct context *cnt, unsigned char *jpeg_image, int width, int height, int size)
+void stream_put_encoded(struct context *cnt, unsigned char *jpeg_image, int width ATTRIBUTE_UNUSED,
+                        int height ATTRIBUTE_UNUSED, int size)
 {
-    struct stream_buffer *tmpbuffer;
-    const char jpeghead[] = "--BoundaryString\r\n"
-                            "Content-type: image/jpeg\r\n"
-                            "Content-Length:                ";
-    int headlength = sizeof(jpeghead) - 1;    /* Don't include terminator. */
-    char len[20];    /* Will be used for sprintf, must be >= 16 */
+    struct stream_publisher *publisher = cnt->stream_publisher;
+    struct stream_buffer *tmpbuffer = NULL;
+    int t;
 
-    stream_put_pre(cnt);
+    if (!publisher)
+        return;
 
-    /* Check if any clients have available buffers. */
-    if (stream_check_write(&cnt->stream)) {
-        /*
-         * Yes - create a new tmpbuffer for current image.
-         */
-        tmpbuffer = stream_tmpbuffer(size + headlength + 2);
-
-        /* Check if allocation was ok. */
-        if (tmpbuffer) {
-            int imgsize;
-
-            /*
-             * We need a pointer that points to the picture buffer
-             * just after the mjpeg header. We create a working pointer wptr
-             * to be used in the call to put_picture_memory which we can change
-             * and leave tmpbuffer->ptr intact.
-             */
-            unsigned char *wptr = tmpbuffer->ptr;
-
-            /*
-             * For web protocol, our image needs to be preceded
-             * with a little HTTP, so we put that into the buffer
-             * first.
-             */
-            memcpy(wptr, jpeghead, headlength);
-
-            /* Update our working pointer to point past header. */
-            wptr += headlength;
-
-            /* Create a jpeg image and place into tmpbuffer. */
-            memcpy(wptr, jpeg_image, size);
-            tmpbuffer->size = size;
+    /*
+     * The jpeg lives in the image ring and is overwritten when the ring
+     * wraps, so it is copied once into a pooled buffer the clients share.
+     * There is no raw image to encode other sizes from, so all tiers get
+     * the same jpeg and lagging clients only skip frames.
+     */
+    for (t = 0; t < publisher->tier_count; t++) {
+        if (!publisher->tiers[t].wanted)
+            continue;
 
-            /* Fill in the image length into the header. */
-            imgsize = sprintf(len, "%9ld\r\n\r\n", tmpbuffer->size);
-            memcpy(wptr - imgsize, len, imgsize);
-
-            /* Append a CRLF for good measure. */
-            memcpy(wptr + tmpbuffer->size, "\r\n", 2);
-
-            /*
-             * Now adjust tmpbuffer->size to reflect the
-             * header at the beginning and the extra CRLF
-             * at the end.
-             */
-            tmpbuffer->size += headlength + 2;
-
-            /*
-             * And finally put this buffer to all clients with
-             * no outstanding data from previous frames.
-             */
-            stream_add_write(&cnt->stream, tmpbuffer, cnt->conf.stream_maxrate);
+        if (!tmpbuffer) {
+            tmpbuffer = stream_pool_get(&publisher->pool, size);
+            memcpy(tmpbuffer->ptr, jpeg_image, size);
+            tmpbuffer->size = size;
+            stream_part_head(tmpbuffer);
         } else {
-            MOTION_LOG(ERR, TYPE_STREAM, SHOW_ERRNO, "%s: Error creating tmpbuffer");
+            __sync_add_and_fetch(&tmpbuffer->ref, 1);
         }
-    }
 
-    stream_put_post(cnt);
+        stream_publish(publisher, t, tmpbuffer);
+    }
 }
@@ -21,10 +21,37 @@
 #ifndef _INCLUDE_STREAM_H_
 #define _INCLUDE_STREAM_H_
 
+#define STREAM_HEAD_SIZE        96  /* Room for a multipart part header */
+#define STREAM_ZEROCOPY_PINS    8   /* Zerocopy sends in flight per client */
+#define STREAM_ADDR_SIZE        46  /* Room for a numeric IPv6 address */
+#define STREAM_NONCE_SIZE       17  /* Digest authentication nonce */
+
+#define STREAM_FORMAT_JPEG      0
+#define STREAM_FORMAT_WEBP      1
+#define STREAM_FORMATS          2
+
+struct context;
+struct coord;
+struct stream_publisher;
+struct stream_pool;
+struct stream_set;
+
+/*
+ * A frame as sent to the clients: part header, payload and tail, sent
+ * together with sendmsg. The payload is not changed once published.
+ */
 struct stream_buffer {
     unsigned char *ptr;
     int ref;
-    long size;
+    long size;                      /* Payload size */
+    int format;                     /* STREAM_FORMAT_* of the payload */
+    char head[STREAM_HEAD_SIZE];
+    int head_size;
+    const char *tail;
+    int tail_size;
+    struct stream_pool *pool;       /* Pool the buffer returns to, NULL if none */
+    int pool_class;
+    struct stream_buffer *next;     /* Free list link while in the pool */
 };
 
 struct stream {
@@ -33,14 +60,36 @@ struct stream {
     struct stream_buffer *tmpbuffer;
     long filepos;
     int nr;
-    unsigned long int last;
+    unsigned long int last;         /* Monotonic us the last frame was sent or request started */
+    unsigned long int frame_nr;     /* Number of the last frame sent */
+    int due;                        /* Paced interval passed, may get a new frame */
+    int tier;                       /* Stream tier the client is sent */
+    long last_size;                 /* Bytes sent for the last frame */
+    int dropped;                    /* Frames skipped while backlogged */
+    int lag_count;                  /* Frames skipped in a row */
+    int sent_count;                 /* Frames sent in a row on the lag tier */
+    char addr[STREAM_ADDR_SIZE];    /* Peer address, for logging */
+    char *request;                  /* Request read so far, NULL once streaming */
+    int request_len;
+    char nonce[STREAM_NONCE_SIZE];  /* Digest nonce the client was challenged with */
+    struct stream_publisher *publisher; /* Camera streamed, NULL while reading the request */
+    int snapshot;                   /* Sent one frame as a plain image, then closed */
+    int zerocopy;                   /* Socket sends large payloads with MSG_ZEROCOPY */
+    unsigned int zc_seq;            /* Sequence number of the next zerocopy send */
+    struct stream_buffer *zc_pins[STREAM_ZEROCOPY_PINS];
+    unsigned int zc_pin_seq[STREAM_ZEROCOPY_PINS];
+    int zc_pin_count;
+    struct stream_set *set;         /* Set of clients this one is in */
     struct stream *prev;
     struct stream *next;
 };
 
 int stream_init(struct context *);
-void stream_put(struct context *, unsigned char *, int, int, int);
+void stream_put(struct context *, unsigned char *, int, int, int, const char *, struct tm *,
+                struct coord *);
 void stream_put_encoded(struct context *cnt, unsigned char *, int, int, int);
 void stream_stop(struct context *);
+int stream_shared_start(struct context **);
+void stream_shared_stop(void);
 
 #endif /* _INCLUDE_STREAM_H_ */
@@ -82,6 +82,9 @@ struct video_dev {
     int v4l_curbuffer;
     int v4l_maxbuffer;
     int v4l_bufsize;
+
+    struct timeval capture_time;        /* When the driver captured the last frame, 0 if unknown */
+    int capture_monotonic;              /* capture_time is on the monotonic clock */
 #endif
 };
 
@@ -1009,6 +1009,19 @@ int v4l2_next(struct context *cnt, struct video_dev *viddev, unsigned char *map,
 
     vid_source->pframe = vid_source->buf.index;
     vid_source->buffers[vid_source->buf.index].used = vid_source->buf.bytesused;
+
+    /* 
+     * Drivers stamp the buffers on the monotonic clock, older ones on the wall
+     * clock. Stamps copied from an output buffer tell nothing of the capture.
+     */
+    viddev->capture_time = vid_source->buf.timestamp;
+    viddev->capture_monotonic = 0;
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+    if ((vid_source->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        viddev->capture_monotonic = 1;
+    else if ((vid_source->buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_COPY)
+        memset(&viddev->capture_time, 0, sizeof(struct timeval));
+#endif
     vid_source->buffers[vid_source->buf.index].content_length = vid_source->buf.bytesused;
 
     MOTION_LOG(DBG, TYPE_VIDEO, NO_ERRNO, "%s: 3) vid_source->pframe %i "
@@ -20,6 +20,8 @@ typedef unsigned int uint32_t;
 
 #define CLAMP(x)  ((x) < 0 ? 0 : ((x) > 255) ? 255 : (x))
 
+#define NSEC_PER_SEC    1000000000LL
+
 typedef struct {
     int is_abs;
     int len;
@@ -889,6 +891,39 @@ int vid_start(struct context *cnt)
     return dev;
 }
 
+static long long vid_timeval_ns(const struct timeval *tv)
+{
+    return tv->tv_sec * NSEC_PER_SEC + tv->tv_usec * 1000LL;
+}
+
+/**
+ * vid_timestamp
+ *
+ * Completes the capture time of imgdat. The source stamps a frame on either
+ * clock, or on none when it does not know. The other clock is worked out
+ * from the current offset between the two, and a frame without any stamp
+ * was captured now.
+ */
+static void vid_timestamp(struct image_data *imgdat)
+{
+    long long mono, real;
+
+    if (!imgdat)
+        return;
+
+    mono = monotonic_ns();
+    real = realtime_ns();
+
+    if (imgdat->capture_mono_ns == 0 && imgdat->capture_real_ns == 0) {
+        imgdat->capture_mono_ns = mono;
+        imgdat->capture_real_ns = real;
+    } else if (imgdat->capture_real_ns == 0) {
+        imgdat->capture_real_ns = imgdat->capture_mono_ns + real - mono;
+    } else if (imgdat->capture_mono_ns == 0) {
+        imgdat->capture_mono_ns = imgdat->capture_real_ns + mono - real;
+    }
+}
+
 /**
  * vid_next
  *
@@ -897,7 +932,7 @@ int vid_start(struct context *cnt)
  * Parameters:
  *     cnt        Pointer to the context for this thread
  *     map        Pointer to the buffer in which the function puts the new image
- *     map2       Pointer to the secondary buffer in which the function puts the new image (optional, can be NULL)
+ *     imgdat     Image data of the new image, stamped with its capture time (optional, can be NULL)
  *
  * Global variable
  *     viddevs    The viddevs struct is "global" within the context of video.c
@@ -915,15 +950,28 @@ int vid_next(struct context *cnt, unsigned char *map, struct image_data* imgdat)
     int ret = -2;
     struct config *conf = &cnt->conf;
 
+    /* The source stamps the frame when it knows when it was captured */
+    if (imgdat)
+        imgdat->capture_mono_ns = imgdat->capture_real_ns = 0;
+
     if (cnt->video_source.video_source_next_fn) {
-        return cnt->video_source.video_source_next_fn(cnt, imgdat);
+        ret = cnt->video_source.video_source_next_fn(cnt, imgdat);
+        vid_timestamp(imgdat);
+        return ret;
     }
     else
     if (conf->netcam_url) {
         if (cnt->video_dev == -1)
             return NETCAM_GENERAL_ERROR;
 
-        return netcam_next(cnt, map);
+        ret = netcam_next(cnt, map);
+
+        /* The time the picture was received, the one decoded is jpegbuf now */
+        if (imgdat && ret == 0)
+            imgdat->capture_real_ns = vid_timeval_ns(&cnt->netcam->jpegbuf->image_time);
+
+        vid_timestamp(imgdat);
+        return ret;
     }
 #ifndef WITHOUT_V4L
     /*
@@ -955,6 +1003,7 @@ int vid_next(struct context *cnt, unsigned char *map, struct image_data* imgdat)
             dev->owner = cnt->threadnr;
             dev->frames = conf->roundrobin_frames;
         }
+        memset(&dev->capture_time, 0, sizeof(struct timeval));
 #ifdef MOTION_V4L2
         if (dev->v4l2) {
             v4l2_set_input(cnt, dev, map, width, height, conf);
@@ -968,6 +1017,14 @@ int vid_next(struct context *cnt, unsigned char *map, struct image_data* imgdat)
 #ifdef MOTION_V4L2
         }
 #endif
+        /* The time the driver stamped the buffer with */
+        if (imgdat && dev->capture_time.tv_sec) {
+            if (dev->capture_monotonic)
+                imgdat->capture_mono_ns = vid_timeval_ns(&dev->capture_time);
+            else
+                imgdat->capture_real_ns = vid_timeval_ns(&dev->capture_time);
+        }
+
         if (--dev->frames <= 0) {
             dev->owner = -1;
             dev->frames = 0;
@@ -980,5 +1037,6 @@ int vid_next(struct context *cnt, unsigned char *map, struct image_data* imgdat)
 
     }
 #endif  /*WITHOUT_V4L */
+    vid_timestamp(imgdat);
     return ret;
 }
@@ -1251,6 +1251,41 @@ static unsigned int detection(char *pointer, char *res, unsigned int length_uri,
              else
                  response_client(client_socket, not_found_response_valid_command_raw, NULL);
         }
+    } else if (!strcmp(command, "shedding")) {
+        pointer = pointer + 8;
+        length_uri = length_uri - 8;
+
+        if (length_uri == 0) {
+            /* call shedding, the SHED_* level each camera applies */
+            if (cnt[0]->conf.webcontrol_html_output) {
+                send_template_ini_client(client_socket, ini_template);
+                sprintf(res, "<a href=/%hu/detection>&lt;&ndash; back</a><br><br>\n", thread);
+                send_template(client_socket, res);
+                do {
+                    if (thread == 0 || i == thread) {
+                        sprintf(res, "<b>Thread %hu</b> load shedding level %d<br>\n", i,
+                                     scheduler_shed_level(&cnt[i]->scheduler));
+                        send_template(client_socket, res);
+                    }
+                } while (cnt[++i]);
+                send_template_end_client(client_socket);
+            } else {
+                send_template_ini_client_raw(client_socket);
+                do {
+                    if (thread == 0 || i == thread) {
+                        sprintf(res, "Thread %hu load shedding level %d\n", i,
+                                     scheduler_shed_level(&cnt[i]->scheduler));
+                        send_template_raw(client_socket, res);
+                    }
+                } while (cnt[++i]);
+            }
+        } else {
+            /* error */
+             if (cnt[0]->conf.webcontrol_html_output)
+                 response_client(client_socket, not_found_response_valid_command, NULL);
+             else
+                 response_client(client_socket, not_found_response_valid_command_raw, NULL);
+        }
     } else {
         if (cnt[0]->conf.webcontrol_html_output)
             response_client(client_socket, not_found_response_valid_command, NULL);
@@ -2084,13 +2119,14 @@ static unsigned int handle_get(int client_socket, const char *url, void *userdat
                                              "<a href=/%hd/detection/status>status</a><br>\n"
                                              "<a href=/%hd/detection/start>start</a><br>\n"
                                              "<a href=/%hd/detection/pause>pause</a><br>\n"
-                                             "<a href=/%hd/detection/connection>connection</a><br>\n",
-                                             thread, thread, thread, thread, thread, thread);
+                                             "<a href=/%hd/detection/connection>connection</a><br>\n"
+                                             "<a href=/%hd/detection/shedding>shedding</a><br>\n",
+                                             thread, thread, thread, thread, thread, thread, thread);
                                 send_template(client_socket, res);
                                 send_template_end_client(client_socket);
                             } else {
                                 send_template_ini_client_raw(client_socket);
-                                sprintf(res, "Thread %hd\nstatus\nstart\npause\nconnection\n", thread);
+                                sprintf(res, "Thread %hd\nstatus\nstart\npause\nconnection\nshedding\n", thread);
                                 send_template_raw(client_socket, res);
                             }
                         } else if ((slash == '/') && (length_uri > 5)) {
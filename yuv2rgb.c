@@ -0,0 +1,216 @@
+/*
+ * yuv2rgb.c
+ *
+ *  YUV420P to packed RGB conversion.
+ *
+ *  Uses 16 bit fixed point coefficients. When the compiler supports GCC
+ *  vector extensions with vector comparisons (gcc >= 4.7) eight pixels are
+ *  converted per step using four lane vectors, which gcc maps to NEON or
+ *  SSE when the target has them and to plain integer code otherwise. Both
+ *  paths give identical results.
+ */
+
+#include "yuv2rgb.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7))
+#define YUV2RGB_VECTOR
+typedef int v4si __attribute__ ((vector_size (16)));
+#endif
+
+#define YUV2RGB_ROUND   (1 << 15)
+
+struct yuv_coeffs {
+    int y;      /* (Y - 16) */
+    int rv;     /* (V - 128) to red */
+    int gu;     /* (U - 128) to green, subtracted */
+    int gv;     /* (V - 128) to green, subtracted */
+    int bu;     /* (U - 128) to blue */
+};
+
+static const struct yuv_coeffs yuv_matrices[] = {
+    /* YUV_MATRIX_BT601 */
+    { 76283, 104595, 25625, 53281, 132252 },
+    /* YUV_MATRIX_BT709 */
+    { 76283, 117490, 13975, 34925, 138438 },
+};
+
+struct rgb_layout {
+    int r;      /* Byte offsets of the components within a pixel */
+    int g;
+    int b;
+    int a;      /* -1 when there is no alpha */
+    int bpp;
+};
+
+static const struct rgb_layout rgb_layouts[] = {
+    /* RGB_FORMAT_RGB24 */
+    { 0, 1, 2, -1, 3 },
+    /* RGB_FORMAT_BGR24 */
+    { 2, 1, 0, -1, 3 },
+    /* RGB_FORMAT_RGBA */
+    { 0, 1, 2, 3, 4 },
+};
+
+static inline unsigned char clamp_pixel(int v)
+{
+    if (v < 0)
+        return 0;
+    if (v > 255)
+        return 255;
+    return v;
+}
+
+#ifdef YUV2RGB_VECTOR
+static inline v4si clamp_v4si(v4si v)
+{
+    const v4si zero = { 0, 0, 0, 0 };
+    const v4si max = { 255, 255, 255, 255 };
+
+    v &= ~(v < zero);
+    return (v | (v > max)) & max;
+}
+#endif
+
+/**
+ * convert_row
+ *      Converts one row of luma with its (horizontally half size) chroma row.
+ */
+static void convert_row(const unsigned char *py, const unsigned char *pu, const unsigned char *pv,
+                        int width, unsigned char *d, const struct yuv_coeffs *c,
+                        const struct rgb_layout *l)
+{
+    int x = 0;
+    int yv, u, v;
+
+#ifdef YUV2RGB_VECTOR
+    const v4si cy = { c->y, c->y, c->y, c->y };
+    const v4si crv = { c->rv, c->rv, c->rv, c->rv };
+    const v4si cgu = { c->gu, c->gu, c->gu, c->gu };
+    const v4si cgv = { c->gv, c->gv, c->gv, c->gv };
+    const v4si cbu = { c->bu, c->bu, c->bu, c->bu };
+    const v4si round = { YUV2RGB_ROUND, YUV2RGB_ROUND, YUV2RGB_ROUND, YUV2RGB_ROUND };
+    const v4si shift = { 16, 16, 16, 16 };
+
+    for (; x + 8 <= width; x += 8) {
+        v4si vu, vv, ye, yo, ruv, guv, buv;
+        v4si re, ge, be, ro, go, bo;
+        int k;
+
+        /* Four chroma samples cover eight pixels, split luma in even and odd */
+        for (k = 0; k < 4; k++) {
+            vu[k] = pu[k] - 128;
+            vv[k] = pv[k] - 128;
+            ye[k] = py[2 * k] - 16;
+            yo[k] = py[2 * k + 1] - 16;
+        }
+
+        ye = ye * cy + round;
+        yo = yo * cy + round;
+        ruv = vv * crv;
+        guv = vu * cgu + vv * cgv;
+        buv = vu * cbu;
+
+        re = clamp_v4si((ye + ruv) >> shift);
+        ge = clamp_v4si((ye - guv) >> shift);
+        be = clamp_v4si((ye + buv) >> shift);
+        ro = clamp_v4si((yo + ruv) >> shift);
+        go = clamp_v4si((yo - guv) >> shift);
+        bo = clamp_v4si((yo + buv) >> shift);
+
+        for (k = 0; k < 4; k++) {
+            d[l->r] = re[k];
+            d[l->g] = ge[k];
+            d[l->b] = be[k];
+            if (l->a >= 0)
+                d[l->a] = 255;
+            d += l->bpp;
+
+            d[l->r] = ro[k];
+            d[l->g] = go[k];
+            d[l->b] = bo[k];
+            if (l->a >= 0)
+                d[l->a] = 255;
+            d += l->bpp;
+        }
+
+        py += 8;
+        pu += 4;
+        pv += 4;
+    }
+#endif /* YUV2RGB_VECTOR */
+
+    for (; x < width; x++) {
+        yv = (*py++ - 16) * c->y + YUV2RGB_ROUND;
+        u = *pu - 128;
+        v = *pv - 128;
+
+        d[l->r] = clamp_pixel((yv + c->rv * v) >> 16);
+        d[l->g] = clamp_pixel((yv - c->gu * u - c->gv * v) >> 16);
+        d[l->b] = clamp_pixel((yv + c->bu * u) >> 16);
+        if (l->a >= 0)
+            d[l->a] = 255;
+        d += l->bpp;
+
+        if (x & 1) {
+            pu++;
+            pv++;
+        }
+    }
+}
+
+/**
+ * yuv2rgb_bytes_per_pixel
+ *
+ * Returns the size of one pixel in the given RGB_FORMAT_* layout.
+ */
+int yuv2rgb_bytes_per_pixel(int format)
+{
+    if (format < RGB_FORMAT_RGB24 || format > RGB_FORMAT_RGBA)
+        format = RGB_FORMAT_RGB24;
+
+    return rgb_layouts[format].bpp;
+}
+
+/**
+ * yuv420p_to_rgb
+ *      Converts rows first_row to first_row + rows - 1 of a YUV420P image to
+ *      packed RGB. Converting the image in chunks of rows keeps the output
+ *      buffer small, dest must hold width * rows * yuv2rgb_bytes_per_pixel().
+ *
+ * Inputs:
+ * - image is the image in YUV420P format, width and height its dimensions
+ * - format is one of RGB_FORMAT_*
+ * - matrix is one of YUV_MATRIX_*
+ *
+ * Returns nothing
+ */
+void yuv420p_to_rgb(const unsigned char *image, int width, int height,
+                    int first_row, int rows, unsigned char *dest,
+                    int format, int matrix)
+{
+    const unsigned char *u = image + width * height;
+    const unsigned char *v = u + (width * height) / 4;
+    const struct rgb_layout *l;
+    const struct yuv_coeffs *c;
+    int y;
+
+    if (format < RGB_FORMAT_RGB24 || format > RGB_FORMAT_RGBA)
+        format = RGB_FORMAT_RGB24;
+
+    if (matrix != YUV_MATRIX_BT709)
+        matrix = YUV_MATRIX_BT601;
+
+    l = &rgb_layouts[format];
+    c = &yuv_matrices[matrix];
+
+    if (first_row + rows > height)
+        rows = height - first_row;
+
+    for (y = first_row; y < first_row + rows; y++) {
+        convert_row(image + y * width,
+                    u + (y / 2) * (width / 2),
+                    v + (y / 2) * (width / 2),
+                    width, dest, c, l);
+        dest += width * l->bpp;
+    }
+}
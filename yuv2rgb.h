@@ -0,0 +1,25 @@
+/*
+ * yuv2rgb.h
+ *
+ *  YUV420P to packed RGB conversion for PPM output and any other
+ *  consumer that needs raw RGB.
+ */
+
+#ifndef YUV2RGB_H_
+#define YUV2RGB_H_
+
+/* Packed output layouts */
+#define RGB_FORMAT_RGB24        0
+#define RGB_FORMAT_BGR24        1
+#define RGB_FORMAT_RGBA         2
+
+/* Colour matrices, both for limited (16-235) range input */
+#define YUV_MATRIX_BT601        0
+#define YUV_MATRIX_BT709        1
+
+extern int yuv2rgb_bytes_per_pixel(int format);
+extern void yuv420p_to_rgb(const unsigned char *image, int width, int height,
+                           int first_row, int rows, unsigned char *dest,
+                           int format, int matrix);
+
+#endif /* YUV2RGB_H_ */
@@ -0,0 +1,131 @@
+/*
+ * yuvscale.c
+ *
+ *  Downscaling of YUV420P images, used for thumbnails.
+ *
+ *  The box filter first sums the source rows covered by a destination row
+ *  into column totals, a plain loop over the row that the compiler
+ *  vectorises, and then averages the columns covered by each destination
+ *  pixel. The bilinear filter uses 8 bit fixed point weights.
+ */
+
+#include "motion.h"
+#include "yuvscale.h"
+
+/**
+ * scale_plane_box
+ *      Scales one image plane down by averaging the source area covered by
+ *      each destination pixel.
+ */
+static void scale_plane_box(const unsigned char *src, int sw, int sh,
+                            unsigned char *dst, int dw, int dh)
+{
+    unsigned int *sums = mymalloc(sw * sizeof(*sums));
+    const unsigned char *row;
+    unsigned int sum, n;
+    int x, y, x0, x1, y0, y1, dx, dy;
+
+    for (dy = 0; dy < dh; dy++) {
+        y0 = dy * sh / dh;
+        y1 = (dy + 1) * sh / dh;
+        if (y1 <= y0)
+            y1 = y0 + 1;
+
+        memset(sums, 0, sw * sizeof(*sums));
+
+        for (y = y0; y < y1; y++) {
+            row = src + y * sw;
+            for (x = 0; x < sw; x++)
+                sums[x] += row[x];
+        }
+
+        for (dx = 0; dx < dw; dx++) {
+            x0 = dx * sw / dw;
+            x1 = (dx + 1) * sw / dw;
+            if (x1 <= x0)
+                x1 = x0 + 1;
+
+            sum = 0;
+            for (x = x0; x < x1; x++)
+                sum += sums[x];
+
+            n = (x1 - x0) * (y1 - y0);
+            *dst++ = (sum + n / 2) / n;
+        }
+    }
+
+    free(sums);
+}
+
+/**
+ * scale_plane_bilinear
+ *      Scales one image plane by interpolating between the four source
+ *      pixels nearest to the centre of each destination pixel.
+ */
+static void scale_plane_bilinear(const unsigned char *src, int sw, int sh,
+                                 unsigned char *dst, int dw, int dh)
+{
+    int step_x = (sw << 16) / dw;
+    int step_y = (sh << 16) / dh;
+    const unsigned char *r0, *r1;
+    int fx, fy, x0, x1, y0, y1, wx, wy, top, bottom;
+    int dx, dy;
+
+    for (dy = 0; dy < dh; dy++) {
+        fy = dy * step_y + step_y / 2 - 0x8000;
+        if (fy < 0)
+            fy = 0;
+        y0 = fy >> 16;
+        y1 = (y0 + 1 < sh) ? y0 + 1 : y0;
+        wy = (fy >> 8) & 0xff;
+        r0 = src + y0 * sw;
+        r1 = src + y1 * sw;
+
+        for (dx = 0; dx < dw; dx++) {
+            fx = dx * step_x + step_x / 2 - 0x8000;
+            if (fx < 0)
+                fx = 0;
+            x0 = fx >> 16;
+            x1 = (x0 + 1 < sw) ? x0 + 1 : x0;
+            wx = (fx >> 8) & 0xff;
+
+            top = r0[x0] * (256 - wx) + r0[x1] * wx;
+            bottom = r1[x0] * (256 - wx) + r1[x1] * wx;
+            *dst++ = (top * (256 - wy) + bottom * wy + 0x8000) >> 16;
+        }
+    }
+}
+
+/**
+ * yuv420p_scale
+ *      Scales a YUV420P image to dest_width x dest_height. Both sizes must
+ *      be even.
+ *
+ * Inputs:
+ * - src is the image in YUV420P format, src_width and src_height its size
+ * - filter is one of SCALE_FILTER_*
+ *
+ * Output:
+ * - dest holds the scaled YUV420P image
+ *
+ * Returns nothing
+ */
+void yuv420p_scale(const unsigned char *src, int src_width, int src_height,
+                   unsigned char *dest, int dest_width, int dest_height,
+                   int filter)
+{
+    void (*scale_plane)(const unsigned char *, int, int, unsigned char *, int, int);
+    int src_luma = src_width * src_height;
+    int dest_luma = dest_width * dest_height;
+
+    if (filter == SCALE_FILTER_BILINEAR)
+        scale_plane = scale_plane_bilinear;
+    else
+        scale_plane = scale_plane_box;
+
+    scale_plane(src, src_width, src_height, dest, dest_width, dest_height);
+    scale_plane(src + src_luma, src_width / 2, src_height / 2,
+                dest + dest_luma, dest_width / 2, dest_height / 2);
+    scale_plane(src + src_luma + src_luma / 4, src_width / 2, src_height / 2,
+                dest + dest_luma + dest_luma / 4, dest_width / 2, dest_height / 2);
+}
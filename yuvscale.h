@@ -0,0 +1,17 @@
+/*
+ * yuvscale.h
+ *
+ *  Downscaling of YUV420P images, used for thumbnails.
+ */
+
+#ifndef YUVSCALE_H_
+#define YUVSCALE_H_
+
+#define SCALE_FILTER_BOX        0   /* Average of all source pixels covered */
+#define SCALE_FILTER_BILINEAR   1   /* Interpolate the nearest four source pixels */
+
+extern void yuv420p_scale(const unsigned char *src, int src_width, int src_height,
+                          unsigned char *dest, int dest_width, int dest_height,
+                          int filter);
+
+#endif /* YUVSCALE_H_ */